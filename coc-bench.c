@@ -0,0 +1,621 @@
+/* coc-bench -- measure rule matching on synthetic rulesets.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Each case builds a ruleset of one kind and size in COC_BLOCK_FILE,
+ * then calls connect on a fixed set of targets, about half of which
+ * match a rule, for the given time. The library is linked in with
+ * connect stubbed out, so that only decisions are measured, and names
+ * are recorded as if the targets had been looked up, so that glob rules
+ * need no nameserver. Cases run in processes of their own, for their
+ * init time and memory footprint not to add up.
+ */
+
+void coc_init (void);
+void coc_bench_name (const struct sockaddr *addr, const char *name);
+
+#define COC_BENCH_TARGETS 1024
+#define COC_BENCH_CASES 64
+
+typedef enum
+{
+  COC_BENCH_V4,
+  COC_BENCH_V6,
+  COC_BENCH_PREFIX,
+  COC_BENCH_PORT,
+  COC_BENCH_DOMAIN,
+  COC_BENCH_GLOB,
+  COC_BENCH_MIXED
+} coc_bench_kind_t;
+
+static const char *const kinds[] = {
+  "v4", "v6", "prefix", "port", "domain", "glob", "mixed"
+};
+
+#define COC_BENCH_KINDS (sizeof (kinds) / sizeof (kinds[0]))
+
+typedef struct
+{
+  char kind[16];
+  size_t rules;
+  double ns_per_decision;
+} coc_bench_result_t;
+
+static const char *me = "coc-bench";
+static coc_bench_result_t baseline[COC_BENCH_CASES];
+static size_t baseline_count = 0;
+
+static int
+usage (int retcode)
+{
+  FILE *out = retcode ? stderr : stdout;
+  fprintf (out, "Usage: %s [OPTION]...\n", me);
+  fprintf (out, "Measure connect-or-cut rule matching on synthetic "
+	   "rulesets, and print the\ntime per decision, init time and "
+	   "memory footprint of each case as JSON.\n\n");
+  fprintf (out, "OPTIONS:\n"
+	   " -k, --kinds KIND,...    \tRuleset kinds, among v4, v6, prefix, "
+	   "port, domain,\n"
+	   "                         \tglob and mixed. All of them by "
+	   "default.\n"
+	   " -s, --sizes N,...       \tRuleset sizes. Default is "
+	   "10,1000,100000,1000000.\n"
+	   " -t, --time MS           \tTime spent matching per case. "
+	   "Default is 200.\n"
+	   " -B, --baseline FILE     \tCompare with FILE, a previous "
+	   "output.\n"
+	   " -r, --regression PCT    \tExit with status 1 when a case is "
+	   "more than PCT\n"
+	   "                         \tpercent slower than its baseline.\n"
+	   " -h, --help              \tPrint this help message.\n");
+  exit (retcode);
+}
+
+/* The address of the `i'-th IPv4 host, or /28 network for prefixes. */
+static uint32_t
+coc_bench_v4 (coc_bench_kind_t kind, size_t i)
+{
+  switch (kind)
+    {
+    case COC_BENCH_PREFIX:
+      return 0x0b000000 + (uint32_t) i * 16;
+    case COC_BENCH_PORT:
+      return 0x0c000000 + (uint32_t) i;
+    default:
+      return 0x0a000000 + (uint32_t) i;
+    }
+}
+
+/* Writes the `i'-th rule of `kind' to `f'. */
+static void
+coc_bench_rule (FILE *f, coc_bench_kind_t kind, size_t i)
+{
+  uint32_t a = coc_bench_v4 (kind, i);
+
+  switch (kind)
+    {
+    case COC_BENCH_V4:
+      fprintf (f, "%u.%u.%u.%u\n", a >> 24, a >> 16 & 255, a >> 8 & 255,
+	       a & 255);
+      break;
+    case COC_BENCH_V6:
+      fprintf (f, "[2001:db8::%zx:%zx]\n", i >> 16, i & 0xffff);
+      break;
+    case COC_BENCH_PREFIX:
+      fprintf (f, "%u.%u.%u.%u/28\n", a >> 24, a >> 16 & 255, a >> 8 & 255,
+	       a & 255);
+      break;
+    case COC_BENCH_PORT:
+      fprintf (f, "%u.%u.%u.%u:%s\n", a >> 24, a >> 16 & 255, a >> 8 & 255,
+	       a & 255,
+	       i % 3 == 0 ? "80" : i % 3 == 1 ? "8000-8100" : "{22,443,993}");
+      break;
+    case COC_BENCH_DOMAIN:
+      fprintf (f, "*.d%zu.example\n", i);
+      break;
+    case COC_BENCH_GLOB:
+      fprintf (f, "h%zu?.g*.example\n", i);
+      break;
+    case COC_BENCH_MIXED:
+      coc_bench_rule (f, (coc_bench_kind_t) (i % COC_BENCH_MIXED),
+		      i / COC_BENCH_MIXED);
+      break;
+    }
+}
+
+/*
+ * Sets up the `t'-th target of a ruleset of `kind' with `n' rules: it
+ * is that of a rule picked in twice as many, and thus matches one half
+ * of the time. Names of domain and glob targets are those of the rule,
+ * and others get one that no rule matches.
+ */
+static socklen_t
+coc_bench_target (struct sockaddr_storage *ss, char *name, size_t len,
+		  coc_bench_kind_t kind, size_t n, size_t t)
+{
+  static const in_port_t ports[] = { 22, 80, 443, 8050, 9999 };
+  size_t i;
+
+  if (kind == COC_BENCH_MIXED)
+    {
+      kind = (coc_bench_kind_t) (t % COC_BENCH_MIXED);
+      n = (n + COC_BENCH_MIXED - 1) / COC_BENCH_MIXED;
+    }
+
+  i = (size_t) rand () % (2 * n);
+  memset (ss, 0, sizeof (*ss));
+  snprintf (name, len, "t%zu.bench.invalid", t);
+
+  if (kind == COC_BENCH_V6)
+    {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons (443);
+      sin6->sin6_addr.s6_addr[0] = 0x20;
+      sin6->sin6_addr.s6_addr[1] = 0x01;
+      sin6->sin6_addr.s6_addr[2] = 0x0d;
+      sin6->sin6_addr.s6_addr[3] = 0xb8;
+      sin6->sin6_addr.s6_addr[12] = (uint8_t) (i >> 24);
+      sin6->sin6_addr.s6_addr[13] = (uint8_t) (i >> 16);
+      sin6->sin6_addr.s6_addr[14] = (uint8_t) (i >> 8);
+      sin6->sin6_addr.s6_addr[15] = (uint8_t) i;
+      return sizeof (*sin6);
+    }
+
+  struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+  uint32_t a = coc_bench_v4 (kind, i);
+
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons (443);
+
+  switch (kind)
+    {
+    case COC_BENCH_PREFIX:
+      a += (uint32_t) rand () % 16;
+      break;
+    case COC_BENCH_PORT:
+      /* Ports match one time in three, whatever the address. */
+      a = coc_bench_v4 (kind, i / 2);
+      sin->sin_port = htons (ports[(size_t) rand () % 5]);
+      break;
+    case COC_BENCH_DOMAIN:
+      a = 0xc6120000 + (uint32_t) t;
+      snprintf (name, len, "h%zu.d%zu.example", t, i);
+      break;
+    case COC_BENCH_GLOB:
+      a = 0xc6120000 + (uint32_t) t;
+      snprintf (name, len, "h%zua.g%zu.example", i, t);
+      break;
+    default:
+      break;
+    }
+
+  sin->sin_addr.s_addr = htonl (a);
+  return sizeof (*sin);
+}
+
+/* The baseline of the case of `kind' with `n' rules, if any. */
+static const coc_bench_result_t *
+coc_bench_find (const char *kind, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < baseline_count; i++)
+    {
+      if (strcmp (baseline[i].kind, kind) == 0 && baseline[i].rules == n)
+	{
+	  return &baseline[i];
+	}
+    }
+
+  return NULL;
+}
+
+/* Peak resident set size, in kibibytes. */
+static long
+coc_bench_maxrss (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+static void
+coc_bench_env (const char *name, const char *value)
+{
+  if (value == NULL ? unsetenv (name) : setenv (name, value, 1))
+    {
+      fprintf (stderr, "%s: Cannot set %s: %s\n", me, name,
+	       strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Runs a case, in a process of its own, and prints its outcome. */
+static void
+coc_bench_run (coc_bench_kind_t kind, size_t n, uint64_t duration_ms)
+{
+  static struct sockaddr_storage targets[COC_BENCH_TARGETS];
+  static socklen_t lengths[COC_BENCH_TARGETS];
+  char path[] = "/tmp/coc-bench.XXXXXX";
+  int fd = mkstemp (path);
+  FILE *f = fd < 0 ? NULL : fdopen (fd, "w");
+  size_t i, t;
+
+  if (f == NULL)
+    {
+      fprintf (stderr, "%s: Cannot create rules file: %s\n", me,
+	       strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      coc_bench_rule (f, kind, i);
+    }
+
+  if (fclose (f) != 0)
+    {
+      fprintf (stderr, "%s: Cannot write %s: %s\n", me, path,
+	       strerror (errno));
+      unlink (path);
+      exit (EXIT_FAILURE);
+    }
+
+  /* Names are checked when DNS is allowed to nameservers, and looked up
+   * in the forward cache only, which holds all targets. */
+  coc_bench_env ("COC_BLOCK_FILE", path);
+  coc_bench_env ("COC_ALLOW", "0.0.0.0/0:53;[::/0]:53");
+  coc_bench_env ("COC_LOG_LEVEL", "0");
+  coc_bench_env ("COC_CACHE_SIZE", "0");
+  coc_bench_env ("COC_DNS_CACHE_SIZE", "65536");
+  coc_bench_env ("COC_DNS_TTL", "86400");
+  coc_bench_env ("COC_RDNS_TIMEOUT_MS", "1");
+  coc_bench_env ("COC_BLOCK", NULL);
+  coc_bench_env ("COC_ALLOW_FILE", NULL);
+  coc_bench_env ("COC_RULES_DB", NULL);
+  coc_bench_env ("COC_HOST_CACHE", NULL);
+  coc_bench_env ("COC_LAZY", NULL);
+  coc_bench_env ("COC_RELOAD", NULL);
+  coc_bench_env ("COC_EVENT_LOG", NULL);
+  coc_bench_env ("COC_STATS", NULL);
+  coc_bench_env ("COC_LATENCY", NULL);
+
+  long rss = coc_bench_maxrss ();
+  uint64_t start = coc_now_ns ();
+
+  coc_init ();
+
+  double init_ms = (coc_now_ns () - start) / 1e6;
+
+  rss = coc_bench_maxrss () - rss;
+  unlink (path);
+
+  srand (1);
+
+  for (t = 0; t < COC_BENCH_TARGETS; t++)
+    {
+      char name[NI_MAXHOST];
+
+      lengths[t] = coc_bench_target (&targets[t], name, sizeof (name), kind,
+				     n, t);
+      coc_bench_name ((const struct sockaddr *) &targets[t], name);
+    }
+
+  /* A first round warms up caches, and counts matches. */
+  size_t blocked = 0;
+
+  for (t = 0; t < COC_BENCH_TARGETS; t++)
+    {
+      if (connect (-1, (const struct sockaddr *) &targets[t], lengths[t]))
+	{
+	  blocked++;
+	}
+    }
+
+  uint64_t decisions = 0;
+  uint64_t elapsed;
+
+  start = coc_now_ns ();
+
+  do
+    {
+      for (t = 0; t < COC_BENCH_TARGETS; t++)
+	{
+	  connect (-1, (const struct sockaddr *) &targets[t], lengths[t]);
+	}
+
+      decisions += COC_BENCH_TARGETS;
+      elapsed = coc_now_ns () - start;
+    }
+  while (elapsed < duration_ms * 1000000);
+
+  double ns = (double) elapsed / decisions;
+
+  printf ("{\"case\":\"%s\",\"rules\":%zu,\"ns_per_decision\":%.1f,"
+	  "\"init_ms\":%.1f,\"rss_kb\":%ld,\"blocked_pct\":%.1f",
+	  kinds[kind], n, ns, init_ms, rss,
+	  100.0 * blocked / COC_BENCH_TARGETS);
+
+  const coc_bench_result_t *b = coc_bench_find (kinds[kind], n);
+
+  if (b != NULL)
+    {
+      printf (",\"baseline_ns_per_decision\":%.1f,\"change_pct\":%.1f",
+	      b->ns_per_decision,
+	      100.0 * (ns - b->ns_per_decision) / b->ns_per_decision);
+    }
+
+  printf ("}");
+  fflush (stdout);
+}
+
+/* Reads cases of a previous output, one per line. */
+static void
+coc_bench_baseline (const char *path)
+{
+  FILE *f = fopen (path, "r");
+  char line[512];
+
+  if (f == NULL)
+    {
+      fprintf (stderr, "%s: Cannot open %s: %s\n", me, path,
+	       strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+
+  while (baseline_count < COC_BENCH_CASES &&
+	 fgets (line, sizeof (line), f) != NULL)
+    {
+      coc_bench_result_t *r = &baseline[baseline_count];
+
+      if (sscanf (line, " {\"case\":\"%15[^\"]\",\"rules\":%zu,"
+		  "\"ns_per_decision\":%lf", r->kind, &r->rules,
+		  &r->ns_per_decision) == 3 && r->ns_per_decision > 0)
+	{
+	  baseline_count++;
+	}
+    }
+
+  fclose (f);
+}
+
+/* Whether `ns' is more than `pct' percent above the baseline of the
+ * case. */
+static bool
+coc_bench_regressed (const char *kind, size_t n, double ns, double pct)
+{
+  const coc_bench_result_t *b = coc_bench_find (kind, n);
+
+  return b != NULL && ns > b->ns_per_decision * (1 + pct / 100);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"kinds", required_argument, NULL, 'k'},
+    {"sizes", required_argument, NULL, 's'},
+    {"time", required_argument, NULL, 't'},
+    {"baseline", required_argument, NULL, 'B'},
+    {"regression", required_argument, NULL, 'r'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  bool selected[COC_BENCH_KINDS];
+  size_t sizes[COC_BENCH_CASES] = { 10, 1000, 100000, 1000000 };
+  size_t size_count = 4;
+  long duration_ms = 200;
+  double regression = -1;
+  char *end, *s;
+  size_t i, k;
+  int c;
+
+  for (k = 0; k < COC_BENCH_KINDS; k++)
+    {
+      selected[k] = true;
+    }
+
+  while ((c = getopt_long (argc, argv, "k:s:t:B:r:h", options, NULL)) != -1)
+    {
+      switch (c)
+	{
+	case 'k':
+	  for (k = 0; k < COC_BENCH_KINDS; k++)
+	    {
+	      selected[k] = false;
+	    }
+
+	  for (s = strtok (optarg, ","); s != NULL; s = strtok (NULL, ","))
+	    {
+	      for (k = 0; k < COC_BENCH_KINDS && strcmp (s, kinds[k]); k++)
+		;
+
+	      if (k == COC_BENCH_KINDS)
+		{
+		  fprintf (stderr, "%s: Unknown kind `%s'\n", me, s);
+		  usage (EXIT_FAILURE);
+		}
+
+	      selected[k] = true;
+	    }
+	  break;
+	case 's':
+	  size_count = 0;
+
+	  for (s = strtok (optarg, ","); s != NULL; s = strtok (NULL, ","))
+	    {
+	      unsigned long n = strtoul (s, &end, 10);
+
+	      if (*end != '\0' || n == 0 || n > 10000000 ||
+		  size_count == COC_BENCH_CASES)
+		{
+		  fprintf (stderr, "%s: Invalid size `%s'\n", me, s);
+		  usage (EXIT_FAILURE);
+		}
+
+	      sizes[size_count++] = n;
+	    }
+	  break;
+	case 't':
+	  duration_ms = strtol (optarg, &end, 10);
+
+	  if (*end != '\0' || duration_ms <= 0)
+	    {
+	      fprintf (stderr, "%s: Invalid time `%s'\n", me, optarg);
+	      usage (EXIT_FAILURE);
+	    }
+	  break;
+	case 'B':
+	  coc_bench_baseline (optarg);
+	  break;
+	case 'r':
+	  regression = strtod (optarg, &end);
+
+	  if (*end != '\0' || regression < 0)
+	    {
+	      fprintf (stderr, "%s: Invalid regression `%s'\n", me, optarg);
+	      usage (EXIT_FAILURE);
+	    }
+	  break;
+	case 'h':
+	  usage (EXIT_SUCCESS);
+	  break;
+	default:
+	  usage (EXIT_FAILURE);
+	}
+    }
+
+  if (optind < argc)
+    {
+      usage (EXIT_FAILURE);
+    }
+
+  int status = EXIT_SUCCESS;
+  const char *separator = "[\n";
+
+  for (k = 0; k < COC_BENCH_KINDS; k++)
+    {
+      for (i = 0; selected[k] && i < size_count; i++)
+	{
+	  int fds[2];
+	  char out[512];
+	  ssize_t len = 0, r;
+	  int wstatus;
+
+	  if (pipe (fds))
+	    {
+	      fprintf (stderr, "%s: Cannot create pipe: %s\n", me,
+		       strerror (errno));
+	      return EXIT_FAILURE;
+	    }
+
+	  fflush (stdout);
+	  pid_t pid = fork ();
+
+	  if (pid < 0)
+	    {
+	      fprintf (stderr, "%s: Cannot fork: %s\n", me, strerror (errno));
+	      return EXIT_FAILURE;
+	    }
+
+	  if (pid == 0)
+	    {
+	      close (fds[0]);
+	      dup2 (fds[1], STDOUT_FILENO);
+	      close (fds[1]);
+	      coc_bench_run ((coc_bench_kind_t) k, sizes[i], duration_ms);
+	      exit (EXIT_SUCCESS);
+	    }
+
+	  close (fds[1]);
+
+	  while (len < (ssize_t) sizeof (out) - 1 &&
+		 (r = read (fds[0], out + len, sizeof (out) - 1 - len)) != 0)
+	    {
+	      if (r > 0)
+		{
+		  len += r;
+		}
+	      else if (errno != EINTR)
+		{
+		  break;
+		}
+	    }
+
+	  out[len] = '\0';
+	  close (fds[0]);
+
+	  if (waitpid (pid, &wstatus, 0) != pid || !WIFEXITED (wstatus) ||
+	      WEXITSTATUS (wstatus) != EXIT_SUCCESS || len == 0)
+	    {
+	      fprintf (stderr, "%s: Case %s with %zu rules failed\n", me,
+		       kinds[k], sizes[i]);
+	      status = EXIT_FAILURE;
+	      continue;
+	    }
+
+	  printf ("%s%s", separator, out);
+	  separator = ",\n";
+
+	  double ns;
+
+	  if (regression >= 0 &&
+	      sscanf (strstr (out, "\"ns_per_decision\":"),
+		      "\"ns_per_decision\":%lf", &ns) == 1 &&
+	      coc_bench_regressed (kinds[k], sizes[i], ns, regression))
+	    {
+	      fprintf (stderr, "%s: Case %s with %zu rules regressed by more "
+		       "than %g%%\n", me, kinds[k], sizes[i], regression);
+	      status = EXIT_FAILURE;
+	    }
+	}
+    }
+
+  printf ("%s]\n", *separator == '[' ? "[\n" : "\n");
+  return status;
+}
@@ -0,0 +1,155 @@
+/* coc-bloom -- blocked Bloom filters for connect-or-cut.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Bloom filter split in blocks of one cache line: the first hash picks
+ * a block, and all bits of an item are set or tested within it, so that
+ * a lookup costs a single cache miss. Since blocks do not fill evenly,
+ * this raises the false positive rate over a plain Bloom filter of the
+ * same size; a few more bits per item make up for it.
+ */
+
+#define COC_BLOOM_BLOCK_BITS 512
+#define COC_BLOOM_BLOCK_WORDS (COC_BLOOM_BLOCK_BITS / 64)
+#define COC_BLOOM_MAX_K 16
+
+void
+coc_bloom_init (coc_bloom_t *b, size_t n, unsigned long fp_rate)
+{
+  unsigned int lg = 0;
+
+  memset (b, 0, sizeof (*b));
+
+  if (n == 0 || fp_rate < 2)
+    {
+      return;
+    }
+
+  /* log2 of 1 / p, rounded up: the optimal number of bits to test, and
+   * the optimal bits per item divided by ln 2. */
+  while (lg < 63 && (1UL << lg) < fp_rate)
+    {
+      lg++;
+    }
+
+  size_t bits_per_item = (lg * 1443 + 999) / 1000 + 1 + lg / 6;
+  size_t blocks = (n * bits_per_item + COC_BLOOM_BLOCK_BITS - 1) /
+    COC_BLOOM_BLOCK_BITS;
+
+  b->base = malloc (blocks * COC_BLOOM_BLOCK_BITS / 8 + 63);
+
+  if (b->base == NULL)
+    {
+      DIE ("Cannot allocate Bloom filter, aborting\n");
+    }
+
+  b->blocks = (uint64_t *) (((uintptr_t) b->base + 63) & ~(uintptr_t) 63);
+  memset (b->blocks, 0, blocks * COC_BLOOM_BLOCK_BITS / 8);
+  b->block_count = blocks;
+  b->k = lg < COC_BLOOM_MAX_K ? lg : COC_BLOOM_MAX_K;
+}
+
+/* Block of `h'. Bits within it come from a second hash, nine at a
+ * time. */
+static inline uint64_t *
+coc_bloom_block (const coc_bloom_t *b, uint64_t h)
+{
+  return b->blocks + ((((h >> 32) * b->block_count) >> 32) *
+		      COC_BLOOM_BLOCK_WORDS);
+}
+
+void
+coc_bloom_add (coc_bloom_t *b, uint64_t h)
+{
+  unsigned int i;
+
+  if (b->blocks == NULL)
+    {
+      return;
+    }
+
+  uint64_t *block = coc_bloom_block (b, h);
+  uint64_t bits = h;
+
+  for (i = 0; i < b->k; i++, bits >>= 9)
+    {
+      if (i % 7 == 0)
+	{
+	  bits = coc_bloom_mix (h + i);
+	}
+
+      uint32_t j = (uint32_t) bits % COC_BLOOM_BLOCK_BITS;
+      block[j / 64] |= (uint64_t) 1 << (j % 64);
+    }
+}
+
+bool
+coc_bloom_maybe (const coc_bloom_t *b, uint64_t h)
+{
+  unsigned int i;
+
+  if (b->blocks == NULL)
+    {
+      return true;
+    }
+
+  const uint64_t *block = coc_bloom_block (b, h);
+  uint64_t bits = h;
+
+  for (i = 0; i < b->k; i++, bits >>= 9)
+    {
+      if (i % 7 == 0)
+	{
+	  bits = coc_bloom_mix (h + i);
+	}
+
+      uint32_t j = (uint32_t) bits % COC_BLOOM_BLOCK_BITS;
+
+      if ((block[j / 64] & ((uint64_t) 1 << (j % 64))) == 0)
+	{
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+void
+coc_bloom_free (coc_bloom_t *b)
+{
+  free (b->base);
+  memset (b, 0, sizeof (*b));
+}
@@ -0,0 +1,266 @@
+/* coc-cache -- verdict cache for connect-or-cut.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Fixed-size cache from (address, port) to the verdict of the ruleset,
+ * shared by all threads of the process. Readers never lock: each slot
+ * is guarded by a sequence number, odd while a writer updates it. A
+ * reader that sees it change retries nothing and just reports a miss.
+ * Writers that lose the race for a slot drop their update.
+ *
+ * Verdicts are tagged with the ruleset generation, so a new ruleset
+ * invalidates the whole cache at once. Those that depend on the name
+ * of the destination expire with it, and when names recorded for any
+ * address change.
+ *
+ * Hits and misses are counted apart from the slots, in one of
+ * COC_CACHE_SHARDS cache lines per thread, handed out in turn as for
+ * coc_stats_add.
+ */
+struct coc_cache_slot {
+  uint64_t seq;
+  uint64_t key[2];
+  uint64_t meta;		/* generation, port, rule type and valid bit. */
+  uint64_t rank;
+  uint64_t expires;		/* coc_now_ms () deadline, 0 for never. */
+  uint64_t epoch;		/* names epoch, if `expires' is set. */
+  uint64_t pad[1];		/* one slot per cache line. */
+};
+
+struct coc_cache_counters {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t pad[6];		/* one shard per cache line. */
+};
+
+#define COC_CACHE_WAYS 4	/* slots probed from the home slot. */
+#define COC_CACHE_LINE 64
+
+static uint64_t next_shard = 0;
+static COC_THREAD_LOCAL uint32_t shard = 0;	/* 1 + index, 0 if none. */
+
+static inline coc_cache_counters_t *
+coc_cache_counters (coc_cache_t *c)
+{
+  if (shard == 0)
+    {
+      shard = (uint32_t) (coc_fetch_add (&next_shard, 1) %
+			  COC_CACHE_SHARDS) + 1;
+    }
+
+  return &c->counters[shard - 1];
+}
+
+static inline uint64_t
+coc_cache_meta (uint64_t generation, in_port_t port, int rule_type)
+{
+  return (generation << 32) | ((uint64_t) port << 16) |
+    ((uint64_t) (uint8_t) rule_type << 8) | 1;
+}
+
+static inline size_t
+coc_cache_home (const coc_cache_t *c, const uint64_t *key, in_port_t port)
+{
+  uint64_t h = (key[0] * 0x9e3779b97f4a7c15ULL) ^ key[1] ^ port;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+
+  return (size_t) h & c->mask;
+}
+
+void
+coc_cache_init (coc_cache_t *c, size_t size)
+{
+  size_t slots = COC_CACHE_WAYS;
+
+  memset (c, 0, sizeof (*c));
+
+  if (size == 0)
+    {
+      return;
+    }
+
+  while (slots < size)
+    {
+      slots <<= 1;
+    }
+
+  c->slots = (coc_cache_slot_t *) calloc (slots, sizeof (coc_cache_slot_t));
+
+  /* Counters start on a line of their own; the cache is never freed. */
+  char *counters = (char *) calloc (COC_CACHE_SHARDS + 1,
+				    sizeof (coc_cache_counters_t));
+
+  if (c->slots == NULL || counters == NULL)
+    {
+      DIE ("Cannot allocate verdict cache, aborting\n");
+    }
+
+  c->mask = slots - 1;
+  c->counters = (coc_cache_counters_t *)
+    (counters + (COC_CACHE_LINE - (uintptr_t) counters % COC_CACHE_LINE));
+}
+
+bool
+coc_cache_lookup (coc_cache_t *c, uint64_t generation,
+		  const uint8_t key[COC_KEY_LEN], in_port_t port,
+		  int *rule_type, uint32_t *rank)
+{
+  uint64_t k[2];
+  size_t i, home;
+
+  if (c->slots == NULL)
+    {
+      return false;
+    }
+
+  memcpy (k, key, sizeof (k));
+  home = coc_cache_home (c, k, port);
+
+  for (i = 0; i < COC_CACHE_WAYS; i++)
+    {
+      coc_cache_slot_t *s = &c->slots[(home + i) & c->mask];
+      uint64_t seq = coc_load_acquire (&s->seq);
+
+      if (seq & 1)
+	{
+	  continue;
+	}
+
+      uint64_t k0 = coc_load_relaxed (&s->key[0]);
+      uint64_t k1 = coc_load_relaxed (&s->key[1]);
+      uint64_t meta = coc_load_relaxed (&s->meta);
+      uint64_t r = coc_load_relaxed (&s->rank);
+      uint64_t expires = coc_load_relaxed (&s->expires);
+      uint64_t epoch = coc_load_relaxed (&s->epoch);
+
+      coc_fence_acquire ();
+
+      if (coc_load_relaxed (&s->seq) != seq)
+	{
+	  continue;
+	}
+
+      if (k0 == k[0] && k1 == k[1] &&
+	  (meta & ~(uint64_t) 0xff00) == (coc_cache_meta (generation, port, 0)
+					  & ~(uint64_t) 0xff00) &&
+	  (expires == 0 ||
+	   (expires > coc_now_ms () && epoch == coc_load_relaxed (&c->epoch))))
+	{
+	  *rule_type = (int8_t) (meta >> 8);
+	  *rank = (uint32_t) r;
+	  coc_fetch_add (&coc_cache_counters (c)->hits, 1);
+	  return true;
+	}
+    }
+
+  coc_fetch_add (&coc_cache_counters (c)->misses, 1);
+  return false;
+}
+
+void
+coc_cache_insert (coc_cache_t *c, uint64_t generation,
+		  const uint8_t key[COC_KEY_LEN], in_port_t port,
+		  int rule_type, uint32_t rank, uint64_t expires,
+		  uint64_t epoch)
+{
+  uint64_t k[2];
+  size_t i, home, victim;
+
+  if (c->slots == NULL)
+    {
+      return;
+    }
+
+  memcpy (k, key, sizeof (k));
+  home = coc_cache_home (c, k, port);
+
+  /* Prefer a slot from an older generation; else evict one picked by
+   * the rank bits, which spreads evictions over the ways. */
+  victim = (home + (rank & (COC_CACHE_WAYS - 1))) & c->mask;
+
+  for (i = 0; i < COC_CACHE_WAYS; i++)
+    {
+      size_t j = (home + i) & c->mask;
+
+      if ((coc_load_relaxed (&c->slots[j].meta) >> 32) !=
+	  (generation & 0xffffffff))
+	{
+	  victim = j;
+	  break;
+	}
+    }
+
+  coc_cache_slot_t *s = &c->slots[victim];
+  uint64_t seq = coc_load_relaxed (&s->seq);
+
+  if ((seq & 1) || !coc_cas (&s->seq, &seq, seq + 1))
+    {
+      return;
+    }
+
+  coc_fence_release ();
+  coc_store_relaxed (&s->key[0], k[0]);
+  coc_store_relaxed (&s->key[1], k[1]);
+  coc_store_relaxed (&s->meta, coc_cache_meta (generation, port, rule_type));
+  coc_store_relaxed (&s->rank, rank);
+  coc_store_relaxed (&s->expires, expires);
+  coc_store_relaxed (&s->epoch, epoch);
+  coc_store_release (&s->seq, seq + 2);
+}
+
+/* Invalidates verdicts depending on names, after some have changed. */
+void
+coc_cache_names_changed (coc_cache_t *c)
+{
+  coc_fetch_add (&c->epoch, 1);
+}
+
+/* Sum up the hits and misses of all shards. */
+void
+coc_cache_counts (const coc_cache_t *c, uint64_t *hits, uint64_t *misses)
+{
+  size_t i;
+
+  *hits = *misses = 0;
+
+  for (i = 0; c->counters != NULL && i < COC_CACHE_SHARDS; i++)
+    {
+      *hits += coc_load_relaxed (&c->counters[i].hits);
+      *misses += coc_load_relaxed (&c->counters[i].misses);
+    }
+}
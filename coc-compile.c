@@ -0,0 +1,1522 @@
+/* Offline compiler and optimizer for connect-or-cut rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+/*
+ * Rules from several sources are concatenated into a policy that keeps
+ * its meaning, the verdict of the first matching rule or ALLOW if none,
+ * while getting smaller:
+ *
+ *  - rules whose every destination is matched by earlier rules can
+ *    never match, and are dropped;
+ *  - BLOCK rules whose destinations are all blocked by later rules, and
+ *    ALLOW rules overlapping no BLOCK rule, are redundant;
+ *  - rules of the same kind on the same address or pattern are merged
+ *    into one with the union of their ports, and sibling prefixes with
+ *    the same ports into their parent.
+ *
+ * All ALLOW rules rank before all BLOCK rules, as in the library, so
+ * that a rule can move to an earlier rank of the same kind. Only glob
+ * rules known to match a superset of names cover other glob rules:
+ * `*', and patterns `*SUFFIX' where SUFFIX has no wildcard.
+ */
+
+typedef struct coc_range {
+  in_port_t low;
+  in_port_t high;
+} coc_range_t;
+
+/* Ports in sorted, disjoint and non adjacent ranges. */
+typedef struct coc_ranges {
+  coc_range_t *r;
+  size_t count;
+} coc_ranges_t;
+
+typedef struct coc_crule {
+  uint8_t key[COC_KEY_LEN];	/* masked to `bits'. */
+  char *glob;			/* NULL for address rules. */
+  coc_ranges_t ports;
+  uint8_t bits;
+  uint8_t rule_type;
+  bool dead;
+} coc_crule_t;
+
+typedef struct coc_policy {
+  coc_crule_t *rules;		/* in evaluation order: index is rank. */
+  size_t count;
+  /* Indexes over live rules, rebuilt by coc_policy_index. */
+  uint32_t *addrs;		/* address rules by key, then bits. */
+  size_t addr_count;
+  uint32_t *min_rank;		/* segment trees over `addrs'. */
+  uint32_t *max_block;		/* rank + 1 of BLOCK rules, or 0. */
+  uint32_t *globs;		/* glob rules by pattern. */
+  size_t glob_count;
+  bool lengths[COC_KEY_LEN * 8 + 1];	/* of address rules. */
+  coc_ranges_t block_ports;	/* of all BLOCK rules. */
+  coc_ranges_t block_glob_ports;	/* of BLOCK glob rules. */
+  bool names;			/* some glob rule needs host names. */
+} coc_policy_t;
+
+typedef enum coc_pass {
+  COC_SHADOWED,			/* covered by earlier rules. */
+  COC_SUBSUMED,			/* BLOCK covered by later BLOCK rules. */
+  COC_UNBLOCKED,		/* ALLOW overlapping no BLOCK rule. */
+  COC_PASSES
+} coc_pass_t;
+
+static const char *me = "coc-compile";
+static bool verbose = false;
+
+void
+coc_log (coc_log_level_t level, const char *format, ...)
+{
+  if (level <= COC_ERROR_LOG_LEVEL || verbose)
+    {
+      va_list ap;
+      va_start (ap, format);
+      fprintf (stderr, "%s: ", me);
+      vfprintf (stderr, format, ap);
+      va_end (ap);
+    }
+}
+
+static void *
+coc_xalloc (size_t count, size_t size)
+{
+  void *p = calloc (count ? count : 1, size);
+
+  if (p == NULL)
+    {
+      DIE ("Out of memory, aborting\n");
+    }
+
+  return p;
+}
+
+static coc_ranges_t
+coc_ranges_new (size_t count)
+{
+  coc_ranges_t s;
+  s.r = (coc_range_t *) coc_xalloc (count, sizeof (coc_range_t));
+  s.count = 0;
+  return s;
+}
+
+static coc_ranges_t
+coc_ranges_copy (const coc_ranges_t *a)
+{
+  coc_ranges_t s = coc_ranges_new (a->count);
+  memcpy (s.r, a->r, a->count * sizeof (coc_range_t));
+  s.count = a->count;
+  return s;
+}
+
+static inline void
+coc_ranges_free (coc_ranges_t *s)
+{
+  free (s->r);
+  s->r = NULL;
+  s->count = 0;
+}
+
+static inline bool
+coc_ranges_any (const coc_ranges_t *s)
+{
+  return s->count == 1 && s->r[0].low == 0 && s->r[0].high == UINT16_MAX;
+}
+
+/* Append [low, high] to `s', which has room for it, after any range
+ * ending lower. */
+static inline void
+coc_ranges_push (coc_ranges_t *s, in_port_t low, in_port_t high)
+{
+  if (s->count > 0 && (uint32_t) s->r[s->count - 1].high + 1 >= low)
+    {
+      if (high > s->r[s->count - 1].high)
+	{
+	  s->r[s->count - 1].high = high;
+	}
+    }
+  else
+    {
+      s->r[s->count].low = low;
+      s->r[s->count].high = high;
+      s->count++;
+    }
+}
+
+static coc_ranges_t
+coc_ranges_union (const coc_ranges_t *a, const coc_ranges_t *b)
+{
+  coc_ranges_t s = coc_ranges_new (a->count + b->count);
+  size_t i = 0, j = 0;
+
+  while (i < a->count || j < b->count)
+    {
+      const coc_range_t *r =
+	j == b->count || (i < a->count && a->r[i].low < b->r[j].low) ?
+	&a->r[i++] : &b->r[j++];
+      coc_ranges_push (&s, r->low, r->high);
+    }
+
+  return s;
+}
+
+/* `a' without `b'. */
+static coc_ranges_t
+coc_ranges_minus (const coc_ranges_t *a, const coc_ranges_t *b)
+{
+  coc_ranges_t s = coc_ranges_new (a->count + b->count);
+  size_t i, j = 0;
+
+  for (i = 0; i < a->count; i++)
+    {
+      uint32_t low = a->r[i].low;
+      uint32_t high = a->r[i].high;
+
+      while (j < b->count && b->r[j].high < low)
+	{
+	  j++;
+	}
+
+      size_t k;
+      for (k = j; k < b->count && b->r[k].low <= high && low <= high; k++)
+	{
+	  if (b->r[k].low > low)
+	    {
+	      coc_ranges_push (&s, low, b->r[k].low - 1);
+	    }
+
+	  low = (uint32_t) b->r[k].high + 1;
+	}
+
+      if (low <= high)
+	{
+	  coc_ranges_push (&s, low, high);
+	}
+    }
+
+  return s;
+}
+
+static bool
+coc_ranges_meet (const coc_ranges_t *a, const coc_ranges_t *b)
+{
+  size_t i = 0, j = 0;
+
+  while (i < a->count && j < b->count)
+    {
+      if (a->r[i].high < b->r[j].low)
+	{
+	  i++;
+	}
+      else if (b->r[j].high < a->r[i].low)
+	{
+	  j++;
+	}
+      else
+	{
+	  return true;
+	}
+    }
+
+  return false;
+}
+
+static bool
+coc_ranges_equal (const coc_ranges_t *a, const coc_ranges_t *b)
+{
+  return a->count == b->count &&
+    !memcmp (a->r, b->r, a->count * sizeof (coc_range_t));
+}
+
+/* Replace `*s' with `*s' without `b'. */
+static inline void
+coc_ranges_remove (coc_ranges_t *s, const coc_ranges_t *b)
+{
+  coc_ranges_t t = coc_ranges_minus (s, b);
+  coc_ranges_free (s);
+  *s = t;
+}
+
+/* Ranges of parsed port sets, by index of the set. */
+static coc_ranges_t *portset_ranges = NULL;
+static size_t portset_ranges_count = 0;
+
+static coc_ranges_t
+coc_ranges_of_entry (const coc_entry_t *e)
+{
+  coc_ranges_t s;
+
+  if (e->ports == NULL)
+    {
+      in_port_t port = ntohs (e->port);
+      s = coc_ranges_new (1);
+      coc_ranges_push (&s, port ? port : 0, port ? port : UINT16_MAX);
+      return s;
+    }
+
+  if (e->ports->index >= portset_ranges_count)
+    {
+      size_t count = e->ports->index + 1;
+      portset_ranges = (coc_ranges_t *)
+	realloc (portset_ranges, count * sizeof (coc_ranges_t));
+
+      if (portset_ranges == NULL)
+	{
+	  DIE ("Out of memory, aborting\n");
+	}
+
+      memset (portset_ranges + portset_ranges_count, 0,
+	      (count - portset_ranges_count) * sizeof (coc_ranges_t));
+      portset_ranges_count = count;
+    }
+
+  coc_ranges_t *cached = &portset_ranges[e->ports->index];
+
+  if (cached->r == NULL)
+    {
+      uint32_t port;
+      size_t count = 0;
+
+      for (port = 0; port <= UINT16_MAX; port++)
+	{
+	  count += coc_portset_has (e->ports->bits, port) &&
+	    (port == 0 || !coc_portset_has (e->ports->bits, port - 1));
+	}
+
+      *cached = coc_ranges_new (count);
+
+      for (port = 0; port <= UINT16_MAX; port++)
+	{
+	  if (coc_portset_has (e->ports->bits, port))
+	    {
+	      coc_ranges_push (cached, port, port);
+	    }
+	}
+    }
+
+  return coc_ranges_copy (cached);
+}
+
+static inline unsigned int
+coc_key_bit (const uint8_t *key, unsigned int i)
+{
+  return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* Copy of `key' with bits from `bits' on set to `fill'. */
+static void
+coc_key_fill (uint8_t out[COC_KEY_LEN], const uint8_t *key,
+	      unsigned int bits, bool fill)
+{
+  unsigned int i;
+
+  memcpy (out, key, COC_KEY_LEN);
+
+  for (i = bits; i < COC_KEY_LEN * 8; i++)
+    {
+      if ((i & 7) == 0)
+	{
+	  memset (out + (i >> 3), fill ? 0xff : 0, COC_KEY_LEN - (i >> 3));
+	  break;
+	}
+
+      if (fill)
+	{
+	  out[i >> 3] |= 0x80 >> (i & 7);
+	}
+      else
+	{
+	  out[i >> 3] &= ~(0x80 >> (i & 7));
+	}
+    }
+}
+
+static inline bool
+coc_glob_is_star (const char *glob)
+{
+  return glob[0] == '*' && glob[1] == '\0';
+}
+
+/* Take the parsed rules out of coc_list_head. */
+static void
+coc_policy_from_list (coc_policy_t *p)
+{
+  coc_entry_t *e;
+  size_t count = 0;
+
+  SLIST_FOREACH (e, &coc_list_head, entries)
+  {
+    count++;
+  }
+
+  p->rules = (coc_crule_t *) coc_xalloc (count, sizeof (coc_crule_t));
+  p->count = 0;
+
+  while (!SLIST_EMPTY (&coc_list_head))
+    {
+      e = SLIST_FIRST (&coc_list_head);
+      SLIST_REMOVE_HEAD (&coc_list_head, entries);
+
+      coc_crule_t *r = &p->rules[p->count++];
+      r->rule_type = (uint8_t) e->rule_type;
+      r->ports = coc_ranges_of_entry (e);
+
+      if (e->addr_type == COC_GLOB_ADDR)
+	{
+	  r->glob = e->addr.glob;
+	}
+      else
+	{
+	  uint8_t key[COC_KEY_LEN];
+	  r->bits = (uint8_t) coc_key_from_entry (key, e);
+	  coc_key_fill (r->key, key, r->bits, false);
+	}
+
+      free (e);
+    }
+
+  /* Port sets are numbered again by the next parse. */
+  size_t i;
+
+  for (i = 0; i < portset_ranges_count; i++)
+    {
+      coc_ranges_free (&portset_ranges[i]);
+    }
+
+  free (portset_ranges);
+  portset_ranges = NULL;
+  portset_ranges_count = 0;
+  coc_portset_clear ();
+}
+
+/* Remove dead rules, keeping the order of the others. */
+static size_t
+coc_policy_compact (coc_policy_t *p)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < p->count; i++)
+    {
+      coc_crule_t *r = &p->rules[i];
+
+      if (r->dead)
+	{
+	  free (r->glob);
+	  coc_ranges_free (&r->ports);
+	}
+      else
+	{
+	  p->rules[n++] = *r;
+	}
+    }
+
+  size_t removed = p->count - n;
+  p->count = n;
+  return removed;
+}
+
+static const coc_policy_t *sorted_policy;
+
+static int
+coc_key_cmp (const uint8_t *a, unsigned int a_bits, const uint8_t *b,
+	     unsigned int b_bits)
+{
+  int c = memcmp (a, b, COC_KEY_LEN);
+  return c ? c : (int) a_bits - (int) b_bits;
+}
+
+static int
+coc_addr_cmp (const void *a, const void *b)
+{
+  const coc_crule_t *x = &sorted_policy->rules[*(const uint32_t *) a];
+  const coc_crule_t *y = &sorted_policy->rules[*(const uint32_t *) b];
+  int c = coc_key_cmp (x->key, x->bits, y->key, y->bits);
+  return c ? c : (*(const uint32_t *) a > *(const uint32_t *) b) -
+    (*(const uint32_t *) a < *(const uint32_t *) b);
+}
+
+static int
+coc_glob_cmp (const void *a, const void *b)
+{
+  const coc_crule_t *x = &sorted_policy->rules[*(const uint32_t *) a];
+  const coc_crule_t *y = &sorted_policy->rules[*(const uint32_t *) b];
+  int c = strcmp (x->glob, y->glob);
+  return c ? c : (*(const uint32_t *) a > *(const uint32_t *) b) -
+    (*(const uint32_t *) a < *(const uint32_t *) b);
+}
+
+/* Same kind of rule on the same address or pattern, then rank. */
+static int
+coc_space_cmp (const void *a, const void *b)
+{
+  const coc_crule_t *x = &sorted_policy->rules[*(const uint32_t *) a];
+  const coc_crule_t *y = &sorted_policy->rules[*(const uint32_t *) b];
+
+  if (x->rule_type != y->rule_type)
+    {
+      return (int) x->rule_type - (int) y->rule_type;
+    }
+
+  if ((x->glob == NULL) != (y->glob == NULL))
+    {
+      return x->glob == NULL ? -1 : 1;
+    }
+
+  return x->glob ? coc_glob_cmp (a, b) : coc_addr_cmp (a, b);
+}
+
+static void
+coc_policy_unindex (coc_policy_t *p)
+{
+  free (p->addrs);
+  free (p->min_rank);
+  free (p->max_block);
+  free (p->globs);
+  coc_ranges_free (&p->block_ports);
+  coc_ranges_free (&p->block_glob_ports);
+  p->addrs = p->min_rank = p->max_block = p->globs = NULL;
+  p->addr_count = p->glob_count = 0;
+}
+
+static void
+coc_policy_index (coc_policy_t *p)
+{
+  size_t i;
+
+  coc_policy_unindex (p);
+  memset (p->lengths, 0, sizeof (p->lengths));
+  p->names = false;
+  p->addrs = (uint32_t *) coc_xalloc (p->count, sizeof (uint32_t));
+  p->globs = (uint32_t *) coc_xalloc (p->count, sizeof (uint32_t));
+  p->block_ports = coc_ranges_new (0);
+  p->block_glob_ports = coc_ranges_new (0);
+
+  for (i = 0; i < p->count; i++)
+    {
+      const coc_crule_t *r = &p->rules[i];
+
+      if (r->glob != NULL)
+	{
+	  p->globs[p->glob_count++] = (uint32_t) i;
+	  p->names |= !coc_glob_is_star (r->glob);
+	}
+      else
+	{
+	  p->addrs[p->addr_count++] = (uint32_t) i;
+	  p->lengths[r->bits] = true;
+	}
+
+      if (r->rule_type == COC_BLOCK)
+	{
+	  coc_ranges_t *u = r->glob ? &p->block_glob_ports : NULL;
+	  coc_ranges_t t = coc_ranges_union (&p->block_ports, &r->ports);
+	  coc_ranges_free (&p->block_ports);
+	  p->block_ports = t;
+
+	  if (u != NULL)
+	    {
+	      t = coc_ranges_union (u, &r->ports);
+	      coc_ranges_free (u);
+	      *u = t;
+	    }
+	}
+    }
+
+  sorted_policy = p;
+  qsort (p->addrs, p->addr_count, sizeof (uint32_t), coc_addr_cmp);
+  qsort (p->globs, p->glob_count, sizeof (uint32_t), coc_glob_cmp);
+
+  size_t n = p->addr_count;
+  p->min_rank = (uint32_t *) coc_xalloc (2 * n, sizeof (uint32_t));
+  p->max_block = (uint32_t *) coc_xalloc (2 * n, sizeof (uint32_t));
+
+  for (i = 0; i < n; i++)
+    {
+      uint32_t rank = p->addrs[i];
+      p->min_rank[n + i] = rank;
+      p->max_block[n + i] =
+	p->rules[rank].rule_type == COC_BLOCK ? rank + 1 : 0;
+    }
+
+  for (i = n - 1; i > 0 && i < n; i--)
+    {
+      uint32_t a = p->min_rank[2 * i], b = p->min_rank[2 * i + 1];
+      p->min_rank[i] = a < b ? a : b;
+      a = p->max_block[2 * i];
+      b = p->max_block[2 * i + 1];
+      p->max_block[i] = a > b ? a : b;
+    }
+}
+
+/* Lowest rank, and highest rank + 1 of BLOCK rules, in addrs[lo, hi). */
+static void
+coc_policy_range (const coc_policy_t *p, size_t lo, size_t hi,
+		  uint32_t *min_rank, uint32_t *max_block)
+{
+  size_t n = p->addr_count;
+
+  *min_rank = COC_NIL;
+  *max_block = 0;
+
+  for (lo += n, hi += n; lo < hi; lo >>= 1, hi >>= 1)
+    {
+      if (lo & 1)
+	{
+	  *min_rank = p->min_rank[lo] < *min_rank ? p->min_rank[lo] : *min_rank;
+	  *max_block = p->max_block[lo] > *max_block ? p->max_block[lo] :
+	    *max_block;
+	  lo++;
+	}
+
+      if (hi & 1)
+	{
+	  hi--;
+	  *min_rank = p->min_rank[hi] < *min_rank ? p->min_rank[hi] : *min_rank;
+	  *max_block = p->max_block[hi] > *max_block ? p->max_block[hi] :
+	    *max_block;
+	}
+    }
+}
+
+/* First of `addrs' not before (`key', `bits'). */
+static size_t
+coc_policy_addr_bound (const coc_policy_t *p, const uint8_t *key,
+		       unsigned int bits)
+{
+  size_t lo = 0, hi = p->addr_count;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const coc_crule_t *r = &p->rules[p->addrs[mid]];
+
+      if (coc_key_cmp (r->key, r->bits, key, bits) < 0)
+	{
+	  lo = mid + 1;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return lo;
+}
+
+/* First of `globs' not before `glob'. */
+static size_t
+coc_policy_glob_bound (const coc_policy_t *p, const char *glob)
+{
+  size_t lo = 0, hi = p->glob_count;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (strcmp (p->rules[p->globs[mid]].glob, glob) < 0)
+	{
+	  lo = mid + 1;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return lo;
+}
+
+/* Whether the rule ranked `rank' may cover the rule ranked `of' in
+ * `pass'. */
+static inline bool
+coc_covers (const coc_policy_t *p, coc_pass_t pass, uint32_t rank,
+	    uint32_t of)
+{
+  return pass == COC_SHADOWED ? rank < of :
+    rank > of && p->rules[rank].rule_type == COC_BLOCK;
+}
+
+/* Remove from `ports' those of the rules on (`key', `bits') covering
+ * the rule ranked `of'. */
+static void
+coc_remove_prefix (const coc_policy_t *p, coc_pass_t pass, uint32_t of,
+		   const uint8_t *key, unsigned int bits, coc_ranges_t *ports)
+{
+  size_t i;
+
+  for (i = coc_policy_addr_bound (p, key, bits);
+       i < p->addr_count && ports->count > 0; i++)
+    {
+      uint32_t rank = p->addrs[i];
+      const coc_crule_t *r = &p->rules[rank];
+
+      if (r->bits != bits || memcmp (r->key, key, COC_KEY_LEN))
+	{
+	  break;
+	}
+
+      if (coc_covers (p, pass, rank, of))
+	{
+	  coc_ranges_remove (ports, &r->ports);
+	}
+    }
+}
+
+/* Remove from `ports' those of the glob rules on `glob'. */
+static void
+coc_remove_glob (const coc_policy_t *p, coc_pass_t pass, uint32_t of,
+		 const char *glob, coc_ranges_t *ports)
+{
+  size_t i;
+
+  for (i = coc_policy_glob_bound (p, glob);
+       i < p->glob_count && ports->count > 0 &&
+       !strcmp (p->rules[p->globs[i]].glob, glob); i++)
+    {
+      if (coc_covers (p, pass, p->globs[i], of))
+	{
+	  coc_ranges_remove (ports, &p->rules[p->globs[i]].ports);
+	}
+    }
+}
+
+/* Whether some rule strictly inside the prefix (`key', `bits') may
+ * cover the rule ranked `of'. */
+static bool
+coc_prefix_has_inner (const coc_policy_t *p, coc_pass_t pass, uint32_t of,
+		      const uint8_t *key, unsigned int bits)
+{
+  uint8_t last[COC_KEY_LEN];
+  uint32_t min_rank, max_block;
+
+  coc_key_fill (last, key, bits, true);
+  coc_policy_range (p, coc_policy_addr_bound (p, key, bits + 1),
+		    coc_policy_addr_bound (p, last, COC_KEY_LEN * 8 + 1),
+		    &min_rank, &max_block);
+
+  return pass == COC_SHADOWED ? min_rank < of : max_block > of + 1;
+}
+
+/* Whether `ports' of every address in (`key', `bits') are matched by
+ * rules covering the rule ranked `of'. Consumes `ports'. */
+static bool
+coc_prefix_covered (const coc_policy_t *p, coc_pass_t pass, uint32_t of,
+		    const uint8_t *key, unsigned int bits,
+		    coc_ranges_t ports)
+{
+  bool covered = true;
+  unsigned int side;
+
+  if (ports.count > 0 &&
+      (bits == COC_KEY_LEN * 8 ||
+       !coc_prefix_has_inner (p, pass, of, key, bits)))
+    {
+      covered = false;
+    }
+
+  for (side = 0; covered && ports.count > 0 && side < 2; side++)
+    {
+      uint8_t half[COC_KEY_LEN];
+      coc_ranges_t rest = coc_ranges_copy (&ports);
+
+      memcpy (half, key, COC_KEY_LEN);
+
+      if (side)
+	{
+	  half[bits >> 3] |= 0x80 >> (bits & 7);
+	}
+
+      coc_remove_prefix (p, pass, of, half, bits + 1, &rest);
+      covered = coc_prefix_covered (p, pass, of, half, bits + 1, rest);
+    }
+
+  coc_ranges_free (&ports);
+  return covered;
+}
+
+/* Whether the destinations of the rule ranked `of' are all matched by
+ * the rules that may cover it in `pass'. */
+static bool
+coc_rule_covered (const coc_policy_t *p, coc_pass_t pass, uint32_t of)
+{
+  const coc_crule_t *r = &p->rules[of];
+  coc_ranges_t ports = coc_ranges_copy (&r->ports);
+  uint8_t key[COC_KEY_LEN];
+  unsigned int bits;
+
+  /* `*' and rules on every address. */
+  coc_remove_glob (p, pass, of, "*", &ports);
+
+  if (p->lengths[0])
+    {
+      memset (key, 0, sizeof (key));
+      coc_remove_prefix (p, pass, of, key, 0, &ports);
+    }
+
+  if (r->glob != NULL)
+    {
+      /* Patterns `*SUFFIX' matching every name matched by this one: its
+       * names end with the text after its last wildcard. */
+      const char *tail = r->glob;
+      const char *t;
+      char *glob = (char *) coc_xalloc (strlen (r->glob) + 2, 1);
+
+      for (t = r->glob; *t != '\0'; t++)
+	{
+	  if (*t == '*' || *t == '?')
+	    {
+	      tail = t + 1;
+	    }
+	}
+
+      coc_remove_glob (p, pass, of, r->glob, &ports);
+
+      for (t = tail; *t != '\0' && ports.count > 0; t++)
+	{
+	  glob[0] = '*';
+	  strcpy (glob + 1, t);
+
+	  if (strcmp (glob, r->glob))
+	    {
+	      coc_remove_glob (p, pass, of, glob, &ports);
+	    }
+	}
+
+      free (glob);
+      bool covered = ports.count == 0;
+      coc_ranges_free (&ports);
+      return covered;
+    }
+
+  for (bits = 1; bits <= r->bits && ports.count > 0; bits++)
+    {
+      if (p->lengths[bits])
+	{
+	  coc_key_fill (key, r->key, bits, false);
+	  coc_remove_prefix (p, pass, of, key, bits, &ports);
+	}
+    }
+
+  return coc_prefix_covered (p, pass, of, r->key, r->bits, ports);
+}
+
+/* Whether some BLOCK rule may match a destination of the ALLOW rule
+ * ranked `of', or this rule lets the resolver be reached. */
+static bool
+coc_rule_blocked (const coc_policy_t *p, uint32_t of)
+{
+  const coc_crule_t *r = &p->rules[of];
+  uint8_t key[COC_KEY_LEN];
+  uint8_t last[COC_KEY_LEN];
+  uint32_t min_rank, max_block;
+  unsigned int bits;
+  size_t i;
+
+  if (r->glob != NULL)
+    {
+      return coc_ranges_meet (&r->ports, &p->block_ports);
+    }
+
+  if (coc_ranges_meet (&r->ports, &p->block_glob_ports))
+    {
+      return true;
+    }
+
+  /* Name lookups need a DNS server to be allowed. */
+  if (p->names)
+    {
+      coc_ranges_t dns = { &(coc_range_t) { 53, 53 }, 1 };
+
+      if (coc_ranges_meet (&r->ports, &dns))
+	{
+	  return true;
+	}
+    }
+
+  for (bits = 0; bits <= r->bits; bits++)
+    {
+      if (!p->lengths[bits])
+	{
+	  continue;
+	}
+
+      coc_key_fill (key, r->key, bits, false);
+
+      for (i = coc_policy_addr_bound (p, key, bits); i < p->addr_count; i++)
+	{
+	  const coc_crule_t *b = &p->rules[p->addrs[i]];
+
+	  if (b->bits != bits || memcmp (b->key, key, COC_KEY_LEN))
+	    {
+	      break;
+	    }
+
+	  if (b->rule_type == COC_BLOCK && coc_ranges_meet (&r->ports,
+							      &b->ports))
+	    {
+	      return true;
+	    }
+	}
+    }
+
+  coc_key_fill (last, r->key, r->bits, true);
+  coc_policy_range (p, coc_policy_addr_bound (p, r->key, r->bits + 1),
+		    coc_policy_addr_bound (p, last, COC_KEY_LEN * 8 + 1),
+		    &min_rank, &max_block);
+  return max_block > 0;
+}
+
+static bool
+coc_rule_droppable (const coc_policy_t *p, coc_pass_t pass, uint32_t rank)
+{
+  switch (pass)
+    {
+    case COC_SHADOWED:
+      return coc_rule_covered (p, pass, rank);
+
+    case COC_SUBSUMED:
+      return p->rules[rank].rule_type == COC_BLOCK &&
+	coc_rule_covered (p, pass, rank);
+
+    case COC_UNBLOCKED:
+      return p->rules[rank].rule_type == COC_ALLOW &&
+	!coc_rule_blocked (p, rank);
+
+    default:
+      return false;
+    }
+}
+
+/* Rules are checked against the policy as it was before the pass, so
+ * that checks are independent and run on several threads. Dropping
+ * them all keeps the verdicts: a rule covered by earlier, or only by
+ * later, rules is still covered once those covered in turn are gone. */
+typedef struct coc_job {
+  const coc_policy_t *p;
+  coc_pass_t pass;
+  size_t next;
+  bool *drop;
+} coc_job_t;
+
+#define COC_JOB_CHUNK 64
+
+static void *
+coc_job_run (void *arg)
+{
+  coc_job_t *job = (coc_job_t *) arg;
+  size_t first;
+
+  while ((first = coc_fetch_add (&job->next, COC_JOB_CHUNK)) <
+	 job->p->count)
+    {
+      size_t i;
+
+      for (i = first; i < first + COC_JOB_CHUNK && i < job->p->count; i++)
+	{
+	  job->drop[i] = coc_rule_droppable (job->p, job->pass, (uint32_t) i);
+	}
+    }
+
+  return NULL;
+}
+
+static size_t
+coc_policy_pass (coc_policy_t *p, coc_pass_t pass, size_t jobs)
+{
+  coc_job_t job = { p, pass, 0, NULL };
+  pthread_t *threads;
+  size_t i, started = 0;
+
+  coc_policy_index (p);
+  job.drop = (bool *) coc_xalloc (p->count, sizeof (bool));
+
+  if (jobs > p->count / COC_JOB_CHUNK)
+    {
+      jobs = p->count / COC_JOB_CHUNK + 1;
+    }
+
+  threads = (pthread_t *) coc_xalloc (jobs, sizeof (pthread_t));
+
+  for (i = 1; i < jobs; i++)
+    {
+      if (pthread_create (&threads[started], NULL, coc_job_run, &job) == 0)
+	{
+	  started++;
+	}
+    }
+
+  coc_job_run (&job);
+
+  for (i = 0; i < started; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+
+  for (i = 0; i < p->count; i++)
+    {
+      p->rules[i].dead = job.drop[i];
+    }
+
+  free (threads);
+  free (job.drop);
+  return coc_policy_compact (p);
+}
+
+/* First of `order', sorted by coc_space_cmp, not before the address
+ * rule of `type' on (`key', `bits'). */
+static size_t
+coc_order_bound (const coc_policy_t *p, const uint32_t *order,
+		 size_t count, uint8_t type, const uint8_t *key,
+		 unsigned int bits)
+{
+  size_t lo = 0, hi = count;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const coc_crule_t *r = &p->rules[order[mid]];
+      int c = (int) r->rule_type - (int) type;
+
+      if (c == 0)
+	{
+	  c = r->glob ? 1 : coc_key_cmp (r->key, r->bits, key, bits);
+	}
+
+      if (c < 0)
+	{
+	  lo = mid + 1;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return lo;
+}
+
+/* Merge rules of the same kind on the same address or pattern, and
+ * sibling prefixes with the same ports. The rule ranked first takes
+ * the place of both: only rules of the same kind rank between them. */
+static size_t
+coc_policy_merge (coc_policy_t *p)
+{
+  uint32_t *order = (uint32_t *) coc_xalloc (p->count, sizeof (uint32_t));
+  bool *touched = (bool *) coc_xalloc (p->count, sizeof (bool));
+  size_t i, first = 0;
+
+  for (i = 0; i < p->count; i++)
+    {
+      order[i] = (uint32_t) i;
+    }
+
+  sorted_policy = p;
+  qsort (order, p->count, sizeof (uint32_t), coc_space_cmp);
+
+  for (i = 1; i < p->count; i++)
+    {
+      coc_crule_t *a = &p->rules[order[first]];
+      coc_crule_t *b = &p->rules[order[i]];
+
+      if (a->rule_type == b->rule_type &&
+	  (a->glob ? b->glob && !strcmp (a->glob, b->glob) :
+	   !b->glob && a->bits == b->bits &&
+	   !memcmp (a->key, b->key, COC_KEY_LEN)))
+	{
+	  coc_ranges_t u = coc_ranges_union (&a->ports, &b->ports);
+	  coc_ranges_free (&a->ports);
+	  a->ports = u;
+	  b->dead = true;
+	}
+      else
+	{
+	  first = i;
+	}
+    }
+
+  for (i = 0; i < p->count; i++)
+    {
+      coc_crule_t *a = &p->rules[order[i]];
+      unsigned int bits = a->bits;
+      uint8_t key[COC_KEY_LEN];
+
+      if (a->dead || a->glob || touched[order[i]] || bits == 0 ||
+	  coc_key_bit (a->key, bits - 1))
+	{
+	  continue;
+	}
+
+      memcpy (key, a->key, COC_KEY_LEN);
+      key[(bits - 1) >> 3] |= 0x80 >> ((bits - 1) & 7);
+
+      size_t j = coc_order_bound (p, order, p->count, a->rule_type, key,
+				  bits);
+      coc_crule_t *b = j < p->count ? &p->rules[order[j]] : NULL;
+
+      if (b == NULL || b->dead || b->glob || touched[order[j]] ||
+	  b->rule_type != a->rule_type || b->bits != bits ||
+	  memcmp (b->key, key, COC_KEY_LEN) ||
+	  !coc_ranges_equal (&a->ports, &b->ports))
+	{
+	  continue;
+	}
+
+      coc_crule_t *keep = order[i] < order[j] ? a : b;
+      memcpy (keep->key, a->key, COC_KEY_LEN);
+      keep->bits = (uint8_t) (bits - 1);
+      (keep == a ? b : a)->dead = true;
+      touched[order[i]] = touched[order[j]] = true;
+    }
+
+  free (touched);
+  free (order);
+  return coc_policy_compact (p);
+}
+
+typedef struct coc_buf {
+  char *s;
+  size_t len;
+  size_t cap;
+} coc_buf_t;
+
+#ifdef __GNUC__
+static void coc_buf_printf (coc_buf_t * b, const char *format, ...)
+  __attribute__ ((__format__ (__printf__, 2, 3)));
+#endif
+
+static void
+coc_buf_printf (coc_buf_t *b, const char *format, ...)
+{
+  va_list ap;
+  va_start (ap, format);
+  int n = vsnprintf (NULL, 0, format, ap);
+  va_end (ap);
+
+  if (b->len + n + 1 > b->cap)
+    {
+      b->cap = (b->len + n + 1) * 2;
+      b->s = (char *) realloc (b->s, b->cap);
+
+      if (b->s == NULL)
+	{
+	  DIE ("Out of memory, aborting\n");
+	}
+    }
+
+  va_start (ap, format);
+  vsnprintf (b->s + b->len, n + 1, format, ap);
+  va_end (ap);
+  b->len += n;
+}
+
+/* Rule `r' in the syntax of COC_ALLOW and COC_BLOCK. */
+static void
+coc_rule_format (coc_buf_t *b, const coc_crule_t *r)
+{
+  static const uint8_t v4_mapped[12] =
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  bool any = coc_ranges_any (&r->ports);
+  size_t i;
+
+  if (r->glob != NULL)
+    {
+      /* Rules on a single name start with `=', not to be resolved. */
+      coc_buf_printf (b, "%s%s",
+		      strpbrk (r->glob, "*?[") == NULL ? "=" : "", r->glob);
+    }
+  else if (r->bits >= COC_KEY_V4_OFFSET &&
+	   !memcmp (r->key, v4_mapped, sizeof (v4_mapped)))
+    {
+      char str[INET_ADDRSTRLEN];
+      inet_ntop (AF_INET, r->key + 12, str, sizeof (str));
+      coc_buf_printf (b, "%s", str);
+
+      if (r->bits < COC_KEY_LEN * 8)
+	{
+	  coc_buf_printf (b, "/%u", r->bits - COC_KEY_V4_OFFSET);
+	}
+    }
+  else
+    {
+      char str[INET6_ADDRSTRLEN];
+      inet_ntop (AF_INET6, r->key, str, sizeof (str));
+      coc_buf_printf (b, "%s%s", any ? "" : "[", str);
+
+      if (r->bits < COC_KEY_LEN * 8)
+	{
+	  coc_buf_printf (b, "/%u", r->bits);
+	}
+
+      coc_buf_printf (b, "%s", any ? "" : "]");
+    }
+
+  if (any)
+    {
+      return;
+    }
+
+  coc_buf_printf (b, ":%s", r->ports.count > 1 ? "{" : "");
+
+  for (i = 0; i < r->ports.count; i++)
+    {
+      const coc_range_t *g = &r->ports.r[i];
+      coc_buf_printf (b, "%s%hu", i ? "," : "", g->low);
+
+      if (g->high != g->low)
+	{
+	  coc_buf_printf (b, "-%hu", g->high);
+	}
+    }
+
+  coc_buf_printf (b, "%s", r->ports.count > 1 ? "}" : "");
+}
+
+static char *
+coc_policy_format (const coc_policy_t *p, coc_rule_type_t rule_type)
+{
+  coc_buf_t b = { NULL, 0, 0 };
+  size_t i;
+
+  coc_buf_printf (&b, "%s", "");
+
+  for (i = 0; i < p->count; i++)
+    {
+      if (p->rules[i].rule_type == rule_type)
+	{
+	  coc_buf_printf (&b, "%s", b.len ? ";" : "");
+	  coc_rule_format (&b, &p->rules[i]);
+	}
+    }
+
+  return b.s;
+}
+
+/* Deepest path of the prefix trie, in nodes. */
+static size_t
+coc_lpm_depth (const coc_lpm_t *t, uint32_t n)
+{
+  if (n == COC_NIL)
+    {
+      return 0;
+    }
+
+  size_t a = coc_lpm_depth (t, t->nodes[n].child[0]);
+  size_t b = coc_lpm_depth (t, t->nodes[n].child[1]);
+  return 1 + (a > b ? a : b);
+}
+
+/* What `connect' does for a destination not in the verdict cache. */
+static void
+coc_report_cost (const coc_ruleset_t *rs)
+{
+  size_t labels = 0;
+  uint32_t first_name = COC_NIL;
+  uint32_t rank;
+
+  for (rank = 0; rank < rs->rule_count; rank++)
+    {
+      const char *glob;
+
+      if (rs->rules[rank].addr_type != COC_GLOB_ADDR ||
+	  coc_glob_is_star (glob = coc_rule_glob (rs, rank)))
+	{
+	  continue;
+	}
+
+      if (first_name == COC_NIL)
+	{
+	  first_name = rank;
+	}
+
+      if (glob[0] == '*' && glob[1] == '.' && strpbrk (glob + 2, "*?") ==
+	  NULL)
+	{
+	  size_t n = 1;
+	  const char *c;
+
+	  for (c = glob + 2; *c != '\0'; c++)
+	    {
+	      n += *c == '.';
+	    }
+
+	  labels = n > labels ? n : labels;
+	}
+    }
+
+  coc_log (COC_ERROR_LOG_LEVEL, "per connect() missing from the verdict "
+	   "cache: %sup to %zu prefix trie nodes, %zu `*' rules\n",
+	   rs->exact.count > 0 ? "1 address hash probe, " : "",
+	   coc_lpm_depth (&rs->lpm, rs->lpm.root), rs->star_count);
+
+  if (first_name != COC_NIL)
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "  unless an address rule ranked "
+	       "before #%u matches: 1 reverse DNS lookup, then per name "
+	       "%zu domain trie labels and %zu other globs\n",
+	       first_name + 1, labels, rs->glob_count);
+    }
+}
+
+static int
+usage (int retcode)
+{
+  FILE *out = retcode ? stderr : stdout;
+  fprintf (out, "Usage: %s [OPTION]...\n", me);
+  fprintf (out, "Compile connect-or-cut rules to the smallest equivalent "
+	   "policy, printed as\nshell snippets. Rules default to those of "
+	   "COC_ALLOW, COC_BLOCK,\nCOC_ALLOW_FILE and COC_BLOCK_FILE.\n\n");
+  fprintf (out, "OPTIONS:\n"
+	   " -a, --allow=RULES      \tAllow connections to RULES.\n"
+	   " -b, --block=RULES      \tPrevent connections to RULES.\n"
+	   " -A, --allow-file=PATH  \tAllow connections to the rules of "
+	   "PATH.\n"
+	   " -B, --block-file=PATH  \tPrevent connections to the rules of "
+	   "PATH.\n"
+	   " -o, --output=PATH      \tAlso compile the policy to the rules "
+	   "database\n"
+	   "                        \tPATH, for COC_RULES_DB.\n"
+	   " -j, --jobs=N           \tCheck rules on N threads. Defaults to "
+	   "the\n"
+	   "                        \tnumber of processors.\n"
+	   " -q, --quiet            \tDo not report what was done.\n"
+	   " -v, --verbose          \tLog rules as they are parsed.\n"
+	   " -h, --help             \tPrint this help message.\n");
+  exit (retcode);
+}
+
+/* Append `rules' to the `;' separated `*list'. */
+static void
+coc_append (char **list, const char *rules)
+{
+  coc_buf_t b = { *list, 0, 0 };
+
+  if (*list != NULL)
+    {
+      b.len = strlen (*list);
+      b.cap = b.len + 1;
+    }
+
+  coc_buf_printf (&b, "%s%s", b.len ? ";" : "", rules);
+  *list = b.s;
+}
+
+static void
+coc_print_def (const char *name, const char *value)
+{
+  if (value[0] != '\0')
+    {
+      printf ("%s='%s'\nexport %s\n", name, value, name);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"allow", required_argument, NULL, 'a'},
+    {"block", required_argument, NULL, 'b'},
+    {"allow-file", required_argument, NULL, 'A'},
+    {"block-file", required_argument, NULL, 'B'},
+    {"output", required_argument, NULL, 'o'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  char *allow = NULL;
+  char *block = NULL;
+  const char *allow_file = NULL;
+  const char *block_file = NULL;
+  const char *db = NULL;
+  long jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  bool quiet = false;
+  bool from_args = false;
+  int c;
+
+  while ((c = getopt_long (argc, argv, "a:b:A:B:o:j:qvh", options, NULL)) != -1)
+    {
+      switch (c)
+	{
+	case 'a':
+	  coc_append (&allow, optarg);
+	  from_args = true;
+	  break;
+	case 'b':
+	  coc_append (&block, optarg);
+	  from_args = true;
+	  break;
+	case 'A':
+	  allow_file = optarg;
+	  from_args = true;
+	  break;
+	case 'B':
+	  block_file = optarg;
+	  from_args = true;
+	  break;
+	case 'o':
+	  db = optarg;
+	  break;
+	case 'j':
+	  jobs = strtol (optarg, NULL, 10);
+	  if (jobs < 1)
+	    {
+	      usage (EXIT_FAILURE);
+	    }
+	  break;
+	case 'q':
+	  quiet = true;
+	  break;
+	case 'v':
+	  verbose = true;
+	  break;
+	case 'h':
+	  usage (EXIT_SUCCESS);
+	  break;
+	default:
+	  usage (EXIT_FAILURE);
+	}
+    }
+
+  if (optind != argc)
+    {
+      usage (EXIT_FAILURE);
+    }
+
+  if (!from_args)
+    {
+      const char *env = getenv ("COC_ALLOW");
+      allow = env ? strdup (env) : NULL;
+      env = getenv ("COC_BLOCK");
+      block = env ? strdup (env) : NULL;
+      allow_file = getenv ("COC_ALLOW_FILE");
+      block_file = getenv ("COC_BLOCK_FILE");
+    }
+
+  /* Same order as the library: ALLOW rules rank first, then rules of
+   * the environment. */
+  size_t given = 0;
+
+  if (block_file != NULL && *block_file != '\0')
+    {
+      given += coc_rules_add_file (block_file, COC_BLOCK);
+    }
+
+  given += coc_rules_add (block, COC_BLOCK, "COC_BLOCK");
+
+  if (allow_file != NULL && *allow_file != '\0')
+    {
+      given += coc_rules_add_file (allow_file, COC_ALLOW);
+    }
+
+  given += coc_rules_add (allow, COC_ALLOW, "COC_ALLOW");
+  coc_rules_resolve (COC_RESOLVE_TIMEOUT_MS);
+
+  if (coc_rules_errors () > 0)
+    {
+      DIE ("%zu error(s) in rules, aborting\n", coc_rules_errors ());
+    }
+
+  coc_rules_order ();
+
+  coc_policy_t p;
+  size_t dropped[COC_PASSES] = { 0, 0, 0 };
+  size_t merged = 0;
+  size_t changed;
+
+  memset (&p, 0, sizeof (p));
+  coc_policy_from_list (&p);
+  size_t resolved = p.count;
+
+  do
+    {
+      coc_pass_t pass;
+      size_t n = coc_policy_merge (&p);
+
+      merged += n;
+      changed = n;
+
+      for (pass = COC_SHADOWED; pass < COC_PASSES; pass++)
+	{
+	  n = coc_policy_pass (&p, pass, (size_t) jobs);
+	  dropped[pass] += n;
+	  changed += n;
+	}
+    }
+  while (changed > 0);
+
+  coc_policy_unindex (&p);
+  free (allow);
+  free (block);
+  allow = coc_policy_format (&p, COC_ALLOW);
+  block = coc_policy_format (&p, COC_BLOCK);
+  coc_print_def ("COC_ALLOW", allow);
+  coc_print_def ("COC_BLOCK", block);
+
+  /* The output goes through the parser again: what is reported is what
+   * the library will do with it. */
+  coc_ruleset_t rs;
+  coc_rules_add (block, COC_BLOCK, "COC_BLOCK");
+  coc_rules_add (allow, COC_ALLOW, "COC_ALLOW");
+  coc_rules_compile (&rs, COC_BLOOM_FP_RATE);
+
+  if (!quiet)
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "%zu rules given, %zu once host names "
+	       "resolved, %zu left\n", given, resolved, rs.rule_count);
+      coc_log (COC_ERROR_LOG_LEVEL, "  %zu never matching, %zu redundant, "
+	       "%zu merged\n", dropped[COC_SHADOWED],
+	       dropped[COC_SUBSUMED] + dropped[COC_UNBLOCKED], merged);
+      coc_report_cost (&rs);
+    }
+
+  if (db != NULL)
+    {
+      const char *error =
+	coc_db_write (&rs, db, coc_rules_source (block, allow, NULL, NULL));
+
+      if (error != NULL)
+	{
+	  DIE ("Cannot write rules database %s: %s, aborting\n", db, error);
+	}
+    }
+
+  exit (EXIT_SUCCESS);
+}
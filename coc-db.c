@@ -0,0 +1,538 @@
+/* coc-db -- precompiled rules database for connect-or-cut.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+/*
+ * A rules database holds the arrays of a compiled ruleset, each in its
+ * own section, after a header with the scalars needed to use them.
+ * Since the arrays only refer to each other by index, the file is
+ * mapped read-only and used in place: processes sharing a database
+ * share its pages, and loading it costs a few checks of the header.
+ *
+ * The database is trusted as much as the environment it replaces: only
+ * its layout is checked, not every index in it. It is written in native
+ * byte order, and rejected on a host with another one.
+ */
+
+#define COC_DB_MAGIC "COCRULES"
+#define COC_DB_ENDIAN 0x01020304U
+#define COC_DB_ALIGN 64		/* cache line, as Bloom filter blocks. */
+
+enum coc_db_section
+{
+  COC_DB_RULES,
+  COC_DB_STRINGS,
+  COC_DB_PORTSETS,
+  COC_DB_EXACT,
+  COC_DB_EXACT_BLOOM,
+  COC_DB_LPM,
+  COC_DB_DOMAIN_EDGES,
+  COC_DB_DOMAIN_NODES,
+  COC_DB_DOMAIN_BLOOM,
+  COC_DB_STARS,
+  COC_DB_GLOBS,
+  COC_DB_SECTIONS
+};
+
+/* Size of an item in each section. */
+static const size_t coc_db_item_size[COC_DB_SECTIONS] = {
+  sizeof (coc_rule_t),
+  1,
+  COC_PORTSET_BYTES,
+  sizeof (coc_hash_slot_t),
+  COC_DB_ALIGN,
+  sizeof (coc_lpm_node_t),
+  sizeof (coc_domain_edge_t),
+  sizeof (coc_domain_node_t),
+  COC_DB_ALIGN,
+  sizeof (uint32_t),
+  sizeof (uint32_t)
+};
+
+typedef struct coc_db_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;		/* COC_DB_ENDIAN, as written. */
+  uint64_t size;		/* of the whole file. */
+  uint64_t source;		/* rules compiled. */
+  uint32_t exact_count;
+  uint32_t lpm_root;
+  uint32_t domain_first;
+  uint32_t domain_count;
+  uint32_t domain_edge_count;
+  uint32_t exact_bloom_k;
+  uint32_t domain_bloom_k;
+  uint32_t pad;
+  struct {
+    uint64_t offset;
+    uint64_t size;
+  } sections[COC_DB_SECTIONS];
+} coc_db_header_t;
+
+static void
+coc_db_sections (const coc_ruleset_t *rs, const void *data[COC_DB_SECTIONS],
+		 size_t count[COC_DB_SECTIONS])
+{
+  data[COC_DB_RULES] = rs->rules;
+  count[COC_DB_RULES] = rs->rule_count;
+  data[COC_DB_STRINGS] = rs->strings;
+  count[COC_DB_STRINGS] = rs->strings_len;
+  data[COC_DB_PORTSETS] = rs->portsets;
+  count[COC_DB_PORTSETS] = rs->portset_count;
+  data[COC_DB_EXACT] = rs->exact.slots;
+  count[COC_DB_EXACT] = rs->exact.slots ? rs->exact.mask + 1 : 0;
+  data[COC_DB_EXACT_BLOOM] = rs->exact_bloom.blocks;
+  count[COC_DB_EXACT_BLOOM] = rs->exact_bloom.block_count;
+  data[COC_DB_LPM] = rs->lpm.nodes;
+  count[COC_DB_LPM] = rs->lpm.node_count;
+  data[COC_DB_DOMAIN_EDGES] = rs->domains.edges;
+  count[COC_DB_DOMAIN_EDGES] = rs->domains.edges ? rs->domains.mask + 1 : 0;
+  data[COC_DB_DOMAIN_NODES] = rs->domains.nodes;
+  count[COC_DB_DOMAIN_NODES] = rs->domains.node_count;
+  data[COC_DB_DOMAIN_BLOOM] = rs->domain_bloom.blocks;
+  count[COC_DB_DOMAIN_BLOOM] = rs->domain_bloom.block_count;
+  data[COC_DB_STARS] = rs->stars;
+  count[COC_DB_STARS] = rs->star_count;
+  data[COC_DB_GLOBS] = rs->globs;
+  count[COC_DB_GLOBS] = rs->glob_count;
+}
+
+/* Write `rs' to `path', through a temporary file renamed over it so
+ * that readers never see a partial database. Returns NULL on success,
+ * or what went wrong. */
+const char *
+coc_db_write (const coc_ruleset_t *rs, const char *path, uint64_t source)
+{
+  static const char zeros[COC_DB_ALIGN];
+  const void *data[COC_DB_SECTIONS];
+  size_t count[COC_DB_SECTIONS];
+  coc_db_header_t h;
+  uint64_t offset = sizeof (h);
+  size_t i;
+
+  coc_db_sections (rs, data, count);
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, COC_DB_MAGIC, sizeof (h.magic));
+  h.version = COC_DB_VERSION;
+  h.endian = COC_DB_ENDIAN;
+  h.source = source;
+  h.exact_count = (uint32_t) rs->exact.count;
+  h.lpm_root = rs->lpm.root;
+  h.domain_first = rs->domains.first;
+  h.domain_count = (uint32_t) rs->domains.count;
+  h.domain_edge_count = (uint32_t) rs->domains.edge_count;
+  h.exact_bloom_k = rs->exact_bloom.k;
+  h.domain_bloom_k = rs->domain_bloom.k;
+
+  for (i = 0; i < COC_DB_SECTIONS; i++)
+    {
+      offset = (offset + COC_DB_ALIGN - 1) & ~(uint64_t) (COC_DB_ALIGN - 1);
+      h.sections[i].offset = offset;
+      h.sections[i].size = (uint64_t) count[i] * coc_db_item_size[i];
+      offset += h.sections[i].size;
+    }
+
+  h.size = offset;
+
+  size_t len = strlen (path) + sizeof (".tmp.") + 20;
+  char *tmp = (char *) malloc (len);
+
+  if (tmp == NULL)
+    {
+      return strerror (ENOMEM);
+    }
+
+  snprintf (tmp, len, "%s.tmp.%ld", path, (long) getpid ());
+
+  FILE *f = fopen (tmp, "wb");
+
+  if (f == NULL)
+    {
+      free (tmp);
+      return strerror (errno);
+    }
+
+  bool ok = fwrite (&h, sizeof (h), 1, f) == 1;
+  offset = sizeof (h);
+
+  for (i = 0; ok && i < COC_DB_SECTIONS; i++)
+    {
+      size_t pad = (size_t) (h.sections[i].offset - offset);
+
+      ok = (pad == 0 || fwrite (zeros, pad, 1, f) == 1) &&
+	(h.sections[i].size == 0 ||
+	 fwrite (data[i], (size_t) h.sections[i].size, 1, f) == 1);
+      offset = h.sections[i].offset + h.sections[i].size;
+    }
+
+  ok = fflush (f) == 0 && ok;
+#ifndef _WIN32
+  ok = ok && fsync (fileno (f)) == 0;
+#endif
+  int error = errno;
+  ok = fclose (f) == 0 && ok;
+
+#ifdef _WIN32
+  ok = ok && MoveFileExA (tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename (tmp, path) == 0;
+#endif
+
+  if (!ok)
+    {
+      error = errno ? errno : error;
+      remove (tmp);
+    }
+
+  free (tmp);
+  return ok ? NULL : strerror (error ? error : EIO);
+}
+
+void
+coc_file_unmap (void *map, size_t size)
+{
+#ifdef _WIN32
+  UnmapViewOfFile (map);
+#else
+  munmap (map, size);
+#endif
+}
+
+/* Map `path' read-only. With `owned', refuse with EPERM a file which is
+ * not the effective user's or which others can write. Returns NULL and
+ * sets errno on failure. */
+void *
+coc_file_map (const char *path, size_t *size, bool owned)
+{
+  void *map = NULL;
+#ifdef _WIN32
+  HANDLE file = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ |
+			     FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			     FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER len;
+
+  errno = ENOENT;
+
+  if (file == INVALID_HANDLE_VALUE)
+    {
+      return NULL;
+    }
+
+  if (GetFileSizeEx (file, &len) && len.QuadPart > 0 &&
+      (uint64_t) len.QuadPart <= SIZE_MAX)
+    {
+      HANDLE mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0,
+					   NULL);
+
+      if (mapping != NULL)
+	{
+	  map = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+	  *size = (size_t) len.QuadPart;
+	  CloseHandle (mapping);
+	}
+    }
+
+  CloseHandle (file);
+  errno = map != NULL ? 0 : EINVAL;
+  (void) owned;
+#else
+  struct stat st;
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    {
+      return NULL;
+    }
+
+  if (fstat (fd, &st) == 0)
+    {
+      if (owned && (st.st_uid != geteuid () ||
+		    (st.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+	{
+	  errno = EPERM;
+	}
+      else if (st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX)
+	{
+	  errno = EINVAL;
+	}
+      else
+	{
+	  *size = (size_t) st.st_size;
+	  map = mmap (NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+
+	  if (map == MAP_FAILED)
+	    {
+	      map = NULL;
+	    }
+	}
+    }
+
+  int error = errno;
+  close (fd);
+  errno = error;
+#endif
+  return map;
+}
+
+/* Read `path' whole into memory, where unlike a mapping it cannot be
+ * truncated under the reader. Returns NULL and sets errno on failure,
+ * to EINVAL if the file is empty. */
+char *
+coc_file_read (const char *path, size_t *size)
+{
+  FILE *f = fopen (path, "rb");
+  char *buf = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+
+  if (f == NULL)
+    {
+      return NULL;
+    }
+
+  for (;;)
+    {
+      if (len == cap)
+	{
+	  char *grown = (char *) realloc (buf, cap > 0 ? 2 * cap : 65536);
+
+	  if (grown == NULL)
+	    {
+	      free (buf);
+	      buf = NULL;
+	      errno = ENOMEM;
+	      break;
+	    }
+
+	  buf = grown;
+	  cap = cap > 0 ? 2 * cap : 65536;
+	}
+
+      size_t n = fread (buf + len, 1, cap - len, f);
+
+      len += n;
+
+      if (n == 0)
+	{
+	  if (ferror (f))
+	    {
+	      free (buf);
+	      buf = NULL;
+	      errno = EIO;
+	    }
+
+	  break;
+	}
+    }
+
+  fclose (f);
+
+  if (buf != NULL && len == 0)
+    {
+      free (buf);
+      buf = NULL;
+      errno = EINVAL;
+    }
+
+  *size = len;
+  return buf;
+}
+
+static inline bool
+coc_db_pow2 (uint64_t n)
+{
+  return n > 0 && (n & (n - 1)) == 0;
+}
+
+/* What is wrong with the layout of the database `h' of `size' bytes, or
+ * NULL if nothing is. */
+static const char *
+coc_db_check (const coc_db_header_t *h, size_t size, uint64_t source)
+{
+  size_t i;
+
+  if (size < sizeof (*h) || memcmp (h->magic, COC_DB_MAGIC, 8) != 0)
+    {
+      return "not a rules database";
+    }
+
+  if (h->version != COC_DB_VERSION || h->endian != COC_DB_ENDIAN)
+    {
+      return "unsupported version or byte order";
+    }
+
+  if (h->size != size)
+    {
+      return "truncated";
+    }
+
+  if (source != 0 && h->source != source)
+    {
+      return "compiled from other rules";
+    }
+
+  for (i = 0; i < COC_DB_SECTIONS; i++)
+    {
+      uint64_t offset = h->sections[i].offset;
+      uint64_t len = h->sections[i].size;
+
+      if (offset % COC_DB_ALIGN != 0 || offset < sizeof (*h) ||
+	  offset > size || len > size - offset ||
+	  len % coc_db_item_size[i] != 0)
+	{
+	  return "corrupted section table";
+	}
+    }
+
+  uint64_t rules = h->sections[COC_DB_RULES].size / sizeof (coc_rule_t);
+  uint64_t strings = h->sections[COC_DB_STRINGS].size;
+  uint64_t slots = h->sections[COC_DB_EXACT].size /
+    sizeof (coc_hash_slot_t);
+  uint64_t nodes = h->sections[COC_DB_LPM].size / sizeof (coc_lpm_node_t);
+  uint64_t edges = h->sections[COC_DB_DOMAIN_EDGES].size /
+    sizeof (coc_domain_edge_t);
+  const char *base = (const char *) h;
+
+  if (rules >= COC_NIL ||
+      (strings > 0 && base[h->sections[COC_DB_STRINGS].offset +
+			   strings - 1] != '\0') ||
+      !coc_db_pow2 (slots) || h->exact_count > slots / 2 ||
+      (h->lpm_root != COC_NIL && h->lpm_root >= nodes) ||
+      (h->domain_count > 0 && (!coc_db_pow2 (edges) ||
+			       h->domain_edge_count >= edges ||
+			       h->domain_first >= rules)) ||
+      h->exact_bloom_k > 16 || h->domain_bloom_k > 16)
+    {
+      return "corrupted indexes";
+    }
+
+  return NULL;
+}
+
+/* Map the database at `path' into `rs'. If `source' is not 0, the
+ * database must have been compiled from it. Returns NULL on success,
+ * or what went wrong. */
+const char *
+coc_db_load (coc_ruleset_t *rs, const char *path, uint64_t source)
+{
+  size_t size;
+  char *map = (char *) coc_file_map (path, &size, false);
+
+  if (map == NULL)
+    {
+      return strerror (errno);
+    }
+
+  const coc_db_header_t *h = (const coc_db_header_t *) map;
+  const char *error = coc_db_check (h, size, source);
+
+  if (error != NULL)
+    {
+      coc_file_unmap (map, size);
+      return error;
+    }
+
+#define COC_DB_SECTION(type, i) \
+  ((type *) (map + h->sections[i].offset))
+#define COC_DB_COUNT(i) \
+  ((size_t) (h->sections[i].size / coc_db_item_size[i]))
+
+  /* Sections are read-only: nothing but the automaton is built once a
+   * ruleset is compiled. */
+  memset (rs, 0, sizeof (*rs));
+  rs->rules = COC_DB_SECTION (coc_rule_t, COC_DB_RULES);
+  rs->rule_count = COC_DB_COUNT (COC_DB_RULES);
+  rs->strings = COC_DB_SECTION (char, COC_DB_STRINGS);
+  rs->strings_len = COC_DB_COUNT (COC_DB_STRINGS);
+  rs->portsets = (uint8_t (*)[COC_PORTSET_BYTES])
+    (map + h->sections[COC_DB_PORTSETS].offset);
+  rs->portset_count = COC_DB_COUNT (COC_DB_PORTSETS);
+
+  rs->exact.slots = COC_DB_SECTION (coc_hash_slot_t, COC_DB_EXACT);
+  rs->exact.mask = COC_DB_COUNT (COC_DB_EXACT) - 1;
+  rs->exact.count = h->exact_count;
+
+  rs->lpm.nodes = COC_DB_SECTION (coc_lpm_node_t, COC_DB_LPM);
+  rs->lpm.node_count = rs->lpm.node_cap = COC_DB_COUNT (COC_DB_LPM);
+  rs->lpm.root = h->lpm_root;
+
+  rs->domains.edges = COC_DB_SECTION (coc_domain_edge_t, COC_DB_DOMAIN_EDGES);
+  rs->domains.mask = h->domain_count > 0 ?
+    COC_DB_COUNT (COC_DB_DOMAIN_EDGES) - 1 : 0;
+  rs->domains.edge_count = h->domain_edge_count;
+  rs->domains.nodes = COC_DB_SECTION (coc_domain_node_t, COC_DB_DOMAIN_NODES);
+  rs->domains.node_count = rs->domains.node_cap =
+    COC_DB_COUNT (COC_DB_DOMAIN_NODES);
+  rs->domains.first = h->domain_first;
+  rs->domains.count = h->domain_count;
+
+  if (h->sections[COC_DB_EXACT_BLOOM].size > 0)
+    {
+      rs->exact_bloom.blocks = COC_DB_SECTION (uint64_t, COC_DB_EXACT_BLOOM);
+      rs->exact_bloom.block_count = COC_DB_COUNT (COC_DB_EXACT_BLOOM);
+      rs->exact_bloom.k = h->exact_bloom_k;
+    }
+
+  if (h->sections[COC_DB_DOMAIN_BLOOM].size > 0)
+    {
+      rs->domain_bloom.blocks = COC_DB_SECTION (uint64_t,
+						COC_DB_DOMAIN_BLOOM);
+      rs->domain_bloom.block_count = COC_DB_COUNT (COC_DB_DOMAIN_BLOOM);
+      rs->domain_bloom.k = h->domain_bloom_k;
+    }
+
+  rs->stars = COC_DB_SECTION (uint32_t, COC_DB_STARS);
+  rs->star_count = COC_DB_COUNT (COC_DB_STARS);
+  rs->globs = COC_DB_SECTION (uint32_t, COC_DB_GLOBS);
+  rs->glob_count = COC_DB_COUNT (COC_DB_GLOBS);
+
+#undef COC_DB_SECTION
+#undef COC_DB_COUNT
+
+  rs->map = map;
+  rs->map_size = size;
+  return NULL;
+}
@@ -0,0 +1,302 @@
+/* coc-decode -- print connect-or-cut event logs.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#include <getopt.h>
+
+/*
+ * Events of COC_EVENT_LOG are printed one per line, as text or as JSON
+ * objects. Files start with a header telling how events were written,
+ * and those written by another version or a host of other endianness
+ * are refused. Headers found in between, written by processes sharing
+ * the file, are checked and skipped alike.
+ */
+
+static const char *me = "coc-decode";
+static bool json = false;
+
+void
+coc_log (coc_log_level_t level, const char *format, ...)
+{
+  va_list ap;
+  va_start (ap, format);
+  fprintf (stderr, "%s: ", me);
+  vfprintf (stderr, format, ap);
+  va_end (ap);
+}
+
+static int
+usage (int retcode)
+{
+  FILE *out = retcode ? stderr : stdout;
+  fprintf (out, "Usage: %s [OPTION]... [FILE]...\n", me);
+  fprintf (out, "Print the connect-or-cut event logs FILE, written with "
+	   "COC_EVENT_LOG, one\nevent per line. With no FILE, or when FILE "
+	   "is -, read standard input.\n\n");
+  fprintf (out, "OPTIONS:\n"
+	   " -j, --json             \tPrint events as JSON objects.\n"
+	   " -h, --help             \tPrint this help message.\n");
+  exit (retcode);
+}
+
+/* Returns an error message if `h' is not a header of ours. */
+static const char *
+coc_header_check (const coc_event_header_t *h)
+{
+  if (memcmp (h->magic, COC_EVENT_MAGIC, sizeof (h->magic)) != 0)
+    {
+      return "not an event log";
+    }
+
+  if (h->endian != COC_EVENT_ENDIAN)
+    {
+      return "written by a host of other endianness";
+    }
+
+  if (h->version != COC_EVENT_VERSION || h->size != sizeof (coc_event_t))
+    {
+      return "unsupported version";
+    }
+
+  return NULL;
+}
+
+static const char *
+coc_verdict_name (uint8_t verdict)
+{
+  switch (verdict)
+    {
+    case COC_ALLOW:
+      return "ALLOW";
+    case COC_BLOCK:
+      return "BLOCK";
+    case COC_EVENT_DROPPED:
+      return "DROPPED";
+    default:
+      return "UNKNOWN";
+    }
+}
+
+static void
+coc_event_print (const coc_event_t *e)
+{
+  char addr[INET6_ADDRSTRLEN] = "";
+  char stamp[sizeof ("YYYY-MM-DDTHH:MM:SS")];
+  time_t t = (time_t) (e->time_ns / 1000000000);
+  unsigned long us = (unsigned long) (e->time_ns % 1000000000 / 1000);
+  const char *verdict = coc_verdict_name (e->verdict);
+  struct tm tm;
+
+  localtime_r (&t, &tm);
+  strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  if (e->family == 4)
+    {
+      inet_ntop (AF_INET, e->addr + COC_KEY_LEN - 4, addr, sizeof (addr));
+    }
+  else if (e->family == 6)
+    {
+      inet_ntop (AF_INET6, e->addr, addr, sizeof (addr));
+    }
+
+  if (e->verdict == COC_EVENT_DROPPED)
+    {
+      if (json)
+	{
+	  printf ("{\"time_ns\":%llu,\"pid\":%lu,\"verdict\":\"%s\","
+		  "\"count\":%lu}\n", (unsigned long long) e->time_ns,
+		  (unsigned long) e->pid, verdict, (unsigned long) e->rule);
+	}
+      else
+	{
+	  printf ("%s.%06lu pid %lu %s %lu events\n", stamp, us,
+		  (unsigned long) e->pid, verdict, (unsigned long) e->rule);
+	}
+
+      return;
+    }
+
+  if (json)
+    {
+      printf ("{\"time_ns\":%llu,\"pid\":%lu,\"tid\":%lu,\"verdict\":\"%s\","
+	      "\"family\":%u,\"addr\":\"%s\",\"port\":%u,",
+	      (unsigned long long) e->time_ns, (unsigned long) e->pid,
+	      (unsigned long) e->tid, verdict, e->family, addr, e->port);
+
+      if (e->rule == COC_NIL)
+	{
+	  printf ("\"rule\":null,");
+	}
+      else
+	{
+	  printf ("\"rule\":%lu,", (unsigned long) e->rule);
+	}
+
+      printf ("\"latency_ns\":%lu,\"cached\":%s,\"timed_out\":%s}\n",
+	      (unsigned long) e->latency_ns,
+	      e->flags & COC_EVENT_CACHED ? "true" : "false",
+	      e->flags & COC_EVENT_TIMED_OUT ? "true" : "false");
+      return;
+    }
+
+  printf ("%s.%06lu pid %lu tid %lu %s %s%s%s:%u", stamp, us,
+	  (unsigned long) e->pid, (unsigned long) e->tid, verdict,
+	  e->family == 6 ? "[" : "", addr, e->family == 6 ? "]" : "",
+	  e->port);
+
+  if (e->rule == COC_NIL)
+    {
+      printf (" rule -");
+    }
+  else
+    {
+      printf (" rule %lu", (unsigned long) e->rule);
+    }
+
+  printf (" %lu.%03luus%s%s\n", (unsigned long) e->latency_ns / 1000,
+	  (unsigned long) e->latency_ns % 1000,
+	  e->flags & COC_EVENT_CACHED ? " cached" : "",
+	  e->flags & COC_EVENT_TIMED_OUT ? " timed-out" : "");
+}
+
+/* Print the events of `in', named `name'. Returns false on error. */
+static bool
+coc_decode (FILE *in, const char *name)
+{
+  union {
+    coc_event_header_t h;
+    coc_event_t e;
+  } rec;
+  const char *error;
+  size_t n;
+
+  if ((n = fread (&rec, 1, sizeof (rec), in)) == 0 && !ferror (in))
+    {
+      /* Opened, but no process wrote to it yet. */
+      return true;
+    }
+
+  if (n != sizeof (rec) || (error = coc_header_check (&rec.h)) != NULL)
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "%s: %s\n", name,
+	       ferror (in) ? strerror (errno) : n != sizeof (rec) ?
+	       "not an event log" : error);
+      return false;
+    }
+
+  while ((n = fread (&rec, 1, sizeof (rec), in)) == sizeof (rec))
+    {
+      if (memcmp (rec.h.magic, COC_EVENT_MAGIC, sizeof (rec.h.magic)) != 0)
+	{
+	  coc_event_print (&rec.e);
+	}
+      else if ((error = coc_header_check (&rec.h)) != NULL)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL, "%s: %s\n", name, error);
+	  return false;
+	}
+    }
+
+  if (ferror (in))
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "%s: %s\n", name, strerror (errno));
+      return false;
+    }
+
+  if (n > 0)
+    {
+      /* The last event may still be being written. */
+      coc_log (COC_ERROR_LOG_LEVEL, "%s: truncated event ignored\n", name);
+    }
+
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"json", no_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  bool ok = true;
+  int c;
+
+  while ((c = getopt_long (argc, argv, "jh", options, NULL)) != -1)
+    {
+      switch (c)
+	{
+	case 'j':
+	  json = true;
+	  break;
+	case 'h':
+	  usage (EXIT_SUCCESS);
+	  break;
+	default:
+	  usage (EXIT_FAILURE);
+	}
+    }
+
+  if (optind == argc)
+    {
+      ok = coc_decode (stdin, "-");
+    }
+
+  for (; optind < argc; optind++)
+    {
+      const char *name = argv[optind];
+
+      if (strcmp (name, "-") == 0)
+	{
+	  ok &= coc_decode (stdin, name);
+	  continue;
+	}
+
+      FILE *in = fopen (name, "rb");
+
+      if (in == NULL)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL, "%s: %s\n", name, strerror (errno));
+	  ok = false;
+	  continue;
+	}
+
+      ok &= coc_decode (in, name);
+      fclose (in);
+    }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,619 @@
+/* coc-dfa -- combined automaton for connect-or-cut glob rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Glob rules that are not plain suffixes are compiled into a single
+ * automaton so that a name is scanned once, whatever the number of
+ * rules. Globs only contain literal characters, `*' and `?', so each
+ * pattern is a chain of positions in a shared NFA:
+ *  - a literal or `?' at position p moves to p + 1;
+ *  - `*' at position p stays at p, and also allows p + 1 right away;
+ *  - the position after the last character accepts the pattern.
+ *
+ * The DFA over sets of positions is built lazily, one state at a time
+ * as names are scanned. States keep the positions they hold, in
+ * increasing order, since most are far fewer than all of them.
+ *
+ * Scans read built transitions without locking, and only take a lock
+ * to build missing ones, which are published once complete. A graph of
+ * states growing over `max_size' is dropped, and built again from the
+ * start state by the next scans; those which were walking it keep on
+ * reading it until they are done, as with the ruleset itself. Rules are
+ * checked with fnmatch, one at a time as before, in the meantime.
+ */
+struct coc_dfa_state {
+  coc_dfa_state_t **next;	/* per character class; NULL if not built. */
+  uint32_t *set;		/* positions, in increasing order. */
+  size_t set_count;
+  uint32_t *accept;		/* rules accepted here, ordered by rank. */
+  size_t accept_count;
+  uint32_t hash;
+  coc_dfa_state_t *link;	/* next one in its graph. */
+};
+
+struct coc_dfa_graph {
+  coc_dfa_state_t *start;
+  coc_dfa_state_t *states;	/* all of them, linked. */
+  coc_dfa_state_t **index;	/* hash set of states. */
+  size_t index_mask;
+  size_t state_count;
+  size_t size;
+  uint64_t epoch;		/* when dropped. */
+  coc_dfa_graph_t *retired;	/* next one dropped before. */
+};
+
+typedef struct coc_dfa_set {
+  uint32_t *pos;
+  size_t count;
+  size_t cap;
+} coc_dfa_set_t;
+
+/* Serializes builds of all automata. */
+static coc_mutex_t coc_dfa_lock;
+
+static void
+coc_dfa_add (const coc_dfa_t *d, coc_dfa_set_t *s, size_t pos)
+{
+  /* `*' also matches the empty string: add the following positions.
+   * Such runs end at the first other character, so that any run
+   * starting before the last position added ends there too: skipping
+   * those keeps positions in increasing order. */
+  for (;;)
+    {
+      if (s->count == 0 || pos > s->pos[s->count - 1])
+	{
+	  if (s->count == s->cap)
+	    {
+	      s->cap = s->cap ? s->cap * 2 : 16;
+	      s->pos = (uint32_t *) realloc (s->pos,
+					     s->cap * sizeof (uint32_t));
+
+	      if (s->pos == NULL)
+		{
+		  DIE ("Cannot allocate glob automaton, aborting\n");
+		}
+	    }
+
+	  s->pos[s->count++] = (uint32_t) pos;
+	}
+
+      if (d->chars[pos] != '*')
+	{
+	  break;
+	}
+
+      pos++;
+    }
+}
+
+static uint32_t
+coc_dfa_hash (const uint32_t *set, size_t count)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ count;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      h = (h ^ set[i]) * 0x100000001b3ULL;
+    }
+
+  return (uint32_t) (h ^ (h >> 32));
+}
+
+#ifndef _WIN32
+/* A build may have been going on in another thread of the parent. */
+static void
+coc_dfa_forked (void)
+{
+  coc_mutex_init (&coc_dfa_lock);
+}
+#endif
+
+static void
+coc_dfa_once (void)
+{
+  coc_mutex_init (&coc_dfa_lock);
+#ifndef _WIN32
+  pthread_atfork (NULL, NULL, coc_dfa_forked);
+#endif
+}
+
+void
+coc_dfa_init (coc_dfa_t *d, const coc_ruleset_t *rs, const uint32_t *rules,
+	      size_t count, size_t max_size)
+{
+  static coc_once_t once = COC_ONCE_INIT;
+  size_t i, k;
+
+  coc_once (&once, coc_dfa_once);
+  memset (d, 0, sizeof (*d));
+  d->rs = rs;
+  d->rules = rules;
+  d->rule_count = count;
+  d->max_size = max_size;
+
+  if (count == 0)
+    {
+      return;
+    }
+
+  d->base = (size_t *) malloc (count * sizeof (size_t));
+
+  if (d->base == NULL)
+    {
+      DIE ("Cannot allocate glob automaton, aborting\n");
+    }
+
+  for (k = 0; k < count; k++)
+    {
+      d->base[k] = d->positions;
+      d->positions += strlen (coc_rule_glob (rs, rules[k])) + 1;
+    }
+
+  d->chars = (char *) malloc (d->positions);
+
+  if (d->chars == NULL || d->positions > UINT32_MAX)
+    {
+      DIE ("Cannot allocate glob automaton, aborting\n");
+    }
+
+  /* Every character used in a pattern gets its own class; all others
+   * share class 0, which only `*' and `?' accept. */
+  bool used[UCHAR_MAX + 1] = { false };
+
+  for (k = 0; k < count; k++)
+    {
+      const char *g = coc_rule_glob (rs, rules[k]);
+      memcpy (d->chars + d->base[k], g, strlen (g) + 1);
+
+      for (; *g != '\0'; g++)
+	{
+	  if (*g != '*' && *g != '?')
+	    {
+	      used[(unsigned char) *g] = true;
+	    }
+	}
+    }
+
+  d->class_count = 1;
+  d->class_char[0] = '\0';
+
+  for (i = 1; i <= UCHAR_MAX; i++)
+    {
+      if (used[i])
+	{
+	  d->class_char[d->class_count] = (char) i;
+	  d->classes[i] = (uint8_t) d->class_count++;
+	}
+      else if (d->class_char[0] == '\0')
+	{
+	  d->class_char[0] = (char) i;
+	}
+    }
+}
+
+/* The index of the rule whose pattern holds position `pos'. */
+static size_t
+coc_dfa_rule_of (const coc_dfa_t *d, size_t pos)
+{
+  size_t lo = 0, hi = d->rule_count;
+
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (d->base[mid] <= pos)
+	{
+	  lo = mid;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return lo;
+}
+
+static void
+coc_dfa_index_add (coc_dfa_graph_t *g, coc_dfa_state_t *s)
+{
+  size_t i = s->hash & g->index_mask;
+
+  while (g->index[i] != NULL)
+    {
+      i = (i + 1) & g->index_mask;
+    }
+
+  g->index[i] = s;
+}
+
+/* Find or add the state for `set' to `g', which takes it over. Returns
+ * NULL if over the size cap. */
+static coc_dfa_state_t *
+coc_dfa_state (coc_dfa_t *d, coc_dfa_graph_t *g, coc_dfa_set_t *set)
+{
+  uint32_t hash = coc_dfa_hash (set->pos, set->count);
+  coc_dfa_state_t *s;
+  size_t i;
+
+  if (g->index != NULL)
+    {
+      for (i = hash & g->index_mask; (s = g->index[i]) != NULL;
+	   i = (i + 1) & g->index_mask)
+	{
+	  if (s->hash == hash && s->set_count == set->count &&
+	      !memcmp (s->set, set->pos, set->count * sizeof (uint32_t)))
+	    {
+	      free (set->pos);
+	      return s;
+	    }
+	}
+    }
+
+  /* Rules accepted in this state, in rank order like positions. */
+  uint32_t *accept = NULL;
+  size_t accept_count = 0;
+
+  for (i = 0; i < set->count; i++)
+    {
+      if (d->chars[set->pos[i]] == '\0')
+	{
+	  accept = (uint32_t *) realloc (accept, (accept_count + 1) *
+					 sizeof (uint32_t));
+
+	  if (accept == NULL)
+	    {
+	      DIE ("Cannot allocate glob automaton, aborting\n");
+	    }
+
+	  accept[accept_count++] =
+	    d->rules[coc_dfa_rule_of (d, set->pos[i])];
+	}
+    }
+
+  size_t size = set->count * sizeof (uint32_t) +
+    d->class_count * sizeof (coc_dfa_state_t *) +
+    accept_count * sizeof (uint32_t) + sizeof (coc_dfa_state_t);
+
+  if (g->size + size > d->max_size)
+    {
+      free (set->pos);
+      free (accept);
+      return NULL;
+    }
+
+  g->size += size;
+
+  /* Readers never look at the index: it is rebuilt in place. */
+  if (g->state_count * 2 >= g->index_mask)
+    {
+      free (g->index);
+      g->index_mask = g->index_mask ? g->index_mask * 2 + 1 : 31;
+      g->index = (coc_dfa_state_t **) calloc (g->index_mask + 1,
+					      sizeof (coc_dfa_state_t *));
+
+      if (g->index == NULL)
+	{
+	  DIE ("Cannot allocate glob automaton, aborting\n");
+	}
+
+      for (s = g->states; s != NULL; s = s->link)
+	{
+	  coc_dfa_index_add (g, s);
+	}
+    }
+
+  s = (coc_dfa_state_t *) calloc (1, sizeof (coc_dfa_state_t));
+
+  if (s == NULL || (s->next = (coc_dfa_state_t **)
+		    calloc (d->class_count, sizeof (coc_dfa_state_t *))) ==
+      NULL)
+    {
+      DIE ("Cannot allocate glob automaton, aborting\n");
+    }
+
+  s->set = set->count > 0 ?
+    (uint32_t *) realloc (set->pos, set->count * sizeof (uint32_t)) : NULL;
+
+  if (set->count == 0)
+    {
+      free (set->pos);
+    }
+  else if (s->set == NULL)
+    {
+      DIE ("Cannot allocate glob automaton, aborting\n");
+    }
+
+  s->set_count = set->count;
+  s->hash = hash;
+  s->accept = accept;
+  s->accept_count = accept_count;
+  s->link = g->states;
+  g->states = s;
+  g->state_count++;
+  coc_dfa_index_add (g, s);
+  return s;
+}
+
+/* Compute the transition of state `from' for class `c'. */
+static coc_dfa_state_t *
+coc_dfa_step (coc_dfa_t *d, coc_dfa_graph_t *g, const coc_dfa_state_t *from,
+	      uint8_t c)
+{
+  coc_dfa_set_t set = { NULL, 0, 0 };
+  char ch = d->class_char[c];
+  size_t i;
+
+  for (i = 0; i < from->set_count; i++)
+    {
+      size_t pos = from->set[i];
+      char p = d->chars[pos];
+
+      if (p == '*')
+	{
+	  coc_dfa_add (d, &set, pos);
+	}
+      else if (p != '\0' && (p == '?' || (c != 0 && p == ch)))
+	{
+	  coc_dfa_add (d, &set, pos + 1);
+	}
+    }
+
+  return coc_dfa_state (d, g, &set);
+}
+
+static void
+coc_dfa_graph_free (coc_dfa_graph_t *g)
+{
+  coc_dfa_state_t *s, *link;
+
+  for (s = g->states; s != NULL; s = link)
+    {
+      link = s->link;
+      free (s->set);
+      free (s->next);
+      free (s->accept);
+      free (s);
+    }
+
+  free (g->index);
+  free (g);
+}
+
+/* Unpublish the graph of `d', to be freed once no scan reads it. */
+static void
+coc_dfa_retire (coc_dfa_t *d)
+{
+  coc_dfa_graph_t *g = d->graph;
+
+  if (g != NULL)
+    {
+      coc_store_release (&d->graph, NULL);
+      g->epoch = coc_epoch_advance ();
+      g->retired = d->retired;
+      d->retired = g;
+    }
+}
+
+/* Free graphs no scan reads any more. */
+static void
+coc_dfa_reclaim (coc_dfa_t *d)
+{
+  coc_dfa_graph_t **p = &d->retired;
+
+  while (*p != NULL)
+    {
+      coc_dfa_graph_t *g = *p;
+
+      if (coc_epoch_passed (g->epoch))
+	{
+	  *p = g->retired;
+	  coc_dfa_graph_free (g);
+	}
+      else
+	{
+	  p = &g->retired;
+	}
+    }
+}
+
+/* Take the build lock. A fork in the middle of a build leaves a graph
+ * which may be inconsistent: it is dropped. */
+static void
+coc_dfa_lock_build (coc_dfa_t *d)
+{
+  coc_mutex_lock (&coc_dfa_lock);
+
+  if (d->building)
+    {
+      coc_dfa_retire (d);
+    }
+
+  coc_dfa_reclaim (d);
+  d->building = true;
+}
+
+static void
+coc_dfa_unlock_build (coc_dfa_t *d)
+{
+  d->building = false;
+  coc_mutex_unlock (&coc_dfa_lock);
+}
+
+/* The graph of `d', with its start state built. */
+static coc_dfa_graph_t *
+coc_dfa_graph (coc_dfa_t *d)
+{
+  coc_dfa_graph_t *g = coc_load_acquire (&d->graph);
+
+  if (g != NULL || coc_load_relaxed (&d->disabled))
+    {
+      return g;
+    }
+
+  coc_dfa_lock_build (d);
+
+  if ((g = d->graph) == NULL && !d->disabled)
+    {
+      coc_dfa_set_t set = { NULL, 0, 0 };
+      size_t k;
+
+      g = (coc_dfa_graph_t *) calloc (1, sizeof (coc_dfa_graph_t));
+
+      if (g == NULL)
+	{
+	  DIE ("Cannot allocate glob automaton, aborting\n");
+	}
+
+      for (k = 0; k < d->rule_count; k++)
+	{
+	  coc_dfa_add (d, &set, d->base[k]);
+	}
+
+      if ((g->start = coc_dfa_state (d, g, &set)) != NULL)
+	{
+	  coc_store_release (&d->graph, g);
+	}
+      else
+	{
+	  coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Glob automaton start state "
+		   "over %zu bytes, using fnmatch\n", d->max_size);
+	  coc_dfa_graph_free (g);
+	  coc_store_relaxed (&d->disabled, true);
+	  g = NULL;
+	}
+    }
+
+  coc_dfa_unlock_build (d);
+  return g;
+}
+
+/* Build the transition of `from' in `g' for class `c', unless `g' was
+ * dropped meanwhile. */
+static coc_dfa_state_t *
+coc_dfa_build (coc_dfa_t *d, coc_dfa_graph_t *g, coc_dfa_state_t *from,
+	       uint8_t c)
+{
+  coc_dfa_state_t *to = NULL;
+
+  coc_dfa_lock_build (d);
+
+  if (d->graph == g && (to = from->next[c]) == NULL)
+    {
+      to = coc_dfa_step (d, g, from, c);
+
+      if (to != NULL)
+	{
+	  coc_store_release (&from->next[c], to);
+	}
+      else
+	{
+	  coc_log (COC_DEBUG_LOG_LEVEL,
+		   "DEBUG Glob automaton over %zu bytes, rebuilding it\n",
+		   d->max_size);
+	  coc_dfa_retire (d);
+	}
+    }
+
+  coc_dfa_unlock_build (d);
+  return to;
+}
+
+uint32_t
+coc_dfa_match (coc_dfa_t *d, const char *name, in_port_t port, bool *ok)
+{
+  uint32_t match = COC_NIL;
+
+  /* Graphs are only freed once scans which may read them are done. */
+  coc_epoch_enter ();
+
+  coc_dfa_graph_t *g = coc_dfa_graph (d);
+  coc_dfa_state_t *s = g != NULL ? g->start : NULL;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) name;
+       s != NULL && *p != '\0' && s->set_count > 0; p++)
+    {
+      uint8_t c = d->classes[*p];
+      coc_dfa_state_t *next = coc_load_acquire (&s->next[c]);
+
+      s = next != NULL ? next : coc_dfa_build (d, g, s, c);
+    }
+
+  *ok = s != NULL;
+
+  if (*ok)
+    {
+      size_t i;
+
+      for (i = 0; i < s->accept_count; i++)
+	{
+	  if (coc_rule_port_match (d->rs, s->accept[i], port))
+	    {
+	      match = s->accept[i];
+	      break;
+	    }
+	}
+    }
+
+  coc_epoch_exit ();
+  return match;
+}
+
+void
+coc_dfa_free (coc_dfa_t *d)
+{
+  coc_dfa_graph_t *g, *retired;
+
+  if (d->graph != NULL)
+    {
+      coc_dfa_graph_free (d->graph);
+    }
+
+  for (g = d->retired; g != NULL; g = retired)
+    {
+      retired = g->retired;
+      coc_dfa_graph_free (g);
+    }
+
+  free (d->base);
+  free (d->chars);
+  d->graph = NULL;
+  d->retired = NULL;
+  d->base = NULL;
+  d->chars = NULL;
+}
@@ -0,0 +1,293 @@
+/* coc-domain -- domain suffix trie for connect-or-cut glob rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Glob rules of the form `*.example.com' match every name ending with
+ * `.example.com'. They are stored in a trie keyed on DNS labels read
+ * from right to left: `com', then `example'. Matching a name walks its
+ * labels once, whatever the number of suffix rules. Rules on a single
+ * name, from hosts files and adblock lists, live in the same trie.
+ *
+ * Trie edges live in a single open-addressing table keyed on the parent
+ * node and the label; labels are offsets in the glob strings of the
+ * ruleset. Labels compare without regard to case.
+ */
+
+#define COC_DOMAIN_ROOT 0
+
+static uint32_t
+coc_domain_hash (uint32_t parent, const char *label, size_t len)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261U ^ parent;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      h = (h ^ (uint8_t) tolower ((unsigned char) label[i])) * 16777619U;
+    }
+
+  return h;
+}
+
+static inline bool
+coc_domain_label_eq (const char *a, const char *b, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (tolower ((unsigned char) a[i]) != tolower ((unsigned char) b[i]))
+	{
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+static coc_domain_edge_t *
+coc_domain_find (const coc_domain_t *d, const char *strings, uint32_t parent,
+		 const char *label, size_t len, uint32_t hash)
+{
+  size_t i = hash & d->mask;
+
+  while (d->edges[i].label != COC_NIL)
+    {
+      coc_domain_edge_t *x = &d->edges[i];
+
+      if (x->hash == hash && x->parent == parent && x->len == len &&
+	  coc_domain_label_eq (strings + x->label, label, len))
+	{
+	  return x;
+	}
+
+      i = (i + 1) & d->mask;
+    }
+
+  return &d->edges[i];
+}
+
+static void
+coc_domain_grow (coc_domain_t *d)
+{
+  coc_domain_edge_t *old = d->edges;
+  size_t old_size = old ? d->mask + 1 : 0;
+  size_t size = old ? old_size * 2 : 64;
+  size_t i;
+
+  d->edges = (coc_domain_edge_t *) malloc (size * sizeof (coc_domain_edge_t));
+
+  if (d->edges == NULL)
+    {
+      DIE ("Cannot allocate domain trie, aborting\n");
+    }
+
+  d->mask = size - 1;
+
+  for (i = 0; i < size; i++)
+    {
+      d->edges[i].label = COC_NIL;
+    }
+
+  for (i = 0; i < old_size; i++)
+    {
+      if (old[i].label != COC_NIL)
+	{
+	  size_t j = old[i].hash & d->mask;
+
+	  while (d->edges[j].label != COC_NIL)
+	    {
+	      j = (j + 1) & d->mask;
+	    }
+
+	  d->edges[j] = old[i];
+	}
+    }
+
+  free (old);
+}
+
+static uint32_t
+coc_domain_node_alloc (coc_domain_t *d)
+{
+  if (d->node_count == d->node_cap)
+    {
+      d->node_cap = d->node_cap ? d->node_cap * 2 : 64;
+      d->nodes = (coc_domain_node_t *) realloc (d->nodes, d->node_cap *
+						sizeof (coc_domain_node_t));
+
+      if (d->nodes == NULL)
+	{
+	  DIE ("Cannot allocate domain trie, aborting\n");
+	}
+    }
+
+  d->nodes[d->node_count].rules = COC_NIL;
+  d->nodes[d->node_count].exact = COC_NIL;
+  return (uint32_t) d->node_count++;
+}
+
+void
+coc_domain_init (coc_domain_t *d)
+{
+  memset (d, 0, sizeof (*d));
+  d->first = COC_NIL;
+}
+
+void
+coc_domain_insert (coc_domain_t *d, coc_rule_t *rules, const char *strings,
+		   uint32_t suffix, uint32_t rank, bool exact)
+{
+  size_t end = strlen (strings + suffix);
+  uint32_t node;
+
+  if (d->nodes == NULL)
+    {
+      coc_domain_node_alloc (d);
+    }
+
+  node = COC_DOMAIN_ROOT;
+
+  /* Walk labels from the right, adding missing edges. */
+  for (;;)
+    {
+      size_t start = end;
+
+      while (start > 0 && strings[suffix + start - 1] != '.')
+	{
+	  start--;
+	}
+
+      if ((d->edge_count + 1) * 2 > (d->edges ? d->mask + 1 : 0))
+	{
+	  coc_domain_grow (d);
+	}
+
+      const char *label = strings + suffix + start;
+      size_t len = end - start;
+      uint32_t hash = coc_domain_hash (node, label, len);
+      coc_domain_edge_t *x = coc_domain_find (d, strings, node, label, len,
+					      hash);
+
+      if (x->label == COC_NIL)
+	{
+	  x->label = suffix + (uint32_t) start;
+	  x->len = (uint32_t) len;
+	  x->hash = hash;
+	  x->parent = node;
+	  x->child = coc_domain_node_alloc (d);
+	  d->edge_count++;
+	}
+
+      node = x->child;
+
+      if (start == 0)
+	{
+	  break;
+	}
+
+      end = start - 1;
+    }
+
+  coc_rule_link (rules, exact ? &d->nodes[node].exact :
+		 &d->nodes[node].rules, rank);
+
+  if (rank < d->first)
+    {
+      d->first = rank;
+    }
+
+  d->count++;
+}
+
+uint32_t
+coc_domain_lookup (const coc_domain_t *d, const coc_ruleset_t *rs,
+		   const char *name, in_port_t port)
+{
+  uint32_t best = COC_NIL;
+  uint32_t node = COC_DOMAIN_ROOT;
+  size_t end = strlen (name);
+
+  if (d->count == 0)
+    {
+      return COC_NIL;
+    }
+
+  for (;;)
+    {
+      size_t start = end;
+
+      while (start > 0 && name[start - 1] != '.')
+	{
+	  start--;
+	}
+
+      const char *label = name + start;
+      size_t len = end - start;
+      uint32_t hash = coc_domain_hash (node, label, len);
+      coc_domain_edge_t *x = coc_domain_find (d, rs->strings, node, label,
+					      len, hash);
+
+      if (x->label == COC_NIL)
+	{
+	  break;
+	}
+
+      node = x->child;
+
+      /* Suffix rules at a node need at least one more label on the
+       * left; rules on a name need none. */
+      if (start == 0)
+	{
+	  best = coc_rule_chain_match (rs, d->nodes[node].exact, best, port);
+	  break;
+	}
+
+      best = coc_rule_chain_match (rs, d->nodes[node].rules, best, port);
+      end = start - 1;
+    }
+
+  return best;
+}
+
+void
+coc_domain_free (coc_domain_t *d)
+{
+  free (d->edges);
+  free (d->nodes);
+  coc_domain_init (d);
+}
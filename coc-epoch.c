@@ -0,0 +1,265 @@
+/* coc-epoch -- reclaim data replaced under lock-free readers.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * Each reading thread owns a slot, on a cache line of its own, where
+ * it writes the global epoch when it starts reading and 0 when done.
+ * A writer that unpublished some data bumps the epoch, then waits for
+ * every slot to be 0 or to show the new epoch: readers which started
+ * since cannot see the data any more. Readers thus never wait, and
+ * only write memory nobody else writes to.
+ *
+ * Threads get a slot on first read and give it back when they exit.
+ * Those that find none left count themselves in a shared counter
+ * instead, and writers wait for it to drop to 0.
+ */
+
+typedef struct coc_epoch_slot {
+  uint64_t epoch;		/* when its reader started; 0 if done. */
+  uint64_t owned;		/* 1 while a thread owns it. */
+  uint8_t pad[48];
+} coc_epoch_slot_t;
+
+static coc_epoch_slot_t coc_epoch_slots[COC_EPOCH_SLOTS];
+static uint64_t coc_epoch = 1;
+static uint64_t coc_epoch_overflow = 0;	/* readers without a slot. */
+static COC_THREAD_LOCAL coc_epoch_slot_t *coc_epoch_self;
+static COC_THREAD_LOCAL bool coc_epoch_claimed;
+static COC_THREAD_LOCAL unsigned coc_epoch_depth;
+
+/* Give back the slot of an exiting thread. */
+#ifdef _WIN32
+static DWORD coc_epoch_key = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI
+coc_epoch_release (PVOID slot)
+#else
+static pthread_key_t coc_epoch_key;
+
+static void
+coc_epoch_release (void *slot)
+#endif
+{
+  coc_epoch_slot_t *s = (coc_epoch_slot_t *) slot;
+
+  if (s != NULL)
+    {
+      coc_store_release (&s->epoch, 0);
+      coc_store_release (&s->owned, 0);
+    }
+}
+
+#ifndef _WIN32
+/* In a child process, other threads of the parent are gone. */
+static void
+coc_epoch_forked (void)
+{
+  size_t i;
+
+  for (i = 0; i < COC_EPOCH_SLOTS; i++)
+    {
+      if (&coc_epoch_slots[i] != coc_epoch_self)
+	{
+	  coc_epoch_slots[i].epoch = 0;
+	  coc_epoch_slots[i].owned = 0;
+	}
+    }
+
+  coc_epoch_overflow = coc_epoch_self == NULL && coc_epoch_depth > 0;
+}
+#endif
+
+static void
+coc_epoch_key_init (void)
+{
+#ifdef _WIN32
+  coc_epoch_key = FlsAlloc (coc_epoch_release);
+#else
+  pthread_key_create (&coc_epoch_key, coc_epoch_release);
+  pthread_atfork (NULL, NULL, coc_epoch_forked);
+#endif
+}
+
+static coc_epoch_slot_t *
+coc_epoch_claim (void)
+{
+  static coc_once_t once = COC_ONCE_INIT;
+  size_t i;
+
+  coc_epoch_claimed = true;
+  coc_once (&once, coc_epoch_key_init);
+
+  for (i = 0; i < COC_EPOCH_SLOTS; i++)
+    {
+      uint64_t free_slot = 0;
+
+      if (coc_load_relaxed (&coc_epoch_slots[i].owned) == 0 &&
+	  coc_cas (&coc_epoch_slots[i].owned, &free_slot, 1))
+	{
+#ifdef _WIN32
+	  if (coc_epoch_key != FLS_OUT_OF_INDEXES)
+	    {
+	      FlsSetValue (coc_epoch_key, &coc_epoch_slots[i]);
+	    }
+#else
+	  pthread_setspecific (coc_epoch_key, &coc_epoch_slots[i]);
+#endif
+	  return &coc_epoch_slots[i];
+	}
+    }
+
+  return NULL;
+}
+
+/* Start reading. Calls nest. */
+void
+coc_epoch_enter (void)
+{
+  if (coc_epoch_depth++ > 0)
+    {
+      return;
+    }
+
+  if (coc_epoch_self == NULL && !coc_epoch_claimed)
+    {
+      coc_epoch_self = coc_epoch_claim ();
+    }
+
+  if (coc_epoch_self != NULL)
+    {
+      coc_store_relaxed (&coc_epoch_self->epoch,
+			 coc_load_relaxed (&coc_epoch));
+    }
+  else
+    {
+      coc_fetch_add (&coc_epoch_overflow, 1);
+    }
+
+  /* Published data must be read after the slot is written. */
+  coc_fence ();
+}
+
+void
+coc_epoch_exit (void)
+{
+  if (--coc_epoch_depth > 0)
+    {
+      return;
+    }
+
+  if (coc_epoch_self != NULL)
+    {
+      coc_store_release (&coc_epoch_self->epoch, 0);
+    }
+  else
+    {
+      coc_fence_release ();
+      coc_fetch_add (&coc_epoch_overflow, (uint64_t) -1);
+    }
+}
+
+static void
+coc_epoch_pause (void)
+{
+#ifdef _WIN32
+  Sleep (1);
+#else
+  usleep (1000);
+#endif
+}
+
+/* Start a new epoch, and return it: data unpublished before the call
+ * may be freed once coc_epoch_passed says so. */
+uint64_t
+coc_epoch_advance (void)
+{
+  uint64_t epoch;
+
+  coc_fence ();
+  epoch = coc_fetch_add (&coc_epoch, 1) + 1;
+  coc_fence ();
+  return epoch;
+}
+
+/* Whether readers other than the caller, started before `epoch', are
+ * done. Never waits, so that it can be called while reading. */
+bool
+coc_epoch_passed (uint64_t epoch)
+{
+  size_t i;
+
+  for (i = 0; i < COC_EPOCH_SLOTS; i++)
+    {
+      uint64_t seen = coc_load_acquire (&coc_epoch_slots[i].epoch);
+
+      if (&coc_epoch_slots[i] != coc_epoch_self && seen != 0 &&
+	  seen < epoch)
+	{
+	  return false;
+	}
+    }
+
+  return coc_load_acquire (&coc_epoch_overflow) <=
+    (uint64_t) (coc_epoch_self == NULL && coc_epoch_depth > 0);
+}
+
+/* Wait until readers started before the call are done. */
+void
+coc_epoch_synchronize (void)
+{
+  size_t i;
+  uint64_t epoch = coc_epoch_advance ();
+
+  for (i = 0; i < COC_EPOCH_SLOTS; i++)
+    {
+      uint64_t seen;
+
+      while ((seen = coc_load_acquire (&coc_epoch_slots[i].epoch)) != 0 &&
+	     seen < epoch)
+	{
+	  coc_epoch_pause ();
+	}
+    }
+
+  while (coc_load_acquire (&coc_epoch_overflow) != 0)
+    {
+      coc_epoch_pause ();
+    }
+}
@@ -0,0 +1,155 @@
+/* coc-hash -- exact address index for connect-or-cut rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Open-addressing hash table with linear probing, keyed on
+ * (address, port). Rules without a port are stored under port 0 so a
+ * lookup is at most two probes sequences, whatever the rule count.
+ *
+ * The table is sized once from the number of exact rules and never
+ * grows: it is only filled by coc_rules_compile.
+ */
+
+static inline size_t
+coc_hash_of (const uint8_t *key, in_port_t port)
+{
+  uint64_t a, b;
+  memcpy (&a, key, sizeof (a));
+  memcpy (&b, key + sizeof (a), sizeof (b));
+
+  /* Mix with the 64-bit finalizer of MurmurHash3. */
+  uint64_t h = a ^ (b * 0x9e3779b97f4a7c15ULL) ^ port;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return (size_t) h;
+}
+
+void
+coc_hash_init (coc_hash_t *h, size_t count)
+{
+  size_t size = 16;
+  size_t i;
+
+  /* Keep the load factor under 1/2. */
+  while (size < count * 2)
+    {
+      size <<= 1;
+    }
+
+  h->slots = (coc_hash_slot_t *) calloc (size, sizeof (coc_hash_slot_t));
+
+  if (h->slots == NULL)
+    {
+      DIE ("Cannot allocate address hash table, aborting\n");
+    }
+
+  for (i = 0; i < size; i++)
+    {
+      h->slots[i].rules = COC_NIL;
+    }
+
+  h->mask = size - 1;
+  h->count = 0;
+}
+
+static coc_hash_slot_t *
+coc_hash_find (const coc_hash_t *h, const uint8_t *key, in_port_t port)
+{
+  size_t i = coc_hash_of (key, port) & h->mask;
+
+  while (h->slots[i].rules != COC_NIL)
+    {
+      coc_hash_slot_t *s = &h->slots[i];
+
+      if (s->port == port && !memcmp (s->key, key, COC_KEY_LEN))
+	{
+	  return s;
+	}
+
+      i = (i + 1) & h->mask;
+    }
+
+  return &h->slots[i];
+}
+
+void
+coc_hash_insert (coc_hash_t *h, coc_rule_t *rules, uint32_t rank)
+{
+  const coc_rule_t *r = &rules[rank];
+
+  assert (h->count <= h->mask / 2);
+
+  coc_hash_slot_t *s = coc_hash_find (h, r->key, r->port);
+
+  if (s->rules == COC_NIL)
+    {
+      memcpy (s->key, r->key, COC_KEY_LEN);
+      s->port = r->port;
+      h->count++;
+    }
+
+  coc_rule_link (rules, &s->rules, rank);
+}
+
+uint32_t
+coc_hash_lookup (const coc_hash_t *h, const coc_ruleset_t *rs,
+		 const uint8_t key[COC_KEY_LEN], in_port_t port)
+{
+  if (h->count == 0)
+    {
+      return COC_NIL;
+    }
+
+  uint32_t exact =
+    coc_rule_chain_match (rs, coc_hash_find (h, key, port)->rules, COC_NIL,
+			  port);
+
+  return coc_rule_chain_match (rs, coc_hash_find (h, key, 0)->rules, exact,
+			       port);
+}
+
+void
+coc_hash_free (coc_hash_t *h)
+{
+  free (h->slots);
+  h->slots = NULL;
+  h->mask = 0;
+  h->count = 0;
+}
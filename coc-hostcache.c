@@ -0,0 +1,468 @@
+/* coc-hostcache -- host rule resolutions shared by processes.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+/*
+ * Without it, every process resolves each host rule again, and a script
+ * forking thousands of children sends as many identical DNS queries.
+ *
+ * The cache file holds, for each host name, the addresses it resolved
+ * to and until when they can be used. Records are sorted by name
+ * through an offset table, for a binary search in the mapped file. The
+ * file is never modified in place: a process which resolved names
+ * writes a new one, merged with the live records of the one it mapped,
+ * and renames it over the old one. Concurrent writers may lose each
+ * other's records, which are then resolved again.
+ */
+
+#define COC_HOST_CACHE_MAGIC "COCHOSTS"
+#define COC_HOST_CACHE_VERSION 1
+#define COC_HOST_CACHE_ENDIAN 0x01020304U
+
+typedef struct coc_host_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t count;		/* records, and offsets after the header. */
+  uint32_t pad;
+  uint64_t size;
+} coc_host_cache_header_t;
+
+/* Followed by the name, padded to 4 bytes, then by the addresses. */
+typedef struct coc_host_record {
+  int64_t expires;		/* seconds since the Epoch. */
+  uint32_t addr_count;
+  uint16_t name_len;
+  uint16_t pad;
+} coc_host_record_t;
+
+/* Record being written, of this process or of the mapped file. */
+typedef struct coc_host_item {
+  const char *name;
+  size_t name_len;
+  int64_t expires;
+  const coc_host_addr_t *addrs;
+  size_t addr_count;
+} coc_host_item_t;
+
+static char *cache_path = NULL;
+static int64_t cache_ttl = 0;
+static const coc_host_cache_header_t *cache_map = NULL;
+static size_t cache_size = 0;
+static coc_host_item_t *pending = NULL;
+static size_t pending_count = 0;
+
+static inline size_t
+coc_host_record_size (size_t name_len, size_t addr_count)
+{
+  size_t len = sizeof (coc_host_record_t) + ((name_len + 3) & ~(size_t) 3) +
+    addr_count * sizeof (coc_host_addr_t);
+
+  return (len + 7) & ~(size_t) 7;
+}
+
+static int
+coc_host_name_cmp (const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  int c = memcmp (a, b, a_len < b_len ? a_len : b_len);
+
+  if (c != 0)
+    {
+      return c;
+    }
+
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int
+coc_host_item_cmp (const void *a, const void *b)
+{
+  const coc_host_item_t *x = (const coc_host_item_t *) a;
+  const coc_host_item_t *y = (const coc_host_item_t *) b;
+
+  return coc_host_name_cmp (x->name, x->name_len, y->name, y->name_len);
+}
+
+/* Record `i' of the mapped file, or NULL if it does not fit in it. */
+static const coc_host_record_t *
+coc_host_cache_record (size_t i, coc_host_item_t *item)
+{
+  const uint32_t *offsets = (const uint32_t *) (cache_map + 1);
+  size_t offset = offsets[i];
+
+  if (offset % 8 != 0 || offset > cache_size - sizeof (coc_host_record_t))
+    {
+      return NULL;
+    }
+
+  const coc_host_record_t *r =
+    (const coc_host_record_t *) ((const char *) cache_map + offset);
+
+  if (r->addr_count > UINT16_MAX ||
+      coc_host_record_size (r->name_len, r->addr_count) >
+      cache_size - offset)
+    {
+      return NULL;
+    }
+
+  item->name = (const char *) (r + 1);
+  item->name_len = r->name_len;
+  item->expires = r->expires;
+  item->addrs = (const coc_host_addr_t *)
+    (item->name + ((r->name_len + 3) & ~(size_t) 3));
+  item->addr_count = r->addr_count;
+  return r;
+}
+
+void
+coc_host_cache_open (const char *path, uint64_t ttl)
+{
+  const coc_host_cache_header_t *h;
+  size_t size = 0;
+
+  cache_path = strdup (path);
+  cache_ttl = (int64_t) ttl;
+
+  if (cache_path == NULL)
+    {
+      return;
+    }
+
+  /* Another user able to write the cache could redirect our hosts. */
+  h = (const coc_host_cache_header_t *) coc_file_map (path, &size, true);
+
+  if (h == NULL)
+    {
+      if (errno == EPERM)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL, "ERROR Ignoring host cache %s: "
+		   "not ours or writable by others\n", path);
+	}
+
+      return;
+    }
+
+  if (size < sizeof (*h) ||
+      memcmp (h->magic, COC_HOST_CACHE_MAGIC, sizeof (h->magic)) ||
+      h->version != COC_HOST_CACHE_VERSION ||
+      h->endian != COC_HOST_CACHE_ENDIAN || h->size != size ||
+      h->count > (size - sizeof (*h)) / sizeof (uint32_t))
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Ignoring host cache %s: "
+	       "invalid header\n", path);
+      coc_file_unmap ((void *) h, size);
+      return;
+    }
+
+  cache_map = h;
+  cache_size = size;
+}
+
+const coc_host_addr_t *
+coc_host_cache_get (const char *host, size_t *count)
+{
+  size_t len = strlen (host);
+  size_t lo = 0;
+  size_t hi = cache_map != NULL ? cache_map->count : 0;
+  int64_t now = (int64_t) time (NULL);
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      coc_host_item_t item;
+
+      if (coc_host_cache_record (mid, &item) == NULL)
+	{
+	  return NULL;
+	}
+
+      int c = coc_host_name_cmp (item.name, item.name_len, host, len);
+
+      if (c == 0)
+	{
+	  if (item.expires <= now || item.addr_count == 0)
+	    {
+	      return NULL;
+	    }
+
+	  *count = item.addr_count;
+	  return item.addrs;
+	}
+
+      if (c < 0)
+	{
+	  lo = mid + 1;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return NULL;
+}
+
+void
+coc_host_cache_put (const char *host, const struct addrinfo *ailist)
+{
+  const struct addrinfo *ai;
+  coc_host_item_t *item;
+  coc_host_addr_t *addrs;
+  size_t count = 0;
+  size_t len = strlen (host);
+
+  if (cache_path == NULL || cache_ttl == 0 || len > UINT16_MAX)
+    {
+      return;
+    }
+
+  for (ai = ailist; ai != NULL; ai = ai->ai_next)
+    {
+      count += ai->ai_family == AF_INET || ai->ai_family == AF_INET6;
+    }
+
+  item = (coc_host_item_t *) realloc (pending, (pending_count + 1) *
+				      sizeof (coc_host_item_t));
+
+  if (item == NULL)
+    {
+      return;
+    }
+
+  pending = item;
+  addrs = (coc_host_addr_t *) calloc (count ? count : 1, sizeof (*addrs));
+  item = &pending[pending_count];
+  item->name = strdup (host);
+
+  if (addrs == NULL || item->name == NULL)
+    {
+      free (addrs);
+      free ((void *) item->name);
+      return;
+    }
+
+  item->name_len = len;
+  item->expires = (int64_t) time (NULL) + cache_ttl;
+  item->addrs = addrs;
+  item->addr_count = 0;
+
+  for (ai = ailist; ai != NULL; ai = ai->ai_next)
+    {
+      coc_host_addr_t *a = &addrs[item->addr_count];
+
+      if (ai->ai_family == AF_INET)
+	{
+	  a->type = COC_IPV4_ADDR;
+	  memcpy (a->addr, &((const struct sockaddr_in *) ai->ai_addr)->
+		  sin_addr, sizeof (struct in_addr));
+	  item->addr_count++;
+	}
+      else if (ai->ai_family == AF_INET6)
+	{
+	  a->type = COC_IPV6_ADDR;
+	  memcpy (a->addr, &((const struct sockaddr_in6 *) ai->ai_addr)->
+		  sin6_addr, sizeof (struct in6_addr));
+	  item->addr_count++;
+	}
+    }
+
+  pending_count++;
+}
+
+/* Write the records to a temporary file renamed over `cache_path'. */
+static bool
+coc_host_cache_write (coc_host_item_t *items, size_t count)
+{
+  coc_host_cache_header_t h;
+  size_t size = (sizeof (h) + count * sizeof (uint32_t) + 7) & ~(size_t) 7;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      size += coc_host_record_size (items[i].name_len, items[i].addr_count);
+    }
+
+  if (size > UINT32_MAX)
+    {
+      return false;
+    }
+
+  char *buf = (char *) calloc (1, size);
+  size_t len = strlen (cache_path) + sizeof (".tmp.") + 20;
+  char *tmp = (char *) malloc (len);
+
+  if (buf == NULL || tmp == NULL)
+    {
+      free (buf);
+      free (tmp);
+      return false;
+    }
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, COC_HOST_CACHE_MAGIC, sizeof (h.magic));
+  h.version = COC_HOST_CACHE_VERSION;
+  h.endian = COC_HOST_CACHE_ENDIAN;
+  h.count = (uint32_t) count;
+  h.size = size;
+  memcpy (buf, &h, sizeof (h));
+
+  uint32_t *offsets = (uint32_t *) (buf + sizeof (h));
+  size_t offset = (sizeof (h) + count * sizeof (uint32_t) + 7) & ~(size_t) 7;
+
+  for (i = 0; i < count; i++)
+    {
+      coc_host_record_t *r = (coc_host_record_t *) (buf + offset);
+      char *name = (char *) (r + 1);
+
+      r->expires = items[i].expires;
+      r->addr_count = (uint32_t) items[i].addr_count;
+      r->name_len = (uint16_t) items[i].name_len;
+      memcpy (name, items[i].name, items[i].name_len);
+      memcpy (name + ((items[i].name_len + 3) & ~(size_t) 3), items[i].addrs,
+	      items[i].addr_count * sizeof (coc_host_addr_t));
+      offsets[i] = (uint32_t) offset;
+      offset += coc_host_record_size (items[i].name_len,
+				      items[i].addr_count);
+    }
+
+  snprintf (tmp, len, "%s.tmp.%ld", cache_path, (long) getpid ());
+
+  /* Addresses of allowed hosts are not for others to change. */
+#ifdef _WIN32
+  FILE *f = fopen (tmp, "wb");
+#else
+  int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  FILE *f = fd >= 0 ? fdopen (fd, "wb") : NULL;
+
+  if (f == NULL && fd >= 0)
+    {
+      close (fd);
+    }
+#endif
+
+  bool ok = f != NULL && fwrite (buf, size, 1, f) == 1;
+
+  ok = f != NULL && fclose (f) == 0 && ok;
+#ifdef _WIN32
+  ok = ok && MoveFileExA (tmp, cache_path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename (tmp, cache_path) == 0;
+#endif
+
+  if (!ok)
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Cannot write host cache %s: "
+	       "%s\n", cache_path, strerror (errno));
+      remove (tmp);
+    }
+
+  free (tmp);
+  free (buf);
+  return ok;
+}
+
+void
+coc_host_cache_flush (void)
+{
+  size_t i, j;
+
+  if (pending_count > 0)
+    {
+      size_t old = cache_map != NULL ? cache_map->count : 0;
+      coc_host_item_t *items =
+	(coc_host_item_t *) malloc ((pending_count + old) *
+				    sizeof (coc_host_item_t));
+      int64_t now = (int64_t) time (NULL);
+      size_t count = pending_count;
+
+      if (items != NULL)
+	{
+	  qsort (pending, pending_count, sizeof (coc_host_item_t),
+		 coc_host_item_cmp);
+	  memcpy (items, pending, pending_count * sizeof (coc_host_item_t));
+
+	  /* Keep the live records of others, unless resolved again. */
+	  for (i = 0; i < old; i++)
+	    {
+	      coc_host_item_t *item = &items[count];
+
+	      if (coc_host_cache_record (i, item) != NULL &&
+		  item->expires > now &&
+		  bsearch (item, pending, pending_count,
+			   sizeof (coc_host_item_t), coc_host_item_cmp) == NULL)
+		{
+		  count++;
+		}
+	    }
+
+	  qsort (items, count, sizeof (coc_host_item_t), coc_host_item_cmp);
+
+	  if (coc_host_cache_write (items, count))
+	    {
+	      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Cached %zu host rule "
+		       "resolutions to %s\n", pending_count, cache_path);
+	    }
+
+	  free (items);
+	}
+
+      for (j = 0; j < pending_count; j++)
+	{
+	  free ((void *) pending[j].name);
+	  free ((void *) pending[j].addrs);
+	}
+    }
+
+  free (pending);
+  pending = NULL;
+  pending_count = 0;
+
+  if (cache_map != NULL)
+    {
+      coc_file_unmap ((void *) cache_map, cache_size);
+      cache_map = NULL;
+    }
+
+  free (cache_path);
+  cache_path = NULL;
+}
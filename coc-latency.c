@@ -0,0 +1,550 @@
+/* coc-latency -- histograms of the time spent in each phase.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * Latencies are counted in log-linear buckets, as in HdrHistogram:
+ * 16 buckets for each power of 2, so a value is known within 1/16 of
+ * it, from 1 ns up to 2^40 ns. Each thread counts in a set of its own,
+ * on first use, and gives it back when it exits for another thread to
+ * carry on counting in: sets are summed up when dumped, so that
+ * counts of threads gone are kept. Threads finding no set left count
+ * in a shared one, with atomic additions.
+ *
+ * Dumps are appended to COC_LATENCY at exit, and when the signal
+ * COC_LATENCY_SIGNAL is received, as one JSON object per line. The
+ * signal handler only wakes a thread which makes the dump.
+ */
+
+#define COC_LATENCY_SUB_BITS 4
+#define COC_LATENCY_SUB (1 << COC_LATENCY_SUB_BITS)
+#define COC_LATENCY_MAX_BITS 40
+#define COC_LATENCY_BUCKETS \
+  ((COC_LATENCY_MAX_BITS - COC_LATENCY_SUB_BITS + 1) * COC_LATENCY_SUB + \
+   COC_LATENCY_SUB)
+
+typedef struct coc_latency_set {
+  uint64_t owned;		/* 1 while a thread owns it. */
+  uint64_t pad[7];
+  uint64_t sum[COC_PHASES];
+  uint64_t max[COC_PHASES];
+  uint64_t counts[COC_PHASES][COC_LATENCY_BUCKETS];
+} coc_latency_set_t;
+
+static const char *const phase_names[COC_PHASES] = {
+  "rules", "ntop", "rdns", "log", "connect"
+};
+
+static coc_latency_set_t *sets = NULL;	/* the shared one last. */
+static char *dump_path = NULL;
+static int dump_signal = 0;
+static int wake_pipe[2] = { -1, -1 };
+static coc_mutex_t dump_lock;
+static uint64_t forked = 0;	/* 1 once forked, 2 while restarting. */
+static pthread_key_t set_key;
+static COC_THREAD_LOCAL coc_latency_set_t *self;
+static COC_THREAD_LOCAL bool claimed;
+
+static void coc_latency_restart (void);
+
+static inline size_t
+coc_latency_bucket (uint64_t ns)
+{
+  if (ns < COC_LATENCY_SUB)
+    {
+      return (size_t) ns;
+    }
+
+  if (ns >> (COC_LATENCY_MAX_BITS + 1))
+    {
+      return COC_LATENCY_BUCKETS - 1;
+    }
+
+#ifdef __GNUC__
+  unsigned e = 63 - __builtin_clzll (ns) - COC_LATENCY_SUB_BITS;
+#else
+  unsigned e = 0;
+
+  while (ns >> (e + COC_LATENCY_SUB_BITS + 1))
+    {
+      e++;
+    }
+#endif
+  return (size_t) e * COC_LATENCY_SUB + (size_t) (ns >> e);
+}
+
+/* Lowest value counted in bucket `i'. */
+static inline uint64_t
+coc_latency_lowest (size_t i)
+{
+  if (i < 2 * COC_LATENCY_SUB)
+    {
+      return i;
+    }
+
+  unsigned e = i / COC_LATENCY_SUB - 1;
+  return (uint64_t) (i % COC_LATENCY_SUB + COC_LATENCY_SUB) << e;
+}
+
+static void
+coc_latency_release (void *set)
+{
+  if (set != NULL)
+    {
+      coc_store_release (&((coc_latency_set_t *) set)->owned, 0);
+    }
+}
+
+static coc_latency_set_t *
+coc_latency_claim (void)
+{
+  size_t i;
+
+  claimed = true;
+
+  for (i = 0; i < COC_LATENCY_SETS; i++)
+    {
+      uint64_t free_set = 0;
+
+      if (coc_load_relaxed (&sets[i].owned) == 0 &&
+	  coc_cas (&sets[i].owned, &free_set, 1))
+	{
+	  pthread_setspecific (set_key, &sets[i]);
+	  return &sets[i];
+	}
+    }
+
+  return NULL;
+}
+
+/* Count `ns' spent in `phase'. */
+void
+coc_latency_add (coc_phase_t phase, uint64_t ns)
+{
+  coc_latency_set_t *s;
+  size_t i = coc_latency_bucket (ns);
+
+  if (sets == NULL)
+    {
+      return;
+    }
+
+  if (coc_load_relaxed (&forked))
+    {
+      coc_latency_restart ();
+    }
+
+  if (self == NULL && !claimed)
+    {
+      self = coc_latency_claim ();
+    }
+
+  if ((s = self) != NULL)
+    {
+      /* Only read by dumps, which may miss the latest counts. */
+      coc_store_relaxed (&s->counts[phase][i],
+			 coc_load_relaxed (&s->counts[phase][i]) + 1);
+      coc_store_relaxed (&s->sum[phase],
+			 coc_load_relaxed (&s->sum[phase]) + ns);
+
+      if (ns > coc_load_relaxed (&s->max[phase]))
+	{
+	  coc_store_relaxed (&s->max[phase], ns);
+	}
+
+      return;
+    }
+
+  s = &sets[COC_LATENCY_SETS];
+  coc_fetch_add (&s->counts[phase][i], 1);
+  coc_fetch_add (&s->sum[phase], ns);
+
+  uint64_t max = coc_load_relaxed (&s->max[phase]);
+
+  while (ns > max && !coc_cas (&s->max[phase], &max, ns))
+    {
+      continue;
+    }
+}
+
+typedef struct coc_dump {
+  char *s;
+  size_t len;
+  size_t cap;
+} coc_dump_t;
+
+static void
+coc_dump_printf (coc_dump_t *d, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start (ap, format);
+  n = vsnprintf (d->s + d->len, d->cap - d->len, format, ap);
+  va_end (ap);
+
+  if (n >= 0 && (size_t) n >= d->cap - d->len)
+    {
+      size_t cap = (d->len + n + 1) * 2;
+      char *s = (char *) realloc (d->s, cap);
+
+      if (s == NULL)
+	{
+	  return;
+	}
+
+      d->s = s;
+      d->cap = cap;
+      va_start (ap, format);
+      vsnprintf (d->s + d->len, d->cap - d->len, format, ap);
+      va_end (ap);
+    }
+
+  if (n > 0)
+    {
+      d->len += (size_t) n;
+    }
+}
+
+/* Highest value of the bucket holding the `q' quantile of `counts'. */
+static uint64_t
+coc_latency_quantile (const uint64_t *counts, uint64_t total, uint64_t max,
+		      double q)
+{
+  uint64_t rank = (uint64_t) (q * total);
+  uint64_t seen = 0;
+  size_t i;
+
+  for (i = 0; i < COC_LATENCY_BUCKETS - 1; i++)
+    {
+      seen += counts[i];
+
+      if (seen > rank)
+	{
+	  uint64_t highest = coc_latency_lowest (i + 1) - 1;
+	  return highest < max ? highest : max;
+	}
+    }
+
+  return max;
+}
+
+/* Whether any latency was counted. */
+static bool
+coc_latency_any (void)
+{
+  size_t j;
+  int p;
+
+  for (j = 0; j <= COC_LATENCY_SETS; j++)
+    {
+      for (p = 0; p < COC_PHASES; p++)
+	{
+	  if (coc_load_relaxed (&sets[j].sum[p]) > 0)
+	    {
+	      return true;
+	    }
+	}
+    }
+
+  return false;
+}
+
+/* Append the histograms of all threads to COC_LATENCY, unless empty as
+ * for processes which made no connection. */
+void
+coc_latency_dump (void)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char *const quantile_names[] = { "p50", "p90", "p99", "p999" };
+  uint64_t counts[COC_LATENCY_BUCKETS];
+  coc_dump_t d = { NULL, 0, 0 };
+  struct timespec now;
+  int p;
+
+  if (sets == NULL || !coc_latency_any ())
+    {
+      return;
+    }
+
+  coc_latency_restart ();
+  coc_mutex_lock (&dump_lock);
+  clock_gettime (CLOCK_REALTIME, &now);
+  coc_dump_printf (&d, "{\"pid\":%lu,\"time_ns\":%llu,\"phases\":{",
+		   (unsigned long) getpid (),
+		   (unsigned long long) now.tv_sec * 1000000000 +
+		   (unsigned long long) now.tv_nsec);
+
+  for (p = 0; p < COC_PHASES; p++)
+    {
+      uint64_t total = 0, sum = 0, max = 0;
+      size_t i, j;
+
+      memset (counts, 0, sizeof (counts));
+
+      for (j = 0; j <= COC_LATENCY_SETS; j++)
+	{
+	  uint64_t m = coc_load_relaxed (&sets[j].max[p]);
+
+	  sum += coc_load_relaxed (&sets[j].sum[p]);
+	  max = m > max ? m : max;
+
+	  for (i = 0; i < COC_LATENCY_BUCKETS; i++)
+	    {
+	      counts[i] += coc_load_relaxed (&sets[j].counts[p][i]);
+	    }
+	}
+
+      for (i = 0; i < COC_LATENCY_BUCKETS; i++)
+	{
+	  total += counts[i];
+	}
+
+      coc_dump_printf (&d, "%s\"%s\":{\"count\":%llu,\"sum_ns\":%llu,"
+		       "\"max_ns\":%llu", p ? "," : "", phase_names[p],
+		       (unsigned long long) total, (unsigned long long) sum,
+		       (unsigned long long) max);
+
+      for (i = 0; i < sizeof (quantiles) / sizeof (quantiles[0]); i++)
+	{
+	  coc_dump_printf (&d, ",\"%s_ns\":%llu", quantile_names[i],
+			   (unsigned long long)
+			   coc_latency_quantile (counts, total, max,
+						 quantiles[i]));
+	}
+
+      /* Lowest value and count of each bucket used. */
+      coc_dump_printf (&d, ",\"buckets\":[");
+
+      for (i = 0, j = 0; i < COC_LATENCY_BUCKETS; i++)
+	{
+	  if (counts[i] > 0)
+	    {
+	      coc_dump_printf (&d, "%s[%llu,%llu]", j++ ? "," : "",
+			       (unsigned long long) coc_latency_lowest (i),
+			       (unsigned long long) counts[i]);
+	    }
+	}
+
+      coc_dump_printf (&d, "]}");
+    }
+
+  coc_dump_printf (&d, "}}\n");
+
+  /* One write, so that dumps of processes sharing the file do not mix. */
+  int fd = open (dump_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+
+  if (fd < 0 || d.s == NULL || write (fd, d.s, d.len) != (ssize_t) d.len)
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "ERROR Cannot write latencies to %s\n",
+	       dump_path);
+    }
+
+  if (fd >= 0)
+    {
+      close (fd);
+    }
+
+  free (d.s);
+  coc_mutex_unlock (&dump_lock);
+}
+
+static void
+coc_latency_signaled (int signo)
+{
+  int saved = errno;
+
+  /* Until restarted, a forked child holds the pipe of its parent. */
+  if (!coc_load_relaxed (&forked) && write (wake_pipe[1], "", 1) < 0)
+    {
+      /* A dump is pending already. */
+    }
+
+  errno = saved;
+}
+
+static void *
+coc_latency_dumper (void *arg)
+{
+  char buf[64];
+
+  for (;;)
+    {
+      if (read (wake_pipe[0], buf, sizeof (buf)) > 0)
+	{
+	  coc_latency_dump ();
+	}
+      else if (errno != EINTR)
+	{
+	  return NULL;
+	}
+    }
+}
+
+static bool
+coc_latency_dumper_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  bool ok;
+  int j;
+
+  for (j = 0; j < 2; j++)
+    {
+      if (wake_pipe[j] >= 0)
+	{
+	  close (wake_pipe[j]);
+	}
+    }
+
+  if (pipe (wake_pipe) < 0)
+    {
+      return false;
+    }
+
+  for (j = 0; j < 2; j++)
+    {
+      fcntl (wake_pipe[j], F_SETFD, FD_CLOEXEC);
+    }
+
+  fcntl (wake_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  ok = pthread_create (&thread, &attr, coc_latency_dumper, NULL) == 0;
+  pthread_attr_destroy (&attr);
+  return ok;
+}
+
+/* Latencies of the parent are its own to dump. The child only gets a
+ * dumper once it counts some, since most exec right away. */
+static void
+coc_latency_forked (void)
+{
+  size_t j;
+
+  for (j = 0; j <= COC_LATENCY_SETS; j++)
+    {
+      uint64_t owned = &sets[j] == self;
+
+      memset (&sets[j], 0, sizeof (sets[j]));
+      sets[j].owned = owned;
+    }
+
+  forked = 1;
+}
+
+/* Start a dumper of our own, if forked since the last one. */
+static void
+coc_latency_restart (void)
+{
+  uint64_t pending = 1;
+
+  if (!coc_load_relaxed (&forked) || !coc_cas (&forked, &pending, 2))
+    {
+      return;
+    }
+
+  coc_mutex_init (&dump_lock);
+
+  if (dump_signal > 0 && !coc_latency_dumper_start ())
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "ERROR Cannot start latency dumper: "
+	       "%s\n", strerror (errno));
+    }
+
+  coc_store_release (&forked, 0);
+}
+
+/* Count latencies, dumped to `path' at exit, and on signal `signo' if
+ * not 0. */
+bool
+coc_latency_open (const char *path, int signo)
+{
+  sets = (coc_latency_set_t *) calloc (COC_LATENCY_SETS + 1,
+				       sizeof (*sets));
+  dump_path = strdup (path);
+
+  if (sets == NULL || dump_path == NULL ||
+      pthread_key_create (&set_key, coc_latency_release) != 0)
+    {
+      free (sets);
+      free (dump_path);
+      sets = NULL;
+      return false;
+    }
+
+  coc_mutex_init (&dump_lock);
+  dump_signal = signo;
+
+  if (signo > 0)
+    {
+      struct sigaction sa;
+
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = coc_latency_signaled;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset (&sa.sa_mask);
+
+      if (!coc_latency_dumper_start () || sigaction (signo, &sa, NULL) < 0)
+	{
+	  return false;
+	}
+    }
+
+  pthread_atfork (NULL, NULL, coc_latency_forked);
+  return true;
+}
+#else
+bool
+coc_latency_open (const char *path, int signo)
+{
+  return false;
+}
+
+void
+coc_latency_add (coc_phase_t phase, uint64_t ns)
+{
+}
+
+void
+coc_latency_dump (void)
+{
+}
+#endif
@@ -0,0 +1,896 @@
+/* coc-log -- log records written by a background thread.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Bounded ring of log records, filled by any thread and emptied by a
+ * flusher thread. Each record has a sequence number telling whose turn
+ * it is: equal to the position a writer claims it for, one more once
+ * written, and one lap later once flushed. Writers claim positions by
+ * compare-and-swap on the tail and never wait: when the record at the
+ * tail is not flushed yet, the ring is full and theirs is dropped and
+ * counted. They only format the message; timestamps are formatted and
+ * records written, with one writev per batch, by the flusher.
+ *
+ * Binary events of COC_EVENT_LOG go through the same ring, copied as
+ * they are.
+ */
+
+typedef struct coc_log_record {
+  uint64_t seq;
+  int64_t time;
+  int32_t level;		/* COC_LOG_EVENT for events. */
+  uint32_t len;
+  char text[COC_LOG_RECORD_LEN];
+} coc_log_record_t;
+
+#define COC_LOG_BATCH 64	/* records per writev. */
+#define COC_LOG_EVENT (-2)
+
+static coc_log_record_t *ring = NULL;
+static uint64_t ring_head = 0;	/* next record to flush. */
+static uint64_t ring_tail = 0;	/* next record to write. */
+static uint64_t dropped = 0;
+static uint64_t dropped_reported = 0;
+static uint64_t flusher_idle = 0;
+static coc_mutex_t drain_lock;	/* between the flusher and exit. */
+static int wake_pipe[2] = { -1, -1 };
+static bool text_async = false;
+static coc_log_target_t targets;
+static int file_fd = -1;
+static int event_fd = -1;
+static uint32_t event_pid;
+static COC_THREAD_LOCAL uint32_t event_tid;
+
+static uint64_t forked = 0;	/* 1 once forked, 2 while restarting. */
+
+static void coc_log_restart (void);
+
+/* Empty the ring. Only touches memory, for fork handlers. */
+static void
+coc_log_ring_reset (void)
+{
+  size_t i;
+
+  for (i = 0; i < COC_LOG_RING_SIZE; i++)
+    {
+      ring[i].seq = i;
+    }
+
+  ring_head = ring_tail = 0;
+  dropped = dropped_reported = 0;
+  flusher_idle = 0;
+  event_pid = (uint32_t) getpid ();
+  event_tid = 0;
+}
+
+static bool
+coc_log_pipe_open (void)
+{
+  int j;
+
+  for (j = 0; j < 2; j++)
+    {
+      if (wake_pipe[j] >= 0)
+	{
+	  close (wake_pipe[j]);
+	}
+    }
+
+  if (pipe (wake_pipe) < 0)
+    {
+      return false;
+    }
+
+  for (j = 0; j < 2; j++)
+    {
+      fcntl (wake_pipe[j], F_SETFD, FD_CLOEXEC);
+      fcntl (wake_pipe[j], F_SETFL, O_NONBLOCK);
+    }
+
+  return true;
+}
+
+/* Claim the record at the tail, or count it dropped and return NULL. */
+static coc_log_record_t *
+coc_log_claim (uint64_t *pos)
+{
+  coc_log_record_t *r;
+
+  *pos = coc_load_relaxed (&ring_tail);
+
+  for (;;)
+    {
+      r = &ring[*pos & (COC_LOG_RING_SIZE - 1)];
+
+      uint64_t seq = coc_load_acquire (&r->seq);
+
+      if (seq == *pos)
+	{
+	  if (coc_cas (&ring_tail, pos, *pos + 1))
+	    {
+	      return r;
+	    }
+	}
+      else if (seq < *pos)
+	{
+	  coc_fetch_add (&dropped, 1);
+	  return NULL;
+	}
+      else
+	{
+	  *pos = coc_load_relaxed (&ring_tail);
+	}
+    }
+}
+
+static void
+coc_log_publish (coc_log_record_t *r, uint64_t pos)
+{
+  coc_store_release (&r->seq, pos + 1);
+
+  coc_fence ();
+
+  /* One writer wakes the flusher when it sleeps. */
+  uint64_t idle = 1;
+
+  if (coc_load_relaxed (&flusher_idle) &&
+      coc_cas (&flusher_idle, &idle, 0) && write (wake_pipe[1], "", 1) < 0)
+    {
+      /* Woken already, the pipe being full. */
+    }
+}
+
+/* Queue a record. Returns false if records are written synchronously. */
+bool
+coc_log_async (coc_log_level_t level, const char *format, va_list ap)
+{
+  coc_log_record_t *r;
+  uint64_t pos;
+
+  if (!text_async)
+    {
+      return false;
+    }
+
+  coc_log_restart ();
+
+  if (!text_async || (r = coc_log_claim (&pos)) == NULL)
+    {
+      return true;
+    }
+
+  int len = vsnprintf (r->text, sizeof (r->text), format, ap);
+
+  if (len < 0)
+    {
+      len = 0;
+    }
+  else if ((size_t) len >= sizeof (r->text))
+    {
+      /* Truncated messages still end lines. */
+      len = sizeof (r->text) - 1;
+      memcpy (r->text + len - 4, "...\n", 4);
+    }
+
+  r->time = (int64_t) time (NULL);
+  r->level = level;
+  r->len = (uint32_t) len;
+  coc_log_publish (r, pos);
+  return true;
+}
+
+static uint64_t
+coc_event_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Queue event `e', once stamped with the time, process and thread. */
+void
+coc_event_log (coc_event_t *e)
+{
+  coc_log_record_t *r;
+  uint64_t pos;
+
+  if (event_fd < 0)
+    {
+      return;
+    }
+
+  coc_log_restart ();
+
+  if (event_fd < 0 || (r = coc_log_claim (&pos)) == NULL)
+    {
+      return;
+    }
+
+  if (event_tid == 0)
+    {
+#ifdef __linux__
+      event_tid = (uint32_t) syscall (SYS_gettid);
+#else
+      event_tid = (uint32_t) (uintptr_t) pthread_self ();
+#endif
+    }
+
+  e->time_ns = coc_event_now_ns ();
+  e->pid = event_pid;
+  e->tid = event_tid;
+  memcpy (r->text, e, sizeof (*e));
+  r->level = COC_LOG_EVENT;
+  r->len = sizeof (*e);
+  coc_log_publish (r, pos);
+}
+
+static void
+coc_log_writev (int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+    {
+      ssize_t n = writev (fd, iov, count);
+
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+
+	  return;
+	}
+
+      /* Resume a short write where it stopped. */
+      while (count > 0 && (size_t) n >= iov->iov_len)
+	{
+	  n -= (ssize_t) iov->iov_len;
+	  iov++;
+	  count--;
+	}
+
+      if (count > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= (size_t) n;
+	}
+    }
+}
+
+static void
+coc_log_stamp (char *buf, size_t size, time_t t)
+{
+  struct tm tm;
+
+  localtime_r (&t, &tm);
+  strftime (buf, size, "%Y-%m-%dT%H:%M:%S ", &tm);
+}
+
+/* Write a batch of records, and how many were dropped since last time.
+ * Returns the number of records written. Called with drain_lock. */
+static size_t
+coc_log_drain (void)
+{
+  static char stamps[COC_LOG_BATCH + 1][sizeof ("YYYY-MM-DDTHH:MM:SS ")];
+  static char note[64];
+  static coc_event_t lost_event;
+  struct iovec iov[2 * COC_LOG_BATCH + 2];
+  struct iovec events[COC_LOG_BATCH + 1];
+  char *stamp = NULL;
+  int64_t last = -1;
+  size_t taken;
+  size_t count;
+  int n = 0;
+  int e = 0;
+
+  for (taken = 0; taken < COC_LOG_BATCH; taken++)
+    {
+      coc_log_record_t *r = &ring[(ring_head + taken) &
+				  (COC_LOG_RING_SIZE - 1)];
+
+      if (coc_load_acquire (&r->seq) != ring_head + taken + 1)
+	{
+	  break;
+	}
+
+      if (r->level == COC_LOG_EVENT)
+	{
+	  events[e].iov_base = r->text;
+	  events[e++].iov_len = r->len;
+	  continue;
+	}
+
+      /* Records mostly come in bursts within the same second. */
+      if (r->time != last)
+	{
+	  stamp = stamps[taken];
+	  coc_log_stamp (stamp, sizeof (stamps[0]), (time_t) r->time);
+	  last = r->time;
+	}
+
+      iov[n].iov_base = stamp;
+      iov[n++].iov_len = sizeof (stamps[0]) - 1;
+      iov[n].iov_base = r->text;
+      iov[n++].iov_len = r->len;
+
+      if (targets & COC_SYSLOG_LOG)
+	{
+	  syslog (r->level, "%.*s", (int) r->len, r->text);
+	}
+    }
+
+  count = taken;
+
+  uint64_t lost = coc_load_relaxed (&dropped);
+
+  if (lost != dropped_reported)
+    {
+      if (text_async)
+	{
+	  stamp = stamps[COC_LOG_BATCH];
+	  coc_log_stamp (stamp, sizeof (stamps[0]), time (NULL));
+	  iov[n].iov_base = stamp;
+	  iov[n++].iov_len = sizeof (stamps[0]) - 1;
+	  iov[n].iov_base = note;
+	  iov[n++].iov_len = (size_t)
+	    snprintf (note, sizeof (note), "ERROR Dropped %llu log records\n",
+		      (unsigned long long) (lost - dropped_reported));
+	}
+
+      /* Event logs tell where they miss some. */
+      if (event_fd >= 0)
+	{
+	  memset (&lost_event, 0, sizeof (lost_event));
+	  lost_event.time_ns = coc_event_now_ns ();
+	  lost_event.pid = event_pid;
+	  lost_event.rule = (uint32_t) (lost - dropped_reported);
+	  lost_event.verdict = COC_EVENT_DROPPED;
+	  events[e].iov_base = &lost_event;
+	  events[e++].iov_len = sizeof (lost_event);
+	}
+
+      dropped_reported = lost;
+      count++;
+    }
+
+  if (n > 0 && (targets & COC_STDERR_LOG))
+    {
+      struct iovec copy[2 * COC_LOG_BATCH + 2];
+
+      memcpy (copy, iov, n * sizeof (iov[0]));
+      coc_log_writev (STDERR_FILENO, copy, n);
+    }
+
+  if (n > 0 && file_fd >= 0)
+    {
+      coc_log_writev (file_fd, iov, n);
+    }
+
+  if (e > 0)
+    {
+      coc_log_writev (event_fd, events, e);
+    }
+
+  /* Records can be written again once out. */
+  for (; taken > 0; taken--)
+    {
+      coc_log_record_t *r = &ring[ring_head & (COC_LOG_RING_SIZE - 1)];
+
+      coc_store_release (&r->seq, ring_head + COC_LOG_RING_SIZE);
+      ring_head++;
+    }
+
+  return count;
+}
+
+static bool
+coc_log_ring_empty (void)
+{
+  coc_log_record_t *r = &ring[ring_head & (COC_LOG_RING_SIZE - 1)];
+
+  return coc_load_acquire (&r->seq) != ring_head + 1 &&
+    coc_load_relaxed (&dropped) == dropped_reported;
+}
+
+static void *
+coc_log_flusher (void *arg)
+{
+  for (;;)
+    {
+      size_t n;
+
+      coc_mutex_lock (&drain_lock);
+      n = coc_log_drain ();
+      coc_mutex_unlock (&drain_lock);
+
+      if (n > 0)
+	{
+	  continue;
+	}
+
+      /* Writers only wake the flusher once it says it sleeps. */
+      coc_store_relaxed (&flusher_idle, 1);
+      coc_fence ();
+
+      if (coc_log_ring_empty ())
+	{
+	  struct pollfd pfd = { wake_pipe[0], POLLIN, 0 };
+	  char buf[64];
+
+	  poll (&pfd, 1, COC_LOG_FLUSH_MS);
+
+	  while (read (wake_pipe[0], buf, sizeof (buf)) > 0)
+	    {
+	      continue;
+	    }
+	}
+
+      coc_store_relaxed (&flusher_idle, 0);
+    }
+
+  return NULL;
+}
+
+static bool
+coc_log_flusher_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  bool ok;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  ok = pthread_create (&thread, &attr, coc_log_flusher, NULL) == 0;
+  pthread_attr_destroy (&attr);
+  return ok;
+}
+
+/* Records pending in the parent are its own to write. The child only
+ * gets a flusher once it logs, since most exec right away: until then,
+ * the flusher is not idle for writers to wake it through the pipe of
+ * the parent. */
+static void
+coc_log_forked (void)
+{
+  if (ring != NULL)
+    {
+      coc_log_ring_reset ();
+      forked = 1;
+    }
+}
+
+/* Start a flusher of our own, if forked since the last one. */
+static void
+coc_log_restart (void)
+{
+  uint64_t pending = 1;
+
+  if (!coc_load_relaxed (&forked) || !coc_cas (&forked, &pending, 2))
+    {
+      return;
+    }
+
+  coc_mutex_init (&drain_lock);
+
+  if (!coc_log_pipe_open () || !coc_log_flusher_start ())
+    {
+      ring = NULL;
+      text_async = false;
+      event_fd = -1;
+    }
+
+  coc_store_release (&forked, 0);
+}
+
+/* Start the flusher, once for text records and events. */
+static bool
+coc_log_ring_start (void)
+{
+  if (ring != NULL)
+    {
+      return true;
+    }
+
+  ring = (coc_log_record_t *) malloc (COC_LOG_RING_SIZE * sizeof (*ring));
+
+  if (ring == NULL)
+    {
+      return false;
+    }
+
+  coc_log_ring_reset ();
+  coc_mutex_init (&drain_lock);
+
+  if (!coc_log_pipe_open () || !coc_log_flusher_start ())
+    {
+      free (ring);
+      ring = NULL;
+      return false;
+    }
+
+  /* Also when exiting before the library destructor can run. */
+  atexit (coc_log_async_flush);
+  pthread_atfork (NULL, NULL, coc_log_forked);
+  return true;
+}
+
+/* Start writing records to `target' in the background, with the file
+ * `file_name' opened once for all. */
+bool
+coc_log_async_start (coc_log_target_t target, const char *file_name)
+{
+  if (target & COC_FILE_LOG)
+    {
+      file_fd = open (file_name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		      0666);
+
+      if (file_fd < 0)
+	{
+	  return false;
+	}
+    }
+
+  targets = target;
+  text_async = coc_log_ring_start ();
+  return text_async;
+}
+
+/* Append events to `path', created with a header if missing. Processes
+ * may share it: records are appended whole, and the header is written
+ * under a lock on the file, by the first to find it empty. */
+bool
+coc_event_log_open (const char *path)
+{
+  struct stat st;
+  struct flock lock;
+  int fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  bool ok = true;
+
+  if (fd < 0)
+    {
+      return false;
+    }
+
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+
+  while (fcntl (fd, F_SETLKW, &lock) != 0)
+    {
+      if (errno != EINTR)
+	{
+	  close (fd);
+	  return false;
+	}
+    }
+
+  if (fstat (fd, &st) == 0 && st.st_size == 0)
+    {
+      coc_event_header_t h;
+
+      memset (&h, 0, sizeof (h));
+      memcpy (h.magic, COC_EVENT_MAGIC, sizeof (h.magic));
+      h.version = COC_EVENT_VERSION;
+      h.endian = COC_EVENT_ENDIAN;
+      h.size = sizeof (coc_event_t);
+
+      ok = write (fd, &h, sizeof (h)) == sizeof (h);
+    }
+
+  lock.l_type = F_UNLCK;
+  fcntl (fd, F_SETLK, &lock);
+
+  if (!ok)
+    {
+      close (fd);
+      return false;
+    }
+
+  event_fd = fd;
+
+  if (!coc_log_ring_start ())
+    {
+      close (fd);
+      event_fd = -1;
+      return false;
+    }
+
+  return true;
+}
+
+/* Write the records left, as the process exits. */
+void
+coc_log_async_flush (void)
+{
+  /* Nothing was queued since the fork. */
+  if (ring != NULL && coc_load_relaxed (&forked) != 1)
+    {
+      coc_mutex_lock (&drain_lock);
+
+      while (coc_log_drain () > 0)
+	{
+	  continue;
+	}
+
+      coc_mutex_unlock (&drain_lock);
+    }
+}
+#else
+bool
+coc_log_async (coc_log_level_t level, const char *format, va_list ap)
+{
+  return false;
+}
+
+bool
+coc_log_async_start (coc_log_target_t target, const char *file_name)
+{
+  return false;
+}
+
+bool
+coc_event_log_open (const char *path)
+{
+  return false;
+}
+
+void
+coc_event_log (coc_event_t *e)
+{
+}
+
+void
+coc_log_async_flush (void)
+{
+}
+#endif
+
+/*
+ * Repeated records of the same verdict on the same destination are
+ * suppressed for a window of COC_LOG_REPEAT_MS, then summed up in one
+ * record. Destinations map to one slot of a fixed table each, by hash,
+ * and evict whichever was there. A slot is claimed with a
+ * compare-and-swap on its state word, busy while the destination is
+ * rewritten, and repeats are counted in that same word: a writer racing
+ * with a claim either counts its record in the window that was current
+ * or fails and logs it, never both. Summaries are logged when a window
+ * is over and the destination logged again, when another destination
+ * takes the slot, and at exit.
+ */
+
+typedef struct coc_repeat_slot {
+  uint64_t state;		/* claim << 32 | repeats << 1 | busy. */
+  uint64_t key[2];
+  uint64_t meta;		/* port << 16 | level << 8 | family. */
+  uint64_t start;		/* coc_now_ms () when the window opened. */
+  uint64_t pad[3];		/* one slot per cache line. */
+} coc_repeat_slot_t;
+
+#define COC_REPEAT_BUSY 1
+#define COC_REPEAT_ONE 2
+#define COC_REPEAT_MAX 0x7fffffffULL
+#define COC_REPEAT_COUNT(s) (((s) >> 1) & COC_REPEAT_MAX)
+#define COC_REPEAT_CLAIM(s) ((s) >> 32)
+
+static coc_repeat_slot_t *repeats = NULL;
+static uint64_t repeat_window = 0;
+
+#ifndef _WIN32
+/* Repeats counted by the parent are its own to report. */
+static void
+coc_log_repeat_forked (void)
+{
+  memset (repeats, 0, COC_LOG_REPEAT_SLOTS * sizeof (*repeats));
+}
+#endif
+
+/* Suppress repeated records for `window_ms', if not 0. */
+void
+coc_log_repeat_init (uint64_t window_ms)
+{
+  if (window_ms == 0)
+    {
+      return;
+    }
+
+  repeats = (coc_repeat_slot_t *) calloc (COC_LOG_REPEAT_SLOTS,
+					  sizeof (*repeats));
+
+  if (repeats == NULL)
+    {
+      DIE ("Cannot allocate log repeat table, aborting\n");
+    }
+
+  repeat_window = window_ms;
+#ifndef _WIN32
+  pthread_atfork (NULL, NULL, coc_log_repeat_forked);
+#endif
+}
+
+static void
+coc_log_repeat_summary (uint64_t meta, const uint64_t key[2],
+			uint64_t count, uint64_t elapsed)
+{
+  char str[INET6_ADDRSTRLEN];
+  coc_log_level_t level = (coc_log_level_t) ((meta >> 8) & 0xff);
+  const uint8_t *addr = (const uint8_t *) key;
+
+  if ((meta & 0xff) == AF_INET)
+    {
+      inet_ntop (AF_INET, addr + COC_KEY_LEN - 4, str, sizeof (str));
+    }
+  else
+    {
+      inet_ntop (AF_INET6, addr, str, sizeof (str));
+    }
+
+  coc_log (level, "%s connection to %s:%hu repeated %llu times in %llu ms\n",
+	   level == COC_BLOCK_LOG_LEVEL ? "BLOCK" : "ALLOW", str,
+	   (unsigned short) (meta >> 16), (unsigned long long) count,
+	   (unsigned long long) (elapsed < repeat_window ?
+				 elapsed : repeat_window));
+}
+
+/* Take slot `s', in state `state', for `key' and `meta' if not NULL, or
+ * empty it. Logs the summary of the destination it had. */
+static void
+coc_log_repeat_claim (coc_repeat_slot_t *s, uint64_t state,
+		      const uint64_t key[2], uint64_t meta, uint64_t now)
+{
+  uint64_t old_key[2];
+  uint64_t old_meta, old_start;
+
+  if (!coc_cas (&s->state, &state, state | COC_REPEAT_BUSY))
+    {
+      return;
+    }
+
+  old_key[0] = coc_load_relaxed (&s->key[0]);
+  old_key[1] = coc_load_relaxed (&s->key[1]);
+  old_meta = coc_load_relaxed (&s->meta);
+  old_start = coc_load_relaxed (&s->start);
+
+  coc_store_relaxed (&s->key[0], key ? key[0] : 0);
+  coc_store_relaxed (&s->key[1], key ? key[1] : 0);
+  coc_store_relaxed (&s->meta, key ? meta : 0);
+  coc_store_relaxed (&s->start, now);
+  coc_store_release (&s->state, (COC_REPEAT_CLAIM (state) + 1) << 32);
+
+  if (COC_REPEAT_COUNT (state) > 0)
+    {
+      coc_log_repeat_summary (old_meta, old_key, COC_REPEAT_COUNT (state),
+			      now - old_start);
+    }
+}
+
+/* Returns true if the record of `level' on destination `key' and `port',
+ * of `family', repeats one logged within the window, and was counted
+ * instead. */
+bool
+coc_log_repeated (coc_log_level_t level, int family,
+		  const uint8_t key[COC_KEY_LEN], in_port_t port)
+{
+  uint64_t k[2];
+
+  if (repeats == NULL)
+    {
+      return false;
+    }
+
+  memcpy (k, key, sizeof (k));
+
+  uint64_t meta = ((uint64_t) ntohs (port) << 16) |
+    ((uint64_t) (uint8_t) level << 8) | (uint8_t) family;
+  uint64_t h = (k[0] * 0x9e3779b97f4a7c15ULL) ^ k[1] ^ meta;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+
+  coc_repeat_slot_t *s = &repeats[h & (COC_LOG_REPEAT_SLOTS - 1)];
+  uint64_t now = coc_now_ms ();
+  uint64_t state = coc_load_acquire (&s->state);
+
+  if (state & COC_REPEAT_BUSY)
+    {
+      return false;
+    }
+
+  uint64_t k0 = coc_load_relaxed (&s->key[0]);
+  uint64_t k1 = coc_load_relaxed (&s->key[1]);
+  uint64_t m = coc_load_relaxed (&s->meta);
+  uint64_t start = coc_load_relaxed (&s->start);
+
+  coc_fence_acquire ();
+
+  if (k0 != k[0] || k1 != k[1] || m != meta ||
+      now - start >= repeat_window)
+    {
+      coc_log_repeat_claim (s, state, k, meta, now);
+      return false;
+    }
+
+  /* Count it, unless the slot was claimed meanwhile. */
+  while (COC_REPEAT_COUNT (state) < COC_REPEAT_MAX)
+    {
+      uint64_t claim = COC_REPEAT_CLAIM (state);
+
+      if (coc_cas (&s->state, &state, state + COC_REPEAT_ONE))
+	{
+	  return true;
+	}
+
+      if ((state & COC_REPEAT_BUSY) || COC_REPEAT_CLAIM (state) != claim)
+	{
+	  return false;
+	}
+    }
+
+  coc_log_repeat_claim (s, state, k, meta, now);
+  return false;
+}
+
+/* Log the summaries of windows still open, as the process exits. */
+void
+coc_log_repeat_flush (void)
+{
+  size_t i;
+
+  if (repeats == NULL)
+    {
+      return;
+    }
+
+  for (i = 0; i < COC_LOG_REPEAT_SLOTS; i++)
+    {
+      uint64_t state = coc_load_acquire (&repeats[i].state);
+
+      if (!(state & COC_REPEAT_BUSY) && COC_REPEAT_COUNT (state) > 0)
+	{
+	  coc_log_repeat_claim (&repeats[i], state, NULL, 0, coc_now_ms ());
+	}
+    }
+}
@@ -0,0 +1,223 @@
+/* coc-lpm -- address prefix trie for connect-or-cut rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Binary trie with path compression over the 128-bit IPv6 key space.
+ * IPv4 prefixes live under ::ffff:0:0/96 so that a mapped address
+ * finds the same rules as its IPv4 form.
+ *
+ * A lookup walks the nodes whose prefix covers the address, so it
+ * costs at most one step per prefix bit whatever the number of rules.
+ * Every covering node may hold rules; the one ranked first wins to
+ * keep the first-match semantics of the rule list.
+ */
+
+static inline unsigned int
+coc_lpm_bit (const uint8_t *key, unsigned int i)
+{
+  return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* Number of leading bits shared by `a' and `b', in [from, max]. */
+static unsigned int
+coc_lpm_common (const uint8_t *a, const uint8_t *b, unsigned int from,
+		unsigned int max)
+{
+  unsigned int i = from;
+
+  while (i < max)
+    {
+      if ((i & 7) == 0 && max - i >= 8 && a[i >> 3] == b[i >> 3])
+	{
+	  i += 8;
+	}
+      else if (coc_lpm_bit (a, i) == coc_lpm_bit (b, i))
+	{
+	  i++;
+	}
+      else
+	{
+	  break;
+	}
+    }
+
+  return i;
+}
+
+void
+coc_lpm_init (coc_lpm_t *t)
+{
+  memset (t, 0, sizeof (*t));
+  t->root = COC_NIL;
+}
+
+static uint32_t
+coc_lpm_node_alloc (coc_lpm_t *t, const uint8_t *key, unsigned int bits)
+{
+  if (t->node_count == t->node_cap)
+    {
+      t->node_cap = t->node_cap ? t->node_cap * 2 : 64;
+      t->nodes = (coc_lpm_node_t *) realloc (t->nodes, t->node_cap *
+					     sizeof (coc_lpm_node_t));
+
+      if (t->nodes == NULL)
+	{
+	  DIE ("Cannot allocate prefix trie node, aborting\n");
+	}
+    }
+
+  coc_lpm_node_t *n = &t->nodes[t->node_count];
+  unsigned int full = bits >> 3;
+
+  memset (n, 0, sizeof (*n));
+  memcpy (n->key, key, full);
+
+  if (bits & 7)
+    {
+      n->key[full] = key[full] & (uint8_t) (0xff << (8 - (bits & 7)));
+    }
+
+  n->child[0] = n->child[1] = COC_NIL;
+  n->rules = COC_NIL;
+  n->bits = bits;
+  return (uint32_t) t->node_count++;
+}
+
+/* Link from node `parent' to its child on `side', or to the root.
+ * Nodes move as the trie grows, so links are looked up again after
+ * allocating one. */
+static inline uint32_t *
+coc_lpm_link (coc_lpm_t *t, uint32_t parent, unsigned int side)
+{
+  return parent == COC_NIL ? &t->root : &t->nodes[parent].child[side];
+}
+
+void
+coc_lpm_insert (coc_lpm_t *t, coc_rule_t *rules, uint32_t rank)
+{
+  const uint8_t *key = rules[rank].key;
+  unsigned int bits = rules[rank].bits;
+  uint32_t parent = COC_NIL;
+  unsigned int side = 0;
+  unsigned int from = 0;
+  uint32_t n;
+
+  assert (bits <= COC_KEY_LEN * 8);
+
+  while ((n = *coc_lpm_link (t, parent, side)) != COC_NIL)
+    {
+      unsigned int n_bits = t->nodes[n].bits;
+      unsigned int max = n_bits < bits ? n_bits : bits;
+      unsigned int cp = coc_lpm_common (t->nodes[n].key, key, from, max);
+
+      if (cp == n_bits && cp == bits)
+	{
+	  coc_rule_link (rules, &t->nodes[n].rules, rank);
+	  return;
+	}
+
+      if (cp == n_bits)
+	{
+	  /* `n' covers the new prefix: go down. */
+	  parent = n;
+	  side = coc_lpm_bit (key, cp);
+	  from = cp;
+	  continue;
+	}
+
+      uint32_t leaf = coc_lpm_node_alloc (t, key, bits);
+      coc_rule_link (rules, &t->nodes[leaf].rules, rank);
+
+      if (cp == bits)
+	{
+	  /* The new prefix covers `n': insert it above. */
+	  t->nodes[leaf].child[coc_lpm_bit (t->nodes[n].key, cp)] = n;
+	  *coc_lpm_link (t, parent, side) = leaf;
+	}
+      else
+	{
+	  /* Prefixes diverge at `cp': add a branching node. */
+	  uint32_t glue = coc_lpm_node_alloc (t, key, cp);
+	  t->nodes[glue].child[coc_lpm_bit (t->nodes[n].key, cp)] = n;
+	  t->nodes[glue].child[coc_lpm_bit (key, cp)] = leaf;
+	  *coc_lpm_link (t, parent, side) = glue;
+	}
+
+      return;
+    }
+
+  n = coc_lpm_node_alloc (t, key, bits);
+  *coc_lpm_link (t, parent, side) = n;
+  coc_rule_link (rules, &t->nodes[n].rules, rank);
+}
+
+uint32_t
+coc_lpm_lookup (const coc_lpm_t *t, const coc_ruleset_t *rs,
+		const uint8_t key[COC_KEY_LEN], in_port_t port)
+{
+  uint32_t n = t->root;
+  uint32_t best = COC_NIL;
+  unsigned int from = 0;
+
+  while (n != COC_NIL)
+    {
+      const coc_lpm_node_t *x = &t->nodes[n];
+
+      if (coc_lpm_common (x->key, key, from, x->bits) != x->bits)
+	{
+	  break;
+	}
+
+      best = coc_rule_chain_match (rs, x->rules, best, port);
+
+      if (x->bits == COC_KEY_LEN * 8)
+	{
+	  break;
+	}
+
+      from = x->bits;
+      n = x->child[coc_lpm_bit (key, from)];
+    }
+
+  return best;
+}
+
+void
+coc_lpm_free (coc_lpm_t *t)
+{
+  free (t->nodes);
+  coc_lpm_init (t);
+}
@@ -0,0 +1,436 @@
+/* coc-names -- address name cache for connect-or-cut.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "connect-or-cut.h"
+
+/*
+ * Bounded cache from address to its names, or to the absence of a
+ * name. Names are a list of strings, each NUL-terminated, ending with
+ * an empty one, as recorded by reverse lookups or by forward lookups
+ * snooped from the application. Entries live in a fixed array, chained from a
+ * power-of-two bucket table, and are evicted with the CLOCK algorithm
+ * once the array is full: the hand skips, and clears, entries read
+ * since its last pass, and takes the first one that was not or that
+ * has expired.
+ *
+ * Lookups only happen when the verdict cache misses, so a mutex is
+ * cheap enough here.
+ */
+struct coc_name_entry {
+  uint8_t key[COC_KEY_LEN];
+  uint64_t expires;		/* coc_now_ms () deadline. */
+  char *names;			/* NULL for an address without name. */
+  int32_t next;			/* next entry in bucket, or -1. */
+  bool referenced;		/* read since the last pass of the hand. */
+};
+
+static inline size_t
+coc_name_bucket (const coc_name_cache_t *c, const uint8_t key[COC_KEY_LEN])
+{
+  uint64_t k[2];
+  memcpy (k, key, sizeof (k));
+
+  uint64_t h = (k[0] * 0x9e3779b97f4a7c15ULL) ^ k[1];
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+
+  return (size_t) h & c->mask;
+}
+
+void
+coc_name_cache_init (coc_name_cache_t *c, size_t size)
+{
+  size_t buckets = 1;
+
+  memset (c, 0, sizeof (*c));
+  coc_mutex_init (&c->lock);
+
+  if (size == 0)
+    {
+      return;
+    }
+
+  while (buckets < size)
+    {
+      buckets <<= 1;
+    }
+
+  c->entries = (coc_name_entry_t *) calloc (size, sizeof (coc_name_entry_t));
+  c->buckets = (int32_t *) malloc (buckets * sizeof (int32_t));
+
+  if (c->entries == NULL || c->buckets == NULL)
+    {
+      DIE ("Cannot allocate name cache, aborting\n");
+    }
+
+  memset (c->buckets, 0xff, buckets * sizeof (int32_t));
+  c->mask = buckets - 1;
+  c->size = size;
+}
+
+static int32_t
+coc_name_find (coc_name_cache_t *c, const uint8_t key[COC_KEY_LEN])
+{
+  int32_t i = c->buckets[coc_name_bucket (c, key)];
+
+  while (i >= 0 && memcmp (c->entries[i].key, key, COC_KEY_LEN) != 0)
+    {
+      i = c->entries[i].next;
+    }
+
+  return i;
+}
+
+coc_name_status_t
+coc_name_cache_get (coc_name_cache_t *c, const uint8_t key[COC_KEY_LEN],
+		    uint64_t now, char names[COC_NAMES_LEN], uint64_t *expires)
+{
+  coc_name_status_t status = COC_NAME_MISS;
+
+  if (c->entries == NULL)
+    {
+      return status;
+    }
+
+  coc_mutex_lock (&c->lock);
+
+  int32_t i = coc_name_find (c, key);
+
+  if (i >= 0 && c->entries[i].expires > now)
+    {
+      coc_name_entry_t *e = &c->entries[i];
+
+      e->referenced = true;
+      *expires = e->expires;
+
+      if (e->names != NULL)
+	{
+	  memcpy (names, e->names, coc_names_len (e->names));
+	  status = COC_NAME_FOUND;
+	}
+      else
+	{
+	  status = COC_NAME_NONE;
+	}
+    }
+
+  if (status == COC_NAME_MISS)
+    {
+      c->misses++;
+    }
+  else
+    {
+      c->hits++;
+    }
+
+  coc_mutex_unlock (&c->lock);
+  return status;
+}
+
+/* Removes entry `i' from its bucket chain. */
+static void
+coc_name_unlink (coc_name_cache_t *c, int32_t i)
+{
+  int32_t *p = &c->buckets[coc_name_bucket (c, c->entries[i].key)];
+
+  while (*p != i)
+    {
+      p = &c->entries[*p].next;
+    }
+
+  *p = c->entries[i].next;
+}
+
+/* Entry to reuse for a new address, unlinked from its bucket. */
+static int32_t
+coc_name_victim (coc_name_cache_t *c, uint64_t now)
+{
+  if (c->used < c->size)
+    {
+      return (int32_t) c->used++;
+    }
+
+  for (;;)
+    {
+      int32_t i = (int32_t) c->hand;
+      coc_name_entry_t *e = &c->entries[i];
+
+      c->hand = (c->hand + 1) % c->size;
+
+      if (e->referenced && e->expires > now)
+	{
+	  e->referenced = false;
+	  continue;
+	}
+
+      coc_name_unlink (c, i);
+      free (e->names);
+      e->names = NULL;
+      return i;
+    }
+}
+
+/*
+ * Records `names' for `key', or that it has none if NULL, until
+ * `expires'. Returns whether they differ from those cached before:
+ * not when the cache is disabled or they could not be copied, as the
+ * cache is left as it was.
+ */
+bool
+coc_name_cache_put (coc_name_cache_t *c, const uint8_t key[COC_KEY_LEN],
+		    uint64_t now, const char *names, uint64_t expires)
+{
+  bool changed = true;
+
+  if (c->entries == NULL)
+    {
+      return false;
+    }
+
+  /* Allocated outside of the lock; a failure just skips caching. */
+  char *copy = NULL;
+  size_t len = names != NULL ? coc_names_len (names) : 0;
+
+  if (names != NULL)
+    {
+      if ((copy = (char *) malloc (len)) == NULL)
+	{
+	  return false;
+	}
+
+      memcpy (copy, names, len);
+    }
+
+  coc_mutex_lock (&c->lock);
+  c->writing = true;
+  coc_fence ();
+
+  int32_t i = coc_name_find (c, key);
+
+  if (i >= 0)
+    {
+      const char *old = c->entries[i].names;
+
+      changed = c->entries[i].expires <= now ||
+	(old == NULL ? names != NULL :
+	 names == NULL || coc_names_len (old) != len ||
+	 memcmp (old, names, len) != 0);
+
+      free (c->entries[i].names);
+    }
+  else
+    {
+      size_t b;
+
+      i = coc_name_victim (c, now);
+      b = coc_name_bucket (c, key);
+      memcpy (c->entries[i].key, key, COC_KEY_LEN);
+      c->entries[i].next = c->buckets[b];
+      c->buckets[b] = i;
+    }
+
+  c->entries[i].names = copy;
+  c->entries[i].expires = expires;
+  c->entries[i].referenced = false;
+
+  coc_store_release (&c->writing, false);
+  coc_mutex_unlock (&c->lock);
+  return changed;
+}
+
+/*
+ * In a child process, the lock may have been held by a thread of the
+ * parent, which is gone. Entries it was changing may be half linked:
+ * they are all dropped then, leaking their names rather than risk
+ * freeing them twice.
+ */
+void
+coc_name_cache_forked (coc_name_cache_t *c)
+{
+  size_t i;
+
+  coc_mutex_init (&c->lock);
+
+  if (c->writing && c->entries != NULL)
+    {
+      for (i = 0; i < c->size; i++)
+	{
+	  c->entries[i].names = NULL;
+	}
+
+      memset (c->buckets, 0xff, (c->mask + 1) * sizeof (int32_t));
+      c->used = c->hand = 0;
+      c->writing = false;
+    }
+}
+
+/* Appends `name' to the list of `names', unless it is already there,
+ * is a numeric address or does not fit. */
+void
+coc_names_add (char names[COC_NAMES_LEN], const char *name)
+{
+  size_t end = coc_names_len (names) - 1;
+  size_t len = strlen (name);
+  uint8_t numeric[sizeof (struct in6_addr)];
+  const char *p;
+
+  /* Rules never end with the root label. */
+  if (len > 0 && name[len - 1] == '.')
+    {
+      len--;
+    }
+
+  if (len == 0 || end + len + 2 > COC_NAMES_LEN ||
+      inet_pton (AF_INET, name, numeric) == 1 ||
+      inet_pton (AF_INET6, name, numeric) == 1)
+    {
+      return;
+    }
+
+  memcpy (names + end, name, len);
+  names[end + len] = '\0';
+  coc_lowercase (names + end);
+
+  for (p = names; p < names + end; p += strlen (p) + 1)
+    {
+      if (strcmp (p, names + end) == 0)
+	{
+	  names[end] = '\0';
+	  return;
+	}
+    }
+
+  names[end + len + 1] = '\0';
+}
+
+void
+coc_flights_init (coc_flights_t *f)
+{
+  memset (f, 0, sizeof (*f));
+  coc_mutex_init (&f->lock);
+  coc_cond_init (&f->done);
+}
+
+/*
+ * Returns true if the caller must look up the names of `key', then
+ * call coc_flight_end with `slot'. Returns false once another thread
+ * looking them up is done, so that they can be read from the cache, or
+ * at `deadline'.
+ */
+bool
+coc_flight_begin (coc_flights_t *f, const uint8_t key[COC_KEY_LEN],
+		  uint64_t deadline, int *slot)
+{
+  bool waited = false;
+  int i, found, free_slot;
+
+  coc_mutex_lock (&f->lock);
+
+  for (;;)
+    {
+      found = free_slot = -1;
+
+      for (i = 0; i < COC_FLIGHTS && found < 0; i++)
+	{
+	  if (!f->busy[i])
+	    {
+	      if (free_slot < 0)
+		{
+		  free_slot = i;
+		}
+	    }
+	  else if (memcmp (f->keys[i], key, COC_KEY_LEN) == 0)
+	    {
+	      found = i;
+	    }
+	}
+
+      if (found < 0)
+	{
+	  break;
+	}
+
+      if (!coc_cond_wait_until (&f->done, &f->lock, deadline))
+	{
+	  f->timeouts++;
+	  coc_mutex_unlock (&f->lock);
+	  return false;
+	}
+
+      waited = true;
+    }
+
+  if (waited)
+    {
+      f->coalesced++;
+      coc_mutex_unlock (&f->lock);
+      return false;
+    }
+
+  /* With too many lookups in progress, this one is not shared. */
+  if (free_slot >= 0)
+    {
+      memcpy (f->keys[free_slot], key, COC_KEY_LEN);
+      f->busy[free_slot] = true;
+    }
+
+  *slot = free_slot;
+  f->lookups++;
+  coc_mutex_unlock (&f->lock);
+  return true;
+}
+
+void
+coc_flight_end (coc_flights_t *f, int slot)
+{
+  coc_mutex_lock (&f->lock);
+
+  if (slot >= 0)
+    {
+      f->busy[slot] = false;
+    }
+
+  coc_cond_broadcast (&f->done);
+  coc_mutex_unlock (&f->lock);
+}
+
+/* In a child process, lookups of the parent threads will never end,
+ * and the lock may have been held by one of them. */
+void
+coc_flights_forked (coc_flights_t *f)
+{
+  memset (f->busy, 0, sizeof (f->busy));
+  coc_mutex_init (&f->lock);
+  coc_cond_init (&f->done);
+}
@@ -0,0 +1,191 @@
+/* coc-port -- port sets for connect-or-cut rules.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+/*
+ * Port ranges and sets are stored as 8 KiB bitmaps so that checking a
+ * port is a single bit test. Rules with the same set share one bitmap:
+ * policies tend to repeat a handful of sets over many addresses. They
+ * are found in a hash table, which lasts as long as the parsed rules:
+ * each build of the rules numbers its sets from 0.
+ */
+static coc_portset_t **coc_portset_buckets = NULL;
+static size_t coc_portset_mask = 0;
+static uint32_t coc_portset_count = 0;
+
+void
+coc_portset_add (uint8_t *bits, in_port_t low, in_port_t high)
+{
+  uint32_t p;
+
+  for (p = low; p <= high; p++)
+    {
+      bits[p >> 3] |= (uint8_t) (1 << (p & 7));
+    }
+}
+
+/* FNV-1a of the bytes between the lowest and highest port of the set. */
+static uint32_t
+coc_portset_hash (const uint8_t *bits, in_port_t low, in_port_t high)
+{
+  uint32_t h = (2166136261U ^ low) * 16777619U;
+  size_t i;
+
+  for (i = low >> 3; low <= high && i <= (size_t) (high >> 3); i++)
+    {
+      h = (h ^ bits[i]) * 16777619U;
+    }
+
+  return h;
+}
+
+/* Double the buckets when they are as many as sets. */
+static void
+coc_portset_grow (void)
+{
+  size_t mask = coc_portset_mask ? coc_portset_mask * 2 + 1 : 63;
+  coc_portset_t **buckets = (coc_portset_t **) calloc (mask + 1,
+						       sizeof (*buckets));
+  size_t i;
+
+  if (buckets == NULL)
+    {
+      DIE ("Cannot allocate port set, aborting\n");
+    }
+
+  for (i = 0; coc_portset_buckets != NULL && i <= coc_portset_mask; i++)
+    {
+      coc_portset_t *s, *next;
+
+      for (s = coc_portset_buckets[i]; s != NULL; s = next)
+	{
+	  next = s->next;
+	  s->next = buckets[s->hash & mask];
+	  buckets[s->hash & mask] = s;
+	}
+    }
+
+  free (coc_portset_buckets);
+  coc_portset_buckets = buckets;
+  coc_portset_mask = mask;
+}
+
+/*
+ * Returns the set with the same ports as `bits', which has none below
+ * `low' or above `high'. Only the bytes in between are hashed and
+ * compared, so that a set costs as much as its span of ports.
+ */
+const coc_portset_t *
+coc_portset_intern (const uint8_t *bits, in_port_t low, in_port_t high)
+{
+  uint32_t hash = coc_portset_hash (bits, low, high);
+  size_t from = low >> 3;
+  size_t len = low <= high ? (size_t) (high >> 3) - from + 1 : 0;
+  coc_portset_t *s;
+
+  if (coc_portset_count >= coc_portset_mask)
+    {
+      coc_portset_grow ();
+    }
+
+  for (s = coc_portset_buckets[hash & coc_portset_mask]; s != NULL;
+       s = s->next)
+    {
+      if (s->hash == hash && s->low == low && s->high == high &&
+	  !memcmp (s->bits + from, bits + from, len))
+	{
+	  return s;
+	}
+    }
+
+  s = (coc_portset_t *) malloc (sizeof (coc_portset_t));
+
+  if (s == NULL)
+    {
+      DIE ("Cannot allocate port set, aborting\n");
+    }
+
+  memcpy (s->bits, bits, COC_PORTSET_BYTES);
+  s->hash = hash;
+  s->low = low;
+  s->high = high;
+  s->index = coc_portset_count++;
+  s->next = coc_portset_buckets[hash & coc_portset_mask];
+  coc_portset_buckets[hash & coc_portset_mask] = s;
+  return s;
+}
+
+/* Copies the bitmaps of the first `count' sets, each at its index. */
+void
+coc_portset_copy (uint8_t (*to)[COC_PORTSET_BYTES], uint32_t count)
+{
+  size_t i;
+
+  for (i = 0; coc_portset_buckets != NULL && i <= coc_portset_mask; i++)
+    {
+      const coc_portset_t *s;
+
+      for (s = coc_portset_buckets[i]; s != NULL; s = s->next)
+	{
+	  if (s->index < count)
+	    {
+	      memcpy (to[s->index], s->bits, COC_PORTSET_BYTES);
+	    }
+	}
+    }
+}
+
+/* Free all sets, once no parsed rule refers to them. */
+void
+coc_portset_clear (void)
+{
+  size_t i;
+
+  for (i = 0; coc_portset_buckets != NULL && i <= coc_portset_mask; i++)
+    {
+      coc_portset_t *s, *next;
+
+      for (s = coc_portset_buckets[i]; s != NULL; s = next)
+	{
+	  next = s->next;
+	  free (s);
+	}
+    }
+
+  free (coc_portset_buckets);
+  coc_portset_buckets = NULL;
+  coc_portset_mask = 0;
+  coc_portset_count = 0;
+}
@@ -0,0 +1,577 @@
+/* coc-rdns -- reverse DNS client for connect-or-cut.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*
+ * Minimal DNS client for PTR queries, used instead of getnameinfo so
+ * that a slow or unreachable nameserver cannot stall `connect' for the
+ * whole timeout and retry chain of the system resolver.
+ *
+ * The query is sent at once to every nameserver, over UDP sockets
+ * connected so that the kernel drops datagrams from anyone else and
+ * reports unreachable servers. The first usable answer wins. Queries
+ * are sent again halfway to the deadline, in case of packet loss.
+ */
+
+#define COC_DNS_PORT 53
+#define COC_DNS_HEADER_LEN 12
+#define COC_DNS_MAX_LEN 512	/* UDP message size without EDNS. */
+#define COC_DNS_TYPE_SOA 6
+#define COC_DNS_TYPE_PTR 12
+#define COC_DNS_CLASS_IN 1
+#define COC_DNS_NXDOMAIN 3
+
+static uint64_t coc_rdns_sequence = 0;
+
+static inline uint16_t
+coc_dns_u16 (const uint8_t *p)
+{
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+coc_dns_u32 (const uint8_t *p)
+{
+  return ((uint32_t) coc_dns_u16 (p) << 16) | coc_dns_u16 (p + 2);
+}
+
+/* Query ID, hard to guess from outside the process. */
+static uint16_t
+coc_rdns_id (void)
+{
+  uint64_t x = coc_fetch_add (&coc_rdns_sequence, 1) +
+    coc_now_ms () * 0x9e3779b97f4a7c15ULL + (uint64_t) getpid ();
+
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+
+  return (uint16_t) x;
+}
+
+/*
+ * Writes the PTR query for `key' in `q': reversed octets under
+ * in-addr.arpa for IPv4 and mapped addresses, reversed nibbles under
+ * ip6.arpa otherwise. Returns the message length.
+ */
+static size_t
+coc_rdns_build (uint8_t q[COC_DNS_MAX_LEN], const uint8_t key[COC_KEY_LEN])
+{
+  static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xff, 0xff
+  };
+  static const char hex[] = "0123456789abcdef";
+  uint16_t id = coc_rdns_id ();
+  uint8_t *p = q + COC_DNS_HEADER_LEN;
+  int i;
+
+  memset (q, 0, COC_DNS_HEADER_LEN);
+  q[0] = (uint8_t) (id >> 8);
+  q[1] = (uint8_t) id;
+  q[2] = 0x01;			/* recursion desired. */
+  q[5] = 1;			/* one question. */
+
+  if (memcmp (key, mapped, sizeof (mapped)) == 0)
+    {
+      for (i = COC_KEY_LEN - 1; i >= 12; i--)
+	{
+	  int len = sprintf ((char *) p + 1, "%u", key[i]);
+	  *p = (uint8_t) len;
+	  p += len + 1;
+	}
+
+      memcpy (p, "\7in-addr\4arpa", 14);
+      p += 14;
+    }
+  else
+    {
+      for (i = COC_KEY_LEN - 1; i >= 0; i--)
+	{
+	  *p++ = 1;
+	  *p++ = (uint8_t) hex[key[i] & 0xf];
+	  *p++ = 1;
+	  *p++ = (uint8_t) hex[key[i] >> 4];
+	}
+
+      memcpy (p, "\3ip6\4arpa", 10);
+      p += 10;
+    }
+
+  *p++ = 0;
+  *p++ = COC_DNS_TYPE_PTR;
+  *p++ = 0;
+  *p++ = COC_DNS_CLASS_IN;
+
+  return (size_t) (p - q);
+}
+
+/*
+ * Decodes the possibly compressed name at `off' in message `m' into
+ * `out', if not NULL. Returns the offset past the name, or 0 if it is
+ * malformed or does not fit.
+ */
+static size_t
+coc_dns_name (const uint8_t *m, size_t len, size_t off, char *out,
+	      size_t outlen)
+{
+  size_t end = 0, o = 0;
+  int jumps = 0;
+
+  for (;;)
+    {
+      if (off >= len)
+	{
+	  return 0;
+	}
+
+      uint8_t l = m[off];
+
+      if ((l & 0xc0) == 0xc0)
+	{
+	  if (off + 1 >= len || ++jumps > 32)
+	    {
+	      return 0;
+	    }
+
+	  if (end == 0)
+	    {
+	      end = off + 2;
+	    }
+
+	  off = ((size_t) (l & 0x3f) << 8) | m[off + 1];
+	  continue;
+	}
+
+      if ((l & 0xc0) != 0 || off + 1 + l > len)
+	{
+	  return 0;
+	}
+
+      if (l == 0)
+	{
+	  break;
+	}
+
+      if (out != NULL)
+	{
+	  size_t i;
+
+	  if (o + l + 2 > outlen)
+	    {
+	      return 0;
+	    }
+
+	  if (o > 0)
+	    {
+	      out[o++] = '.';
+	    }
+
+	  for (i = 1; i <= l; i++)
+	    {
+	      /* Keep names usable as strings and glob subjects. */
+	      if (m[off + i] <= ' ' || m[off + i] == '.' || m[off + i] >= 0x7f)
+		{
+		  return 0;
+		}
+
+	      out[o++] = (char) m[off + i];
+	    }
+	}
+
+      off += 1 + l;
+    }
+
+  if (out != NULL)
+    {
+      out[o] = '\0';
+    }
+
+  return end ? end : off + 1;
+}
+
+/* Minimum of the TTL and of the SOA minimum of an SOA record at `off'
+ * with `rdlen' bytes of data, per RFC 2308. */
+static uint32_t
+coc_dns_soa_ttl (const uint8_t *m, size_t len, size_t off, uint32_t ttl,
+		 uint16_t rdlen)
+{
+  if (rdlen >= 20 && off + rdlen <= len)
+    {
+      uint32_t minimum = coc_dns_u32 (m + off + rdlen - 4);
+
+      if (minimum < ttl)
+	{
+	  ttl = minimum;
+	}
+    }
+
+  return ttl;
+}
+
+/*
+ * Outcome of response `m' to query `q': the name with its TTL, the
+ * absence of name with the TTL of that fact (UINT32_MAX if unknown), or
+ * COC_NAME_MISS if the response is not usable.
+ */
+static coc_name_status_t
+coc_rdns_parse (const uint8_t *m, size_t len, const uint8_t *q, size_t qlen,
+		char name[NI_MAXHOST], uint32_t *ttl)
+{
+  size_t i, off = qlen;
+
+  if (len < qlen || m[0] != q[0] || m[1] != q[1] || (m[2] & 0x80) == 0 ||
+      (m[2] & 0x02) != 0 || coc_dns_u16 (m + 4) != 1)
+    {
+      return COC_NAME_MISS;
+    }
+
+  for (i = COC_DNS_HEADER_LEN; i < qlen; i++)
+    {
+      if (tolower (m[i]) != q[i])
+	{
+	  return COC_NAME_MISS;
+	}
+    }
+
+  uint8_t rcode = m[3] & 0x0f;
+
+  if (rcode != 0 && rcode != COC_DNS_NXDOMAIN)
+    {
+      return COC_NAME_MISS;
+    }
+
+  uint16_t answers = coc_dns_u16 (m + 6);
+  uint16_t authorities = coc_dns_u16 (m + 8);
+  uint32_t min_ttl = UINT32_MAX;
+
+  /* Answers may start with CNAMEs, for classless delegations. */
+  for (i = 0; i < (size_t) answers + authorities; i++)
+    {
+      if ((off = coc_dns_name (m, len, off, NULL, 0)) == 0 ||
+	  off + 10 > len)
+	{
+	  return COC_NAME_MISS;
+	}
+
+      uint16_t type = coc_dns_u16 (m + off);
+      uint16_t class = coc_dns_u16 (m + off + 2);
+      uint32_t rr_ttl = coc_dns_u32 (m + off + 4);
+      uint16_t rdlen = coc_dns_u16 (m + off + 8);
+
+      off += 10;
+
+      if (off + rdlen > len)
+	{
+	  return COC_NAME_MISS;
+	}
+
+      if (class == COC_DNS_CLASS_IN && i < answers)
+	{
+	  if (rr_ttl < min_ttl)
+	    {
+	      min_ttl = rr_ttl;
+	    }
+
+	  if (rcode == 0 && type == COC_DNS_TYPE_PTR &&
+	      coc_dns_name (m, len, off, name, NI_MAXHOST) != 0 &&
+	      name[0] != '\0')
+	    {
+	      *ttl = min_ttl;
+	      return COC_NAME_FOUND;
+	    }
+	}
+      else if (class == COC_DNS_CLASS_IN && type == COC_DNS_TYPE_SOA)
+	{
+	  *ttl = coc_dns_soa_ttl (m, len, off, rr_ttl, rdlen);
+	  return COC_NAME_NONE;
+	}
+
+      off += rdlen;
+    }
+
+  *ttl = UINT32_MAX;
+  return COC_NAME_NONE;
+}
+
+/* UDP socket connected to nameserver `ns', or -1. */
+static int
+coc_rdns_socket (const coc_resolver_t *ns)
+{
+  struct sockaddr_in6 sa;
+  socklen_t salen;
+  int fd;
+
+  memset (&sa, 0, sizeof (sa));
+
+  if (ns->isv6)
+    {
+      sa.sin6_family = AF_INET6;
+      sa.sin6_port = htons (COC_DNS_PORT);
+      sa.sin6_addr = ns->addr.ipv6;
+      salen = sizeof (struct sockaddr_in6);
+    }
+  else
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons (COC_DNS_PORT);
+      sin->sin_addr = ns->addr.ipv4;
+      salen = sizeof (struct sockaddr_in);
+    }
+
+  fd = socket (sa.sin6_family, SOCK_DGRAM, 0);
+
+  if (fd < 0)
+    {
+      return -1;
+    }
+
+  /* Our own `connect' hook must not see this one. */
+  if (fcntl (fd, F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0 ||
+      coc_real_connect (fd, (const struct sockaddr *) &sa, salen) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+coc_name_status_t
+coc_rdns_query (const coc_resolver_t *servers, size_t count,
+		const uint8_t key[COC_KEY_LEN], uint64_t deadline,
+		char name[NI_MAXHOST], uint32_t *ttl)
+{
+  uint8_t q[COC_DNS_MAX_LEN];
+  uint8_t m[COC_DNS_MAX_LEN];
+  struct pollfd fds[MAXNS];
+  size_t qlen = coc_rdns_build (q, key);
+  size_t i, pending = 0;
+  coc_name_status_t status = COC_NAME_MISS;
+  uint64_t now = coc_now_ms ();
+  uint64_t resend = now + (deadline - now) / 2;
+  bool resent = false;
+  int cancel_state;
+
+  if (count > MAXNS)
+    {
+      count = MAXNS;
+    }
+
+  /* Sockets must not leak if the calling thread is cancelled. */
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+  for (i = 0; i < count; i++)
+    {
+      fds[i].fd = coc_rdns_socket (&servers[i]);
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+
+      if (fds[i].fd >= 0 && send (fds[i].fd, q, qlen, 0) == (ssize_t) qlen)
+	{
+	  pending++;
+	}
+      else if (fds[i].fd >= 0)
+	{
+	  close (fds[i].fd);
+	  fds[i].fd = -1;
+	}
+    }
+
+  while (pending > 0 && status == COC_NAME_MISS && now < deadline)
+    {
+      /* Whatever woke us up, a late resend must not push the
+       * deadline. */
+      if (!resent && now >= resend)
+	{
+	  for (i = 0; i < count; i++)
+	    {
+	      if (fds[i].fd >= 0)
+		{
+		  (void) send (fds[i].fd, q, qlen, 0);
+		}
+	    }
+
+	  resent = true;
+	}
+
+      uint64_t until = resent ? deadline : resend;
+      int rc = poll (fds, (nfds_t) count,
+		     until > now ? (int) (until - now) : 0);
+
+      now = coc_now_ms ();
+
+      if (rc < 0 && errno != EINTR)
+	{
+	  break;
+	}
+
+      for (i = 0; rc > 0 && i < count && status == COC_NAME_MISS; i++)
+	{
+	  if (fds[i].fd < 0 || fds[i].revents == 0)
+	    {
+	      continue;
+	    }
+
+	  ssize_t len = recv (fds[i].fd, m, sizeof (m), 0);
+
+	  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			  errno == EINTR))
+	    {
+	      continue;
+	    }
+
+	  if (len >= 0)
+	    {
+	      status = coc_rdns_parse (m, (size_t) len, q, qlen, name, ttl);
+	    }
+
+	  /* Errors and failures mean this server will not help. */
+	  if (status == COC_NAME_MISS &&
+	      (len < 0 || (len >= 4 && m[3] & 0x0f)))
+	    {
+	      close (fds[i].fd);
+	      fds[i].fd = -1;
+	      pending--;
+	    }
+	}
+    }
+
+  /* All servers failed, as the system resolver would have found. */
+  if (status == COC_NAME_MISS && pending == 0 && count > 0)
+    {
+      *ttl = UINT32_MAX;
+      status = COC_NAME_NONE;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      if (fds[i].fd >= 0)
+	{
+	  close (fds[i].fd);
+	}
+    }
+
+  pthread_setcancelstate (cancel_state, NULL);
+  return status;
+}
+
+/*
+ * Loads the names of addresses in hosts file `path' into `c', since
+ * the system resolver looks there before asking nameservers. As with
+ * gethostbyaddr, the first line of an address wins. Returns the number
+ * of addresses found.
+ */
+size_t
+coc_hosts_load (coc_name_cache_t *c, const char *path)
+{
+  char line[1024];
+  size_t lines = 0, count = 0;
+  FILE *hosts = fopen (path, "r");
+
+  if (hosts == NULL)
+    {
+      coc_name_cache_init (c, 0);
+      return 0;
+    }
+
+  while (fgets (line, sizeof (line), hosts) != NULL)
+    {
+      lines++;
+    }
+
+  coc_name_cache_init (c, lines);
+  rewind (hosts);
+
+  while (fgets (line, sizeof (line), hosts) != NULL)
+    {
+      char names[COC_NAMES_LEN] = "";
+      char seen[COC_NAMES_LEN];
+      char *save = NULL;
+      char *comment = strchr (line, '#');
+      uint8_t key[COC_KEY_LEN];
+      uint64_t expires;
+      struct in6_addr a6;
+      struct in_addr a4;
+
+      if (comment != NULL)
+	{
+	  *comment = '\0';
+	}
+
+      char *address = strtok_r (line, " \t\r\n", &save);
+      char *name;
+
+      if (address == NULL)
+	{
+	  continue;
+	}
+
+      if (inet_pton (AF_INET, address, &a4) == 1)
+	{
+	  coc_key_from_v4 (key, &a4);
+	}
+      else if (inet_pton (AF_INET6, address, &a6) == 1)
+	{
+	  coc_key_from_v6 (key, &a6);
+	}
+      else
+	{
+	  continue;
+	}
+
+      while ((name = strtok_r (NULL, " \t\r\n", &save)) != NULL)
+	{
+	  coc_names_add (names, name);
+	}
+
+      if (names[0] != '\0' &&
+	  coc_name_cache_get (c, key, 0, seen, &expires) == COC_NAME_MISS)
+	{
+	  coc_name_cache_put (c, key, 0, names, UINT64_MAX);
+	  count++;
+	}
+    }
+
+  fclose (hosts);
+  return count;
+}
@@ -0,0 +1,1844 @@
+/* Rules parser and compiler, shared by the library and coc-compile.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+const char *coc_rule_type_name[] = {
+  "ALLOW",
+  "BLOCK"
+};
+
+const char *coc_address_type_name[] = {
+  [COC_IPV4_ADDR] = "IPv4",
+  [COC_IPV6_ADDR] = "IPv6",
+  [COC_GLOB_ADDR] = "glob",
+  [COC_HOST_ADDR] = "host"
+};
+
+static inline
+coc_entry_t *
+coc_entry_alloc (void)
+{
+  return (coc_entry_t *) calloc (1, sizeof(coc_entry_t));
+}
+
+struct coc_list coc_list_head = { NULL };
+
+/* Rules being parsed, to report errors. Parsing goes on after an
+ * invalid rule so that all of them are reported at once. */
+static const char *coc_rule_source = NULL;	/* variable or file name. */
+static size_t coc_rule_line = 0;	/* 0 unless from a file. */
+static const char *coc_rule_text = NULL;
+static size_t coc_rule_len = 0;
+static bool coc_rule_bad = false;
+static size_t coc_rule_errors = 0;
+
+#ifdef __GNUC__
+static void coc_rule_error (const char *format, ...)
+  __attribute__ ((__format__ (__printf__, 1, 2)));
+#endif
+
+static void
+coc_rule_error (const char *format, ...)
+{
+  char message[256];
+  char line[32] = "";
+  va_list ap;
+
+  va_start (ap, format);
+  vsnprintf (message, sizeof (message), format, ap);
+  va_end (ap);
+
+  if (coc_rule_line > 0)
+    {
+      snprintf (line, sizeof (line), ":%zu", coc_rule_line);
+    }
+
+  coc_log (COC_ERROR_LOG_LEVEL, "ERROR %s%s: %s%.*s%s%s\n",
+	   coc_rule_source, line, coc_rule_len ? "`" : "",
+	   (int) coc_rule_len, coc_rule_text, coc_rule_len ? "': " : "",
+	   message);
+  coc_rule_bad = true;
+  coc_rule_errors++;
+}
+
+#define COC_RULE_ERROR(...) do { \
+    coc_rule_error (__VA_ARGS__); \
+    return -1; \
+  } while (0)
+
+/* Number of invalid rules met so far. */
+size_t
+coc_rules_errors (void)
+{
+  return coc_rule_errors;
+}
+
+/* TCP services most used in rules, sorted by name, so that port names
+ * do not need a lookup in the services database. */
+static const struct coc_service {
+  const char *name;
+  in_port_t port;
+} coc_services[] = {
+  {"amqp", 5672}, {"auth", 113}, {"bgp", 179}, {"domain", 53},
+  {"epmap", 135}, {"finger", 79}, {"ftp", 21}, {"ftp-data", 20},
+  {"ftps", 990}, {"ftps-data", 989}, {"git", 9418}, {"gopher", 70},
+  {"http", 80}, {"http-alt", 8080}, {"https", 443}, {"ident", 113},
+  {"imap", 143}, {"imap2", 143}, {"imaps", 993}, {"ipp", 631},
+  {"ircd", 6667}, {"jabber-client", 5222}, {"jabber-server", 5269},
+  {"kerberos", 88}, {"kerberos-adm", 749}, {"ldap", 389}, {"ldaps", 636},
+  {"microsoft-ds", 445}, {"ms-sql-s", 1433}, {"ms-wbt-server", 3389},
+  {"mysql", 3306}, {"netbios-ssn", 139}, {"nfs", 2049}, {"nicname", 43},
+  {"nntp", 119}, {"nntps", 563}, {"openvpn", 1194}, {"pop3", 110},
+  {"pop3s", 995}, {"postgres", 5432}, {"postgresql", 5432},
+  {"printer", 515}, {"redis", 6379}, {"rsync", 873}, {"rtsp", 554},
+  {"shell", 514}, {"sieve", 4190}, {"sip", 5060}, {"sip-tls", 5061},
+  {"smtp", 25}, {"smtps", 465}, {"snmp", 161}, {"socks", 1080},
+  {"ssh", 22}, {"submission", 587}, {"submissions", 465},
+  {"subversion", 3690}, {"sunrpc", 111}, {"svn", 3690}, {"telnet", 23},
+  {"telnets", 992}, {"time", 37}, {"webcache", 8080}, {"whois", 43},
+  {"www", 80}, {"x11", 6000}, {"xmpp-client", 5222},
+  {"xmpp-server", 5269}
+};
+
+/* Port of the service named [s, s + len), or 0. */
+static in_port_t
+coc_service_port (const char *s, size_t len)
+{
+  size_t lo = 0;
+  size_t hi = sizeof (coc_services) / sizeof (coc_services[0]);
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const char *name = coc_services[mid].name;
+      int c = strncmp (name, s, len);
+
+      if (c == 0 && name[len] == '\0')
+	{
+	  return coc_services[mid].port;
+	}
+
+      if (c < 0)
+	{
+	  lo = mid + 1;
+	}
+      else
+	{
+	  hi = mid;
+	}
+    }
+
+  return 0;
+}
+
+/* Parse a port number or service name in [s, end). Returns 0 if it is
+ * not valid. */
+static in_port_t
+coc_port_value (const char *s, const char *end)
+{
+  const char *t = s;
+  bool service_needed = false;
+  in_port_t port = 0;
+
+  if (t == end)
+    {
+      coc_rule_error ("No port specified");
+      return 0;
+    }
+
+  while (t < end)
+    {
+      unsigned char u = *t;
+
+      if (isdigit (u))
+	{
+	  /* INT30-C */
+	  if ((port > UINT16_MAX / 10) ||
+	      (UINT16_MAX - (u - '0') < port * 10))
+	    {
+	      coc_rule_error ("Invalid port number");
+	      return 0;
+	    }
+	  else
+	    {
+	      port = port * 10 + (u - '0');
+	    }
+	}
+
+      else if (isalnum (u) || u == '-')
+	{
+	  service_needed = true;
+	}
+
+      else
+	{
+	  coc_rule_error ("`%c' unexpected for port", u);
+	  return 0;
+	}
+
+      t++;
+    }
+
+  if (service_needed &&
+      (port = coc_service_port (s, end - s)) == 0)
+    {
+      char *svc = strndup (s, end - s);
+      struct servent *svt = getservbyname (svc, "tcp");
+
+      if (svt == NULL)
+	{
+	  coc_rule_error ("service `%s' not found", svc);
+	  free (svc);
+	  return 0;
+	}
+
+      port = ntohs (svt->s_port);
+      free (svc);
+    }
+
+  if (port == 0)
+    {
+      coc_rule_error ("`0' not allowed for port");
+    }
+
+  return port;
+}
+
+/* Add ports `low' to `high' to `bits', widening the span of the set. */
+static void
+coc_port_add (uint8_t *bits, in_port_t *span, in_port_t low, in_port_t high)
+{
+  coc_portset_add (bits, low, high);
+
+  if (low < span[0])
+    {
+      span[0] = low;
+    }
+
+  if (high > span[1])
+    {
+      span[1] = high;
+    }
+}
+
+/* Add a port or a numeric `LOW-HIGH' range in [s, end) to `bits'.
+ * Returns false for a single port, stored in `port'. */
+static bool
+coc_port_item (const char *s, const char *end, uint8_t *bits,
+	       in_port_t *span, in_port_t *port)
+{
+  const char *dash = memchr (s, '-', end - s);
+  const char *t;
+
+  for (t = s; dash != NULL && t < end; t++)
+    {
+      if (t != dash && !isdigit ((unsigned char) *t))
+	{
+	  /* Not a range but a service name such as `ftp-data'. */
+	  dash = NULL;
+	}
+    }
+
+  if (dash == NULL || dash == s || dash == end - 1)
+    {
+      if ((*port = coc_port_value (s, end)) != 0)
+	{
+	  coc_port_add (bits, span, *port, *port);
+	}
+
+      return false;
+    }
+
+  in_port_t low = coc_port_value (s, dash);
+  in_port_t high = coc_port_value (dash + 1, end);
+
+  if (low == 0 || high == 0)
+    {
+      return true;
+    }
+
+  if (low > high)
+    {
+      coc_rule_error ("Invalid port range %hu-%hu", low, high);
+      return true;
+    }
+
+  coc_port_add (bits, span, low, high);
+  return true;
+}
+
+/* Parse the port part of a rule: `PORT', `LOW-HIGH' or a set of these
+ * between braces, e.g. `{80,443,8000-8100}'. A single port is stored
+ * in `port'; anything else gives a shared port set. */
+static const coc_portset_t *
+coc_port_spec (const char *s, const char *end, in_port_t *port)
+{
+  uint8_t bits[COC_PORTSET_BYTES];
+  in_port_t span[2] = { UINT16_MAX, 0 };
+  memset (bits, 0, sizeof (bits));
+
+  if (s == end || *s != '{')
+    {
+      if (coc_port_item (s, end, bits, span, port))
+	{
+	  *port = 0;
+	  return coc_rule_bad ? NULL : coc_portset_intern (bits, span[0],
+							   span[1]);
+	}
+
+      return NULL;
+    }
+
+  if (end - s < 3 || end[-1] != '}')
+    {
+      coc_rule_error ("`}' missing for port set");
+      return NULL;
+    }
+
+  const char *item = s + 1;
+
+  while (item < end - 1 && !coc_rule_bad)
+    {
+      const char *comma = memchr (item, ',', end - 1 - item);
+      const char *next = comma ? comma : end - 1;
+
+      coc_port_item (item, next, bits, span, port);
+      item = next + 1;
+    }
+
+  *port = 0;
+  return coc_rule_bad ? NULL : coc_portset_intern (bits, span[0], span[1]);
+}
+
+/* Add a rule on the host name [name, name + len), or on its subdomains
+ * too, without resolving it. */
+static int
+coc_name_rule_add (const char *name, size_t len, bool subdomains,
+		   in_port_t port, const coc_portset_t *ports,
+		   size_t rule_type)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned char c = name[i];
+
+      if (!isalnum (c) && c != '-' && c != '_' &&
+	  (c != '.' || i == 0 || i == len - 1 || name[i - 1] == '.'))
+	{
+	  COC_RULE_ERROR ("Invalid host name `%.*s'", (int) len, name);
+	}
+    }
+
+  if (len == 0)
+    {
+      COC_RULE_ERROR ("No host name specified");
+    }
+
+  coc_entry_t *e = coc_entry_alloc ();
+  char *glob = (char *) malloc (len + 3);
+
+  if (e == NULL || glob == NULL)
+    {
+      DIE ("Cannot allocate rule, aborting\n");
+    }
+
+  snprintf (glob, len + 3, "%s%.*s", subdomains ? "*." : "", (int) len,
+	    name);
+  coc_log (COC_DEBUG_LOG_LEVEL,
+	   "DEBUG Adding %s rule for name connection to %s\n",
+	   coc_rule_type_name[rule_type], glob);
+
+  e->rule_type = rule_type;
+  e->addr_type = COC_GLOB_ADDR;
+  e->port = htons (port);
+  e->ports = ports;
+  e->addr.glob = coc_lowercase (glob);
+  SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+  return 0;
+}
+
+/* Host rule waiting for coc_rules_resolve, in place of its entries. */
+typedef struct coc_host_rule {
+  char *host;
+  char *text;			/* the rule, for errors. */
+  const char *source;
+  size_t line;
+  coc_host_addr_t *addrs;
+  size_t addr_count;
+  int err;			/* why it was not resolved. */
+  bool done;
+} coc_host_rule_t;
+
+static coc_host_rule_t *host_rules = NULL;
+static size_t host_rule_count = 0;
+
+/* Set on threads resolving host rules, whose connections are not ours
+ * to check. */
+static COC_THREAD_LOCAL bool coc_resolving = false;
+
+bool
+coc_rules_resolving (void)
+{
+  return coc_resolving;
+}
+
+static bool
+coc_host_rule_add (coc_entry_t *e, char *host)
+{
+  coc_host_rule_t *r = (coc_host_rule_t *)
+    realloc (host_rules, (host_rule_count + 1) * sizeof (*r));
+
+  if (r == NULL)
+    {
+      return false;
+    }
+
+  host_rules = r;
+  r = &host_rules[host_rule_count];
+  memset (r, 0, sizeof (*r));
+  r->host = host;
+  r->text = strndup (coc_rule_text, coc_rule_len);
+  r->source = coc_rule_source;
+  r->line = coc_rule_line;
+  e->addr.host = host_rule_count++;
+  return r->text != NULL;
+}
+
+static int
+coc_host_resolve (const char *host, struct addrinfo **ailist)
+{
+  struct addrinfo hints;
+  int err;
+
+  memset (&hints, 0, sizeof(struct addrinfo));
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  hints.ai_family = AF_UNSPEC;	/* IPv4 or IPv6 or others */
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  coc_resolving = true;
+  err = getaddrinfo (host, NULL, &hints, ailist);
+  coc_resolving = false;
+  return err;
+}
+
+static int
+coc_rule_add (const char *str, size_t len, size_t rule_type)
+{
+  int type = COC_IPV4_ADDR | COC_IPV6_ADDR | COC_GLOB_ADDR | COC_HOST_ADDR;
+  const char *p = str;
+  const char *service = NULL;
+  enum
+  {
+    IPV6_SB_NONE,
+    IPV6_SB_OPEN,
+    IPV6_SB_CLOSE
+  } sb = IPV6_SB_NONE;
+  size_t colon_count = 0;
+  size_t ipv4_segment = 1;
+  uint16_t segment = 0;		/* IPv4 or IPv6 */
+  const char *slash = NULL;	/* start of IPv4 or IPv6 prefix length */
+  const char *closing_sb = NULL;
+  unsigned int prefix = 0;
+
+  coc_rule_text = str;
+  coc_rule_len = len;
+  coc_rule_bad = false;
+
+  /* `=' before a host name matches it as is, not resolved. */
+  bool as_is = len > 0 && *str == '=';
+
+  if (as_is)
+    {
+      p = ++str;
+      len--;
+    }
+
+  while (p < str + len)
+    {
+      unsigned char c = *p;
+
+      /* `*' and `?' allowed only for glob. Let's go on to check for
+       * errors. */
+      if (c == '*' || c == '?')
+	{
+	  /* Not allowed if only remaining choices are IPv4 or IPv6. */
+	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)))
+	    {
+	      COC_RULE_ERROR ("`%c' not allowed for IPv4 or IPv6", c);
+	    }
+	  else
+	    {
+	      type = COC_GLOB_ADDR;
+	    }
+	}
+
+      /* `[' allowed only at beginning of address for IPv6. */
+      else if (c == '[')
+	{
+	  if (p == str)
+	    {
+	      type = COC_IPV6_ADDR;
+	      sb = IPV6_SB_OPEN;
+	    }
+	  else
+	    {
+	      COC_RULE_ERROR ("`[' allowed only once for IPv6");
+	    }
+	}
+
+      else if (c == ']')
+	{
+	  if (type == COC_IPV6_ADDR && sb == IPV6_SB_OPEN)
+	    {
+	      sb = IPV6_SB_CLOSE;
+	      closing_sb = p;
+	    }
+	  else
+	    {
+	      COC_RULE_ERROR ("`]' unexpected");
+	    }
+	}
+
+      else if (c == ':')
+	{
+	  /* IPv6 uses `:' as a segment separator. So we count them.
+	   * Validation for IPv6 is done later with inet_pton. */
+	  colon_count++;
+	  /* Assume `:' precedes port. We will check if not empty later. */
+	  service = p + 1;
+
+	  if (colon_count > 1)
+	    {
+	      if ((type & COC_IPV6_ADDR) == COC_IPV6_ADDR)
+		{
+		  type = COC_IPV6_ADDR;
+		}
+
+	      if (type != COC_IPV6_ADDR ||
+		  ((sb == IPV6_SB_OPEN && colon_count > 7) ||
+		   colon_count > 8))
+		{
+		  COC_RULE_ERROR ("Extra `:' unexpected");
+		}
+
+	      if (colon_count == 8 || sb == IPV6_SB_CLOSE)
+		{
+		  break;
+		}
+	      else
+		{
+		  service = NULL;
+		}
+	    }
+
+	  else
+	    {
+	      /* If so far IPv4 was still a valid choice, then it is it now. */
+	      if (p != str && ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR))
+		{
+		  type = COC_IPV4_ADDR;
+
+		  if (ipv4_segment == 4)
+		    {
+		      break;
+		    }
+		}
+	    }
+	}
+
+      /* We can see dots for IPv4, glob, or hostnames.  We can rule
+       * out IPv4 when we have a segment that does not fit what is
+       * expected (e.g. higher than 255).
+       */
+      else if (c == '.')
+	{
+	  if (type == COC_IPV6_ADDR)
+	    {
+	      COC_RULE_ERROR ("`.' not allowed for IPv6");
+	    }
+
+	  type &= ~COC_IPV6_ADDR;
+
+	  segment = 0;
+	  ipv4_segment++;
+
+	  if (ipv4_segment > 4)
+	    {
+	      if (type == COC_IPV4_ADDR)	/* not possible for now. */
+		{
+		  COC_RULE_ERROR ("Extra `.' unexpected");
+		}
+	      else
+		{
+		  type &= ~COC_IPV4_ADDR;
+		}
+	    }
+	}
+
+      /* `/' introduces the length of an IPv4 or IPv6 prefix. */
+      else if (c == '/')
+	{
+	  if (slash != NULL || !(type & (COC_IPV4_ADDR | COC_IPV6_ADDR)))
+	    {
+	      COC_RULE_ERROR ("`/' allowed only once for IPv4 or IPv6");
+	    }
+
+	  type &= COC_IPV4_ADDR | COC_IPV6_ADDR;
+	  slash = p++;
+
+	  while (p < str + len && isdigit ((unsigned char) *p))
+	    {
+	      prefix = prefix * 10 + (*p - '0');
+
+	      if (prefix > 128)
+		{
+		  COC_RULE_ERROR ("Invalid prefix length");
+		}
+
+	      p++;
+	    }
+
+	  if (p == slash + 1)
+	    {
+	      COC_RULE_ERROR ("No prefix length specified after `/'");
+	    }
+
+	  if (p < str + len && *p != ':' && *p != ']')
+	    {
+	      COC_RULE_ERROR ("`%c' unexpected after prefix length", *p);
+	    }
+
+	  if (p < str + len && *p == ':' && type == COC_IPV6_ADDR &&
+	      sb == IPV6_SB_NONE)
+	    {
+	      COC_RULE_ERROR ("Port after IPv6 prefix requires `[]'");
+	    }
+
+	  continue;
+	}
+
+      else if (isdigit (c))
+	{
+	  if ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR)
+	    {
+	      /* INT30-C */
+	      if ((segment > UINT16_MAX / 10) ||
+		  (UINT16_MAX - (c - '0') < segment * 10))
+		{
+		  COC_RULE_ERROR ("Invalid IPv4 segment");
+		}
+	      else
+		{
+		  segment = segment * 10 + (c - '0');
+		}
+
+	      if (segment > 255)
+		{
+		  if (type == COC_IPV4_ADDR)	/* not possible */
+		    {
+		      COC_RULE_ERROR ("Invalid IPv4 address");
+		    }
+		  else
+		    {
+		      coc_log (COC_DEBUG_LOG_LEVEL,
+			       "DEBUG %hd... is not an IPv4 segment\n",
+			       segment);
+		      type &= ~COC_IPV4_ADDR;
+		    }
+		}
+	    }
+	}
+
+      else if (isxdigit (c))	/* and not a digit */
+	{
+	  if (type == COC_IPV4_ADDR)	/* not possible */
+	    {
+	      COC_RULE_ERROR ("Invalid IPv4 address");
+	    }
+	  else
+	    {
+	      type &= ~COC_IPV4_ADDR;
+	    }
+	}
+
+      else if (isalnum (c))	/* not a digit nor an xdigit */
+	{
+	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)))
+	    {
+	      COC_RULE_ERROR ("`%c' unexpected", c);
+	    }
+	  else
+	    {
+	      type &= ~(COC_IPV4_ADDR | COC_IPV6_ADDR);
+	    }
+	}
+
+      else if (c == '-' || c == '_')
+	{
+	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)) || p == str)
+	    {
+	      COC_RULE_ERROR ("`%c' unexpected", c);
+	    }
+	  else
+	    {
+	      type &= ~(COC_IPV4_ADDR | COC_IPV6_ADDR);
+	    }
+	}
+
+      /* `{' starts a set of ports. */
+      else if (c == '{' && service == p)
+	{
+	  break;
+	}
+
+      else
+	{
+	  /* We may revisit this later for UTF-8 */
+	  COC_RULE_ERROR ("`%c' unexpected here", c);
+	}
+
+      p++;
+    }
+
+  /* If so far IPv4 was still a valid choice, then it is it now. */
+  if ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR)
+    {
+      type = COC_IPV4_ADDR;
+    }
+
+  /* If so far host was still a valid choice, then it is it now. */
+  else if ((type & COC_HOST_ADDR) == COC_HOST_ADDR)
+    {
+      type = COC_HOST_ADDR;
+    }
+
+  if (type == COC_IPV6_ADDR && sb == IPV6_SB_OPEN)
+    {
+      COC_RULE_ERROR ("`]' missing");
+    }
+
+  assert (type == COC_IPV4_ADDR ||
+	  type == COC_IPV6_ADDR ||
+	  type == COC_HOST_ADDR || type == COC_GLOB_ADDR);
+
+  if (as_is && type != COC_HOST_ADDR)
+    {
+      COC_RULE_ERROR ("`=' allowed only before a host name");
+    }
+
+  if (slash == NULL)
+    {
+      prefix = type == COC_IPV4_ADDR ? 32 : 128;
+    }
+  else if (type == COC_IPV4_ADDR && prefix > 32)
+    {
+      COC_RULE_ERROR ("Invalid IPv4 prefix length");
+    }
+
+  in_port_t port = 0;
+  const coc_portset_t *ports = NULL;
+
+  /* If we have a port here, check if everything after that port is valid. */
+  if (service != NULL)
+    {
+      ports = coc_port_spec (service, str + len, &port);
+
+      if (coc_rule_bad)
+	{
+	  return -1;
+	}
+    }
+
+  const char *end = str + len;
+
+  if (slash != NULL)
+    {
+      end = slash;
+    }
+  else if (closing_sb != NULL)
+    {
+      end = closing_sb;
+    }
+  else if (service != NULL)
+    {
+      end = service - 1;
+    }
+
+  if (sb == IPV6_SB_CLOSE)
+    {
+      str++;
+    }
+
+  if (as_is)
+    {
+      return coc_name_rule_add (str, end - str, false, port, ports,
+				rule_type);
+    }
+
+  char *host = strndup (str, end - str);
+  char bits[sizeof ("/128")] = "";
+
+  if (slash != NULL)
+    {
+      snprintf (bits, sizeof (bits), "/%u", prefix);
+    }
+
+  coc_log (COC_DEBUG_LOG_LEVEL,
+	   "DEBUG Adding %s rule for %s connection to %s%s:%.*s\n",
+	   coc_rule_type_name[rule_type], coc_address_type_name[type], host, bits,
+	   service ? (int) (str + len - service) : 1, service ? service : "*");
+
+  switch (type)
+    {
+    case COC_IPV6_ADDR:
+      {
+	coc_entry_t *e = coc_entry_alloc ();
+	e->rule_type = rule_type;
+	e->addr_type = COC_IPV6_ADDR;
+	e->port = htons (port);
+	e->ports = ports;
+	e->prefix = prefix;
+
+	if (inet_pton (AF_INET6, host, &e->addr.ipv6) != 1)
+	  {
+	    free (e);
+	    coc_rule_error ("Invalid IPv6 address: `%s'", host);
+	    free (host);
+	    return -1;
+	  }
+
+	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+	free (host);
+	break;
+      }
+
+    case COC_IPV4_ADDR:
+      {
+	coc_entry_t *e = coc_entry_alloc ();
+	e->rule_type = rule_type;
+	e->addr_type = COC_IPV4_ADDR;
+	e->port = htons (port);
+	e->ports = ports;
+	e->prefix = prefix;
+
+	if (inet_pton (AF_INET, host, &e->addr.ipv4) != 1)
+	  {
+	    free (e);
+	    coc_rule_error ("Invalid IPv4 address: `%s'", host);
+	    free (host);
+	    return -1;
+	  }
+
+	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+	free (host);
+	break;
+      }
+
+    case COC_GLOB_ADDR:
+      {
+	coc_entry_t *e = coc_entry_alloc ();
+	e->rule_type = rule_type;
+	e->addr_type = COC_GLOB_ADDR;
+	e->port = htons (port);
+	e->ports = ports;
+	/* Here we transfer ownership of `host' to the entry. Names are
+	 * matched without regard to case, as in DNS. */
+	e->addr.glob = coc_lowercase (host);
+	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+	break;
+      }
+
+    case COC_HOST_ADDR:
+      {
+	/* Resolved later with the others, by coc_rules_resolve. */
+	coc_entry_t *e = coc_entry_alloc ();
+	e->rule_type = rule_type;
+	e->addr_type = COC_HOST_ADDR;
+	e->port = htons (port);
+	e->ports = ports;
+
+	if (!coc_host_rule_add (e, host))
+	  {
+	    DIE ("Cannot allocate rule, aborting\n");
+	  }
+
+	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+	break;
+      }
+    }
+
+  return 0;
+}
+
+size_t
+coc_rules_add (const char *rules, size_t rule_type, const char *source)
+{
+  size_t count = 0;
+
+  coc_rule_source = source;
+  coc_rule_line = 0;
+
+  if (rules)
+    {
+      const char *p = rules + strlen (rules);
+      size_t len = 0;
+
+      while (p >= rules)
+	{
+	  if (*p == ';')
+	    {
+	      if (len > 1)
+		{
+		  coc_rule_add (p + 1, len - 1, rule_type);
+		}
+
+	      len = 1;
+	      count++;
+	    }
+	  else
+	    {
+	      len++;
+	    }
+
+	  p--;
+	}
+
+      if (len - 1 > 0)
+	{
+	  coc_rule_add (p + 1, len - 1, rule_type);
+	  count++;
+	}
+    }
+
+  return count;
+}
+
+static inline bool
+coc_blank (char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Loopback and broadcast names of hosts files, not to be blocked. */
+static bool
+coc_hosts_local_name (const char *name, size_t len)
+{
+  static const char *names[] = {
+    "0.0.0.0", "broadcasthost", "ip6-allhosts", "ip6-allnodes",
+    "ip6-allrouters", "ip6-localhost", "ip6-localnet", "ip6-loopback",
+    "ip6-mcastprefix", "local", "localhost", "localhost.localdomain"
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof (names) / sizeof (names[0]); i++)
+    {
+      if (strlen (names[i]) == len && !strncmp (names[i], name, len))
+	{
+	  return true;
+	}
+    }
+
+  return false;
+}
+
+/*
+ * Add the rules of the line [s, end) of a rules file, which is one of:
+ *  - a rule, as in COC_ALLOW and COC_BLOCK;
+ *  - an address followed by host names, as in /etc/hosts: the names
+ *    get a rule, the address is ignored;
+ *  - an adblock filter on a whole domain, `||example.com^', which gets
+ *    a rule on the name and one on its subdomains. Exceptions starting
+ *    with `@@' give ALLOW rules. Other filters are skipped.
+ * Blank lines, comments starting with `#' or `!' and adblock headers are
+ * ignored.
+ * Returns the number of rules.
+ */
+static size_t
+coc_rules_add_line (const char *s, const char *end, size_t rule_type,
+		    size_t *skipped)
+{
+  while (s < end && coc_blank (*s))
+    {
+      s++;
+    }
+
+  /* Comments, either whole lines or after a blank. Anything else with
+   * a `#' is an adblock element hiding filter. */
+  const char *hash = memchr (s, '#', end - s);
+
+  if (hash != NULL)
+    {
+      if (hash != s && !coc_blank (hash[-1]))
+	{
+	  (*skipped)++;
+	  return 0;
+	}
+
+      end = hash;
+    }
+
+  while (end > s && coc_blank (end[-1]))
+    {
+      end--;
+    }
+
+  coc_rule_text = s;
+  coc_rule_len = end - s;
+  coc_rule_bad = false;
+
+  const char *blank = s;
+
+  while (blank < end && !coc_blank (*blank))
+    {
+      blank++;
+    }
+
+  /* Adblock headers are like `[Adblock Plus 2.0]'. */
+  if (s == end || *s == '!' || (*s == '[' && end[-1] == ']' && blank < end))
+    {
+      return 0;
+    }
+
+  if ((end - s > 2 && !strncmp (s, "||", 2)) ||
+      (end - s > 4 && !strncmp (s, "@@||", 4)))
+    {
+      size_t type = *s == '@' ? COC_ALLOW : rule_type;
+      const char *name = s + (*s == '@' ? 4 : 2);
+      const char *caret = memchr (name, '^', end - name);
+
+      /* Filters with options or on paths do not block whole domains. */
+      if (caret == NULL ||
+	  (caret + 1 != end && (caret + 2 != end || caret[1] != '|')))
+	{
+	  (*skipped)++;
+	  return 0;
+	}
+
+      return
+	(coc_name_rule_add (name, caret - name, false, 0, NULL, type) == 0) +
+	(coc_name_rule_add (name, caret - name, true, 0, NULL, type) == 0);
+    }
+
+  if (blank == end)
+    {
+      return coc_rule_add (s, end - s, rule_type) == 0;
+    }
+
+  char address[INET6_ADDRSTRLEN];
+  struct in6_addr ignored;
+  size_t count = 0;
+
+  if ((size_t) (blank - s) >= sizeof (address))
+    {
+      coc_rule_error ("Invalid address in hosts line");
+      return 0;
+    }
+
+  memcpy (address, s, blank - s);
+  address[blank - s] = '\0';
+
+  if (inet_pton (AF_INET, address, &ignored) != 1 &&
+      inet_pton (AF_INET6, address, &ignored) != 1)
+    {
+      coc_rule_error ("Invalid address in hosts line");
+      return 0;
+    }
+
+  while (blank < end)
+    {
+      const char *name = blank;
+
+      while (name < end && coc_blank (*name))
+	{
+	  name++;
+	}
+
+      for (blank = name; blank < end && !coc_blank (*blank); blank++)
+	{
+	}
+
+      if (name < blank && !coc_hosts_local_name (name, blank - name))
+	{
+	  count += coc_name_rule_add (name, blank - name, false, 0, NULL,
+				      rule_type) == 0;
+	}
+    }
+
+  return count;
+}
+
+/* Parse the rules file `path' into coc_list_head, ahead of the rules
+ * already there. The file is read and split in place, one line at a
+ * time: mapped, it could be rewritten under us once watched for
+ * changes. Returns the number of rules. */
+size_t
+coc_rules_add_file (const char *path, size_t rule_type)
+{
+  struct coc_list earlier = coc_list_head;
+  size_t count = 0;
+  size_t skipped = 0;
+  size_t size = 0;
+  coc_entry_t *e;
+
+  coc_rule_source = path;
+  coc_rule_line = 0;
+  coc_rule_text = NULL;
+  coc_rule_len = 0;
+
+  char *map = coc_file_read (path, &size);
+
+  /* Empty files have no rules. */
+  if (map == NULL)
+    {
+      if (errno != EINVAL)
+	{
+	  coc_rule_error ("%s", strerror (errno));
+	}
+
+      return 0;
+    }
+
+  SLIST_INIT (&coc_list_head);
+
+  const char *p = map;
+  const char *end = map + size;
+
+  while (p < end)
+    {
+      const char *eol = memchr (p, '\n', end - p);
+
+      if (eol == NULL)
+	{
+	  eol = end;
+	}
+
+      coc_rule_line++;
+      count += coc_rules_add_line (p, eol, rule_type, &skipped);
+      p = eol + 1;
+    }
+
+  free (map);
+  coc_rule_line = 0;
+  coc_rule_len = 0;
+
+  /* Rules were added ahead of each other: put them back in order. */
+  while (!SLIST_EMPTY (&coc_list_head))
+    {
+      e = SLIST_FIRST (&coc_list_head);
+      SLIST_REMOVE_HEAD (&coc_list_head, entries);
+      SLIST_INSERT_HEAD (&earlier, e, entries);
+    }
+
+  coc_list_head = earlier;
+
+  if (skipped > 0)
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Skipped %zu adblock filters of "
+	       "%s not on whole domains\n", skipped, path);
+    }
+
+  return count;
+}
+
+/*
+ * Host rules are resolved by a few threads at once, so that startup
+ * waits for the slowest lookup rather than for all of them in turn.
+ * Threads left behind at the deadline still own the job: the last one
+ * out, main thread included, frees it.
+ */
+#define COC_RESOLVE_THREADS 16
+
+typedef struct coc_resolve_item {
+  char *host;
+  struct addrinfo *ai;
+  int err;
+  bool done;
+} coc_resolve_item_t;
+
+typedef struct coc_resolve_job {
+  coc_mutex_t lock;
+  coc_cond_t done;
+  coc_resolve_item_t *items;
+  size_t count;
+  uint64_t next;		/* item to resolve, taken atomically. */
+  size_t resolved;
+  size_t refs;
+  bool abandoned;
+} coc_resolve_job_t;
+
+static void
+coc_resolve_job_release (coc_resolve_job_t *job)
+{
+  size_t i;
+
+  coc_mutex_lock (&job->lock);
+  bool last = --job->refs == 0;
+  coc_mutex_unlock (&job->lock);
+
+  if (last)
+    {
+      for (i = 0; i < job->count; i++)
+	{
+	  if (job->items[i].ai != NULL)
+	    {
+	      freeaddrinfo (job->items[i].ai);
+	    }
+
+	  free (job->items[i].host);
+	}
+
+      free (job->items);
+      free (job);
+    }
+}
+
+static void
+coc_resolve_run (coc_resolve_job_t *job)
+{
+  uint64_t i;
+
+  while ((i = coc_fetch_add (&job->next, 1)) < job->count)
+    {
+      coc_resolve_item_t *item = &job->items[i];
+      struct addrinfo *ai = NULL;
+      int err = coc_host_resolve (item->host, &ai);
+
+      coc_mutex_lock (&job->lock);
+
+      if (!job->abandoned)
+	{
+	  item->ai = err == 0 ? ai : NULL;
+	  item->err = err;
+	  item->done = true;
+	  job->resolved++;
+	  coc_cond_broadcast (&job->done);
+	  ai = NULL;
+	}
+
+      bool abandoned = job->abandoned;
+      coc_mutex_unlock (&job->lock);
+
+      if (err == 0 && ai != NULL)
+	{
+	  freeaddrinfo (ai);
+	}
+
+      if (abandoned)
+	{
+	  break;
+	}
+    }
+
+  coc_resolve_job_release (job);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+coc_resolve_thread (void *arg)
+{
+  coc_resolve_run ((coc_resolve_job_t *) arg);
+  return 0;
+}
+
+static bool
+coc_resolve_start (coc_resolve_job_t *job)
+{
+  HANDLE h = (HANDLE) _beginthreadex (NULL, 0, coc_resolve_thread, job, 0,
+				      NULL);
+
+  return h != NULL && CloseHandle (h);
+}
+#else
+static void *
+coc_resolve_thread (void *arg)
+{
+  coc_resolve_run ((coc_resolve_job_t *) arg);
+  return NULL;
+}
+
+static bool
+coc_resolve_start (coc_resolve_job_t *job)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  bool ok;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  ok = pthread_create (&thread, &attr, coc_resolve_thread, job) == 0;
+  pthread_attr_destroy (&attr);
+  return ok;
+}
+#endif
+
+/* Keep the addresses of `ailist' for `r'. */
+static void
+coc_host_rule_addrs (coc_host_rule_t *r, const struct addrinfo *ailist)
+{
+  const struct addrinfo *ai;
+  size_t count = 0;
+
+  for (ai = ailist; ai != NULL; ai = ai->ai_next)
+    {
+      count++;
+    }
+
+  r->addrs = (coc_host_addr_t *) calloc (count + 1, sizeof (*r->addrs));
+
+  if (r->addrs == NULL)
+    {
+      DIE ("Cannot allocate rules, aborting\n");
+    }
+
+  for (ai = ailist; ai != NULL; ai = ai->ai_next)
+    {
+      coc_host_addr_t *a = &r->addrs[r->addr_count];
+
+      if (ai->ai_family == AF_INET)
+	{
+	  a->type = COC_IPV4_ADDR;
+	  memcpy (a->addr, &((const struct sockaddr_in *) ai->ai_addr)->
+		  sin_addr, sizeof (struct in_addr));
+	  r->addr_count++;
+	}
+      else if (ai->ai_family == AF_INET6)
+	{
+	  a->type = COC_IPV6_ADDR;
+	  memcpy (a->addr, &((const struct sockaddr_in6 *) ai->ai_addr)->
+		  sin6_addr, sizeof (struct in6_addr));
+	  r->addr_count++;
+	}
+    }
+}
+
+/* Resolve the host rules not in the host cache, in parallel if
+ * possible, giving up on those still unresolved after `timeout_ms'. */
+static void
+coc_resolve_all (coc_host_rule_t *rules, size_t count, uint64_t timeout_ms)
+{
+  coc_resolve_job_t *job = (coc_resolve_job_t *) calloc (1, sizeof (*job));
+  size_t *index = (size_t *) malloc (count * sizeof (size_t));
+  size_t i, threads = 0;
+
+  if (job == NULL || index == NULL ||
+      (job->items = (coc_resolve_item_t *)
+       calloc (count, sizeof (coc_resolve_item_t))) == NULL)
+    {
+      DIE ("Cannot allocate rules, aborting\n");
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      coc_host_rule_t *r = &rules[i];
+      size_t n;
+      const coc_host_addr_t *cached = coc_host_cache_get (r->host, &n);
+
+      if (cached != NULL)
+	{
+	  coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Using cached addresses of "
+		   "%s\n", r->host);
+	  r->addrs = (coc_host_addr_t *) malloc (n * sizeof (*r->addrs));
+
+	  if (r->addrs == NULL)
+	    {
+	      DIE ("Cannot allocate rules, aborting\n");
+	    }
+
+	  memcpy (r->addrs, cached, n * sizeof (*r->addrs));
+	  r->addr_count = n;
+	  r->done = true;
+	}
+      else
+	{
+	  if ((job->items[job->count].host = strdup (r->host)) == NULL)
+	    {
+	      DIE ("Cannot allocate rules, aborting\n");
+	    }
+
+	  index[job->count++] = i;
+	}
+    }
+
+  coc_mutex_init (&job->lock);
+  coc_cond_init (&job->done);
+  job->refs = 1;
+
+  while (threads < job->count && threads < COC_RESOLVE_THREADS)
+    {
+      coc_mutex_lock (&job->lock);
+      job->refs++;
+      coc_mutex_unlock (&job->lock);
+
+      if (!coc_resolve_start (job))
+	{
+	  coc_mutex_lock (&job->lock);
+	  job->refs--;
+	  coc_mutex_unlock (&job->lock);
+	  break;
+	}
+
+      threads++;
+    }
+
+  if (threads == 0 && job->count > 0)
+    {
+      /* Without threads, there is no deadline to keep. */
+      job->refs++;
+      coc_resolve_run (job);
+    }
+
+  uint64_t deadline = coc_now_ms () + timeout_ms;
+
+  coc_mutex_lock (&job->lock);
+
+  while (job->resolved < job->count &&
+	 coc_cond_wait_until (&job->done, &job->lock, deadline))
+    {
+    }
+
+  job->abandoned = true;
+  coc_mutex_unlock (&job->lock);
+
+  /* Items done are no longer written by threads. */
+  for (i = 0; i < job->count; i++)
+    {
+      coc_resolve_item_t *item = &job->items[i];
+      coc_host_rule_t *r = &rules[index[i]];
+
+      if (item->done)
+	{
+	  r->done = true;
+	  r->err = item->err;
+
+	  if (item->err == 0)
+	    {
+	      coc_host_cache_put (r->host, item->ai);
+	      coc_host_rule_addrs (r, item->ai);
+	    }
+	}
+    }
+
+  coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Resolved %zu of %zu host rules "
+	   "with %zu threads\n", job->resolved, job->count, threads);
+
+  free (index);
+  coc_resolve_job_release (job);
+}
+
+size_t
+coc_rules_resolve (uint64_t timeout_ms)
+{
+  struct coc_list reversed;
+  coc_entry_t *e;
+  size_t i, count = host_rule_count;
+  coc_host_rule_t *rules = host_rules;
+
+  if (count == 0)
+    {
+      return 0;
+    }
+
+  host_rules = NULL;
+  host_rule_count = 0;
+  coc_resolve_all (rules, count, timeout_ms);
+
+  /* Entries are reversed once to expand host rules in place, then
+   * again to restore their order. */
+  SLIST_INIT (&reversed);
+
+  while (!SLIST_EMPTY (&coc_list_head))
+    {
+      e = SLIST_FIRST (&coc_list_head);
+      SLIST_REMOVE_HEAD (&coc_list_head, entries);
+
+      if (e->addr_type != COC_HOST_ADDR)
+	{
+	  SLIST_INSERT_HEAD (&reversed, e, entries);
+	  continue;
+	}
+
+      coc_host_rule_t *r = &rules[e->addr.host];
+
+      for (i = 0; i < r->addr_count; i++)
+	{
+	  coc_entry_t *a = coc_entry_alloc ();
+
+	  if (a == NULL)
+	    {
+	      DIE ("Cannot allocate rule, aborting\n");
+	    }
+
+	  *a = *e;
+
+	  if (r->addrs[i].type == COC_IPV4_ADDR)
+	    {
+	      a->addr_type = COC_IPV4_ADDR;
+	      a->prefix = 32;
+	      memcpy (&a->addr.ipv4, r->addrs[i].addr, sizeof (a->addr.ipv4));
+	    }
+	  else
+	    {
+	      a->addr_type = COC_IPV6_ADDR;
+	      a->prefix = 128;
+	      memcpy (&a->addr.ipv6, r->addrs[i].addr, sizeof (a->addr.ipv6));
+	    }
+
+	  SLIST_INSERT_HEAD (&reversed, a, entries);
+	}
+
+      free (e);
+    }
+
+  while (!SLIST_EMPTY (&reversed))
+    {
+      e = SLIST_FIRST (&reversed);
+      SLIST_REMOVE_HEAD (&reversed, entries);
+      SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      if (!rules[i].done || rules[i].err != 0)
+	{
+	  coc_rule_source = rules[i].source;
+	  coc_rule_line = rules[i].line;
+	  coc_rule_text = rules[i].text;
+	  coc_rule_len = strlen (rules[i].text);
+	  coc_rule_error ("%s", rules[i].done ? gai_strerror (rules[i].err) :
+			  "Not resolved in time");
+	}
+
+      free (rules[i].host);
+      free (rules[i].text);
+      free (rules[i].addrs);
+    }
+
+  coc_rule_len = 0;
+  free (rules);
+  return count;
+}
+
+/* `*.SUFFIX' globs, where SUFFIX has no wildcard, go to the domain trie. */
+static inline const char *
+coc_glob_suffix (const char *g)
+{
+  if (g[0] == '*' && g[1] == '.' && g[2] != '\0' &&
+      strpbrk (g + 2, "*?[") == NULL)
+    {
+      return g + 2;
+    }
+
+  return NULL;
+}
+
+static inline bool
+coc_entry_is_exact (const coc_entry_t *e)
+{
+  return (e->addr_type == COC_IPV4_ADDR && e->prefix == 32) ||
+    (e->addr_type == COC_IPV6_ADDR && e->prefix == 128);
+}
+
+void
+coc_rules_order (void)
+{
+  struct coc_list allow;
+  struct coc_list block;
+  coc_entry_t *e;
+
+  SLIST_INIT (&allow);
+  SLIST_INIT (&block);
+
+  while (!SLIST_EMPTY (&coc_list_head))
+    {
+      e = SLIST_FIRST (&coc_list_head);
+      SLIST_REMOVE_HEAD (&coc_list_head, entries);
+      SLIST_INSERT_HEAD (e->rule_type == COC_ALLOW ? &allow : &block, e,
+			 entries);
+    }
+
+  while (!SLIST_EMPTY (&block))
+    {
+      e = SLIST_FIRST (&block);
+      SLIST_REMOVE_HEAD (&block, entries);
+      SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+    }
+
+  while (!SLIST_EMPTY (&allow))
+    {
+      e = SLIST_FIRST (&allow);
+      SLIST_REMOVE_HEAD (&allow, entries);
+      SLIST_INSERT_HEAD (&coc_list_head, e, entries);
+    }
+}
+
+/*
+ * Index rules from coc_list_head into `rs' for the `connect' hook. The
+ * rules are copied to flat arrays, so that the parsed entries can be
+ * freed and the result written to a rules database as is.
+ */
+void
+coc_rules_compile (coc_ruleset_t *rs, unsigned long bloom_fp_rate)
+{
+  coc_rules_order ();
+
+  coc_entry_t *e;
+  size_t count = 0;
+  size_t globs = 0;
+  size_t exact = 0;
+  size_t strings_len = 0;
+
+  memset (rs, 0, sizeof (*rs));
+
+  SLIST_FOREACH (e, &coc_list_head, entries)
+  {
+    count++;
+
+    if (e->addr_type == COC_GLOB_ADDR)
+      {
+	globs++;
+	strings_len += strlen (e->addr.glob) + 1;
+      }
+    else if (coc_entry_is_exact (e))
+      {
+	exact++;
+      }
+
+    if (e->ports != NULL && e->ports->index >= rs->portset_count)
+      {
+	rs->portset_count = e->ports->index + 1;
+      }
+  }
+
+  if (count >= COC_NIL)
+    {
+      DIE ("Too many rules, aborting\n");
+    }
+
+  rs->rules = (coc_rule_t *) calloc (count, sizeof (coc_rule_t));
+  rs->strings = (char *) malloc (strings_len);
+  rs->portsets = calloc (rs->portset_count, COC_PORTSET_BYTES);
+  rs->globs = (uint32_t *) malloc (globs * sizeof (uint32_t));
+  rs->stars = (uint32_t *) malloc (globs * sizeof (uint32_t));
+
+  if ((count > 0 && rs->rules == NULL) ||
+      (globs > 0 && (rs->strings == NULL || rs->globs == NULL ||
+		     rs->stars == NULL)) ||
+      (rs->portset_count > 0 && rs->portsets == NULL))
+    {
+      DIE ("Cannot allocate rules, aborting\n");
+    }
+
+  coc_portset_copy (rs->portsets, rs->portset_count);
+  coc_hash_init (&rs->exact, exact);
+  coc_bloom_init (&rs->exact_bloom, exact >= COC_BLOOM_MIN_ITEMS ? exact : 0,
+		  bloom_fp_rate);
+  coc_lpm_init (&rs->lpm);
+  coc_domain_init (&rs->domains);
+  coc_bloom_init (&rs->domain_bloom,
+		  globs >= COC_BLOOM_MIN_ITEMS ? globs : 0, bloom_fp_rate);
+
+  SLIST_FOREACH (e, &coc_list_head, entries)
+  {
+    uint32_t rank = (uint32_t) rs->rule_count++;
+    coc_rule_t *r = &rs->rules[rank];
+
+    r->port = e->port;
+    r->ports = COC_NIL;
+    r->next = COC_NIL;
+    r->addr_type = (uint8_t) e->addr_type;
+    r->rule_type = (uint8_t) e->rule_type;
+
+    if (e->ports != NULL)
+      {
+	r->ports = e->ports->index;
+      }
+
+    switch (e->addr_type)
+      {
+      case COC_IPV4_ADDR:
+      case COC_IPV6_ADDR:
+	{
+	  r->bits = (uint8_t) coc_key_from_entry (r->key, e);
+
+	  if (coc_entry_is_exact (e))
+	    {
+	      coc_hash_insert (&rs->exact, rs->rules, rank);
+	      coc_bloom_add (&rs->exact_bloom, coc_bloom_hash_key (r->key));
+	    }
+	  else
+	    {
+	      coc_lpm_insert (&rs->lpm, rs->rules, rank);
+	    }
+	  break;
+	}
+
+      case COC_GLOB_ADDR:
+	{
+	  const char *glob = e->addr.glob;
+	  const char *suffix = coc_glob_suffix (glob);
+
+	  r->glob = (uint32_t) rs->strings_len;
+	  memcpy (rs->strings + r->glob, glob, strlen (glob) + 1);
+	  rs->strings_len += strlen (glob) + 1;
+
+	  if (suffix != NULL)
+	    {
+	      coc_domain_insert (&rs->domains, rs->rules, rs->strings,
+				 r->glob + (uint32_t) (suffix - glob), rank,
+				 false);
+	      coc_bloom_add (&rs->domain_bloom, coc_bloom_hash_str (suffix));
+	    }
+	  else if (strpbrk (glob, "*?[") == NULL)
+	    {
+	      coc_domain_insert (&rs->domains, rs->rules, rs->strings,
+				 r->glob, rank, true);
+	      coc_bloom_add (&rs->domain_bloom, coc_bloom_hash_str (glob));
+	    }
+	  else if (glob[0] == '*' && glob[1] == '\0')
+	    {
+	      rs->stars[rs->star_count++] = rank;
+	    }
+	  else
+	    {
+	      rs->globs[rs->glob_count++] = rank;
+	    }
+	  break;
+	}
+      }
+  }
+
+  /* Entries are not needed any more. */
+  coc_rules_discard ();
+
+  coc_log (COC_DEBUG_LOG_LEVEL,
+	   "DEBUG Compiled %zu rules: %zu addresses, %zu prefix trie nodes, "
+	   "%zu domain suffixes, %zu globs, %zu Bloom filter blocks\n",
+	   rs->rule_count, rs->exact.count, rs->lpm.node_count,
+	   rs->domains.count, rs->glob_count,
+	   rs->exact_bloom.block_count + rs->domain_bloom.block_count);
+}
+
+/* Free the entries of coc_list_head, compiled or not, and their port
+ * sets. */
+void
+coc_rules_discard (void)
+{
+  coc_entry_t *e;
+
+  while (!SLIST_EMPTY (&coc_list_head))
+    {
+      e = SLIST_FIRST (&coc_list_head);
+      SLIST_REMOVE_HEAD (&coc_list_head, entries);
+
+      if (e->addr_type == COC_GLOB_ADDR)
+	{
+	  free (e->addr.glob);
+	}
+
+      free (e);
+    }
+
+  coc_portset_clear ();
+}
+
+/* Free what coc_rules_compile or coc_db_load made of `rs'. */
+void
+coc_ruleset_free (coc_ruleset_t *rs)
+{
+  coc_dfa_free (&rs->dfa);
+
+  if (rs->map != NULL)
+    {
+      coc_file_unmap (rs->map, rs->map_size);
+    }
+  else
+    {
+      free (rs->rules);
+      free (rs->strings);
+      free (rs->portsets);
+      free (rs->stars);
+      free (rs->globs);
+      coc_hash_free (&rs->exact);
+      coc_bloom_free (&rs->exact_bloom);
+      coc_lpm_free (&rs->lpm);
+      coc_domain_free (&rs->domains);
+      coc_bloom_free (&rs->domain_bloom);
+    }
+
+  memset (rs, 0, sizeof (*rs));
+}
+
+/* Identify a rules file by name and, as long as it exists, by its last
+ * change. */
+uint64_t
+coc_file_stamp (uint64_t h, const char *path)
+{
+  struct stat st;
+
+  h = coc_bloom_mix (h ^ coc_bloom_hash_str (path != NULL ? path : ""));
+
+  if (path != NULL && stat (path, &st) == 0)
+    {
+      h = coc_bloom_mix (h ^ (uint64_t) st.st_dev);
+      h = coc_bloom_mix (h ^ (uint64_t) st.st_ino);
+      h = coc_bloom_mix (h ^ (uint64_t) st.st_size);
+      h = coc_bloom_mix (h ^ (uint64_t) st.st_mtime);
+    }
+
+  return h;
+}
+
+/* Identifies the rules given in the environment, to tell whether a
+ * rules database was compiled from them. Never 0. */
+uint64_t
+coc_rules_source (const char *block, const char *allow,
+		  const char *block_file, const char *allow_file)
+{
+  uint64_t h = coc_bloom_hash_str (block != NULL ? block : "");
+
+  h = coc_bloom_mix (h ^ coc_bloom_hash_str (allow != NULL ? allow : ""));
+  h = coc_file_stamp (h, block_file);
+  h = coc_file_stamp (h, allow_file);
+  return h != 0 ? h : 1;
+}
@@ -0,0 +1,286 @@
+/* coc-stats -- counters shared with coc stats.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "connect-or-cut.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Counters of a process are published in a file of /dev/shm named by
+ * its pid, read by `coc stats'. They are sharded: each thread counts
+ * in one of COC_STATS_SHARDS cache lines, handed out in turn, so that
+ * threads do not contend for the same line unless there are more of
+ * them than shards. Readers sum the shards up.
+ *
+ * Hits of the first COC_STATS_RULES rules are counted per rank, also
+ * per shard, and those of later rules all together. The file is
+ * removed when the process exits. Children make their own, and
+ * programs executed keep counting in that of the process, told from
+ * one of a former process with the same pid by its start time.
+ *
+ * Counters are 64-bit words in host order, after a header of as many:
+ *
+ *   magic, version, pid, shards, counters per shard, rules, start, 0
+ *   counters of shard 0 .. shards - 1
+ *   rule hits of shard 0 .. shards - 1
+ */
+
+#define COC_STATS_MAGIC "COCSTATS"
+#define COC_STATS_VERSION 1
+#define COC_STATS_DIR "/dev/shm"
+
+typedef struct coc_stats_header {
+  char magic[8];
+  uint64_t version;
+  uint64_t pid;
+  uint64_t shards;
+  uint64_t counters;
+  uint64_t rules;
+  uint64_t start;		/* of the process, in clock ticks since boot. */
+  uint64_t pad;
+} coc_stats_header_t;
+
+typedef struct coc_stats_shard {
+  uint64_t c[COC_STATS];
+} coc_stats_shard_t;
+
+typedef struct coc_stats_segment {
+  coc_stats_header_t h;
+  coc_stats_shard_t shards[COC_STATS_SHARDS];
+  uint64_t rules[COC_STATS_SHARDS][COC_STATS_RULES];
+} coc_stats_segment_t;
+
+static coc_stats_segment_t *segment = NULL;
+static char path[sizeof (COC_STATS_DIR "/coc-stats.") + 20];
+static uint64_t next_shard = 0;
+static COC_THREAD_LOCAL uint32_t shard = 0;	/* 1 + index, 0 if none. */
+
+/* Start time of the process, which exec keeps, or 0 if unknown. */
+static uint64_t
+coc_stats_start_time (void)
+{
+  char buf[1024];
+  int fd = open ("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+  ssize_t n;
+
+  if (fd < 0)
+    {
+      return 0;
+    }
+
+  n = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+
+  if (n <= 0)
+    {
+      return 0;
+    }
+
+  buf[n] = '\0';
+
+  /* Field 22, counting from the state after the command name. */
+  char *p = strrchr (buf, ')');
+  int field;
+
+  for (field = 2; p != NULL && field < 22; field++)
+    {
+      p = strchr (p + 1, ' ');
+    }
+
+  return p != NULL ? strtoull (p + 1, NULL, 10) : 0;
+}
+
+static bool
+coc_stats_map (void)
+{
+  coc_stats_header_t h;
+  uint64_t pid = (uint64_t) getpid ();
+  uint64_t start = coc_stats_start_time ();
+  struct stat st;
+  int fd;
+
+  snprintf (path, sizeof (path), COC_STATS_DIR "/coc-stats.%lu",
+	    (unsigned long) pid);
+  fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if (fd < 0)
+    {
+      return false;
+    }
+
+  /* Counters of the process before it executed this program. */
+  bool keep = start != 0 && fstat (fd, &st) == 0 &&
+    st.st_size == sizeof (*segment) &&
+    pread (fd, &h, sizeof (h), 0) == sizeof (h) &&
+    memcmp (h.magic, COC_STATS_MAGIC, sizeof (h.magic)) == 0 &&
+    h.version == COC_STATS_VERSION && h.pid == pid && h.start == start;
+
+  if (!keep && (ftruncate (fd, 0) < 0 ||
+		ftruncate (fd, sizeof (*segment)) < 0))
+    {
+      close (fd);
+      unlink (path);
+      return false;
+    }
+
+  void *map = mmap (NULL, sizeof (*segment), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    {
+      unlink (path);
+      return false;
+    }
+
+  segment = (coc_stats_segment_t *) map;
+
+  if (keep)
+    {
+      return true;
+    }
+
+  segment->h.version = COC_STATS_VERSION;
+  segment->h.pid = (uint64_t) getpid ();
+  segment->h.shards = COC_STATS_SHARDS;
+  segment->h.counters = COC_STATS;
+  segment->h.rules = COC_STATS_RULES;
+  segment->h.start = start;
+
+  /* Readers check the magic last. */
+  coc_fence_release ();
+  memcpy (segment->h.magic, COC_STATS_MAGIC, sizeof (segment->h.magic));
+  return true;
+}
+
+/* The segment of the parent is not for children to count in. */
+static void
+coc_stats_forked (void)
+{
+  if (segment != NULL)
+    {
+      munmap (segment, sizeof (*segment));
+      segment = NULL;
+      coc_stats_map ();
+    }
+}
+
+/* Publish counters of this process. Returns false if they cannot be. */
+bool
+coc_stats_open (void)
+{
+  if (!coc_stats_map ())
+    {
+      return false;
+    }
+
+  pthread_atfork (NULL, NULL, coc_stats_forked);
+  return true;
+}
+
+/* Remove the counters, as the process exits. */
+void
+coc_stats_close (void)
+{
+  if (segment != NULL)
+    {
+      unlink (path);
+    }
+}
+
+static inline uint32_t
+coc_stats_shard (void)
+{
+  if (shard == 0)
+    {
+      shard = (uint32_t) (coc_fetch_add (&next_shard, 1) %
+			  COC_STATS_SHARDS) + 1;
+    }
+
+  return shard - 1;
+}
+
+void
+coc_stats_add (coc_stat_t stat, uint64_t n)
+{
+  if (segment != NULL)
+    {
+      coc_fetch_add (&segment->shards[coc_stats_shard ()].c[stat], n);
+    }
+}
+
+/* Count a hit of the rule of rank `rank'. */
+void
+coc_stats_rule (uint32_t rank)
+{
+  if (segment == NULL)
+    {
+      return;
+    }
+
+  if (rank < COC_STATS_RULES)
+    {
+      coc_fetch_add (&segment->rules[coc_stats_shard ()][rank], 1);
+    }
+  else
+    {
+      coc_stats_add (COC_STAT_OTHER_RULES, 1);
+    }
+}
+#else
+bool
+coc_stats_open (void)
+{
+  return false;
+}
+
+void
+coc_stats_close (void)
+{
+}
+
+void
+coc_stats_add (coc_stat_t stat, uint64_t n)
+{
+}
+
+void
+coc_stats_rule (uint32_t rank)
+{
+}
+#endif
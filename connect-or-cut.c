@@ -32,169 +32,48 @@
  * SUCH DAMAGE.
  */
 
-#define _GNU_SOURCE
+#include "connect-or-cut.h"
 
-#ifndef _WIN32
-#include <arpa/inet.h>
-#include <dlfcn.h>
-#include <fnmatch.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <pthread.h>
-#include <resolv.h>
-#include <sys/queue.h>
-#include <sys/socket.h>
-#include <syslog.h>
-#define SOCKET int
-#define HOOK(fn) fn
-#define WSAAPI /* nothing */
-#else
-#define _CRT_SECURE_NO_WARNINGS
-#include <SDKDDKVer.h>
-#define WIN32_LEAN_AND_MEAN
-#ifdef COC_EXPORTS
-#define COC_API __declspec(dllexport)
-#else
-#define COC_API __declspec(dllimport)
-#endif
-#define HOOK(fn) COC_API __stdcall hook_##fn
-#include <windows.h>
-#include <WinSock2.h>
-#include <Ws2tcpip.h>
-#include <Shlwapi.h>
-#include <iphlpapi.h>
-#include "sys_queue.h"
-#include "MinHook.h"
-#pragma comment(lib, "Ws2_32.lib")
-#pragma comment(lib, "shlwapi.lib")
-#pragma comment(lib, "IPHLPAPI.lib")
-#ifdef _M_X64
-#pragma comment(lib, "libMinHook-x64-v140-mtd.lib")
-#elif defined _M_IX86
-#pragma comment(lib, "libMinHook-x86-v140-mtd.lib")
-#endif
-extern BOOL LoadCoCLibrary(HANDLE);
-#endif
-
-#include <assert.h>
-#include <ctype.h>
-#include <errno.h>
-#include <limits.h>
-#include <stdarg.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <sys/types.h>
-#include <time.h>
-
-#ifdef _WIN32
-typedef uint16_t in_port_t;
-#define MISSING_STRNDUP
-#define MAXNS 30
-#define LOG_ERR 3
-#define LOG_WARNING 4
-#define LOG_INFO 6
-#define LOG_DEBUG 7
-#define vsyslog(l,f,a) /* Not supported */
-#define pthread_testcancel() /* Not supported */
-#define localtime_r(ti,tm) localtime_s(tm, ti)
-#define fnmatch(p,s,f) (!PathMatchSpecA(s,p))
-#endif
-
-#if defined(__APPLE__) && defined(__MACH__)
-#include <AvailabilityMacros.h>
-#if __MAC_OS_X_VERSION_MAX_ALLOWED < 1070
-#define MISSING_STRNDUP
-#endif
-#endif
-
-#ifdef __SunOS_5_11
-#undef MISSING_STRNDUP
-#endif
-
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-#include <sys/param.h>
-#if defined(BSD)
-#define HAVE_GETPROGNAME
-#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
 #endif
-
-#if (defined(sun) || defined(__sun)) && (defined(__SVR4) || defined(__svr4__))
-#define HAVE_GETEXECNAME
-#include <libgen.h>
+#ifndef _WIN32
+#include <unistd.h>
 #endif
 
-typedef enum coc_address_type
-{
-  COC_IPV4_ADDR = 1 << 0,	/* 1 */
-  COC_IPV6_ADDR = 1 << 1,	/* 2 */
-  COC_GLOB_ADDR = 1 << 2	/* 4 */
-} coc_address_type_t;
-
-#define COC_HOST_ADDR (1 << 3)  /* 8 */
-
-typedef enum coc_log_level
-{
-  COC_SILENT_LOG_LEVEL = -1,	/* mapped from 0. */
-  COC_ERROR_LOG_LEVEL = LOG_ERR,	/* mapped from 1 (to 3). */
-  COC_BLOCK_LOG_LEVEL = LOG_WARNING,	/* mapped from 2 (to 4). */
-  COC_ALLOW_LOG_LEVEL = LOG_INFO,	/* mapped from 3 (to 6). */
-  COC_DEBUG_LOG_LEVEL = LOG_DEBUG	/* mapped from 4 (to 7). */
-} coc_log_level_t;
-
-typedef enum coc_log_target
-{
-  COC_STDERR_LOG = 1 << 0,	/* 1 */
-  COC_SYSLOG_LOG = 1 << 1,	/* 2 */
-  COC_FILE_LOG = 1 << 2		/* 4 */
-} coc_log_target_t;
-
-typedef enum coc_rule_type
-{
-  COC_ALLOW = 0,
-  COC_BLOCK = 1
-} coc_rule_type_t;
-
-static const char *rule_type_name[] = {
-  "ALLOW",
-  "BLOCK"
-};
-
-static const char *address_type_name[] = {
-  [COC_IPV4_ADDR] = "IPv4",
-  [COC_IPV6_ADDR] = "IPv6",
-  [COC_GLOB_ADDR] = "glob",
-  [COC_HOST_ADDR] = "host"
-};
-
-typedef struct coc_entry {
-  union {
-    struct in_addr ipv4;
-    struct in6_addr ipv6;
-    char *glob;
-  } addr;
-  in_port_t port;
-  coc_address_type_t addr_type;
-  coc_rule_type_t rule_type;
-  SLIST_ENTRY(coc_entry) entries;
-} coc_entry_t;
-
-static inline
-coc_entry_t *
-coc_entry_alloc (void)
-{
-  return (coc_entry_t *) malloc (sizeof(coc_entry_t));
-}
-
-SLIST_HEAD(coc_list, coc_entry) coc_list_head = { NULL };
 
 #define COC_ALLOW_ENV_VAR_NAME "COC_ALLOW"
 #define COC_BLOCK_ENV_VAR_NAME "COC_BLOCK"
+#define COC_ALLOW_FILE_ENV_VAR_NAME "COC_ALLOW_FILE"
+#define COC_BLOCK_FILE_ENV_VAR_NAME "COC_BLOCK_FILE"
 #define COC_LOG_LEVEL_ENV_VAR_NAME "COC_LOG_LEVEL"
 #define COC_LOG_PATH_ENV_VAR_NAME "COC_LOG_PATH"
 #define COC_LOG_TARGET_ENV_VAR_NAME "COC_LOG_TARGET"
+#define COC_DFA_MAX_SIZE_ENV_VAR_NAME "COC_DFA_MAX_SIZE"
+#define COC_CACHE_SIZE_ENV_VAR_NAME "COC_CACHE_SIZE"
+#define COC_RULES_DB_ENV_VAR_NAME "COC_RULES_DB"
+#define COC_RDNS_CACHE_SIZE_ENV_VAR_NAME "COC_RDNS_CACHE_SIZE"
+#define COC_RDNS_TTL_ENV_VAR_NAME "COC_RDNS_TTL"
+#define COC_RDNS_NEGATIVE_TTL_ENV_VAR_NAME "COC_RDNS_NEGATIVE_TTL"
+#define COC_DNS_CACHE_SIZE_ENV_VAR_NAME "COC_DNS_CACHE_SIZE"
+#define COC_DNS_TTL_ENV_VAR_NAME "COC_DNS_TTL"
+#define COC_RDNS_TIMEOUT_MS_ENV_VAR_NAME "COC_RDNS_TIMEOUT_MS"
+#define COC_RDNS_TIMEOUT_VERDICT_ENV_VAR_NAME "COC_RDNS_TIMEOUT_VERDICT"
+#define COC_BLOOM_FP_RATE_ENV_VAR_NAME "COC_BLOOM_FP_RATE"
+#define COC_LAZY_ENV_VAR_NAME "COC_LAZY"
+#define COC_HOST_CACHE_ENV_VAR_NAME "COC_HOST_CACHE"
+#define COC_HOST_CACHE_TTL_ENV_VAR_NAME "COC_HOST_CACHE_TTL"
+#define COC_RESOLVE_TIMEOUT_MS_ENV_VAR_NAME "COC_RESOLVE_TIMEOUT_MS"
+#define COC_RELOAD_ENV_VAR_NAME "COC_RELOAD"
+#define COC_LOG_ASYNC_ENV_VAR_NAME "COC_LOG_ASYNC"
+#define COC_EVENT_LOG_ENV_VAR_NAME "COC_EVENT_LOG"
+#define COC_LOG_REPEAT_MS_ENV_VAR_NAME "COC_LOG_REPEAT_MS"
+#define COC_LOG_SAMPLE_ENV_VAR_NAME "COC_LOG_SAMPLE"
+#define COC_STATS_ENV_VAR_NAME "COC_STATS"
+#define COC_LATENCY_ENV_VAR_NAME "COC_LATENCY"
+#define COC_LATENCY_SIGNAL_ENV_VAR_NAME "COC_LATENCY_SIGNAL"
+#define COC_RUNTIME_DIR_ENV_VAR_NAME "XDG_RUNTIME_DIR"
 #if defined(__APPLE__) && defined(__MACH__)
 #define COC_PRELOAD_ENV_VAR_NAME "DYLD_INSERT_LIBRARIES"
 #else
@@ -230,22 +109,82 @@ getprogname ()
 
 static const char version[] = "connect-or-cut v1.0.4";
 static volatile bool initialized = false;
+static bool lazy_init = false;
+static bool reload_rules = false;
+static bool rules_ready = false;
 static bool needs_dns_lookup = false;
+static coc_ruleset_t *coc_ruleset = NULL;
+static uint64_t coc_generation = 0;
+static coc_cache_t coc_cache;
+static size_t cache_size = COC_CACHE_SIZE;
+static coc_name_cache_t coc_rdns_cache;
+static size_t rdns_cache_size = COC_RDNS_CACHE_SIZE;
+static uint64_t rdns_ttl = COC_RDNS_TTL;
+static uint64_t rdns_negative_ttl = COC_RDNS_NEGATIVE_TTL;
+static coc_name_cache_t coc_dns_cache;
+static size_t dns_cache_size = COC_DNS_CACHE_SIZE;
+static uint64_t dns_ttl = COC_DNS_TTL;
+static coc_resolver_t resolvers[MAXNS];
+static size_t resolver_count = 0;
+static coc_name_cache_t coc_hosts;
+static coc_flights_t coc_flights;
+static uint64_t rdns_timeout_ms = COC_RDNS_TIMEOUT_MS;
+static int rdns_timeout_verdict = COC_NO_RULE;
+static size_t dfa_max_size = COC_DFA_MAX_SIZE;
+static unsigned long bloom_fp_rate = COC_BLOOM_FP_RATE;
+static uint64_t host_cache_ttl = COC_HOST_CACHE_TTL;
+static uint64_t resolve_timeout_ms = COC_RESOLVE_TIMEOUT_MS;
 static coc_log_level_t log_level = COC_BLOCK_LOG_LEVEL;
 static coc_log_target_t log_target = COC_STDERR_LOG;
 static char *log_file_name = NULL;
+static bool log_async = false;
+static bool event_log = false;
+static bool stats = false;
+static bool latency = false;
+static COC_THREAD_LOCAL uint64_t rdns_ns;	/* of the current connect. */
+
+/* Probes whose arguments are only computed when traced. */
+COC_PROBE_SEMAPHORE (init__return);
+COC_PROBE_SEMAPHORE (connect__entry);
+COC_PROBE_SEMAPHORE (connect__return);
+COC_PROBE_SEMAPHORE (rule__match);
+COC_PROBE_SEMAPHORE (ruleset__match);
+COC_PROBE_SEMAPHORE (rdns__entry);
+COC_PROBE_SEMAPHORE (rdns__return);
+static unsigned long log_sample = 1;
+static COC_THREAD_LOCAL unsigned long log_sampled = 0;
+
+static inline bool
+coc_log_enabled (coc_log_level_t level)
+{
+  return log_level >= level;
+}
 
-#ifdef __GNUC__
-static void
-coc_log (coc_log_level_t level, const char *format, ...)
-__attribute__ ((__format__ (__printf__, 2, 3)));
-#endif
+/* Whether this ALLOW record is the one in `log_sample' to log. */
+static inline bool
+coc_log_sampled (void)
+{
+  return log_sample == 1 || ++log_sampled % log_sample == 0;
+}
 
-static void
+void
 coc_log (coc_log_level_t level, const char *format, ...)
 {
   if (log_level >= level)
     {
+      if (log_async)
+	{
+	  va_list ap;
+	  va_start (ap, format);
+	  bool queued = coc_log_async (level, format, ap);
+	  va_end (ap);
+
+	  if (queued)
+	    {
+	      return;
+	    }
+	}
+
       struct tm now_tm;
       time_t now;
       char buffer[sizeof ("YYYY-MM-DDTHH:MM:SS ")];
@@ -305,800 +244,1056 @@ coc_log (coc_log_level_t level, const char *format, ...)
     }
 }
 
-#define DIE(...) do { \
-    coc_log (COC_ERROR_LOG_LEVEL,"ERROR " __VA_ARGS__); \
-    exit (EXIT_FAILURE); \
-  } while (0)
-
-#ifdef MISSING_STRNDUP
-static inline char *
-strndup (const char *s, size_t n)
+static long
+coc_long_value (const char *name, const char *value, long lower_bound,
+		long upper_bound)
 {
-  size_t len = strlen (s);
-
-  if (len > n)
+  char *endptr;
+  errno = 0;
+  long v = strtol (value, &endptr, 10);
+  if ((errno == ERANGE && (v == LONG_MAX || v == LONG_MIN)) ||
+      (errno != 0 && value == 0L) ||
+      *endptr != '\0' || (v < lower_bound || v > upper_bound))
     {
-      len = n;
+      DIE ("`%s' not valid for %s (should be between `%ld' and `%ld')\n",
+	   value, name, lower_bound, upper_bound);
     }
 
-  char *ns = (char *) malloc (len + 1);
+  return v;
+}
 
-  if (ns != NULL)
-    {
-      ns[len] = '\0';
-      memcpy (ns, s, len);
-    }
 
-  return ns;
-}
-#endif
+/* The real connect function. WARNING: cancellation point. */
+static int (WSAAPI *real_connect) (SOCKET fd, const struct sockaddr * addr,
+			    socklen_t addrlen);
 
-static int
-coc_rule_add (const char *str, size_t len, size_t rule_type)
+/* Read the DNS servers into `out'. Returns NULL, or why none could be
+ * read, leaving `*index' at 0. */
+static const char *
+coc_read_resolv (coc_resolver_t * out, size_t * index)
 {
-  int type = COC_IPV4_ADDR | COC_IPV6_ADDR | COC_GLOB_ADDR | COC_HOST_ADDR;
-  const char *p = str;
-  const char *service = NULL;
-  enum
-  {
-    IPV6_SB_NONE,
-    IPV6_SB_OPEN,
-    IPV6_SB_CLOSE
-  } sb = IPV6_SB_NONE;
-  size_t colon_count = 0;
-  size_t ipv4_segment = 1;
-  uint16_t segment = 0;		/* IPv4 or IPv6 */
+	const char *error = NULL;
+
+	*index = 0;
+
+#ifndef _WIN32
+#define NS "nameserver "
+
+  char buffer[1024];
+  FILE *resolv = fopen ("/etc/resolv.conf", "r");
 
-  while (p < str + len)
+  if (!resolv)
     {
-      unsigned char c = *p;
+      return "/etc/resolv.conf cannot be read";
+    }
 
-      /* `*' allowed only for glob. Let's go on to check for errors. */
-      if (c == '*')
-	{
-	  /* `*' not allowed if only remaining choices are IPv4 or IPv6. */
-	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)))
-	    {
-	      DIE ("`*' not allowed for IPv4 or IPv6, aborting\n");
-	    }
-	  else
-	    {
-	      type = COC_GLOB_ADDR;
-	    }
-	}
+  while (error == NULL && fgets(buffer, sizeof(buffer), resolv) &&
+	 *index < MAXNS)
+  {
+	  if (!strncmp(buffer, NS, sizeof(NS) - 1))
+	  {
+		  char *ns = buffer + sizeof(NS) - 1;
+		  size_t len = strlen(ns);
 
-      /* `[' allowed only at beginning of address for IPv6. */
-      else if (c == '[')
-	{
-	  if (p == str)
-	    {
-	      type = COC_IPV6_ADDR;
-	      sb = IPV6_SB_OPEN;
-	    }
-	  else
-	    {
-	      DIE ("`[' allowed only once for IPv6, aborting\n");
-	    }
-	}
+		  if (ns[len - 1] == '\n')
+		  {
+			  ns[len - 1] = '\0';
+		  }
 
-      else if (c == ']')
-	{
-	  if (type == COC_IPV6_ADDR && sb == IPV6_SB_OPEN)
-	    {
-	      sb = IPV6_SB_CLOSE;
-	    }
-	  else
-	    {
-	      DIE ("`]' unexpected, aborting\n");
-	    }
-	}
+		  coc_log(COC_DEBUG_LOG_LEVEL, "DEBUG Found nameserver: %s\n", ns);
 
-      else if (c == ':')
-	{
-	  /* IPv6 uses `:' as a segment separator. So we count them.
-	   * Validation for IPv6 is done later with inet_pton. */
-	  colon_count++;
-	  /* Assume `:' precedes port. We will check if not empty later. */
-	  service = p + 1;
+		  if (inet_pton(AF_INET, ns, &out[*index].addr.ipv4) == 1)
+		  {
+			  out[(*index)++].isv6 = false;
+		  }
+		  else if (inet_pton(AF_INET6, ns, &out[*index].addr.ipv6) == 1)
+		  {
+			  out[(*index)++].isv6 = true;
+		  }
+		  else
+		  {
+			  error = "invalid nameserver in /etc/resolv.conf";
+		  }
+	  }
+  }
 
-	  if (colon_count > 1)
-	    {
-	      if ((type & COC_IPV6_ADDR) == COC_IPV6_ADDR)
-		{
-		  type = COC_IPV6_ADDR;
-		}
+  fclose(resolv);
 
-	      if (type != COC_IPV6_ADDR ||
-		  ((sb == IPV6_SB_OPEN && colon_count > 7) ||
-		   colon_count > 8))
-		{
-		  DIE ("Extra `:' unexpected, aborting\n");
-		}
+#else
+	/* We rely on GetAdaptersAddresses:
+	 *   https://msdn.microsoft.com/en-us/library/windows/desktop/aa365915(v=vs.85).aspx
+	 * to retrieve IPv4 and IPv6 DNS server addresses.
+	 */
+	DWORD dwRetVal = 0;
 
-	      if (colon_count == 8 || sb == IPV6_SB_CLOSE)
-		{
-		  break;
-		}
-	      else
-		{
-		  service = NULL;
-		}
-	    }
+	// Set the flags to pass to GetAdaptersAddresses
+	ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_UNICAST;
 
-	  else
-	    {
-	      /* If so far IPv4 was still a valid choice, then it is it now. */
-	      if (p != str && ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR))
-		{
-		  type = COC_IPV4_ADDR;
+	LPVOID lpMsgBuf = NULL;
 
-		  if (ipv4_segment == 4)
-		    {
-		      break;
-		    }
-		}
-	    }
-	}
+	PIP_ADAPTER_ADDRESSES pAddresses = NULL;
+	ULONG outBufLen = 0;
+	ULONG iterations = 0;
 
-      /* We can see dots for IPv4, glob, or hostnames.  We can rule
-       * out IPv4 when we have a segment that does not fit what is
-       * expected (e.g. higher than 255).
-       */
-      else if (c == '.')
-	{
-	  if (type == COC_IPV6_ADDR)
-	    {
-	      DIE ("`.' not allowed for IPv6, aborting\n");
-	    }
+	PIP_ADAPTER_ADDRESSES pCurrAddresses = NULL;
+	IP_ADAPTER_DNS_SERVER_ADDRESS *pDnServer = NULL;
 
-	  type &= ~COC_IPV6_ADDR;
+#define WORKING_BUFFER_SIZE 15000
+#define MAX_TRIES 3
 
-	  segment = 0;
-	  ipv4_segment++;
+	// Allocate a 15 KB buffer to start with.
+	outBufLen = WORKING_BUFFER_SIZE;
 
-	  if (ipv4_segment > 4)
-	    {
-	      if (type == COC_IPV4_ADDR)	/* not possible for now. */
-		{
-		  DIE ("Extra `.' unexpected, aborting\n");
-		}
-	      else
+	do {
+		pAddresses = (IP_ADAPTER_ADDRESSES *) malloc (outBufLen);
+		if (pAddresses == NULL)
 		{
-		  type &= ~COC_IPV4_ADDR;
+			return "cannot allocate IP_ADAPTER_ADDRESSES";
 		}
-	    }
-	}
 
-      else if (isdigit (c))
-	{
-	  if ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR)
-	    {
-	      /* INT30-C */
-	      if ((segment > UINT16_MAX / 10) ||
-		  (UINT16_MAX - (c - '0') < segment * 10))
+		dwRetVal = GetAdaptersAddresses (AF_UNSPEC, flags, NULL, pAddresses, &outBufLen);
+
+		if (dwRetVal == ERROR_BUFFER_OVERFLOW)
 		{
-		  DIE ("Invalid IPv4 segment, aborting\n");
+			free (pAddresses);
+			pAddresses = NULL;
 		}
-	      else
+		else
 		{
-		  segment = segment * 10 + (c - '0');
+			break;
 		}
 
-	      if (segment > 255)
-		{
-		  if (type == COC_IPV4_ADDR)	/* not possible */
-		    {
-		      DIE ("Invalid IPv4 address, aborting\n");
-		    }
-		  else
-		    {
-		      coc_log (COC_DEBUG_LOG_LEVEL,
-			       "DEBUG %hd... is not an IPv4 segment\n",
-			       segment);
-		      type &= ~COC_IPV4_ADDR;
-		    }
-		}
-	    }
-	}
+		iterations++;
 
-      else if (isxdigit (c))	/* and not a digit */
-	{
-	  if (type == COC_IPV4_ADDR)	/* not possible */
-	    {
-	      DIE ("Invalid IPv4 address, aborting\n");
-	    }
-	  else
-	    {
-	      type &= ~COC_IPV4_ADDR;
-	    }
-	}
+	} while ((dwRetVal == ERROR_BUFFER_OVERFLOW) && (iterations < MAX_TRIES));
 
-      else if (isalnum (c))	/* not a digit nor an xdigit */
-	{
-	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)))
-	    {
-	      DIE ("`%c' unexpected, aborting\n", c);
-	    }
-	  else
-	    {
-	      type &= ~(COC_IPV4_ADDR | COC_IPV6_ADDR);
-	    }
-	}
+	if (dwRetVal == NO_ERROR) {
+		// If successful, output some information from the data we received
+		pCurrAddresses = pAddresses;
 
-      else if (c == '-' || c == '_')
-	{
-	  if (!(type & ~(COC_IPV4_ADDR | COC_IPV6_ADDR)) || p == str)
-	    {
-	      DIE ("`%c' unexpected, aborting\n", c);
-	    }
-	  else
-	    {
-	      type &= ~(COC_IPV4_ADDR | COC_IPV6_ADDR);
-	    }
+		while (pCurrAddresses) {
+			pDnServer = pCurrAddresses->FirstDnsServerAddress;
+
+			while (pDnServer && *index < MAXNS) {
+				ADDRESS_FAMILY family = pDnServer->Address.lpSockaddr->sa_family;
+
+				if (family == AF_INET6)
+				{
+					out[*index].addr.ipv6 = ((struct sockaddr_in6 *) pDnServer->Address.lpSockaddr)->sin6_addr;
+					out[*index].isv6 = true;
+				}
+				else if (family == AF_INET)
+				{
+					out[*index].addr.ipv4 = ((struct sockaddr_in *) pDnServer->Address.lpSockaddr)->sin_addr;
+					out[*index].isv6 = false;
+				}
+
+				(*index)++;
+				pDnServer = pDnServer->Next;
+			}
+
+			pCurrAddresses = pCurrAddresses->Next;
+		}
+	}
+	else {
+		if (dwRetVal == ERROR_NO_DATA)
+			error = "no DNS server found";
+		else {
+			if (FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+				FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+				NULL, dwRetVal, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+				(LPTSTR)&lpMsgBuf, 0, NULL)) {
+				coc_log(COC_ERROR_LOG_LEVEL, "ERROR %s\n", lpMsgBuf);
+				LocalFree(lpMsgBuf);
+			}
+			error = "GetAdaptersAddresses failed";
+		}
+		free (pAddresses);
 	}
+#endif
 
-      else
+	if (error != NULL)
 	{
-	  /* We may revisit this later for UTF-8 */
-	  DIE ("`%c' unexpected here, aborting\n", c);
+		*index = 0;
 	}
 
-      p++;
-    }
+	return error;
+}
 
-  /* If so far IPv4 was still a valid choice, then it is it now. */
-  if ((type & COC_IPV4_ADDR) == COC_IPV4_ADDR)
-    {
-      type = COC_IPV4_ADDR;
-    }
-
-  /* If so far host was still a valid choice, then it is it now. */
-  else if ((type & COC_HOST_ADDR) == COC_HOST_ADDR)
-    {
-      type = COC_HOST_ADDR;
-    }
+const char *
+coc_version (void)
+{
+  return version;
+}
 
-  if (type == COC_IPV6_ADDR && sb == IPV6_SB_OPEN)
-    {
-      DIE ("`]' missing, aborting\n");
-    }
+/* Verdict cache hits and misses since the library was loaded. */
+void
+coc_cache_stats (uint64_t *hits, uint64_t *misses)
+{
+  coc_cache_counts (&coc_cache, hits, misses);
+}
 
-  assert (type == COC_IPV4_ADDR ||
-	  type == COC_IPV6_ADDR ||
-	  type == COC_HOST_ADDR || type == COC_GLOB_ADDR);
+/* Reverse DNS lookups made, and saved by waiting for a concurrent one
+ * for the same address, since the library was loaded. */
+void
+coc_rdns_stats (uint64_t *lookups, uint64_t *coalesced)
+{
+  coc_mutex_lock (&coc_flights.lock);
+  *lookups = coc_flights.lookups;
+  *coalesced = coc_flights.coalesced;
+  coc_mutex_unlock (&coc_flights.lock);
+}
 
-  in_port_t port = 0;
-  /* If we have a port here, check if everything after that port is valid. */
-  if (service != NULL)
-    {
-      const char *t = service;
-      bool getservbyname_needed = false;
+#ifdef _WIN32
 
-      if (t == str + len)
-	{
-	  DIE ("No port specified after `:', aborting\n");
-	}
+int HOOK(connect(SOCKET fd, const struct sockaddr *addr, socklen_t addrlen));
+void coc_init(void);
+void coc_fini(void);
+BOOL(WINAPI *real_CreateProcess) (LPCTSTR lpApplicationName,
+	LPTSTR lpCommandLine,
+	LPSECURITY_ATTRIBUTES lpProcessAttributes,
+	LPSECURITY_ATTRIBUTES lpThreadAttributes,
+	BOOL bInheritHandles,
+	DWORD dwCreationFlags,
+	LPVOID lpEnvironment,
+	LPCTSTR lpCurrentDirectory,
+	LPSTARTUPINFO lpStartupInfo,
+	LPPROCESS_INFORMATION lpProcessInformation);
+BOOL HOOK(CreateProcess(
+	LPCTSTR lpApplicationName,
+	LPTSTR lpCommandLine,
+	LPSECURITY_ATTRIBUTES lpProcessAttributes,
+	LPSECURITY_ATTRIBUTES lpThreadAttributes,
+	BOOL bInheritHandles,
+	DWORD dwCreationFlags,
+	LPVOID lpEnvironment,
+	LPCTSTR lpCurrentDirectory,
+	LPSTARTUPINFO lpStartupInfo,
+	LPPROCESS_INFORMATION lpProcessInformation))
+{
+	// Make sure to start the process in a suspended state, then inject
+	// ourselves
+	bool resume = !(((dwCreationFlags & CREATE_SUSPENDED) == CREATE_SUSPENDED));
+	dwCreationFlags |= CREATE_SUSPENDED;
+	BOOL status = real_CreateProcess(
+		lpApplicationName, lpCommandLine,
+		lpProcessAttributes, lpThreadAttributes,
+		bInheritHandles, dwCreationFlags,
+		lpEnvironment, lpCurrentDirectory,
+		lpStartupInfo, lpProcessInformation);
 
-      while (t < str + len)
+	if (status)
 	{
-	  unsigned char u = *t;
-
-	  if (isdigit (u))
-	    {
-	      /* INT30-C */
-	      if ((port > UINT16_MAX / 10) ||
-		  (UINT16_MAX - (u - '0') < port * 10))
+		if (!LoadCoCLibrary(lpProcessInformation->hProcess))
 		{
-		  DIE ("Invalid port number, aborting\n");
+			// Injection failed. Let's report it and continue.
+			coc_log(COC_ERROR_LOG_LEVEL, "Failed to inject connect-or-cut into new process: %zu", GetLastError());
 		}
-	      else
+
+		if (resume)
 		{
-		  port = port * 10 + (u - '0');
+			ResumeThread(lpProcessInformation->hThread);
 		}
-	    }
+	}
 
-	  else if (isalnum (u) || u == '-')
-	    {
-	      getservbyname_needed = true;
-	    }
+	return status;
+}
 
-	  else
-	    {
-	      DIE ("`%c' unexpected for port, aborting\n", u);
-	    }
+#endif
 
-	  t++;
-	}
+#ifdef COC_BENCH
+/* Benchmarks measure decisions, not the network. */
+static int
+coc_bench_connect (int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  (void) fd;
+  (void) addr;
+  (void) addrlen;
+  return 0;
+}
+#endif
+
+static inline void
+coc_sym_connect (void)
+{
+  if (real_connect == NULL)
+    {
+#ifdef _WIN32
+	  if (MH_Initialize() != MH_OK)
+	  {
+		  DIE("Cannot initialize MinHook, aborting\n");
+	  }
+
+	  if (MH_CreateHookApiEx(L"ws2_32", "connect", &hook_connect, (LPVOID *) &real_connect, NULL) != MH_OK)
+	  {
+		  DIE("Cannot hook connect(), aborting\n");
+	  }
 
-      if (getservbyname_needed)
+	  /* TODO: add WSAConnect, ConnectEx */
+	  if (MH_CreateHook(&CreateProcess, &hook_CreateProcess, (LPVOID *) &real_CreateProcess) != MH_OK)
+	  {
+		  DIE("Cannot hook CreateProcess, aborting\n");
+	  }
+
+	  if (MH_EnableHook(MH_ALL_HOOKS) != MH_OK)
+	  {
+		  DIE("Cannot enable hooks, aborting\n");
+	  }
+#elif defined(COC_BENCH)
+      real_connect = coc_bench_connect;
+#else
+      real_connect =
+	(int (*)(int, const struct sockaddr *, socklen_t)) dlsym (RTLD_NEXT,
+								  "connect");
+
+      if (real_connect == NULL)
 	{
-	  char *svc = strndup (service, len - (service - str));
-	  struct servent *svt = getservbyname (svc, "tcp");
+	  char *error = dlerror ();
 
-	  if (svt != NULL)
-	    {
-	      port = ntohs (svt->s_port);
-	      free (svc);
-	    }
-	  else
+	  if (error == NULL)
 	    {
-	      fprintf (stderr, "service `%s' not found, aborting\n", svc);
-	      free (svc);
-	      exit (EXIT_FAILURE);
+	      error = "connect is NULL";
 	    }
-	}
 
-      if (port == 0)
-	{
-	  DIE ("`0' not allowed for port, aborting\n");
+	  DIE ("%s\n", error);
 	}
+#endif
     }
+}
 
-  char *host = NULL;
-  size_t skip_last = 1;
+int
+coc_real_connect (SOCKET fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  return real_connect (fd, addr, addrlen);
+}
 
-  if (sb == IPV6_SB_CLOSE)
-    {
-      str++;
-      len--;
-      skip_last = 2;
-    }
+#ifdef _WIN32
+BOOL APIENTRY DllMain(HMODULE hModule,
+	DWORD  ul_reason_for_call,
+	LPVOID lpReserved
+)
+{
+	switch (ul_reason_for_call)
+	{
+	case DLL_PROCESS_ATTACH:
+		coc_init ();
+		break;
+	case DLL_PROCESS_DETACH:
+		coc_fini ();
+		break;
+	case DLL_THREAD_ATTACH:
+	case DLL_THREAD_DETACH:
+		break;
+	}
+	return TRUE;
+}
+#endif
 
-  host = strndup (str, service ? service - str - skip_last : len);
+#define INET4_FMLY(a) (a->sa_family == AF_INET)
+#define INET4_CAST(a) ((const struct sockaddr_in *) a)
+#define INET6_CAST(a) ((const struct sockaddr_in6 *) a)
+#define INET4_PORT(a) (INET4_CAST (a)->sin_port)
+#define INET6_PORT(a) (INET6_CAST (a)->sin6_port)
+#define INETX_PORT(a) (INET4_FMLY (a) ? INET4_PORT (a) : INET6_PORT (a))
+#define INET4_ADDR(a) (&INET4_CAST (a)->sin_addr)
+#define INET6_ADDR(a) (&INET6_CAST (a)->sin6_addr)
+#define INETX_ADDR(a) (INET4_FMLY (a) ? (void *) INET4_ADDR (a) : (void *) INET6_ADDR (a))
 
-  coc_log (COC_DEBUG_LOG_LEVEL,
-	   "DEBUG Adding %s rule for %s connection to %s:%hu\n",
-	   rule_type_name[rule_type], address_type_name[type], host, port);
+static inline
+bool
+coc_rule_match (const coc_ruleset_t *rs, uint32_t rank,
+		const struct sockaddr *addr, const char *buf)
+{
+  const coc_rule_t *r = &rs->rules[rank];
+  bool match = false;
 
-  switch (type)
+  switch (r->addr_type)
     {
     case COC_IPV6_ADDR:
-      {
-	coc_entry_t *e = coc_entry_alloc ();
-	e->rule_type = rule_type;
-	e->addr_type = COC_IPV6_ADDR;
-	e->port = htons (port);
-
-	if (inet_pton (AF_INET6, host, &e->addr.ipv6) != 1)
-	  {
-	    DIE ("Invalid IPv6 address: `%s', aborting\n", host);
-	  }
-
-	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
-	free (host);
-	break;
-      }
-
     case COC_IPV4_ADDR:
       {
-	coc_entry_t *e = coc_entry_alloc ();
-	e->rule_type = rule_type;
-	e->addr_type = COC_IPV4_ADDR;
-	e->port = htons (port);
-
-	if (inet_pton (AF_INET, host, &e->addr.ipv4) != 1)
-	  {
-	    DIE ("Invalid IPv4 address: `%s', aborting\n", host);
-	  }
-
-	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
-	free (host);
+	uint8_t key[COC_KEY_LEN];
+	coc_key_from_sockaddr (key, addr);
+	match = (coc_key_prefix_match (r->key, key, r->bits) &&
+		 coc_rule_port_match (rs, rank, INETX_PORT (addr)));
 	break;
       }
 
     case COC_GLOB_ADDR:
       {
-	coc_entry_t *e = coc_entry_alloc ();
-	e->rule_type = rule_type;
-	e->addr_type = COC_GLOB_ADDR;
-	e->port = htons (port);
-	/* Here we transfer ownership of `host' to the entry. */
-	e->addr.glob = host;
-	SLIST_INSERT_HEAD (&coc_list_head, e, entries);
-
-	/* Do not perform DNS lookups for '*' rules. We don't need to. */
-	if (host[0] != '*' || host[1] != '\0')
-	  {
-	    needs_dns_lookup = true;
-	  }
+	const char *glob = coc_rule_glob (rs, rank);
+	match = (((glob[0] == '*' && glob[1] == '\0')
+		  || !fnmatch (glob, buf, 0))
+		 && coc_rule_port_match (rs, rank, INETX_PORT (addr)));
 	break;
       }
+    }
 
-    case COC_HOST_ADDR:
-      {
-	struct addrinfo *ailist, *aip;
-	struct addrinfo hints;
-	int err;
-	memset (&hints, 0, sizeof(struct addrinfo));
-#ifdef AI_ADDRCONFIG
-	hints.ai_flags |= AI_ADDRCONFIG;
-#endif
-	hints.ai_family = AF_UNSPEC;	/* IPv4 or IPv6 or others */
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+  COC_PROBE3 (rule__match, rank, buf, match);
+  return match;
+}
 
-	if ((err = getaddrinfo (host, NULL, &hints, &ailist)) != 0)
-	  {
-	    DIE ("%s, aborting\n", gai_strerror (err));
-	  }
+/* First IPv4 or IPv6 rule of `rs' matching `key' and `port'. */
+static inline uint32_t
+coc_ruleset_lookup (const coc_ruleset_t *rs, const uint8_t *key,
+		    in_port_t port)
+{
+  uint32_t exact =
+    coc_bloom_maybe (&rs->exact_bloom, coc_bloom_hash_key (key)) ?
+    coc_hash_lookup (&rs->exact, rs, key, port) : COC_NIL;
+  uint32_t prefix = coc_lpm_lookup (&rs->lpm, rs, key, port);
 
-	for (aip = ailist; aip != NULL; aip = aip->ai_next)
-	  {
-	    if (aip->ai_family == AF_INET)
-	      {
-		struct sockaddr_in *sa = (struct sockaddr_in *) aip->ai_addr;
-		coc_entry_t *e = coc_entry_alloc ();
-		e->rule_type = rule_type;
-		e->addr_type = COC_IPV4_ADDR;
-		e->port = htons (port);
-		e->addr.ipv4 = sa->sin_addr;
-		SLIST_INSERT_HEAD (&coc_list_head, e, entries);
-	      }
+  return exact < prefix ? exact : prefix;
+}
 
-	    else if (aip->ai_family == AF_INET6)
-	      {
-		struct sockaddr_in6 *sa =
-		  (struct sockaddr_in6 *) aip->ai_addr;
-		coc_entry_t *e = coc_entry_alloc ();
-		e->rule_type = rule_type;
-		e->addr_type = COC_IPV6_ADDR;
-		e->port = htons (port);
-		e->addr.ipv6 = sa->sin6_addr;
-		SLIST_INSERT_HEAD (&coc_list_head, e, entries);
-	      }
-	  }
+/* Called by dynamic linker when library is unloaded. */
+#ifdef __SUNPRO_C
+#pragma fini (coc_fini)
+#elif defined(__GNUC__)
+void coc_fini (void) __attribute__ ((destructor));
+#endif
 
-	freeaddrinfo (ailist);
-	free (host);
-	break;
-      }
+static void
+coc_log_hit_ratio (const char *what, uint64_t hits, uint64_t misses)
+{
+  if (hits + misses > 0)
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL,
+	       "DEBUG %s: %llu hits, %llu misses (%.1f%% hits)\n", what,
+	       (unsigned long long) hits, (unsigned long long) misses,
+	       100.0 * hits / (hits + misses));
     }
-
-  return 0;
 }
 
-static size_t
-coc_rules_add (const char *rules, size_t rule_type)
+void
+coc_fini (void)
 {
-  size_t count = 0;
+  uint64_t hits, misses;
+  coc_cache_stats (&hits, &misses);
 
-  if (rules)
+  if (initialized)
     {
-      const char *p = rules + strlen (rules);
-      size_t len = 0;
-
-      while (p >= rules)
-	{
-	  if (*p == ';')
-	    {
-	      if (len > 1)
-		{
-		  coc_rule_add (p + 1, len - 1, rule_type);
-		}
-
-	      len = 1;
-	      count++;
-	    }
-	  else
-	    {
-	      len++;
-	    }
-
-	  p--;
-	}
+      coc_log_hit_ratio ("Verdict cache", hits, misses);
+      coc_log_hit_ratio ("Forward DNS cache", coc_dns_cache.hits,
+			 coc_dns_cache.misses);
+      coc_log_hit_ratio ("Reverse DNS cache", coc_rdns_cache.hits,
+			 coc_rdns_cache.misses);
 
-      if (len - 1 > 0)
+      if (coc_flights.coalesced + coc_flights.timeouts > 0)
 	{
-	  coc_rule_add (p + 1, len - 1, rule_type);
-	  count++;
+	  coc_log (COC_DEBUG_LOG_LEVEL,
+		   "DEBUG Reverse DNS lookups: %llu made, %llu coalesced, "
+		   "%llu waits timed out\n",
+		   (unsigned long long) coc_flights.lookups,
+		   (unsigned long long) coc_flights.coalesced,
+		   (unsigned long long) coc_flights.timeouts);
 	}
     }
 
-  return count;
-}
+  coc_stats_close ();
 
-static long
-coc_long_value (const char *name, const char *value, long lower_bound,
-		long upper_bound)
-{
-  char *endptr;
-  errno = 0;
-  long v = strtol (value, &endptr, 10);
-  if ((errno == ERANGE && (v == LONG_MAX || v == LONG_MIN)) ||
-      (errno != 0 && value == 0L) ||
-      *endptr != '\0' || (v < lower_bound || v > upper_bound))
+  if (latency)
     {
-      DIE ("`%s' not valid for %s (should be between `%ld' and `%ld')\n",
-	   value, name, lower_bound, upper_bound);
+      coc_latency_dump ();
     }
 
-  return v;
+  coc_log_repeat_flush ();
+  coc_log_async_flush ();
 }
 
+/* Share host rule resolutions through COC_HOST_CACHE, or a file of
+ * the user's runtime directory. */
+static void
+coc_host_cache_init (void)
+{
+  const char *path = getenv (COC_HOST_CACHE_ENV_VAR_NAME);
+  const char *dir = getenv (COC_RUNTIME_DIR_ENV_VAR_NAME);
 
-/* The real connect function. WARNING: cancellation point. */
-static int (WSAAPI *real_connect) (SOCKET fd, const struct sockaddr * addr,
-			    socklen_t addrlen);
+  if (host_cache_ttl == 0)
+    {
+      return;
+    }
 
-typedef struct coc_resolver {
-  union {
-    struct in_addr ipv4;
-    struct in6_addr ipv6;
-  } addr;
-  bool isv6;
-} coc_resolver_t;
+  if (path != NULL && *path != '\0')
+    {
+      coc_host_cache_open (path, host_cache_ttl);
+    }
+  else if (dir != NULL && *dir != '\0')
+    {
+      char *file = (char *) malloc (strlen (dir) + sizeof ("/coc-hosts"));
 
-static void
-coc_read_resolv (coc_resolver_t * out, size_t * index)
-{
-	*index = 0;
+      if (file != NULL)
+	{
+	  sprintf (file, "%s/coc-hosts", dir);
+	  coc_host_cache_open (file, host_cache_ttl);
+	  free (file);
+	}
+    }
+}
 
-#ifndef _WIN32
-#define NS "nameserver "
+/* Give up building rules: at startup the process exits, on reload the
+ * current rules are kept. The format takes the outcome last. */
+#define COC_RULES_FAIL(...) do { \
+    coc_log (COC_ERROR_LOG_LEVEL, "ERROR " __VA_ARGS__, \
+	     reload ? "keeping current rules" : "aborting"); \
+    if (!reload) \
+      { \
+	exit (EXIT_FAILURE); \
+      } \
+    goto fail; \
+  } while (0)
 
-  char buffer[1024];
-  FILE *resolv = fopen ("/etc/resolv.conf", "r");
+/* Whether glob rules of `rs' need the names of destinations. */
+static inline bool
+coc_ruleset_needs_dns (const coc_ruleset_t *rs)
+{
+  return rs->domains.count > 0 || rs->glob_count > 0;
+}
 
-  if (!resolv)
+/* Parse and compile the rules, then check DNS is allowed if needed. */
+static coc_ruleset_t *
+coc_rules_build (bool reload)
+{
+  char *block = getenv (COC_BLOCK_ENV_VAR_NAME);
+  char *allow = getenv (COC_ALLOW_ENV_VAR_NAME);
+  char *block_file = getenv (COC_BLOCK_FILE_ENV_VAR_NAME);
+  char *allow_file = getenv (COC_ALLOW_FILE_ENV_VAR_NAME);
+  char *db = getenv (COC_RULES_DB_ENV_VAR_NAME);
+  uint64_t source = coc_rules_source (block, allow, block_file, allow_file);
+  bool from_env = (block != NULL && *block != '\0') ||
+    (allow != NULL && *allow != '\0') ||
+    (block_file != NULL && *block_file != '\0') ||
+    (allow_file != NULL && *allow_file != '\0');
+  size_t errors = coc_rules_errors ();
+  const char *error = NULL;
+  coc_ruleset_t *rs = (coc_ruleset_t *) calloc (1, sizeof (*rs));
+
+  if (rs == NULL)
     {
-      DIE ("Could not read /etc/resolv.conf, aborting\n");
+      COC_RULES_FAIL ("Cannot allocate rules, %s\n");
     }
 
-  while (fgets(buffer, sizeof(buffer), resolv) && *index < MAXNS)
-  {
-	  if (!strncmp(buffer, NS, sizeof(NS) - 1))
-	  {
-		  char *ns = buffer + sizeof(NS) - 1;
-		  size_t len = strlen(ns);
+  /* A database compiled from other rules than those in the environment
+   * is compiled again. Without rules there, any one will do. */
+  if (db != NULL &&
+      (error = coc_db_load (rs, db, from_env ? source : 0)) == NULL)
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL,
+	       "DEBUG Mapped %zu rules from %s: %zu addresses, "
+	       "%zu prefix trie nodes, %zu domain suffixes, %zu globs\n",
+	       rs->rule_count, db, rs->exact.count, rs->lpm.node_count,
+	       rs->domains.count, rs->glob_count);
+    }
+  else
+    {
+      if (db != NULL && !from_env)
+	{
+	  COC_RULES_FAIL ("Cannot load rules database %s: %s, %s\n", db,
+			  error);
+	}
 
-		  if (ns[len - 1] == '\n')
-		  {
-			  ns[len - 1] = '\0';
-		  }
+      if (db != NULL)
+	{
+	  coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Compiling rules database %s: "
+		   "%s\n", db, error);
+	}
 
-		  coc_log(COC_DEBUG_LOG_LEVEL, "DEBUG Found nameserver: %s\n", ns);
+      coc_host_cache_init ();
 
-		  if (inet_pton(AF_INET, ns, &out[*index].addr.ipv4) == 1)
+      /* Rules of the environment rank before those of files. */
+      if (block_file != NULL && *block_file != '\0')
+	{
+	  coc_rules_add_file (block_file, COC_BLOCK);
+	}
+
+      coc_rules_add (block, COC_BLOCK, COC_BLOCK_ENV_VAR_NAME);
+
+      if (allow_file != NULL && *allow_file != '\0')
+	{
+	  coc_rules_add_file (allow_file, COC_ALLOW);
+	}
+
+      coc_rules_add (allow, COC_ALLOW, COC_ALLOW_ENV_VAR_NAME);
+      coc_rules_resolve (resolve_timeout_ms);
+      coc_host_cache_flush ();
+
+      if (coc_rules_errors () > errors)
+	{
+	  COC_RULES_FAIL ("%zu error(s) in rules, %s\n",
+			  coc_rules_errors () - errors);
+	}
+
+      coc_rules_compile (rs, bloom_fp_rate);
+
+      if ((allow != NULL || allow_file != NULL) && block == NULL &&
+	  block_file == NULL && coc_ruleset_needs_dns (rs))
+	{
+	  COC_RULES_FAIL ("Glob specified for ALLOW rule but no rule for "
+			  "BLOCK; %s\n");
+	}
+
+      if (db != NULL && (error = coc_db_write (rs, db, source)) != NULL)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL,
+		   "ERROR Cannot write rules database %s: %s\n", db, error);
+	}
+    }
+
+  rs->generation = ++coc_generation;
+  coc_dfa_init (&rs->dfa, rs, rs->globs, rs->glob_count, dfa_max_size);
+
+  /* Fail if there is a glob and DNS is not allowed. */
+  if (coc_ruleset_needs_dns (rs))
+    {
+#ifdef _WIN32
+	  /* We need to initialize WinSock. It's safe to do so. */
+	  WSADATA wsaData;
+	  int iWSErr = WSAStartup (MAKEWORD(2, 2), &wsaData);
+
+	  if (iWSErr != 0)
+	    {
+		  COC_RULES_FAIL ("Cannot initialize WinSock 2 API, %s\n");
+	    }
+#endif
+      static bool resolv_read = false;
+      bool dns_server_found = false;
+
+      /* Read nameserver entries in /etc/resolv.conf */
+      if (!resolv_read)
+	{
+	  const char *error = coc_read_resolv (resolvers, &resolver_count);
+
+	  if (error != NULL)
+	    {
+	      COC_RULES_FAIL ("Cannot read DNS servers: %s, %s\n", error);
+	    }
+	}
+
+      /* Cycle in all allowed IP rules to check if we have one of these */
+      uint32_t rank;
+      for (rank = 0; rank < rs->rule_count; rank++)
+      {
+	const coc_rule_t *r = &rs->rules[rank];
+
+	if (dns_server_found)
+	  {
+	    break;
+	  }
+
+	if (r->rule_type == COC_ALLOW && r->addr_type != COC_GLOB_ADDR)
+	  {
+	    size_t i;
+	    for (i = 0; i < resolver_count; i++)
+	      {
+		struct sockaddr_in6 sa;
+		memset (&sa, 0, sizeof (sa));
+
+		if (resolvers[i].isv6)
 		  {
-			  out[(*index)++].isv6 = false;
+		    sa.sin6_family = AF_INET6;
+		    sa.sin6_port = htons (53);
+		    sa.sin6_addr = resolvers[i].addr.ipv6;
 		  }
-		  else if (inet_pton(AF_INET6, ns, &out[*index].addr.ipv6) == 1)
+		else
 		  {
-			  out[(*index)++].isv6 = true;
+		    struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
+		    sin->sin_family = AF_INET;
+		    sin->sin_port = htons (53);
+		    sin->sin_addr = resolvers[i].addr.ipv4;
 		  }
-		  else
+
+		if (coc_rule_match (rs, rank, (const struct sockaddr *) &sa,
+				    NULL))
 		  {
-			  DIE("Cannot process nameserver: `%s'\n", ns);
+		    dns_server_found = true;
+		    break;
 		  }
+	      }
 	  }
-  }
+      }
 
-  fclose(resolv);
+#ifdef _WIN32
+	  WSACleanup ();
+#endif
 
-#else
-	/* We rely on GetAdaptersAddresses:
-	 *   https://msdn.microsoft.com/en-us/library/windows/desktop/aa365915(v=vs.85).aspx
-	 * to retrieve IPv4 and IPv6 DNS server addresses.
-	 */
-	DWORD dwRetVal = 0;
+      if (!dns_server_found)
+	{
+	  COC_RULES_FAIL ("No DNS allowed while some glob rule need one, "
+			  "%s\n");
+	}
 
-	// Set the flags to pass to GetAdaptersAddresses
-	ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_UNICAST;
+#ifndef _WIN32
+      /* Reverse lookups are made by coc_rdns_query, which unlike the
+       * system resolver does not look at the hosts file. */
+      if (!resolv_read)
+	{
+	  coc_hosts_load (&coc_hosts, "/etc/hosts");
+	}
+#endif
 
-	LPVOID lpMsgBuf = NULL;
+      resolv_read = true;
+    }
 
-	PIP_ADAPTER_ADDRESSES pAddresses = NULL;
-	ULONG outBufLen = 0;
-	ULONG iterations = 0;
+  return rs;
 
-	PIP_ADAPTER_ADDRESSES pCurrAddresses = NULL;
-	IP_ADAPTER_DNS_SERVER_ADDRESS *pDnServer = NULL;
+fail:
+  coc_rules_discard ();
 
-#define WORKING_BUFFER_SIZE 15000
-#define MAX_TRIES 3
+  if (rs != NULL)
+    {
+      coc_ruleset_free (rs);
+      free (rs);
+    }
 
-	// Allocate a 15 KB buffer to start with.
-	outBufLen = WORKING_BUFFER_SIZE;
+  return NULL;
+}
 
-	do {
-		pAddresses = (IP_ADAPTER_ADDRESSES *) malloc (outBufLen);
-		if (pAddresses == NULL)
-		{
-			DIE ("Cannot allocate memory for IP_ADAPTER_ADDRESSES, aborting\n");
-		}
+/* Make `rs' the ruleset of new connections, and free the one it
+ * replaces once those being checked against it are done. */
+static void
+coc_rules_publish (coc_ruleset_t *rs)
+{
+  coc_ruleset_t *old = coc_ruleset;
 
-		dwRetVal = GetAdaptersAddresses (AF_UNSPEC, flags, NULL, pAddresses, &outBufLen);
+  coc_store_release (&needs_dns_lookup, coc_ruleset_needs_dns (rs));
+  coc_store_release (&coc_ruleset, rs);
 
-		if (dwRetVal == ERROR_BUFFER_OVERFLOW)
-		{
-			free (pAddresses);
-			pAddresses = NULL;
-		}
-		else
-		{
-			break;
-		}
+  if (old != NULL)
+    {
+      coc_epoch_synchronize ();
+      coc_ruleset_free (old);
+      free (old);
+    }
+}
 
-		iterations++;
+/* Build the rules again when their files change, until the process
+ * exits. Rules of the environment cannot change, but a database or
+ * files can, without restarting long-running processes. */
+#define COC_RELOAD_DELAY_MS 100	/* quiet time before reading changes. */
+#define COC_RELOAD_POLL_MS 1000	/* where files cannot be watched. */
 
-	} while ((dwRetVal == ERROR_BUFFER_OVERFLOW) && (iterations < MAX_TRIES));
+static const char *reload_paths[3];
+static size_t reload_path_count = 0;
 
-	if (dwRetVal == NO_ERROR) {
-		// If successful, output some information from the data we received
-		pCurrAddresses = pAddresses;
+static void
+coc_rules_reload (void)
+{
+  coc_ruleset_t *rs = coc_rules_build (true);
 
-		while (pCurrAddresses) {
-			pDnServer = pCurrAddresses->FirstDnsServerAddress;
+  if (rs != NULL)
+    {
+      coc_rules_publish (rs);
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG Reloaded %zu rules\n",
+	       rs->rule_count);
+    }
+}
 
-			while (pDnServer && *index < MAXNS) {
-				ADDRESS_FAMILY family = pDnServer->Address.lpSockaddr->sa_family;
+#ifdef __linux__
+static int reload_fd = -1;
 
-				if (family == AF_INET6)
-				{
-					out[*index].addr.ipv6 = ((struct sockaddr_in6 *) pDnServer->Address.lpSockaddr)->sin6_addr;
-					out[*index].isv6 = true;
-				}
-				else if (family == AF_INET)
-				{
-					out[*index].addr.ipv4 = ((struct sockaddr_in *) pDnServer->Address.lpSockaddr)->sin_addr;
-					out[*index].isv6 = false;
-				}
+/* Whether `name', in a watched directory, is one of the rules files. */
+static bool
+coc_reload_watched (const char *name)
+{
+  size_t i;
 
-				(*index)++;
-				pDnServer = pDnServer->Next;
-			}
+  for (i = 0; i < reload_path_count; i++)
+    {
+      const char *base = strrchr (reload_paths[i], '/');
 
-			pCurrAddresses = pCurrAddresses->Next;
-		}
+      if (strcmp (name, base != NULL ? base + 1 : reload_paths[i]) == 0)
+	{
+	  return true;
 	}
-	else {
-		if (dwRetVal == ERROR_NO_DATA)
-			DIE("Cannot find any DNS server, aborting\n");
-		else {
-			if (FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-				FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-				NULL, dwRetVal, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-				(LPTSTR)&lpMsgBuf, 0, NULL)) {
-				coc_log(COC_ERROR_LOG_LEVEL, "ERROR %s\n", lpMsgBuf);
-				LocalFree(lpMsgBuf);
-				free (pAddresses);
-				exit(1);
-			}
-		}
+    }
+
+  return false;
+}
+
+/* Whether events read from `fd' are about rules files: 1 if so, 0 if
+ * not, -1 on error. */
+static int
+coc_reload_events (int fd)
+{
+  char buf[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len = read (fd, buf, sizeof (buf));
+  int changed = 0;
+  char *p;
+
+  if (len < 0)
+    {
+      return errno == EINTR ? 0 : -1;
+    }
+
+  for (p = buf; p < buf + len; p += sizeof (*ev) + ev->len)
+    {
+      ev = (const struct inotify_event *) p;
+
+      if (ev->len > 0 && coc_reload_watched (ev->name))
+	{
+	  changed = 1;
 	}
-#endif
+    }
+
+  return changed;
 }
 
-const char *
-coc_version (void)
+/* Directories are watched rather than files, which editors and
+ * coc-compile replace by renaming another one over them. */
+static void *
+coc_reload_thread (void *arg)
 {
-  return version;
+  int fd = (int) (intptr_t) arg;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+
+  int changed;
+
+  while ((changed = coc_reload_events (fd)) >= 0)
+    {
+      if (!changed)
+	{
+	  continue;
+	}
+
+      /* Wait for changes to settle, not to read files half written. */
+      while (poll (&pfd, 1, COC_RELOAD_DELAY_MS) > 0)
+	{
+	  coc_reload_events (fd);
+	}
+
+      coc_rules_reload ();
+    }
+
+  return NULL;
 }
 
-#ifdef _WIN32
+static bool
+coc_reload_watch (void)
+{
+  size_t i;
 
-int HOOK(connect(SOCKET fd, const struct sockaddr *addr, socklen_t addrlen));
-void coc_init(void);
-BOOL(WINAPI *real_CreateProcess) (LPCTSTR lpApplicationName,
-	LPTSTR lpCommandLine,
-	LPSECURITY_ATTRIBUTES lpProcessAttributes,
-	LPSECURITY_ATTRIBUTES lpThreadAttributes,
-	BOOL bInheritHandles,
-	DWORD dwCreationFlags,
-	LPVOID lpEnvironment,
-	LPCTSTR lpCurrentDirectory,
-	LPSTARTUPINFO lpStartupInfo,
-	LPPROCESS_INFORMATION lpProcessInformation);
-BOOL HOOK(CreateProcess(
-	LPCTSTR lpApplicationName,
-	LPTSTR lpCommandLine,
-	LPSECURITY_ATTRIBUTES lpProcessAttributes,
-	LPSECURITY_ATTRIBUTES lpThreadAttributes,
-	BOOL bInheritHandles,
-	DWORD dwCreationFlags,
-	LPVOID lpEnvironment,
-	LPCTSTR lpCurrentDirectory,
-	LPSTARTUPINFO lpStartupInfo,
-	LPPROCESS_INFORMATION lpProcessInformation))
+  reload_fd = inotify_init1 (IN_CLOEXEC);
+
+  for (i = 0; reload_fd != -1 && i < reload_path_count; i++)
+    {
+      const char *base = strrchr (reload_paths[i], '/');
+      char *dir = base != NULL ?
+	strndup (reload_paths[i], (size_t) (base - reload_paths[i]) + 1) :
+	strdup (".");
+
+      if (dir == NULL ||
+	  inotify_add_watch (reload_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL, "ERROR Cannot watch %s: %s\n",
+		   reload_paths[i], strerror (errno));
+	}
+
+      free (dir);
+    }
+
+  return reload_fd != -1;
+}
+#else
+/* Elsewhere, files are polled for a new identity. */
+static uint64_t
+coc_reload_stamp (void)
 {
-	// Make sure to start the process in a suspended state, then inject
-	// ourselves
-	bool resume = !(((dwCreationFlags & CREATE_SUSPENDED) == CREATE_SUSPENDED));
-	dwCreationFlags |= CREATE_SUSPENDED;
-	BOOL status = real_CreateProcess(
-		lpApplicationName, lpCommandLine,
-		lpProcessAttributes, lpThreadAttributes,
-		bInheritHandles, dwCreationFlags,
-		lpEnvironment, lpCurrentDirectory,
-		lpStartupInfo, lpProcessInformation);
+  uint64_t h = 0;
+  size_t i;
 
-	if (status)
+  for (i = 0; i < reload_path_count; i++)
+    {
+      h = coc_file_stamp (h, reload_paths[i]);
+    }
+
+  return h;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+#else
+static void *
+#endif
+coc_reload_thread (void *arg)
+{
+  uint64_t stamp = coc_reload_stamp ();
+
+  for (;;)
+    {
+#ifdef _WIN32
+      Sleep (COC_RELOAD_POLL_MS);
+#else
+      usleep (COC_RELOAD_POLL_MS * 1000);
+#endif
+
+      if (coc_reload_stamp () != stamp)
 	{
-		if (!LoadCoCLibrary(lpProcessInformation->hProcess))
-		{
-			// Injection failed. Let's report it and continue.
-			coc_log(COC_ERROR_LOG_LEVEL, "Failed to inject connect-or-cut into new process: %zu", GetLastError());
-		}
+	  stamp = coc_reload_stamp ();
+	  coc_rules_reload ();
+	}
+    }
 
-		if (resume)
-		{
-			ResumeThread(lpProcessInformation->hThread);
-		}
+  return 0;
+}
+
+static bool
+coc_reload_watch (void)
+{
+  return true;
+}
+#endif
+
+#ifndef _WIN32
+static void coc_reload_atfork (void);
+#endif
+
+static void
+coc_reload_start (void)
+{
+  const char *names[] = {
+    COC_BLOCK_FILE_ENV_VAR_NAME,
+    COC_ALLOW_FILE_ENV_VAR_NAME,
+    COC_RULES_DB_ENV_VAR_NAME
+  };
+  size_t i;
+  bool ok;
+
+  for (i = 0, reload_path_count = 0; i < sizeof (names) / sizeof (names[0]);
+       i++)
+    {
+      const char *path = getenv (names[i]);
+
+      if (path != NULL && *path != '\0')
+	{
+	  reload_paths[reload_path_count++] = path;
 	}
+    }
+
+  if (reload_path_count == 0)
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG No rules file to reload\n");
+      return;
+    }
+
+#ifdef _WIN32
+  HANDLE h;
 
-	return status;
-}
+  ok = coc_reload_watch () &&
+    (h = (HANDLE) _beginthreadex (NULL, 0, coc_reload_thread, NULL, 0,
+				  NULL)) != NULL && CloseHandle (h);
+#else
+  static coc_once_t once = COC_ONCE_INIT;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  ok = coc_reload_watch ();
 
+  if (ok)
+    {
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+#ifdef __linux__
+      ok = pthread_create (&thread, &attr, coc_reload_thread,
+			   (void *) (intptr_t) reload_fd) == 0;
+#else
+      ok = pthread_create (&thread, &attr, coc_reload_thread, NULL) == 0;
 #endif
+      pthread_attr_destroy (&attr);
+    }
 
-static inline void
-coc_sym_connect (void)
-{
-  if (real_connect == NULL)
+  /* The thread is not inherited by child processes. */
+  if (ok)
     {
-#ifdef _WIN32
-	  if (MH_Initialize() != MH_OK)
-	  {
-		  DIE("Cannot initialize MinHook, aborting\n");
-	  }
+      coc_once (&once, coc_reload_atfork);
+    }
+#endif
 
-	  if (MH_CreateHookApiEx(L"ws2_32", "connect", &hook_connect, (LPVOID *) &real_connect, NULL) != MH_OK)
-	  {
-		  DIE("Cannot hook connect(), aborting\n");
-	  }
+  if (!ok)
+    {
+      coc_log (COC_ERROR_LOG_LEVEL, "ERROR Cannot watch rules files: %s\n",
+	       strerror (errno));
+    }
+}
 
-	  /* TODO: add WSAConnect, ConnectEx */
-	  if (MH_CreateHook(&CreateProcess, &hook_CreateProcess, (LPVOID *) &real_CreateProcess) != MH_OK)
-	  {
-		  DIE("Cannot hook CreateProcess, aborting\n");
-	  }
+#ifndef _WIN32
+static uint64_t reload_forked = 0;
 
-	  if (MH_EnableHook(MH_ALL_HOOKS) != MH_OK)
-	  {
-		  DIE("Cannot enable hooks, aborting\n");
-	  }
-#else
-      real_connect =
-	(int (*)(int, const struct sockaddr *, socklen_t)) dlsym (RTLD_NEXT,
-								  "connect");
+/* The watcher is started again on the next connection of the child,
+ * since most exec right away. */
+static void
+coc_reload_forked (void)
+{
+  reload_forked = 1;
+}
 
-      if (real_connect == NULL)
-	{
-	  char *error = dlerror ();
+static void
+coc_reload_restart (void)
+{
+  uint64_t forked = 1;
 
-	  if (error == NULL)
-	    {
-	      error = "connect is NULL";
-	    }
+  if (coc_cas (&reload_forked, &forked, 0))
+    {
+#ifdef __linux__
+      close (reload_fd);
+      reload_fd = -1;
+#endif
+      coc_reload_start ();
+    }
+}
 
-	  DIE ("%s\n", error);
-	}
+static void
+coc_reload_atfork (void)
+{
+  pthread_atfork (NULL, NULL, coc_reload_forked);
+}
 #endif
+
+/* Build the rules for the first time, then watch them if asked to. */
+static void
+coc_rules_init (void)
+{
+  coc_rules_publish (coc_rules_build (false));
+  coc_store_release (&rules_ready, true);
+
+  if (reload_rules)
+    {
+      coc_reload_start ();
     }
 }
 
-#ifdef _WIN32
-BOOL APIENTRY DllMain(HMODULE hModule,
-	DWORD  ul_reason_for_call,
-	LPVOID lpReserved
-)
+/* Compile the rules on first call. In lazy mode, this waits for the
+ * first connection, so that processes which make none do not pay for
+ * it. */
+static inline void
+coc_rules_once (void)
 {
-	switch (ul_reason_for_call)
-	{
-	case DLL_PROCESS_ATTACH:
-		coc_init ();
-		break;
-	case DLL_THREAD_ATTACH:
-	case DLL_THREAD_DETACH:
-	case DLL_PROCESS_DETACH:
-		break;
-	}
-	return TRUE;
+  static coc_once_t once = COC_ONCE_INIT;
+
+  if (!coc_load_acquire (&rules_ready))
+    {
+      coc_once (&once, coc_rules_init);
+    }
+}
+
+#ifndef _WIN32
+/* Threads of the parent, gone in the child, may have held locks. */
+static void
+coc_caches_forked (void)
+{
+  coc_name_cache_forked (&coc_rdns_cache);
+  coc_name_cache_forked (&coc_dns_cache);
+  coc_name_cache_forked (&coc_hosts);
+  coc_flights_forked (&coc_flights);
 }
 #endif
 
-/* Called by dynamic linker when library is loaded. */
-#ifdef __SUNPRO_C
+/* Called by dynamic linker when library is loaded, or by coc-bench once
+ * it has set up the environment. */
+#ifdef COC_BENCH
+void coc_init (void);
+#elif defined(__SUNPRO_C)
 #pragma init (coc_init)
 #elif defined(__GNUC__)
 void coc_init (void) __attribute__ ((constructor));
@@ -1107,6 +1302,8 @@ void coc_init (void) __attribute__ ((constructor));
 void
 coc_init (void)
 {
+  uint64_t start = COC_PROBE_ENABLED (init__return) ? coc_now_ns () : 0;
+
   coc_sym_connect ();
 
   char *level = getenv (COC_LOG_LEVEL_ENV_VAR_NAME);
@@ -1151,142 +1348,538 @@ coc_init (void)
 	  log_file_name = malloc (strlen (log_path) + strlen (progname) + 6);
 	  sprintf (log_file_name, "%s" COC_PATH_SEP "%s.coc", log_path, progname);
 	}
-    }
+    }
+
+  /* Records are written in the background, to a file opened once. */
+  char *async = getenv (COC_LOG_ASYNC_ENV_VAR_NAME);
+  if (async && coc_long_value (COC_LOG_ASYNC_ENV_VAR_NAME, async, 0, 1))
+    {
+      log_async = coc_log_async_start (log_target, log_file_name);
+    }
+
+  /* Tight retry loops should not flood logs. */
+  char *repeat_ms = getenv (COC_LOG_REPEAT_MS_ENV_VAR_NAME);
+  if (repeat_ms)
+    {
+      coc_log_repeat_init (coc_long_value (COC_LOG_REPEAT_MS_ENV_VAR_NAME,
+					   repeat_ms, 0, LONG_MAX));
+    }
+
+  char *sample = getenv (COC_LOG_SAMPLE_ENV_VAR_NAME);
+  if (sample)
+    {
+      log_sample = coc_long_value (COC_LOG_SAMPLE_ENV_VAR_NAME, sample, 1,
+				   LONG_MAX);
+    }
+
+  char *stats_on = getenv (COC_STATS_ENV_VAR_NAME);
+  if (stats_on && coc_long_value (COC_STATS_ENV_VAR_NAME, stats_on, 0, 1))
+    {
+      stats = coc_stats_open ();
+
+      if (!stats)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL,
+		   "ERROR Cannot publish statistics: %s\n", strerror (errno));
+	}
+    }
+
+  char *latency_path = getenv (COC_LATENCY_ENV_VAR_NAME);
+  if (latency_path && *latency_path != '\0')
+    {
+      char *signo = getenv (COC_LATENCY_SIGNAL_ENV_VAR_NAME);
+
+      latency = coc_latency_open (latency_path, signo ?
+				  coc_long_value
+				  (COC_LATENCY_SIGNAL_ENV_VAR_NAME, signo, 0,
+				   64) : 0);
+
+      if (!latency)
+	{
+	  coc_log (COC_ERROR_LOG_LEVEL,
+		   "ERROR Cannot time connections: %s\n", strerror (errno));
+	}
+    }
+
+  char *event_log_name = getenv (COC_EVENT_LOG_ENV_VAR_NAME);
+  if (event_log_name && *event_log_name != '\0')
+    {
+      if (!coc_event_log_open (event_log_name))
+	{
+	  DIE ("Cannot open event log `%s': %s, aborting\n", event_log_name,
+	       strerror (errno));
+	}
+
+      event_log = true;
+    }
+
+  char *dfa_size = getenv (COC_DFA_MAX_SIZE_ENV_VAR_NAME);
+  if (dfa_size)
+    {
+      dfa_max_size = coc_long_value (COC_DFA_MAX_SIZE_ENV_VAR_NAME, dfa_size,
+				     0, LONG_MAX);
+    }
+
+  char *fp_rate = getenv (COC_BLOOM_FP_RATE_ENV_VAR_NAME);
+  if (fp_rate)
+    {
+      bloom_fp_rate = coc_long_value (COC_BLOOM_FP_RATE_ENV_VAR_NAME, fp_rate,
+				      0, 1L << 30);
+    }
+
+  char *cache = getenv (COC_CACHE_SIZE_ENV_VAR_NAME);
+  if (cache)
+    {
+      cache_size = coc_long_value (COC_CACHE_SIZE_ENV_VAR_NAME, cache, 0,
+				   1L << 24);
+    }
+
+  coc_cache_init (&coc_cache, cache_size);
+
+  char *rdns_cache = getenv (COC_RDNS_CACHE_SIZE_ENV_VAR_NAME);
+  if (rdns_cache)
+    {
+      rdns_cache_size = coc_long_value (COC_RDNS_CACHE_SIZE_ENV_VAR_NAME,
+					rdns_cache, 0, 1L << 24);
+    }
+
+  char *ttl = getenv (COC_RDNS_TTL_ENV_VAR_NAME);
+  if (ttl)
+    {
+      rdns_ttl = coc_long_value (COC_RDNS_TTL_ENV_VAR_NAME, ttl, 0, 86400);
+    }
+
+  char *negative_ttl = getenv (COC_RDNS_NEGATIVE_TTL_ENV_VAR_NAME);
+  if (negative_ttl)
+    {
+      rdns_negative_ttl = coc_long_value (COC_RDNS_NEGATIVE_TTL_ENV_VAR_NAME,
+					  negative_ttl, 0, 86400);
+    }
+
+  coc_name_cache_init (&coc_rdns_cache, rdns_cache_size);
+  coc_flights_init (&coc_flights);
+
+  char *dns_cache = getenv (COC_DNS_CACHE_SIZE_ENV_VAR_NAME);
+  if (dns_cache)
+    {
+      dns_cache_size = coc_long_value (COC_DNS_CACHE_SIZE_ENV_VAR_NAME,
+				       dns_cache, 0, 1L << 24);
+    }
+
+  char *dns_ttl_value = getenv (COC_DNS_TTL_ENV_VAR_NAME);
+  if (dns_ttl_value)
+    {
+      dns_ttl = coc_long_value (COC_DNS_TTL_ENV_VAR_NAME, dns_ttl_value, 0,
+				86400);
+    }
+
+  coc_name_cache_init (&coc_dns_cache, dns_cache_size);
+#ifndef _WIN32
+  pthread_atfork (NULL, NULL, coc_caches_forked);
+#endif
+
+  char *timeout = getenv (COC_RDNS_TIMEOUT_MS_ENV_VAR_NAME);
+  if (timeout)
+    {
+      rdns_timeout_ms = coc_long_value (COC_RDNS_TIMEOUT_MS_ENV_VAR_NAME,
+					timeout, 1, 60000);
+    }
+
+  char *verdict = getenv (COC_RDNS_TIMEOUT_VERDICT_ENV_VAR_NAME);
+  if (verdict)
+    {
+      rdns_timeout_verdict =
+	(int) coc_long_value (COC_RDNS_TIMEOUT_VERDICT_ENV_VAR_NAME, verdict,
+			      COC_ALLOW, COC_BLOCK);
+    }
+
+  char *host_ttl = getenv (COC_HOST_CACHE_TTL_ENV_VAR_NAME);
+  if (host_ttl)
+    {
+      host_cache_ttl = coc_long_value (COC_HOST_CACHE_TTL_ENV_VAR_NAME,
+				       host_ttl, 0, 86400);
+    }
+
+  char *resolve_timeout = getenv (COC_RESOLVE_TIMEOUT_MS_ENV_VAR_NAME);
+  if (resolve_timeout)
+    {
+      resolve_timeout_ms =
+	coc_long_value (COC_RESOLVE_TIMEOUT_MS_ENV_VAR_NAME, resolve_timeout,
+			1, 600000);
+    }
+
+  char *lazy = getenv (COC_LAZY_ENV_VAR_NAME);
+  if (lazy)
+    {
+      lazy_init = coc_long_value (COC_LAZY_ENV_VAR_NAME, lazy, 0, 1);
+    }
+
+  char *reload = getenv (COC_RELOAD_ENV_VAR_NAME);
+  if (reload)
+    {
+      reload_rules = coc_long_value (COC_RELOAD_ENV_VAR_NAME, reload, 0, 1);
+    }
+
+  if (!lazy_init)
+    {
+      coc_rules_once ();
+    }
+
+  initialized = true;
+
+  if (COC_PROBE_ENABLED (init__return))
+    {
+      COC_PROBE1 (init__return, coc_now_ns () - start);
+    }
+}
+
+/* Printable form of `addr', formatted in `str' on first use. */
+static const char *
+coc_addr_str (const struct sockaddr *addr, char str[INET6_ADDRSTRLEN])
+{
+  if (str[0] == '\0')
+    {
+      uint64_t start = latency ? coc_now_ns () : 0;
+
+      inet_ntop (addr->sa_family, INETX_ADDR (addr), str, INET6_ADDRSTRLEN);
+
+      if (latency)
+	{
+	  coc_latency_add (COC_PHASE_NTOP, coc_now_ns () - start);
+	}
+    }
+
+  return str;
+}
+
+/* Names of a destination for glob rules, looked up at most once. */
+typedef struct coc_name {
+  int state;			/* 0 before lookup, 1 once done, -1 on error. */
+  uint64_t expires;		/* when the names must be looked up again. */
+  char buf[COC_NAMES_LEN];
+} coc_name_t;
+
+/*
+ * Looks up the name of `addr' with nameservers, and caches the outcome
+ * in the reverse DNS cache. Returns COC_NAME_MISS if it failed.
+ */
+static coc_name_status_t
+coc_name_lookup (const struct sockaddr *addr, socklen_t addrlen,
+		 const uint8_t *key, uint64_t now, coc_name_t *n)
+{
+  coc_name_status_t status;
+  uint32_t ttl = UINT32_MAX;
+
+#ifndef _WIN32
+  if (resolver_count > 0)
+    {
+      status = coc_rdns_query (resolvers, resolver_count, key,
+			       now + rdns_timeout_ms, n->buf, &ttl);
+
+      if (status == COC_NAME_MISS)
+	{
+	  coc_log (COC_BLOCK_LOG_LEVEL,
+		   "ERROR resolving name: no answer within %llu ms\n",
+		   (unsigned long long) rdns_timeout_ms);
+	  return status;
+	}
+    }
+  else
+#endif
+    {
+      int rc = getnameinfo (addr, addrlen, n->buf, NI_MAXHOST,
+			    NULL, 0, NI_NAMEREQD);
+
+      if (rc == 0)
+	{
+	  status = COC_NAME_FOUND;
+	}
+      else if (rc == EAI_NONAME || rc == EAI_AGAIN || rc == EAI_FAIL)
+	{
+	  status = COC_NAME_NONE;
+	}
+      else
+	{
+	  coc_log (COC_BLOCK_LOG_LEVEL, "ERROR resolving name: %s\n",
+		   gai_strerror (rc));
+	  return COC_NAME_MISS;
+	}
+    }
+
+  if (status == COC_NAME_FOUND)
+    {
+      coc_lowercase (n->buf);
+      n->buf[strlen (n->buf) + 1] = '\0';
+      n->expires = now + (ttl < rdns_ttl ? ttl : rdns_ttl) * 1000;
+      coc_name_cache_put (&coc_rdns_cache, key, now, n->buf, n->expires);
+    }
+  else
+    {
+      coc_log (COC_DEBUG_LOG_LEVEL, "DEBUG No name for address\n");
+      n->expires = now + (ttl < rdns_negative_ttl ? ttl :
+			  rdns_negative_ttl) * 1000;
+      coc_name_cache_put (&coc_rdns_cache, key, now, NULL, n->expires);
+    }
+
+  return status;
+}
+
+/*
+ * Names of `addr' for glob rules: those the application looked up to
+ * get `addr' if any, else the one found by a reverse lookup, else the
+ * numeric form of `addr'. Reverse lookups are cached, failed ones for
+ * a shorter time, so that addresses without name are not looked up
+ * again on each connect. They are bounded by COC_RDNS_TIMEOUT_MS when
+ * nameservers are known, and threads needing the same one wait for the
+ * first to make it.
+ */
+static const char *
+coc_name_of (const struct sockaddr *addr, socklen_t addrlen,
+	     const uint8_t *key, coc_name_t *n)
+{
+  if (n->state == 0)
+    {
+      uint64_t now = coc_now_ms ();
+      coc_name_status_t status = coc_name_cache_get (&coc_dns_cache, key,
+						     now, n->buf,
+						     &n->expires);
+      int rc = 0;
+
+      if (status == COC_NAME_MISS)
+	{
+	  status = coc_name_cache_get (&coc_rdns_cache, key, now, n->buf,
+				       &n->expires);
+	}
+
+      if (status == COC_NAME_MISS)
+	{
+	  status = coc_name_cache_get (&coc_hosts, key, now, n->buf,
+				       &n->expires);
+	}
+
+      if (status == COC_NAME_MISS)
+	{
+	  /* Waiting threads read the outcome from the cache. */
+	  bool shared = rdns_cache_size > 0;
+	  int slot = -1;
+
+	  if (!shared || coc_flight_begin (&coc_flights, key,
+					   now + rdns_timeout_ms, &slot))
+	    {
+	      int cancel_state;
+
+	      /* Others may be waiting for this lookup to complete. */
+	      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel_state);
+	      coc_stats_add (COC_STAT_DNS_LOOKUPS, 1);
+
+	      bool timed = latency || COC_PROBE_ENABLED (rdns__return);
+	      uint64_t start = timed ? coc_now_ns () : 0;
+
+	      COC_PROBE1 (rdns__entry, key);
+	      status = coc_name_lookup (addr, addrlen, key, now, n);
+
+	      if (timed)
+		{
+		  uint64_t ns = coc_now_ns () - start;
+
+		  coc_latency_add (COC_PHASE_RDNS, ns);
+		  rdns_ns += ns;
+		  COC_PROBE3 (rdns__return, key, status, ns);
+		}
+
+	      if (shared)
+		{
+		  coc_flight_end (&coc_flights, slot);
+		}
+
+	      pthread_setcancelstate (cancel_state, NULL);
+	    }
+	  else
+	    {
+	      status = coc_name_cache_get (&coc_rdns_cache, key,
+					   coc_now_ms (), n->buf,
+					   &n->expires);
+
+	      if (status == COC_NAME_MISS)
+		{
+		  coc_log (COC_BLOCK_LOG_LEVEL,
+			   "ERROR resolving name: no answer from the lookup "
+			   "of another thread\n");
+		}
+	    }
+	}
+
+      if (status == COC_NAME_NONE)
+	{
+	  rc = getnameinfo (addr, addrlen, n->buf, NI_MAXHOST,
+			    NULL, 0, NI_NUMERICHOST);
+	  n->buf[strlen (n->buf) + 1] = '\0';
+
+	  if (rc)
+	    {
+	      coc_log (COC_BLOCK_LOG_LEVEL, "ERROR resolving name: %s\n",
+		       gai_strerror (rc));
+	    }
+	}
 
-  /* Initialize our singly-linked list. */
-  SLIST_INIT (&coc_list_head);
+      n->state = status == COC_NAME_MISS || rc ? -1 : 1;
+    }
 
-  char *block = getenv (COC_BLOCK_ENV_VAR_NAME);
-  coc_rules_add (block, COC_BLOCK);
+  return n->state > 0 ? n->buf : NULL;
+}
 
-  char *allow = getenv (COC_ALLOW_ENV_VAR_NAME);
-  coc_rules_add (allow, COC_ALLOW);
+/* Whether the domain trie of `rs' may have a rule for `name' or a suffix. */
+static inline bool
+coc_ruleset_has_suffix (const coc_ruleset_t *rs, const char *name)
+{
+  const char *dot;
 
-  if (allow != NULL && block == NULL && needs_dns_lookup)
+  if (rs->domain_bloom.blocks == NULL ||
+      coc_bloom_maybe (&rs->domain_bloom, coc_bloom_hash_str (name)))
     {
-      DIE ("Glob specified for ALLOW rule but no rule for BLOCK; aborting\n");
+      return true;
     }
 
-  /* Fail if there is a glob and DNS is not allowed. */
-  if (needs_dns_lookup)
+  for (dot = strchr (name, '.'); dot != NULL; dot = strchr (dot + 1, '.'))
     {
-#ifdef _WIN32
-	  /* We need to initialize WinSock. It's safe to do so. */
-	  WSADATA wsaData;
-	  int iWSErr = WSAStartup (MAKEWORD(2, 2), &wsaData);
+      if (coc_bloom_maybe (&rs->domain_bloom, coc_bloom_hash_str (dot + 1)))
+	{
+	  return true;
+	}
+    }
 
-	  if (iWSErr != 0)
-	    {
-		  DIE("Cannot initialize WinSock 2 API, aborting\n");
-	    }
-#endif
-      bool dns_server_found = false;
+  return false;
+}
 
-      /* Read nameserver entries in /etc/resolv.conf */
-      coc_resolver_t dns[MAXNS] = { 0 };
-      size_t dns_count;
-      coc_read_resolv (dns, &dns_count);
+/*
+ * First glob rule of `rs' ranked before `match' that matches `name', or
+ * `match'. Suffix rules are looked up in the domain trie, the others in
+ * the automaton.
+ */
+static uint32_t
+coc_glob_match (coc_ruleset_t *rs, const struct sockaddr *addr,
+		const char *name, in_port_t port, uint32_t match, char *str)
+{
+  if (rs->domains.first < match && coc_ruleset_has_suffix (rs, name))
+    {
+      uint32_t rank = coc_domain_lookup (&rs->domains, rs, name, port);
 
-      /* Cycle in all allowed IP entries to check if we have one of these */
-      coc_entry_t *e;
-      SLIST_FOREACH (e, &coc_list_head, entries)
-      {
-	if (dns_server_found)
-	  {
-	    break;
-	  }
+      if (rank < match)
+	{
+	  match = rank;
+	}
+    }
 
-	if (e->rule_type == COC_ALLOW &&
-	    e->addr_type != COC_GLOB_ADDR &&
-	    (!e->port || e->port == htons (53)))
-	  {
-	    size_t i;
-	    for (i = 0; i < dns_count; i++)
-	      {
-		if ((e->addr_type == COC_IPV4_ADDR &&
-		     !dns[i].isv6 &&
-		     e->addr.ipv4.s_addr == dns[i].addr.ipv4.s_addr) ||
-		    (e->addr_type == COC_IPV6_ADDR &&
-		     dns[i].isv6 &&
-		     IN6_ARE_ADDR_EQUAL (&e->addr.ipv6, &dns[i].addr.ipv6)))
-		  {
-		    dns_server_found = true;
-		    break;
-		  }
-	      }
-	  }
-      }
+  bool dfa_ok = false;
 
-      if (!dns_server_found)
+  if (rs->glob_count > 0 && rs->globs[0] < match)
+    {
+      uint32_t rank = coc_dfa_match (&rs->dfa, name, port, &dfa_ok);
+
+      if (rank < match)
 	{
-	  DIE ("No DNS allowed while some glob rule need one, aborting\n");
+	  match = rank;
 	}
+    }
 
-#ifdef _WIN32
-	  WSACleanup ();
-#endif
+  /* Without the automaton, glob rules are checked one at a time. */
+  size_t i;
+  for (i = 0; !dfa_ok && i < rs->glob_count && rs->globs[i] < match; i++)
+  {
+    const coc_rule_t *r = &rs->rules[rs->globs[i]];
 
-    }
+    if (coc_log_enabled (COC_DEBUG_LOG_LEVEL))
+      {
+	coc_log (COC_DEBUG_LOG_LEVEL,
+		 "DEBUG Checking %s rule for %s connection to %s:%hu\n",
+		 coc_rule_type_name[r->rule_type],
+		 coc_address_type_name[r->addr_type],
+		 coc_addr_str (addr, str), ntohs (r->port));
+      }
 
-  initialized = true;
-}
+    if (coc_rule_match (rs, rs->globs[i], addr, name))
+      {
+	match = rs->globs[i];
+	break;
+      }
+  }
 
-#define INET4_FMLY(a) (a->sa_family == AF_INET)
-#define INET4_CAST(a) ((const struct sockaddr_in *) a)
-#define INET6_CAST(a) ((const struct sockaddr_in6 *) a)
-#define INET4_PORT(a) (INET4_CAST (a)->sin_port)
-#define INET6_PORT(a) (INET6_CAST (a)->sin6_port)
-#define INETX_PORT(a) (INET4_FMLY (a) ? INET4_PORT (a) : INET6_PORT (a))
-#define INET4_ADDR(a) (&INET4_CAST (a)->sin_addr)
-#define INET6_ADDR(a) (&INET6_CAST (a)->sin6_addr)
-#define INETX_ADDR(a) (INET4_FMLY (a) ? (void *) INET4_ADDR (a) : (void *) INET6_ADDR (a))
-#define INET4_IN_6(i) ((struct in_addr *) ((i)->s6_addr + 12))
+  return match;
+}
 
-static inline
-bool
-coc_rule_match (coc_entry_t *e, const struct sockaddr *addr, const char *buf)
+/*
+ * Rank of the first rule of `rs' matching the destination, or COC_NIL.
+ *
+ * IPv4 and IPv6 rules are looked up at once in the address hash table
+ * and the prefix trie. Glob rules ranked before the rule found there
+ * are then checked: `*' rules first, then the others against each name
+ * of the destination. `cacheable' is cleared if the name lookup failed,
+ * since the verdict may differ on next attempt, and `expires' is set to
+ * when the names used, if any, must be looked up again. If glob rules
+ * could not be checked, `timed_out' is set.
+ */
+static uint32_t
+coc_ruleset_match (coc_ruleset_t *rs, const struct sockaddr *addr,
+		   socklen_t addrlen, const uint8_t *key, in_port_t port,
+		   char *str, bool *cacheable, uint64_t *expires,
+		   bool *timed_out)
 {
-  switch (e->addr_type)
+  coc_name_t n = { coc_ruleset_needs_dns (rs) ? 0 : 1, 0, "*" };
+  const char *name;
+  uint32_t match = coc_ruleset_lookup (rs, key, port);
+
+  size_t i;
+  for (i = 0; i < rs->star_count && rs->stars[i] < match; i++)
+  {
+    /* Do not perform DNS lookups for '*' rules. We don't need to. */
+    if (coc_rule_port_match (rs, rs->stars[i], port))
+      {
+	match = rs->stars[i];
+	break;
+      }
+  }
+
+  *timed_out = false;
+
+  if ((rs->domains.first < match ||
+       (rs->glob_count > 0 && rs->globs[0] < match)) &&
+      (name = coc_name_of (addr, addrlen, key, &n)) != NULL)
     {
-    case COC_IPV6_ADDR:
-      if (addr->sa_family == AF_INET6)
-	{
-	  return (IN6_ARE_ADDR_EQUAL (&e->addr.ipv6, INET6_ADDR (addr)) &&
-		  (!e->port || e->port == INET6_PORT (addr)));
-	}
-      else if (addr->sa_family == AF_INET)
+      /* A rule matching any of the names applies. */
+      for (; *name != '\0'; name += strlen (name) + 1)
 	{
-	  if (IN6_IS_ADDR_V4MAPPED (&e->addr.ipv6))
-	    {
-	      return (INET4_IN_6 (&e->addr.ipv6)->s_addr == INET4_ADDR (addr)->s_addr &&
-		      (!e->port || e->port == INET4_PORT (addr)));
-	    }
+	  match = coc_glob_match (rs, addr, name, port, match, str);
 	}
-      break;
+    }
+  else if (n.state < 0)
+    {
+      /* Glob rules that could have matched are not checked. */
+      *timed_out = true;
+    }
 
-    case COC_IPV4_ADDR:
-      if (addr->sa_family == AF_INET)
-	{
-	  return (e->addr.ipv4.s_addr == INET4_ADDR (addr)->s_addr &&
-		  (!e->port || e->port == INET4_PORT (addr)));
-	}
-      else if (addr->sa_family == AF_INET6)
-	{
-	  if (IN6_IS_ADDR_V4MAPPED (INET6_ADDR (addr)))
-	    {
-	      return (e->addr.ipv4.s_addr == INET4_IN_6 (INET6_ADDR (addr))->s_addr &&
-		      (!e->port || e->port == INET6_PORT (addr)));
-	    }
-	}
-      break;
+  *cacheable = n.state >= 0;
+  *expires = n.expires;
+  COC_PROBE4 (ruleset__match, key, ntohs (port), match, *timed_out);
+  return match;
+}
 
-    case COC_GLOB_ADDR:
-      return (((e->addr.glob[0] == '*' && e->addr.glob[1] == '\0')
-	       || !fnmatch (e->addr.glob, buf, 0))
-	      && (!e->port || e->port == INETX_PORT (addr)));
-    }
+/* Log the verdict of `level' on a connection to `addr' and `port'. */
+static void
+coc_log_connection (coc_log_level_t level, const struct sockaddr *addr,
+		    char str[INET6_ADDRSTRLEN], in_port_t port)
+{
+  coc_addr_str (addr, str);
 
-  return false;
+  uint64_t start = latency ? coc_now_ns () : 0;
+
+  coc_log (level, "%s connection to %s:%hu\n",
+	   level == COC_BLOCK_LOG_LEVEL ? "BLOCK" : "ALLOW", str,
+	   ntohs (port));
+
+  if (latency)
+    {
+      coc_latency_add (COC_PHASE_LOG, coc_now_ns () - start);
+    }
 }
 
 /*
@@ -1297,27 +1890,33 @@ coc_rule_match (coc_entry_t *e, const struct sockaddr *addr, const char *buf)
 int
 HOOK(connect(SOCKET fd, const struct sockaddr *addr, socklen_t addrlen))
 {
-  if (!initialized)
+  if (!initialized || coc_rules_resolving ())
     {
       /* With SELinux enabled `connect' gets called for audit purpose
          _before_ `coc_init' so we ensure we have the real `connect'
 	 symbol address here to avoid segfaulting. */
       coc_sym_connect ();
 
-      /* Do not check connections if initialization is not complete. */
+      /* Do not check connections if initialization is not complete,
+       * nor those made to resolve host rules. */
       return real_connect (fd, addr, addrlen);
     }
 
   if (addr != NULL &&
       (addr->sa_family == AF_INET || addr->sa_family == AF_INET6))
     {
-      char str[INET6_ADDRSTRLEN];
-      in_port_t port = INETX_PORT (addr);
-      inet_ntop (addr->sa_family, INETX_ADDR (addr), str, INET6_ADDRSTRLEN);
+      coc_rules_once ();
 
-      char hbuf[NI_MAXHOST] = "*";
+#ifndef _WIN32
+      if (coc_load_relaxed (&reload_forked))
+	{
+	  coc_reload_restart ();
+	}
+#endif
 
-      bool dns_lookup_done = !needs_dns_lookup;
+      /* Only formatted when logging needs it. */
+      char str[INET6_ADDRSTRLEN] = "";
+      in_port_t port = INETX_PORT (addr);
 
       /* We have access to IP address and port where the
        * connection is requested.
@@ -1327,59 +1926,300 @@ HOOK(connect(SOCKET fd, const struct sockaddr *addr, socklen_t addrlen))
        *     - if so, proceed to the real connect call
        *  2. If not, check if it's in the BLOCK rules:
        *     - if so, call pthread_testcancel, then return EACCES
-       *  3. Otherwise proceed with regular connect call. */
-      coc_entry_t *e;
-      SLIST_FOREACH (e, &coc_list_head, entries)
-      {
-	if (e->addr_type == COC_GLOB_ADDR)
-	  {
-	    if (!dns_lookup_done)
-	      {
-		int rc = getnameinfo (addr, addrlen, hbuf, sizeof (hbuf),
-                                      NULL, 0, NI_NUMERICSERV);
+       *  3. Otherwise proceed with regular connect call.
+       *
+       * Verdicts are cached so that repeated connections to the same
+       * destination skip rule evaluation. */
+      uint8_t key[COC_KEY_LEN];
+      coc_key_from_sockaddr (key, addr);
+      COC_PROBE4 (connect__entry, fd, addr->sa_family, key, ntohs (port));
+
+      int rule_type = COC_NO_RULE;
+      uint32_t rank = 0;
+      uint8_t event_flags = COC_EVENT_CACHED;
+      uint64_t start = event_log || stats || latency ||
+	COC_PROBE_ENABLED (connect__return) ? coc_now_ns () : 0;
+
+      rdns_ns = 0;
+
+      /* The ruleset may be replaced meanwhile, but not freed. */
+      coc_epoch_enter ();
+      coc_ruleset_t *rs = coc_load_acquire (&coc_ruleset);
+
+      if (!coc_cache_lookup (&coc_cache, rs->generation, key, port,
+			     &rule_type, &rank))
+	{
+	  bool cacheable, timed_out;
+	  uint64_t expires;
+	  uint64_t epoch = coc_load_acquire (&coc_cache.epoch);
+	  uint32_t match = coc_ruleset_match (rs, addr, addrlen, key, port,
+					      str, &cacheable, &expires,
+					      &timed_out);
 
-		if (rc)
-		  {
-		    coc_log (COC_BLOCK_LOG_LEVEL, "ERROR resolving name: %s\n",
-			     gai_strerror (rc));
-		    continue;
-		  }
-                else
-                  {
-                    dns_lookup_done = true;
-                  }
-	      }
-	  }
+	  event_flags = timed_out ? COC_EVENT_TIMED_OUT : 0;
 
-	coc_log (COC_DEBUG_LOG_LEVEL,
-		 "DEBUG Checking %s rule for %s connection to %s:%hu\n",
-		 rule_type_name[e->rule_type],
-		 address_type_name[e->addr_type],
-		 str, ntohs (e->port));
+	  if (timed_out && rdns_timeout_verdict != COC_NO_RULE)
+	    {
+	      rule_type = rdns_timeout_verdict;
+	      rank = COC_NIL;
+	    }
+	  else if (match != COC_NIL)
+	    {
+	      rule_type = rs->rules[match].rule_type;
+	      rank = match;
+	    }
 
-	if (coc_rule_match(e, addr, hbuf))
-	  {
-	    if (e->rule_type == COC_ALLOW)
-	      {
-		coc_log (COC_ALLOW_LOG_LEVEL, "ALLOW connection to %s:%hu\n", str,
-			 ntohs (port));
-		return real_connect (fd, addr, addrlen);
-	      }
-	    else
-	      {
-		pthread_testcancel ();
-		coc_log (COC_BLOCK_LOG_LEVEL, "BLOCK connection to %s:%hu\n", str,
-			 ntohs (port));
-		// TODO WSASetLastError
-		errno = EACCES;
-		return -1;
-	      }
-	  }
-      }
+	  if (cacheable)
+	    {
+	      coc_cache_insert (&coc_cache, rs->generation, key, port,
+				rule_type, rank, expires, epoch);
+	    }
+	}
+
+      coc_epoch_exit ();
+
+      if (latency)
+	{
+	  coc_latency_add (COC_PHASE_RULES, coc_now_ns () - start - rdns_ns);
+	}
+
+      if (COC_PROBE_ENABLED (connect__return))
+	{
+	  COC_PROBE5 (connect__return, key, ntohs (port),
+		      rule_type == COC_BLOCK ? COC_BLOCK : COC_ALLOW,
+		      rule_type == COC_NO_RULE ? COC_NIL : rank,
+		      coc_now_ns () - start);
+	}
+
+      if (event_log)
+	{
+	  coc_event_t e;
+
+	  memset (&e, 0, sizeof (e));
+	  e.latency_ns = (uint32_t) (coc_now_ns () - start);
+	  e.rule = rule_type == COC_NO_RULE ? COC_NIL : rank;
+	  memcpy (e.addr, key, sizeof (e.addr));
+	  e.port = ntohs (port);
+	  e.family = addr->sa_family == AF_INET ? 4 : 6;
+	  e.verdict = rule_type == COC_BLOCK ? COC_BLOCK : COC_ALLOW;
+	  e.flags = event_flags;
+	  coc_event_log (&e);
+	}
+
+      if (stats)
+	{
+	  coc_stats_add (COC_STAT_CONNECTS, 1);
+	  coc_stats_add (rule_type == COC_BLOCK ? COC_STAT_BLOCKED :
+			 COC_STAT_ALLOWED, 1);
+	  coc_stats_add (COC_STAT_CACHE_HITS,
+			 event_flags & COC_EVENT_CACHED ? 1 : 0);
+
+	  if (rule_type != COC_NO_RULE && rank != COC_NIL)
+	    {
+	      coc_stats_rule (rank);
+	    }
+	}
+
+      if (rule_type == COC_BLOCK)
+	{
+	  pthread_testcancel ();
+
+	  if (coc_log_enabled (COC_BLOCK_LOG_LEVEL) &&
+	      !coc_log_repeated (COC_BLOCK_LOG_LEVEL, addr->sa_family, key,
+				 port))
+	    {
+	      coc_log_connection (COC_BLOCK_LOG_LEVEL, addr, str, port);
+	    }
+
+	  if (stats)
+	    {
+	      coc_stats_add (COC_STAT_HOOK_NS, coc_now_ns () - start);
+	    }
+
+	  // TODO WSASetLastError
+	  errno = EACCES;
+	  return -1;
+	}
+
+      if (coc_log_enabled (COC_ALLOW_LOG_LEVEL) && coc_log_sampled () &&
+	  !coc_log_repeated (COC_ALLOW_LOG_LEVEL, addr->sa_family, key, port))
+	{
+	  coc_log_connection (COC_ALLOW_LOG_LEVEL, addr, str, port);
+	}
+
+      if (stats)
+	{
+	  coc_stats_add (COC_STAT_HOOK_NS, coc_now_ns () - start);
+	}
+
+      if (latency)
+	{
+	  uint64_t connect_start = coc_now_ns ();
+	  int rc = real_connect (fd, addr, addrlen);
+	  int saved = errno;
 
-      coc_log (COC_ALLOW_LOG_LEVEL, "ALLOW connection to %s:%hu\n", str,
-	       ntohs (port));
+	  coc_latency_add (COC_PHASE_CONNECT, coc_now_ns () - connect_start);
+	  errno = saved;
+	  return rc;
+	}
     }
 
   return real_connect (fd, addr, addrlen);
  }
+
+#ifndef _WIN32
+/*
+ * Forward lookups made by the application are snooped, so that glob
+ * rules match the names it asked for rather than those reverse DNS
+ * gives for the addresses it got: the latter costs a round-trip per
+ * connection, and often differs for hosts served by a CDN.
+ */
+
+static void *
+coc_sym (const char *symbol)
+{
+  void *fn = dlsym (RTLD_NEXT, symbol);
+
+  if (fn == NULL)
+    {
+      char *error = dlerror ();
+
+      DIE ("%s\n", error != NULL ? error : symbol);
+    }
+
+  return fn;
+}
+
+/* Records that `names' were looked up to get address `key'. */
+static void
+coc_names_record (const uint8_t key[COC_KEY_LEN], const char *names)
+{
+  uint64_t now = coc_now_ms ();
+
+  if (coc_name_cache_put (&coc_dns_cache, key, now, names,
+			  now + dns_ttl * 1000))
+    {
+      coc_cache_names_changed (&coc_cache);
+    }
+}
+
+#ifdef COC_BENCH
+/* Records that `name' was looked up to get `addr', as getaddrinfo
+ * would. */
+void
+coc_bench_name (const struct sockaddr *addr, const char *name)
+{
+  char names[COC_NAMES_LEN] = "";
+  uint8_t key[COC_KEY_LEN];
+
+  coc_names_add (names, name);
+  coc_key_from_sockaddr (key, addr);
+  coc_names_record (key, names);
+}
+#endif
+
+int
+getaddrinfo (const char *node, const char *service,
+	     const struct addrinfo *hints, struct addrinfo **res)
+{
+  static int (*real_getaddrinfo) (const char *, const char *,
+				  const struct addrinfo *,
+				  struct addrinfo **) = NULL;
+
+  if (real_getaddrinfo == NULL)
+    {
+      real_getaddrinfo =
+	(int (*)(const char *, const char *, const struct addrinfo *,
+		 struct addrinfo **)) coc_sym ("getaddrinfo");
+    }
+
+  int rc = real_getaddrinfo (node, service, hints, res);
+
+  /* Until rules are compiled, we cannot tell whether names matter, and
+   * reloaded ones may start to. */
+  if (rc == 0 && node != NULL && initialized &&
+      (coc_load_relaxed (&needs_dns_lookup) || reload_rules ||
+       !coc_load_acquire (&rules_ready)))
+    {
+      char names[COC_NAMES_LEN] = "";
+      const struct addrinfo *ai;
+
+      coc_names_add (names, node);
+
+      if ((*res)->ai_canonname != NULL)
+	{
+	  coc_names_add (names, (*res)->ai_canonname);
+	}
+
+      for (ai = *res; names[0] != '\0' && ai != NULL; ai = ai->ai_next)
+	{
+	  if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6)
+	    {
+	      uint8_t key[COC_KEY_LEN];
+
+	      coc_key_from_sockaddr (key, ai->ai_addr);
+	      coc_names_record (key, names);
+	    }
+	}
+    }
+
+  return rc;
+}
+
+struct hostent *
+gethostbyname (const char *name)
+{
+  static struct hostent *(*real_gethostbyname) (const char *) = NULL;
+
+  if (real_gethostbyname == NULL)
+    {
+      real_gethostbyname =
+	(struct hostent * (*)(const char *)) coc_sym ("gethostbyname");
+    }
+
+  struct hostent *h = real_gethostbyname (name);
+
+  /* Until rules are compiled, we cannot tell whether names matter, and
+   * reloaded ones may start to. */
+  if (h != NULL && name != NULL && initialized &&
+      (coc_load_relaxed (&needs_dns_lookup) || reload_rules ||
+       !coc_load_acquire (&rules_ready)))
+    {
+      char names[COC_NAMES_LEN] = "";
+      size_t i;
+
+      /* Aliases are the CNAME chain leading to the canonical name. */
+      coc_names_add (names, name);
+
+      for (i = 0; h->h_aliases[i] != NULL; i++)
+	{
+	  coc_names_add (names, h->h_aliases[i]);
+	}
+
+      coc_names_add (names, h->h_name);
+
+      for (i = 0; names[0] != '\0' && h->h_addr_list[i] != NULL; i++)
+	{
+	  uint8_t key[COC_KEY_LEN];
+
+	  if (h->h_addrtype == AF_INET)
+	    {
+	      coc_key_from_v4 (key, (const struct in_addr *) h->h_addr_list[i]);
+	    }
+	  else if (h->h_addrtype == AF_INET6)
+	    {
+	      coc_key_from_v6 (key,
+			       (const struct in6_addr *) h->h_addr_list[i]);
+	    }
+	  else
+	    {
+	      break;
+	    }
+
+	  coc_names_record (key, names);
+	}
+    }
+
+  return h;
+}
+#endif
@@ -0,0 +1,1025 @@
+/* connect-or-cut -- shared internal declarations.
+ *
+ * Copyright Ⓒ 2017  Thomas Girard <thomas.g.girard@free.fr>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CONNECT_OR_CUT_H
+#define CONNECT_OR_CUT_H
+
+#define _GNU_SOURCE
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <fnmatch.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#define SOCKET int
+#define HOOK(fn) fn
+#define WSAAPI /* nothing */
+#else
+#define _CRT_SECURE_NO_WARNINGS
+#include <SDKDDKVer.h>
+#define WIN32_LEAN_AND_MEAN
+#ifdef COC_EXPORTS
+#define COC_API __declspec(dllexport)
+#else
+#define COC_API __declspec(dllimport)
+#endif
+#define HOOK(fn) COC_API __stdcall hook_##fn
+#include <windows.h>
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <Shlwapi.h>
+#include <iphlpapi.h>
+#include "sys_queue.h"
+#include "MinHook.h"
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "shlwapi.lib")
+#pragma comment(lib, "IPHLPAPI.lib")
+#ifdef _M_X64
+#pragma comment(lib, "libMinHook-x64-v140-mtd.lib")
+#elif defined _M_IX86
+#pragma comment(lib, "libMinHook-x86-v140-mtd.lib")
+#endif
+extern BOOL LoadCoCLibrary(HANDLE);
+#endif
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Static tracepoints for perf, bpftrace or SystemTap, where sys/sdt.h
+ * is found and unless built with COC_NO_SDT. Arguments computed only
+ * for them are guarded by COC_PROBE_ENABLED, which reads the probe
+ * semaphore that tracers set when attached.
+ */
+#if !defined(_WIN32) && !defined(COC_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define COC_SDT 1
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef COC_SDT
+#define COC_PROBE_SEMAPHORE(name) \
+  unsigned short coc_##name##_semaphore \
+  __attribute__ ((unused)) __attribute__ ((section (".probes")))
+#define COC_PROBE_ENABLED(name) __builtin_expect (coc_##name##_semaphore, 0)
+#define COC_PROBE1(name, a) DTRACE_PROBE1 (coc, name, a)
+#define COC_PROBE3(name, a, b, c) DTRACE_PROBE3 (coc, name, a, b, c)
+#define COC_PROBE4(name, a, b, c, d) DTRACE_PROBE4 (coc, name, a, b, c, d)
+#define COC_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5 (coc, name, a, b, c, d, e)
+#else
+#define COC_PROBE_SEMAPHORE(name) extern int coc_##name##_semaphore
+#define COC_PROBE_ENABLED(name) 0
+/* Arguments are not evaluated, but still count as used. */
+#define COC_PROBE1(name, a) do { (void) sizeof (a); } while (0)
+#define COC_PROBE3(name, a, b, c) \
+  do { (void) sizeof (a); (void) sizeof (b); (void) sizeof (c); } while (0)
+#define COC_PROBE4(name, a, b, c, d) \
+  do { COC_PROBE3 (name, a, b, c); (void) sizeof (d); } while (0)
+#define COC_PROBE5(name, a, b, c, d, e) \
+  do { COC_PROBE4 (name, a, b, c, d); (void) sizeof (e); } while (0)
+#endif
+
+#ifdef _WIN32
+typedef uint16_t in_port_t;
+#define MISSING_STRNDUP
+#define MAXNS 30
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+#define vsyslog(l,f,a) /* Not supported */
+#define pthread_testcancel() /* Not supported */
+#define pthread_setcancelstate(s,o) /* Not supported */
+#define localtime_r(ti,tm) localtime_s(tm, ti)
+#define fnmatch(p,s,f) (!PathMatchSpecA(s,p))
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#include <AvailabilityMacros.h>
+#if __MAC_OS_X_VERSION_MAX_ALLOWED < 1070
+#define MISSING_STRNDUP
+#endif
+#endif
+
+#ifdef __SunOS_5_11
+#undef MISSING_STRNDUP
+#endif
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <sys/param.h>
+#if defined(BSD)
+#define HAVE_GETPROGNAME
+#endif
+#endif
+
+#if (defined(sun) || defined(__sun)) && (defined(__SVR4) || defined(__svr4__))
+#define HAVE_GETEXECNAME
+#include <libgen.h>
+#endif
+
+#ifndef _WIN32
+typedef pthread_mutex_t coc_mutex_t;
+#define coc_mutex_init(m) pthread_mutex_init (m, NULL)
+#define coc_mutex_lock(m) pthread_mutex_lock (m)
+#define coc_mutex_unlock(m) pthread_mutex_unlock (m)
+typedef pthread_cond_t coc_cond_t;
+#define coc_cond_init(c) pthread_cond_init (c, NULL)
+#define coc_cond_broadcast(c) pthread_cond_broadcast (c)
+typedef pthread_once_t coc_once_t;
+#define COC_ONCE_INIT PTHREAD_ONCE_INIT
+#define coc_once(o, fn) pthread_once (o, fn)
+#define COC_THREAD_LOCAL __thread
+#else
+typedef SRWLOCK coc_mutex_t;
+#define coc_mutex_init(m) InitializeSRWLock (m)
+#define coc_mutex_lock(m) AcquireSRWLockExclusive (m)
+#define coc_mutex_unlock(m) ReleaseSRWLockExclusive (m)
+typedef CONDITION_VARIABLE coc_cond_t;
+#define coc_cond_init(c) InitializeConditionVariable (c)
+#define coc_cond_broadcast(c) WakeAllConditionVariable (c)
+typedef INIT_ONCE coc_once_t;
+#define COC_ONCE_INIT INIT_ONCE_STATIC_INIT
+static BOOL CALLBACK
+coc_once_call (PINIT_ONCE once, PVOID fn, PVOID *context)
+{
+  ((void (*)(void)) fn) ();
+  return TRUE;
+}
+#define COC_THREAD_LOCAL __declspec (thread)
+#define coc_once(o, fn) \
+  InitOnceExecuteOnce (o, coc_once_call, (PVOID) (fn), NULL)
+#endif
+
+/* Atomic operations on 64-bit words, for lock-free readers. */
+#if defined(__GNUC__)
+#define coc_load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define coc_load_relaxed(p) __atomic_load_n (p, __ATOMIC_RELAXED)
+#define coc_store_release(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define coc_store_relaxed(p, v) __atomic_store_n (p, v, __ATOMIC_RELAXED)
+#define coc_fetch_add(p, v) __atomic_fetch_add (p, v, __ATOMIC_RELAXED)
+#define coc_cas(p, e, d) \
+  __atomic_compare_exchange_n (p, e, d, false, __ATOMIC_ACQUIRE, \
+			       __ATOMIC_RELAXED)
+#define coc_fence_acquire() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define coc_fence_release() __atomic_thread_fence (__ATOMIC_RELEASE)
+#define coc_fence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#elif defined(_WIN32)
+#define coc_load_acquire(p) (MemoryBarrier (), *(p))
+#define coc_load_relaxed(p) (*(p))
+#define coc_store_release(p, v) (MemoryBarrier (), *(p) = (v))
+#define coc_store_relaxed(p, v) (*(p) = (v))
+#define coc_fetch_add(p, v) \
+  ((uint64_t) InterlockedExchangeAdd64 ((volatile LONG64 *) (p), (v)) )
+static inline bool
+coc_cas (volatile uint64_t *p, uint64_t *expected, uint64_t desired)
+{
+  uint64_t seen = (uint64_t)
+    InterlockedCompareExchange64 ((volatile LONG64 *) p, desired, *expected);
+  bool ok = seen == *expected;
+  *expected = seen;
+  return ok;
+}
+#define coc_fence_acquire() MemoryBarrier ()
+#define coc_fence_release() MemoryBarrier ()
+#define coc_fence() MemoryBarrier ()
+#endif
+
+/* Milliseconds on a monotonic clock, for expiry deadlines. */
+static inline uint64_t
+coc_now_ms (void)
+{
+#ifdef _WIN32
+  return GetTickCount64 ();
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Nanoseconds on a monotonic clock, for latencies. */
+static inline uint64_t
+coc_now_ns (void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER f, c;
+  QueryPerformanceFrequency (&f);
+  QueryPerformanceCounter (&c);
+  return (uint64_t) (c.QuadPart / f.QuadPart * 1000000000 +
+		     c.QuadPart % f.QuadPart * 1000000000 / f.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/* Waits for `c' with `m' locked, until coc_now_ms () reaches `deadline'.
+ * Returns false on timeout. */
+static inline bool
+coc_cond_wait_until (coc_cond_t *c, coc_mutex_t *m, uint64_t deadline)
+{
+  uint64_t now = coc_now_ms ();
+
+  if (now >= deadline)
+    {
+      return false;
+    }
+
+#ifdef _WIN32
+  return SleepConditionVariableSRW (c, m, (DWORD) (deadline - now), 0) ||
+    GetLastError () != ERROR_TIMEOUT;
+#else
+  /* Condition variables wait on the realtime clock by default. */
+  struct timespec ts;
+  uint64_t wait = deadline - now;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_sec += (time_t) (wait / 1000);
+  ts.tv_nsec += (long) (wait % 1000) * 1000000;
+
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+  return pthread_cond_timedwait (c, m, &ts) != ETIMEDOUT;
+#endif
+}
+
+typedef enum coc_address_type
+{
+  COC_IPV4_ADDR = 1 << 0,	/* 1 */
+  COC_IPV6_ADDR = 1 << 1,	/* 2 */
+  COC_GLOB_ADDR = 1 << 2	/* 4 */
+} coc_address_type_t;
+
+#define COC_HOST_ADDR (1 << 3)  /* 8 */
+
+typedef enum coc_log_level
+{
+  COC_SILENT_LOG_LEVEL = -1,	/* mapped from 0. */
+  COC_ERROR_LOG_LEVEL = LOG_ERR,	/* mapped from 1 (to 3). */
+  COC_BLOCK_LOG_LEVEL = LOG_WARNING,	/* mapped from 2 (to 4). */
+  COC_ALLOW_LOG_LEVEL = LOG_INFO,	/* mapped from 3 (to 6). */
+  COC_DEBUG_LOG_LEVEL = LOG_DEBUG	/* mapped from 4 (to 7). */
+} coc_log_level_t;
+
+typedef enum coc_log_target
+{
+  COC_STDERR_LOG = 1 << 0,	/* 1 */
+  COC_SYSLOG_LOG = 1 << 1,	/* 2 */
+  COC_FILE_LOG = 1 << 2		/* 4 */
+} coc_log_target_t;
+
+typedef enum coc_rule_type
+{
+  COC_ALLOW = 0,
+  COC_BLOCK = 1
+} coc_rule_type_t;
+
+
+/* Bitmap of allowed ports, shared by every rule using the same set. */
+#define COC_PORTSET_BYTES ((UINT16_MAX + 1) / 8)
+
+typedef struct coc_portset {
+  uint8_t bits[COC_PORTSET_BYTES];
+  uint32_t hash;
+  in_port_t low;		/* lowest port of the set. */
+  in_port_t high;		/* highest port of the set. */
+  uint32_t index;		/* in order of interning. */
+  struct coc_portset *next;	/* in its hash bucket. */
+} coc_portset_t;
+
+const coc_portset_t *coc_portset_intern (const uint8_t * bits, in_port_t low,
+					 in_port_t high);
+void coc_portset_add (uint8_t * bits, in_port_t low, in_port_t high);
+void coc_portset_copy (uint8_t (*to)[COC_PORTSET_BYTES], uint32_t count);
+void coc_portset_clear (void);
+
+/* `port' is in host byte order. */
+static inline bool
+coc_portset_has (const uint8_t *bits, in_port_t port)
+{
+  return (bits[port >> 3] >> (port & 7)) & 1;
+}
+
+/* Rule as parsed, before coc_rules_compile. */
+typedef struct coc_entry {
+  union {
+    struct in_addr ipv4;
+    struct in6_addr ipv6;
+    char *glob;
+    size_t host;		/* COC_HOST_ADDR: index of the pending rule. */
+  } addr;
+  in_port_t port;		/* network byte order; 0 means any. */
+  const coc_portset_t *ports;	/* if not NULL, overrides `port'. */
+  uint8_t prefix;		/* prefix length in bits for IPv4 and IPv6. */
+  coc_address_type_t addr_type;
+  coc_rule_type_t rule_type;
+  SLIST_ENTRY(coc_entry) entries;
+} coc_entry_t;
+
+SLIST_HEAD(coc_list, coc_entry);
+
+extern struct coc_list coc_list_head;
+extern const char *coc_rule_type_name[];
+extern const char *coc_address_type_name[];
+
+/* Parse the `;' separated `rules' into coc_list_head, ahead of the rules
+ * already there. Returns the number of rules. Invalid rules are logged
+ * as coming from `source', and counted by coc_rules_errors. */
+size_t coc_rules_add (const char *rules, size_t rule_type,
+		      const char *source);
+size_t coc_rules_add_file (const char *path, size_t rule_type);
+/* Resolve the host rules added so far, waiting at most `timeout_ms'.
+ * Returns their number. */
+#define COC_RESOLVE_TIMEOUT_MS 10000
+size_t coc_rules_resolve (uint64_t timeout_ms);
+bool coc_rules_resolving (void);
+size_t coc_rules_errors (void);
+
+/* IPv4 addresses are keyed as IPv4-mapped IPv6 addresses so that a
+ * single key space serves both families. */
+#define COC_KEY_LEN 16
+#define COC_KEY_V4_OFFSET 96
+
+static inline void
+coc_key_from_v4 (uint8_t key[COC_KEY_LEN], const struct in_addr *a)
+{
+  memset (key, 0, 10);
+  key[10] = key[11] = 0xff;
+  memcpy (key + 12, &a->s_addr, 4);
+}
+
+static inline void
+coc_key_from_v6 (uint8_t key[COC_KEY_LEN], const struct in6_addr *a)
+{
+  memcpy (key, a->s6_addr, COC_KEY_LEN);
+}
+
+static inline void
+coc_key_from_sockaddr (uint8_t key[COC_KEY_LEN], const struct sockaddr *sa)
+{
+  if (sa->sa_family == AF_INET)
+    {
+      coc_key_from_v4 (key, &((const struct sockaddr_in *) sa)->sin_addr);
+    }
+  else
+    {
+      coc_key_from_v6 (key, &((const struct sockaddr_in6 *) sa)->sin6_addr);
+    }
+}
+
+/* Key of an IPv4 or IPv6 rule. Returns the prefix length in bits. */
+static inline unsigned int
+coc_key_from_entry (uint8_t key[COC_KEY_LEN], const coc_entry_t *e)
+{
+  if (e->addr_type == COC_IPV4_ADDR)
+    {
+      coc_key_from_v4 (key, &e->addr.ipv4);
+      return COC_KEY_V4_OFFSET + e->prefix;
+    }
+
+  coc_key_from_v6 (key, &e->addr.ipv6);
+  return e->prefix;
+}
+
+static inline bool
+coc_key_prefix_match (const uint8_t *a, const uint8_t *b, unsigned int bits)
+{
+  unsigned int full = bits >> 3;
+
+  return !memcmp (a, b, full) &&
+    (!(bits & 7) ||
+     !((a[full] ^ b[full]) & (uint8_t) (0xff << (8 - (bits & 7)))));
+}
+
+/*
+ * Compiled rules, and the indexes over them, refer to each other by
+ * position instead of by pointer: a compiled ruleset is then valid at
+ * any address, and can be mapped from a file shared by all processes.
+ *
+ * Rules are referred to by rank, their position in evaluation order,
+ * and the first matching one wins. COC_NIL ranks after every rule.
+ */
+#define COC_NIL UINT32_MAX
+
+typedef struct coc_rule {
+  uint8_t key[COC_KEY_LEN];	/* IPv4 and IPv6 rules. */
+  uint32_t glob;		/* offset of the pattern of glob rules. */
+  uint32_t ports;		/* if not COC_NIL, overrides `port'. */
+  uint32_t next;		/* next rule in the same index bucket. */
+  in_port_t port;		/* network byte order; 0 means any. */
+  uint8_t bits;			/* prefix length of `key'. */
+  uint8_t addr_type;
+  uint8_t rule_type;
+  uint8_t pad[3];
+} coc_rule_t;
+
+typedef struct coc_ruleset coc_ruleset_t;
+
+/* Path-compressed binary trie over address prefixes. */
+typedef struct coc_lpm_node {
+  uint8_t key[COC_KEY_LEN];	/* masked to `bits'. */
+  uint32_t child[2];
+  uint32_t rules;		/* chained by rank. */
+  uint32_t bits;
+} coc_lpm_node_t;
+
+typedef struct coc_lpm {
+  coc_lpm_node_t *nodes;
+  size_t node_count;
+  size_t node_cap;
+  uint32_t root;
+} coc_lpm_t;
+
+void coc_lpm_init (coc_lpm_t * t);
+void coc_lpm_insert (coc_lpm_t * t, coc_rule_t * rules, uint32_t rank);
+uint32_t coc_lpm_lookup (const coc_lpm_t * t, const coc_ruleset_t * rs,
+			 const uint8_t key[COC_KEY_LEN], in_port_t port);
+void coc_lpm_free (coc_lpm_t * t);
+
+/* Hash table of rules matching a single address. */
+typedef struct coc_hash_slot {
+  uint8_t key[COC_KEY_LEN];
+  uint32_t rules;		/* chained by rank; COC_NIL if slot is free. */
+  in_port_t port;
+  uint16_t pad;
+} coc_hash_slot_t;
+
+typedef struct coc_hash {
+  coc_hash_slot_t *slots;
+  size_t mask;
+  size_t count;
+} coc_hash_t;
+
+void coc_hash_init (coc_hash_t * h, size_t count);
+void coc_hash_insert (coc_hash_t * h, coc_rule_t * rules, uint32_t rank);
+uint32_t coc_hash_lookup (const coc_hash_t * h, const coc_ruleset_t * rs,
+			  const uint8_t key[COC_KEY_LEN], in_port_t port);
+void coc_hash_free (coc_hash_t * h);
+
+/* Trie of `*.SUFFIX' glob rules keyed on reversed DNS labels. */
+typedef struct coc_domain_edge {
+  uint32_t label;		/* offset in rule strings; COC_NIL if free. */
+  uint32_t len;
+  uint32_t hash;
+  uint32_t parent;
+  uint32_t child;
+} coc_domain_edge_t;
+
+typedef struct coc_domain_node {
+  uint32_t rules;		/* chained by rank. */
+  uint32_t exact;		/* rules on this very name, by rank. */
+} coc_domain_node_t;
+
+typedef struct coc_domain {
+  coc_domain_edge_t *edges;
+  size_t mask;
+  size_t edge_count;
+  coc_domain_node_t *nodes;
+  size_t node_count;
+  size_t node_cap;
+  uint32_t first;		/* rule ranked first in the trie. */
+  size_t count;
+} coc_domain_t;
+
+void coc_domain_init (coc_domain_t * d);
+void coc_domain_insert (coc_domain_t * d, coc_rule_t * rules,
+			const char *strings, uint32_t suffix, uint32_t rank,
+			bool exact);
+uint32_t coc_domain_lookup (const coc_domain_t * d, const coc_ruleset_t * rs,
+			    const char *name, in_port_t port);
+void coc_domain_free (coc_domain_t * d);
+
+/* Automaton matching several glob rules in one scan. */
+#define COC_DFA_MAX_SIZE (16 * 1024 * 1024)	/* default cap in bytes. */
+
+typedef struct coc_dfa_state coc_dfa_state_t;
+typedef struct coc_dfa_graph coc_dfa_graph_t;
+
+typedef struct coc_dfa {
+  const coc_ruleset_t *rs;
+  const uint32_t *rules;	/* ordered by rank. */
+  size_t rule_count;
+  size_t *base;			/* first position of each rule. */
+  char *chars;			/* pattern character at each position. */
+  size_t positions;
+  uint8_t classes[UCHAR_MAX + 1];	/* character to class. */
+  char class_char[UCHAR_MAX + 1];	/* class to character. */
+  size_t class_count;
+  size_t max_size;
+  coc_dfa_graph_t *graph;	/* states built so far; read without lock. */
+  coc_dfa_graph_t *retired;	/* dropped graphs, until no one reads them. */
+  bool building;		/* left set by a fork in the middle of a build. */
+  bool disabled;		/* the start state alone is over `max_size'. */
+} coc_dfa_t;
+
+void coc_dfa_init (coc_dfa_t * d, const coc_ruleset_t * rs,
+		   const uint32_t * rules, size_t count, size_t max_size);
+uint32_t coc_dfa_match (coc_dfa_t * d, const char *name, in_port_t port,
+			bool *ok);
+void coc_dfa_free (coc_dfa_t * d);
+
+/* Epoch-based reclamation: readers between coc_epoch_enter and
+ * coc_epoch_exit neither lock nor wait, and coc_epoch_synchronize
+ * returns once those which may still see data a writer unpublished
+ * are gone, so that it can be freed. */
+#define COC_EPOCH_SLOTS 256	/* threads reading without contention. */
+
+void coc_epoch_enter (void);
+void coc_epoch_exit (void);
+void coc_epoch_synchronize (void);
+uint64_t coc_epoch_advance (void);
+bool coc_epoch_passed (uint64_t epoch);
+
+/* Lock-free cache of connect verdicts. */
+#define COC_CACHE_SIZE 4096	/* default number of slots. */
+
+#define COC_CACHE_SHARDS 16	/* cache lines of hit and miss counters. */
+
+typedef struct coc_cache_slot coc_cache_slot_t;
+typedef struct coc_cache_counters coc_cache_counters_t;
+
+typedef struct coc_cache {
+  coc_cache_slot_t *slots;
+  size_t mask;
+  uint64_t epoch;		/* bumped when names of addresses change. */
+  coc_cache_counters_t *counters;	/* COC_CACHE_SHARDS of them. */
+} coc_cache_t;
+
+#define COC_NO_RULE (-1)	/* no rule matched: default verdict. */
+
+void coc_cache_init (coc_cache_t * c, size_t size);
+bool coc_cache_lookup (coc_cache_t * c, uint64_t generation,
+		       const uint8_t key[COC_KEY_LEN], in_port_t port,
+		       int *rule_type, uint32_t * rank);
+void coc_cache_insert (coc_cache_t * c, uint64_t generation,
+		       const uint8_t key[COC_KEY_LEN], in_port_t port,
+		       int rule_type, uint32_t rank, uint64_t expires,
+		       uint64_t epoch);
+void coc_cache_names_changed (coc_cache_t * c);
+void coc_cache_counts (const coc_cache_t * c, uint64_t * hits,
+		       uint64_t * misses);
+
+/* Verdict cache hits and misses, and reverse DNS lookups made and
+ * coalesced, since the library was loaded. */
+void coc_cache_stats (uint64_t * hits, uint64_t * misses);
+void coc_rdns_stats (uint64_t * lookups, uint64_t * coalesced);
+
+/* Bounded cache of address names, from lookups that did or did not
+ * find one. */
+#define COC_RDNS_CACHE_SIZE 1024	/* default number of entries. */
+#define COC_RDNS_TTL 300		/* default seconds a name is kept. */
+#define COC_RDNS_NEGATIVE_TTL 30	/* same, for addresses without name. */
+#define COC_DNS_CACHE_SIZE 1024	/* same as above, for forward lookups. */
+#define COC_DNS_TTL 300
+
+/* Room for the names of an address: strings each ending with a NUL,
+ * then an empty one. */
+#define COC_NAMES_LEN (NI_MAXHOST + 1)
+
+typedef struct coc_name_entry coc_name_entry_t;
+
+typedef struct coc_name_cache {
+  coc_name_entry_t *entries;
+  size_t size;
+  size_t used;
+  size_t hand;			/* CLOCK eviction position. */
+  int32_t *buckets;
+  size_t mask;
+  uint64_t hits;
+  uint64_t misses;
+  coc_mutex_t lock;
+  bool writing;			/* while entries are changed, for forks. */
+} coc_name_cache_t;
+
+typedef enum coc_name_status
+{
+  COC_NAME_MISS,
+  COC_NAME_FOUND,		/* address has names. */
+  COC_NAME_NONE			/* address has no name. */
+} coc_name_status_t;
+
+static inline char *
+coc_lowercase (char *s)
+{
+  char *p;
+
+  for (p = s; *p != '\0'; p++)
+    {
+      *p = (char) tolower ((unsigned char) *p);
+    }
+
+  return s;
+}
+
+/* Bytes used by a list of names, including the final empty one. */
+static inline size_t
+coc_names_len (const char *names)
+{
+  const char *p = names;
+
+  while (*p != '\0')
+    {
+      p += strlen (p) + 1;
+    }
+
+  return (size_t) (p - names) + 1;
+}
+
+void coc_name_cache_init (coc_name_cache_t * c, size_t size);
+coc_name_status_t coc_name_cache_get (coc_name_cache_t * c,
+				      const uint8_t key[COC_KEY_LEN],
+				      uint64_t now, char names[COC_NAMES_LEN],
+				      uint64_t * expires);
+bool coc_name_cache_put (coc_name_cache_t * c,
+			 const uint8_t key[COC_KEY_LEN], uint64_t now,
+			 const char *names, uint64_t expires);
+void coc_name_cache_forked (coc_name_cache_t * c);
+void coc_names_add (char names[COC_NAMES_LEN], const char *name);
+
+/* Name lookups in progress, so that threads needing the names of the
+ * same address wait for the first one to look them up. */
+#define COC_FLIGHTS 64		/* lookups tracked at once. */
+
+typedef struct coc_flights {
+  uint8_t keys[COC_FLIGHTS][COC_KEY_LEN];
+  bool busy[COC_FLIGHTS];
+  uint64_t lookups;		/* made by a first thread. */
+  uint64_t coalesced;		/* saved by waiting for one of these. */
+  uint64_t timeouts;		/* waits that gave up. */
+  coc_mutex_t lock;
+  coc_cond_t done;
+} coc_flights_t;
+
+void coc_flights_init (coc_flights_t * f);
+bool coc_flight_begin (coc_flights_t * f, const uint8_t key[COC_KEY_LEN],
+		       uint64_t deadline, int *slot);
+void coc_flight_end (coc_flights_t * f, int slot);
+void coc_flights_forked (coc_flights_t * f);
+
+/* Reverse DNS lookups without the system resolver. */
+#define COC_RDNS_TIMEOUT_MS 1000	/* default deadline of a lookup. */
+
+typedef struct coc_resolver {
+  union {
+    struct in_addr ipv4;
+    struct in6_addr ipv6;
+  } addr;
+  bool isv6;
+} coc_resolver_t;
+
+coc_name_status_t coc_rdns_query (const coc_resolver_t * servers,
+				  size_t count,
+				  const uint8_t key[COC_KEY_LEN],
+				  uint64_t deadline, char name[NI_MAXHOST],
+				  uint32_t * ttl);
+size_t coc_hosts_load (coc_name_cache_t * c, const char *path);
+
+/* `connect' bypassing the hook, for the library's own connections. */
+int coc_real_connect (SOCKET fd, const struct sockaddr *addr,
+		      socklen_t addrlen);
+
+/* Blocked Bloom filter, to rule out most misses in one cache line. */
+#define COC_BLOOM_FP_RATE 100	/* default: one false positive in 100. */
+#define COC_BLOOM_MIN_ITEMS 1024	/* smaller indexes stay in cache. */
+
+typedef struct coc_bloom {
+  uint64_t *blocks;		/* NULL if disabled: anything may be in. */
+  size_t block_count;
+  unsigned int k;		/* bits per item. */
+  void *base;
+} coc_bloom_t;
+
+static inline uint64_t
+coc_bloom_mix (uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static inline uint64_t
+coc_bloom_hash_key (const uint8_t key[COC_KEY_LEN])
+{
+  uint64_t k[2];
+  memcpy (k, key, sizeof (k));
+  return coc_bloom_mix (k[0] ^ coc_bloom_mix (k[1]));
+}
+
+static inline uint64_t
+coc_bloom_hash_str (const char *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (; *s != '\0'; s++)
+    {
+      h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    }
+
+  return coc_bloom_mix (h);
+}
+
+void coc_bloom_init (coc_bloom_t * b, size_t n, unsigned long fp_rate);
+void coc_bloom_add (coc_bloom_t * b, uint64_t h);
+bool coc_bloom_maybe (const coc_bloom_t * b, uint64_t h);
+void coc_bloom_free (coc_bloom_t * b);
+
+/* Rules compiled from coc_list_head, or mapped from a rules database,
+ * for the `connect' hook. Only the automaton is built afterwards. */
+struct coc_ruleset {
+  uint64_t generation;		/* tags verdicts cached for this ruleset. */
+  coc_rule_t *rules;		/* in evaluation order. */
+  size_t rule_count;
+  char *strings;		/* patterns of glob rules. */
+  size_t strings_len;
+  uint8_t (*portsets)[COC_PORTSET_BYTES];
+  size_t portset_count;
+  coc_hash_t exact;		/* IPv4 and IPv6 address rules. */
+  coc_bloom_t exact_bloom;	/* keys of `exact'. */
+  coc_lpm_t lpm;		/* IPv4 and IPv6 prefix rules. */
+  coc_domain_t domains;		/* `*.SUFFIX' glob rules. */
+  coc_bloom_t domain_bloom;	/* suffixes of `domains'. */
+  uint32_t *stars;		/* `*' glob rules, ordered by rank. */
+  size_t star_count;
+  uint32_t *globs;		/* other glob rules, ordered by rank. */
+  size_t glob_count;
+  coc_dfa_t dfa;		/* automaton for `globs'. */
+  void *map;			/* rules database, if mapped from one. */
+  size_t map_size;
+};
+
+static inline const char *
+coc_rule_glob (const coc_ruleset_t *rs, uint32_t rank)
+{
+  return rs->strings + rs->rules[rank].glob;
+}
+
+/* `port' is in network byte order. */
+static inline bool
+coc_rule_port_match (const coc_ruleset_t *rs, uint32_t rank, in_port_t port)
+{
+  const coc_rule_t *r = &rs->rules[rank];
+
+  if (r->ports != COC_NIL)
+    {
+      return coc_portset_has (rs->portsets[r->ports], ntohs (port));
+    }
+
+  return !r->port || r->port == port;
+}
+
+/* First rule matching `port' in the chain starting at `rank', if it
+ * ranks before `best'; `best' otherwise. */
+static inline uint32_t
+coc_rule_chain_match (const coc_ruleset_t *rs, uint32_t rank,
+		      uint32_t best, in_port_t port)
+{
+  for (; rank < best; rank = rs->rules[rank].next)
+    {
+      if (coc_rule_port_match (rs, rank, port))
+	{
+	  return rank;
+	}
+    }
+
+  return best;
+}
+
+/* Add rule `rank' to the chain starting at `*head', in rank order. */
+static inline void
+coc_rule_link (coc_rule_t *rules, uint32_t *head, uint32_t rank)
+{
+  while (*head < rank)
+    {
+      head = &rules[*head].next;
+    }
+
+  rules[rank].next = *head;
+  *head = rank;
+}
+
+/* Move ALLOW rules ahead of BLOCK ones, keeping their order otherwise. */
+void coc_rules_order (void);
+void coc_rules_compile (coc_ruleset_t * rs, unsigned long bloom_fp_rate);
+void coc_rules_discard (void);
+void coc_ruleset_free (coc_ruleset_t * rs);
+uint64_t coc_rules_source (const char *block, const char *allow,
+			   const char *block_file, const char *allow_file);
+uint64_t coc_file_stamp (uint64_t h, const char *path);
+
+/* Ruleset compiled to a file, to be mapped instead of compiled again by
+ * each process. `source' identifies the rules it was compiled from. */
+#define COC_DB_VERSION 2
+
+/* Address a host rule resolved to, as cached by coc-hostcache.c. */
+typedef struct coc_host_addr {
+  uint32_t type;		/* COC_IPV4_ADDR or COC_IPV6_ADDR. */
+  uint8_t addr[16];
+} coc_host_addr_t;
+
+/* Cache resolutions of host rules in `path' for `ttl' seconds, until
+ * coc_host_cache_flush writes those made since. */
+#define COC_HOST_CACHE_TTL 300	/* default seconds. */
+void coc_host_cache_open (const char *path, uint64_t ttl);
+const coc_host_addr_t *coc_host_cache_get (const char *host, size_t *count);
+void coc_host_cache_put (const char *host, const struct addrinfo *ailist);
+void coc_host_cache_flush (void);
+
+void *coc_file_map (const char *path, size_t *size, bool owned);
+void coc_file_unmap (void *map, size_t size);
+char *coc_file_read (const char *path, size_t *size);
+const char *coc_db_load (coc_ruleset_t * rs, const char *path,
+			 uint64_t source);
+const char *coc_db_write (const coc_ruleset_t * rs, const char *path,
+			  uint64_t source);
+
+#ifdef __GNUC__
+void
+coc_log (coc_log_level_t level, const char *format, ...)
+__attribute__ ((__format__ (__printf__, 2, 3)));
+#else
+void coc_log (coc_log_level_t level, const char *format, ...);
+#endif
+
+/* Log records queued by coc_log_async are written in the background
+ * by a flusher, woken when it sleeps or every COC_LOG_FLUSH_MS. */
+#define COC_LOG_RING_SIZE 1024	/* records; a power of 2. */
+#define COC_LOG_RECORD_LEN 232	/* bytes of a message, past which it is
+				   truncated. */
+#define COC_LOG_FLUSH_MS 1000
+
+bool coc_log_async_start (coc_log_target_t target, const char *file_name);
+bool coc_log_async (coc_log_level_t level, const char *format, va_list ap);
+void coc_log_async_flush (void);
+
+/*
+ * Binary event log of COC_EVENT_LOG: a header, then one record per
+ * connect, appended through the same ring. Headers may be repeated, as
+ * processes appending to the same file each write one when it is
+ * empty. coc-decode turns events into text or JSON lines.
+ */
+#define COC_EVENT_MAGIC "COCEVENT"
+#define COC_EVENT_VERSION 1
+#define COC_EVENT_ENDIAN 0x01020304	/* as written by the host. */
+
+typedef struct coc_event_header {
+  char magic[8];		/* COC_EVENT_MAGIC, not terminated. */
+  uint32_t version;
+  uint32_t endian;
+  uint32_t size;		/* of an event. */
+  uint8_t pad[28];
+} coc_event_header_t;
+
+#define COC_EVENT_DROPPED 2	/* verdict of events lost in between. */
+#define COC_EVENT_CACHED (1 << 0)	/* verdict from the cache. */
+#define COC_EVENT_TIMED_OUT (1 << 1)	/* rules not ready in time. */
+
+typedef struct coc_event {
+  uint64_t time_ns;		/* since the epoch. */
+  uint32_t pid;
+  uint32_t tid;
+  uint32_t rule;		/* rank, COC_NIL if none; or count dropped. */
+  uint32_t latency_ns;		/* of the verdict. */
+  uint8_t addr[16];		/* IPv4 as IPv4-mapped IPv6. */
+  uint16_t port;		/* in host order. */
+  uint8_t family;		/* 4 or 6. */
+  uint8_t verdict;		/* coc_rule_type_t, or COC_EVENT_DROPPED. */
+  uint8_t flags;
+  uint8_t pad[3];
+} coc_event_t;
+
+bool coc_event_log_open (const char *path);
+void coc_event_log (coc_event_t * e);
+
+/* Repeated ALLOW or BLOCK records are summed up, destinations being
+ * tracked in a table of COC_LOG_REPEAT_SLOTS. */
+#define COC_LOG_REPEAT_SLOTS 1024	/* a power of 2. */
+
+void coc_log_repeat_init (uint64_t window_ms);
+bool coc_log_repeated (coc_log_level_t level, int family,
+		       const uint8_t key[COC_KEY_LEN], in_port_t port);
+void coc_log_repeat_flush (void);
+
+/* Counters of COC_STATS, in each shard. */
+typedef enum coc_stat {
+  COC_STAT_CONNECTS,		/* checked. */
+  COC_STAT_ALLOWED,
+  COC_STAT_BLOCKED,
+  COC_STAT_CACHE_HITS,		/* verdicts found in the cache. */
+  COC_STAT_DNS_LOOKUPS,		/* reverse lookups made. */
+  COC_STAT_HOOK_NS,		/* spent checking connects. */
+  COC_STAT_OTHER_RULES,		/* hits of rules past COC_STATS_RULES. */
+  COC_STAT_RESERVED,
+  COC_STATS
+} coc_stat_t;
+
+#define COC_STATS_SHARDS 16	/* cache lines of counters. */
+#define COC_STATS_RULES 1024	/* ranks with hits counted apart. */
+
+bool coc_stats_open (void);
+void coc_stats_close (void);
+void coc_stats_add (coc_stat_t stat, uint64_t n);
+void coc_stats_rule (uint32_t rank);
+
+/* Phases of a connect timed with COC_LATENCY. */
+typedef enum coc_phase {
+  COC_PHASE_RULES,		/* getting the verdict, but reverse DNS. */
+  COC_PHASE_NTOP,		/* formatting the address. */
+  COC_PHASE_RDNS,		/* reverse DNS lookups. */
+  COC_PHASE_LOG,		/* logging the verdict. */
+  COC_PHASE_CONNECT,		/* the real connect. */
+  COC_PHASES
+} coc_phase_t;
+
+#define COC_LATENCY_SETS 64	/* threads with histograms of their own. */
+
+bool coc_latency_open (const char *path, int signo);
+void coc_latency_add (coc_phase_t phase, uint64_t ns);
+void coc_latency_dump (void);
+
+#define DIE(...) do { \
+    coc_log (COC_ERROR_LOG_LEVEL,"ERROR " __VA_ARGS__); \
+    exit (EXIT_FAILURE); \
+  } while (0)
+
+#ifdef MISSING_STRNDUP
+static inline char *
+strndup (const char *s, size_t n)
+{
+  size_t len = strlen (s);
+
+  if (len > n)
+    {
+      len = n;
+    }
+
+  char *ns = (char *) malloc (len + 1);
+
+  if (ns != NULL)
+    {
+      ns[len] = '\0';
+      memcpy (ns, s, len);
+    }
+
+  return ns;
+}
+#endif
+
+#endif /* CONNECT_OR_CUT_H */
@@ -73,6 +73,8 @@ rm -rf %{buildroot}
 %files
 %defattr(-,root,root,-)
 %{_libdir}/*
+%{_bindir}/coc-compile
+%{_bindir}/coc-decode
 %endif
 
 